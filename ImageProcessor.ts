@@ -8,6 +8,45 @@ import { AppContext } from './ModuleBase';
 import { Pipe } from './SystemPromise';
 import * as RequestHandler from "./RequestHandler";
 import * as BackOfficeAPI from "./shared/BackOfficeAPI";
+import * as Metrics from "./Metrics";
+import Log from './Log';
+
+const logger = Log.logger(__filename);
+
+// As reported by processor --stats
+type FitsServerProductStats = {
+    product: string;
+    hits: number;
+    misses: number;
+    productions: number;
+    failures: number;
+    productionTime: number;
+    evictions: number;
+    evictedBytes: number;
+};
+
+type FitsServerStats = {
+    maxSize: number;
+    currentSize: number;
+    reservedSize: number;
+    contentCount: number;
+    waitingConsumers: number;
+    waitingWorkers: number;
+    streamWatchers: number;
+    startedWorkers: number;
+    activeWorkers: number;
+    blockedWorkers: number;
+    workerSpawns: number;
+    workerSpawnTime: number;
+    firstProductions: number;
+    firstProductionTime: number;
+    spillMaxSize: number;
+    spillSize: number;
+    spillHits: number;
+    spillMisses: number;
+    spillWrites: number;
+    products: FitsServerProductStats[];
+};
 
 
 export default class ImageProcessor
@@ -21,11 +60,7 @@ export default class ImageProcessor
         this.context = context;
     }
 
-    compute = async <K extends keyof ProcessorTypes.Request>
-            (
-                ct: CancellationToken,
-                payload: Pick<ProcessorTypes.Request, K>
-            ):Promise<ProcessorTypes.Result[K]>=>
+    private static withTopLevelOptions(payload: Partial<ProcessorTypes.Request>, priority?: ProcessorTypes.ProcessorPriority):any
     {
         // Options are within up to there, to allow TS typing.
         const payloadWithTopLevelOptions:any = {...payload};
@@ -36,17 +71,116 @@ export default class ImageProcessor
                 payloadWithTopLevelOptions.options = options;
             }
         }
+        if (priority !== undefined) {
+            payloadWithTopLevelOptions.priority = priority;
+        }
+        return payloadWithTopLevelOptions;
+    }
+
+    compute = async <K extends keyof ProcessorTypes.Request>
+            (
+                ct: CancellationToken,
+                payload: Pick<ProcessorTypes.Request, K>,
+                priority?: ProcessorTypes.ProcessorPriority
+            ):Promise<ProcessorTypes.Result[K]>=>
+    {
+        const result = await Pipe(ct,
+            {
+                command: ["./fitsviewer/processor"]
+            },
+            new MemoryStreams.ReadableStream(JSON.stringify(ImageProcessor.withTopLevelOptions(payload, priority)))
+        );
 
+        return JSON.parse(result);
+    }
+
+    // Compute several products at once (single processor call). Shared dependencies (image data) are loaded once
+    computeBatch = async <K1 extends keyof ProcessorTypes.Request, K2 extends keyof ProcessorTypes.Request>
+            (
+                ct: CancellationToken,
+                payloads: [Pick<ProcessorTypes.Request, K1>, Pick<ProcessorTypes.Request, K2>],
+                priority?: ProcessorTypes.ProcessorPriority
+            ):Promise<[ProcessorTypes.Result[K1], ProcessorTypes.Result[K2]]>=>
+    {
         const result = await Pipe(ct,
             {
                 command: ["./fitsviewer/processor"]
             },
-            new MemoryStreams.ReadableStream(JSON.stringify(payloadWithTopLevelOptions))
+            new MemoryStreams.ReadableStream(JSON.stringify(payloads.map(p=>ImageProcessor.withTopLevelOptions(p, priority))))
         );
 
         return JSON.parse(result);
     }
 
+    public async metrics():Promise<Array<Metrics.Definition>> {
+        let stats: FitsServerStats;
+        try {
+            const result = await Pipe(CancellationToken.CONTINUE,
+                {
+                    command: ["./fitsviewer/processor", "--stats"]
+                },
+                undefined
+            );
+            stats = JSON.parse(result);
+        } catch(e) {
+            logger.warn("Unable to query fits-server stats", e);
+            return [];
+        }
+
+        const ret : Array<Metrics.Definition> = [];
+        const gauge = (name: string, help: string, value: number)=> {
+            ret.push({name, help, type: 'gauge', value});
+        }
+        gauge('fits_server_cache_bytes', 'size of produced contents in fits-server cache', stats.currentSize);
+        gauge('fits_server_cache_max_bytes', 'nominal size of fits-server cache', stats.maxSize);
+        gauge('fits_server_cache_reserved_bytes', 'estimated size of contents in production', stats.reservedSize);
+        gauge('fits_server_cache_entries', 'number of contents in fits-server cache', stats.contentCount);
+        gauge('fits_server_waiting_consumers', 'requests waiting for a content', stats.waitingConsumers);
+        gauge('fits_server_stream_watchers', 'clients waiting for a stream frame', stats.streamWatchers);
+        gauge('fits_server_idle_workers', 'workers waiting for work', stats.waitingWorkers);
+        gauge('fits_server_started_workers', 'worker processes', stats.startedWorkers);
+        gauge('fits_server_active_workers', 'workers running a production', stats.activeWorkers);
+        gauge('fits_server_blocked_workers', 'workers waiting for a dependency', stats.blockedWorkers);
+        ret.push({name: 'fits_server_worker_spawns_total', help: 'workers started', type: 'counter', value: stats.workerSpawns});
+        ret.push({name: 'fits_server_worker_spawn_seconds_total', help: 'time from worker start request to its readiness', type: 'counter', value: stats.workerSpawnTime / 1000000});
+        ret.push({name: 'fits_server_worker_first_productions_total', help: 'first productions of new workers', type: 'counter', value: stats.firstProductions});
+        ret.push({name: 'fits_server_worker_first_production_seconds_total', help: 'time spent in first productions of new workers', type: 'counter', value: stats.firstProductionTime / 1000});
+        if (stats.spillMaxSize) {
+            gauge('fits_server_spill_bytes', 'compressed size of the second tier cache', stats.spillSize);
+            gauge('fits_server_spill_max_bytes', 'nominal size of the second tier cache', stats.spillMaxSize);
+            ret.push({name: 'fits_server_spill_writes_total', help: 'evicted image data written to the second tier cache', type: 'counter', value: stats.spillWrites});
+            ret.push({name: 'fits_server_spill_lookups_total', help: 'image data productions, by second tier cache result', type: 'counter', labels: {result: 'hit'}, value: stats.spillHits});
+            ret.push({name: 'fits_server_spill_lookups_total', labels: {result: 'miss'}, value: stats.spillMisses});
+        }
+
+        const counter = (name: string, help: string, values: Array<{value: number, labels: {[id:string]: string}}>)=> {
+            values.forEach((v, i)=> {
+                ret.push({
+                    name,
+                    ...(i === 0 ? {help, type: 'counter'} : {}),
+                    labels: v.labels,
+                    value: v.value,
+                });
+            });
+        }
+        counter('fits_server_requests_total', 'content requests, by product and cache result',
+            stats.products.flatMap(p=>[
+                {value: p.hits, labels: {product: p.product, result: 'hit'}},
+                {value: p.misses, labels: {product: p.product, result: 'miss'}},
+            ]));
+        counter('fits_server_productions_total', 'contents produced',
+            stats.products.map(p=>({value: p.productions, labels: {product: p.product}})));
+        counter('fits_server_production_failures_total', 'failed productions',
+            stats.products.map(p=>({value: p.failures, labels: {product: p.product}})));
+        counter('fits_server_production_seconds_total', 'time spent producing contents',
+            stats.products.map(p=>({value: p.productionTime / 1000, labels: {product: p.product}})));
+        counter('fits_server_evictions_total', 'contents evicted from cache',
+            stats.products.map(p=>({value: p.evictions, labels: {product: p.product}})));
+        counter('fits_server_evicted_bytes_total', 'bytes evicted from cache',
+            stats.products.map(p=>({value: p.evictedBytes, labels: {product: p.product}})));
+        return ret;
+    }
+
     // Find the first ADU value that has at level (0-1) adus
     getHistgramAduLevel(channel: ProcessorTypes.ProcessorHistogramChannel, level:number):number {
         const seuil = level * channel.pixcount;
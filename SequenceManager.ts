@@ -22,7 +22,7 @@ import { SequenceLogic, Progress } from './shared/SequenceLogic';
 import { SequenceActivityWatchdog } from './SequenceActivityWatchdog';
 import { SequenceStatisticWatcher } from './SequenceStatisticWatcher';
 import { SequenceParamClassifier } from './shared/SequenceParamClassifier';
-import { AstrometryResult, ProcessorAstrometryConstraints, ProcessorAstrometryRequest } from './shared/ProcessorTypes';
+import { AstrometryResult, ProcessorAstrometryConstraints, ProcessorAstrometryRequest, ProcessorHistogramResult, ProcessorStarFieldResult } from './shared/ProcessorTypes';
 
 const logger = Log.logger(__filename);
 
@@ -535,33 +535,39 @@ export default class SequenceManager
 
             target.guideStats = GuideStats.computeGuideStats(guideSteps);
 
-            const histogram = await this.imageProcessor.compute(ct,
-                {
-                    histogram: { source: {
-                        path: shootResult.path,
-                        streamId: "",
-                    },
-                    options: {
-                        maxBits: 10
-                    }
+            const histogramRequest = {
+                histogram: { source: {
+                    path: shootResult.path,
+                    streamId: "",
                 },
-            });
+                options: {
+                    maxBits: 10
+                }
+            }};
+
+            // Light frames also get a star field. Ask both at once, so that the image is loaded only once
+            let histogram: ProcessorHistogramResult;
+            let starFieldResponse: ProcessorStarFieldResult|undefined;
+            if (indiFrameType === 'FRAME_LIGHT') {
+                logger.debug('Asking FWHM', {shootResult});
+                [histogram, starFieldResponse] = await this.imageProcessor.computeBatch(ct, [
+                    histogramRequest,
+                    {
+                        starField: { source: {
+                            path: shootResult.path,
+                            streamId: "",
+                        }}
+                    }
+                ], "background");
+            } else {
+                histogram = await this.imageProcessor.compute(ct, histogramRequest, "background");
+            }
 
             const channelBlacks = histogram.map(ch=>this.imageProcessor.getHistgramAduLevel(ch, 0.2));
 
             target.backgroundLevel = channelBlacks.length ? channelBlacks.reduce((a, c)=>a+c, 0) / (1024 * channelBlacks.length) : undefined;
 
-            if (indiFrameType === 'FRAME_LIGHT') {
-                ct.throwIfCancelled();
-
-                // FIXME: mutualise that somewhere
-                logger.debug('Asking FWHM', {shootResult});
-                const starFieldResponse = await this.imageProcessor.compute(ct, {
-                    starField: { source: {
-                        path: shootResult.path,
-                        streamId: "",
-                    }}
-                });
+            if (starFieldResponse !== undefined) {
                 const starField = starFieldResponse.stars;
                 logger.debug('Got starField', {shootResult, starField});
                 let fwhm, starCount;
@@ -241,6 +241,7 @@ function init() {
                 ...await context.indiManager!.metrics(),
                 ...await context.phd!.metrics(),
                 ...await context.sequenceManager!.metrics(),
+                ...await context.imageProcessor!.metrics(),
             ];
 
             res.send(Metrics.format(metrics));
@@ -224,6 +224,11 @@ public:
 };
 
 
+long SharedCache::Messages::Astrometry::estimateSize() const
+{
+    return 4096;
+}
+
 void SharedCache::Messages::Astrometry::produce(SharedCache::Entry* entry)
 {
     json j;
@@ -16,15 +16,13 @@
 #include <dirent.h>
 
 #include "SharedCacheServerClient.h"
+#include "CacheStorage.h"
 
 namespace SharedCache {
 
     void CacheFileDesc::unlink()
     {
-        std::string path = server->basePath + filename;
-        if (::unlink(path.c_str()) == -1) {
-            perror(path.c_str());
-        }
+        server->storage->remove(filename);
         server->contentByFilename.erase(filename);
         filename = "";
     }
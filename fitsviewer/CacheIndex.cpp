@@ -0,0 +1,206 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <iostream>
+#include <fstream>
+#include <map>
+
+#include "CacheIndex.h"
+#include "SharedCache.h"
+
+namespace SharedCache {
+
+const std::string CacheIndex::fileName = "index.journal";
+// 1 was the layout before sample types and levels (records without version)
+const int CacheIndex::storageLayout = 2;
+
+CacheIndex::CacheIndex(const std::string & basePath) :
+	basePath(basePath)
+{
+	fd = -1;
+	journalLength = 0;
+}
+
+CacheIndex::~CacheIndex()
+{
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+void CacheIndex::open()
+{
+	std::string path = basePath + fileName;
+	fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		perror(path.c_str());
+		throw std::runtime_error("Unable to open cache index");
+	}
+}
+
+void CacheIndex::append(const nlohmann::json & j)
+{
+	if (fd == -1) {
+		open();
+	}
+	std::string line = j.dump() + "\n";
+	// O_APPEND: a short write can only leave a truncated last line, that load() ignores
+	if (write(fd, line.data(), line.size()) != (ssize_t)line.size()) {
+		perror("cache index");
+		return;
+	}
+	journalLength++;
+}
+
+static nlohmann::json recordToJson(const CacheIndex::Record & record)
+{
+	nlohmann::json j = nlohmann::json::object();
+	j["v"] = CacheIndex::storageLayout;
+	j["k"] = record.identifier.str();
+	j["f"] = record.filename;
+	j["s"] = record.size;
+	j["d"] = record.prodDuration;
+	nlohmann::json sources = nlohmann::json::array();
+	for(auto it = record.sources.begin(); it != record.sources.end(); ++it) {
+		sources.push_back(nlohmann::json::array({it->path, it->size, it->mtime}));
+	}
+	j["src"] = sources;
+	return j;
+}
+
+static CacheIndex::Record recordFromJson(const nlohmann::json & j)
+{
+	CacheIndex::Record record;
+	record.identifier = ContentKey(j.at("k").get<std::string>());
+	record.filename = j.at("f").get<std::string>();
+	record.size = j.at("s").get<long>();
+	record.prodDuration = j.at("d").get<long>();
+	const nlohmann::json & sources = j.at("src");
+	for(auto it = sources.begin(); it != sources.end(); ++it) {
+		CacheIndex::SourceStamp stamp;
+		stamp.path = it->at(0).get<std::string>();
+		stamp.size = it->at(1).get<long>();
+		stamp.mtime = it->at(2).get<long>();
+		record.sources.push_back(stamp);
+	}
+	return record;
+}
+
+void CacheIndex::added(const Record & record)
+{
+	append(recordToJson(record));
+}
+
+void CacheIndex::removed(const std::string & filename)
+{
+	nlohmann::json j = nlohmann::json::object();
+	j["rm"] = filename;
+	append(j);
+}
+
+std::list<CacheIndex::Record> CacheIndex::load()
+{
+	std::list<Record> records;
+	std::map<std::string, std::list<Record>::iterator> byFilename;
+
+	std::ifstream in(basePath + fileName);
+	std::string line;
+	while(std::getline(in, line)) {
+		try {
+			nlohmann::json j = nlohmann::json::parse(line);
+			std::string filename = j.find("rm") != j.end() ? j.at("rm").get<std::string>() : j.at("f").get<std::string>();
+			auto previous = byFilename.find(filename);
+			if (previous != byFilename.end()) {
+				records.erase(previous->second);
+				byFilename.erase(previous);
+			}
+			if (j.find("rm") == j.end()) {
+				int layout = j.find("v") != j.end() ? j.at("v").get<int>() : 1;
+				if (layout != storageLayout) {
+					std::cerr << "Dropping cache entry " << filename << " stored with layout " << layout << "\n";
+					continue;
+				}
+				records.push_back(recordFromJson(j));
+				byFilename[filename] = std::prev(records.end());
+			}
+		} catch(const std::exception & e) {
+			std::cerr << "Ignoring invalid cache index record: " << e.what() << "\n";
+		}
+	}
+
+	for(auto it = records.begin(); it != records.end();) {
+		const Record & record = *it;
+		bool valid = true;
+
+		struct stat st;
+		std::string dataPath = basePath + record.filename;
+		if (stat(dataPath.c_str(), &st) == -1 || st.st_size != record.size) {
+			valid = false;
+		} else {
+			std::vector<SourceStamp> current;
+			valid = stampSources(record.identifier, current) && current == record.sources;
+		}
+
+		if (valid) {
+			++it;
+		} else {
+			std::cerr << "Dropping outdated cache entry " << record.filename << "\n";
+			it = records.erase(it);
+		}
+	}
+	return records;
+}
+
+void CacheIndex::rewrite(const std::list<Record> & records)
+{
+	std::string path = basePath + fileName;
+	std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream out(tmpPath, std::ios::trunc);
+		for(auto it = records.begin(); it != records.end(); ++it) {
+			out << recordToJson(*it).dump() << "\n";
+		}
+		out.close();
+		if (!out) {
+			throw std::runtime_error("Unable to write cache index");
+		}
+	}
+	if (rename(tmpPath.c_str(), path.c_str()) == -1) {
+		perror(path.c_str());
+		throw std::runtime_error("Unable to replace cache index");
+	}
+	if (fd != -1) {
+		close(fd);
+		fd = -1;
+	}
+	journalLength = records.size();
+}
+
+bool CacheIndex::stampSources(const ContentKey & identifier, std::vector<SourceStamp> & into)
+{
+	Messages::ContentRequest request = nlohmann::json::parse(identifier.str()).get<Messages::ContentRequest>();
+	std::list<Messages::RawContent *> rawContents;
+	request.collectRawContents(rawContents);
+
+	into.clear();
+	for(auto it = rawContents.begin(); it != rawContents.end(); ++it) {
+		Messages::RawContent * rawContent = *it;
+		if (!rawContent->stream.empty() || rawContent->path.empty()) {
+			return false;
+		}
+		struct stat st;
+		if (stat(rawContent->path.c_str(), &st) == -1) {
+			return false;
+		}
+		SourceStamp stamp;
+		stamp.path = rawContent->path;
+		stamp.size = st.st_size;
+		stamp.mtime = st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec;
+		into.push_back(stamp);
+	}
+	return !into.empty();
+}
+
+}
@@ -0,0 +1,68 @@
+#ifndef CACHEINDEX_H_
+#define CACHEINDEX_H_
+
+#include <string>
+#include <list>
+#include <vector>
+#include "json.hpp"
+#include "ContentKey.h"
+
+namespace SharedCache {
+
+// Journal of the produced contents, stored next to the data files.
+// Lets a restarted fits-server reuse its previous data (FITS_SERVER_CACHE_PERSIST)
+class CacheIndex {
+public:
+	// Identity of a source file at production time
+	struct SourceStamp {
+		std::string path;
+		long size;
+		long mtime;
+
+		bool operator==(const SourceStamp & other) const {
+			return path == other.path && size == other.size && mtime == other.mtime;
+		}
+	};
+
+	struct Record {
+		ContentKey identifier;
+		std::string filename;
+		long size;
+		long prodDuration;
+		std::vector<SourceStamp> sources;
+	};
+
+	static const std::string fileName;
+	// Version of the layout of the stored contents (RawDataStorage, ...). Bump it on any change:
+	// entries stored with another layout are not restored
+	static const int storageLayout;
+
+private:
+	std::string basePath;
+	int fd;
+	// Number of records in the journal (live or not)
+	long journalLength;
+
+	void open();
+	void append(const nlohmann::json & j);
+public:
+	CacheIndex(const std::string & basePath);
+	~CacheIndex();
+
+	// Replay the journal. Returns the records that are still valid (same storage layout, unchanged sources), in production order
+	std::list<Record> load();
+	// Replace the journal by exactly these records
+	void rewrite(const std::list<Record> & records);
+
+	void added(const Record & record);
+	void removed(const std::string & filename);
+
+	long getJournalLength() const { return journalLength; }
+
+	// Stamp the source files of a content. Returns false for contents that can't be persisted (streams)
+	static bool stampSources(const ContentKey & identifier, std::vector<SourceStamp> & into);
+};
+
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iostream>
+#include <stdexcept>
+
+#include "CacheStorage.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+namespace SharedCache {
+
+CacheStorage * CacheStorage::build(const std::string & basePath)
+{
+	const char * env = getenv("FITS_SERVER_STORAGE");
+	if (env == nullptr || !strcmp(env, "file")) {
+		return new FileStorage(basePath);
+	}
+	if (!strcmp(env, "memfd")) {
+		return new MemfdStorage();
+	}
+	throw std::runtime_error("invalid FITS_SERVER_STORAGE: " + std::string(env));
+}
+
+FileStorage::FileStorage(const std::string & basePath) :
+	basePath(basePath)
+{
+}
+
+bool FileStorage::create(const std::string & filename)
+{
+	std::string path = basePath + filename;
+	int fd = ::open(path.c_str(), O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		if (errno == EEXIST) {
+			return false;
+		}
+		perror(path.c_str());
+		throw std::runtime_error("Failed to create data file");
+	}
+	close(fd);
+	return true;
+}
+
+void FileStorage::remove(const std::string & filename)
+{
+	std::string path = basePath + filename;
+	if (::unlink(path.c_str()) == -1) {
+		perror(path.c_str());
+	}
+}
+
+int FileStorage::open(const std::string & filename) const
+{
+	std::string path = basePath + filename;
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror(path.c_str());
+	}
+	return fd;
+}
+
+MemfdStorage::MemfdStorage()
+{
+	// One descriptor per entry is kept open
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+			perror("setrlimit");
+		}
+	}
+}
+
+MemfdStorage::~MemfdStorage()
+{
+	// Also called in forked workers: only drops their copy
+	for(auto it = fds.begin(); it != fds.end(); ++it) {
+		close(it->second.writable);
+		close(it->second.readOnly);
+	}
+}
+
+bool MemfdStorage::create(const std::string & filename)
+{
+	if (fds.find(filename) != fds.end()) {
+		return false;
+	}
+	int fd = syscall(SYS_memfd_create, filename.c_str(), MFD_CLOEXEC);
+	if (fd == -1) {
+		perror("memfd_create");
+		throw std::runtime_error("Failed to create data file");
+	}
+	std::string path = "/proc/self/fd/" + std::to_string(fd);
+	int readOnly = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (readOnly == -1) {
+		perror(path.c_str());
+		close(fd);
+		throw std::runtime_error("Failed to create data file");
+	}
+	fds[filename] = { fd, readOnly };
+	return true;
+}
+
+void MemfdStorage::remove(const std::string & filename)
+{
+	auto it = fds.find(filename);
+	if (it == fds.end()) {
+		return;
+	}
+	close(it->second.writable);
+	close(it->second.readOnly);
+	fds.erase(it);
+}
+
+int MemfdStorage::fd(const std::string & filename) const
+{
+	auto it = fds.find(filename);
+	if (it == fds.end()) {
+		return -1;
+	}
+	return it->second.writable;
+}
+
+int MemfdStorage::readFd(const std::string & filename) const
+{
+	auto it = fds.find(filename);
+	if (it == fds.end()) {
+		return -1;
+	}
+	return it->second.readOnly;
+}
+
+int MemfdStorage::open(const std::string & filename) const
+{
+	int existing = readFd(filename);
+	if (existing == -1) {
+		return -1;
+	}
+	int copy = fcntl(existing, F_DUPFD_CLOEXEC, 0);
+	if (copy == -1) {
+		perror("dup");
+	}
+	return copy;
+}
+
+}
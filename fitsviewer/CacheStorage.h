@@ -0,0 +1,72 @@
+#ifndef CACHESTORAGE_H_
+#define CACHESTORAGE_H_
+
+#include <string>
+#include <map>
+
+namespace SharedCache {
+
+// Where fits-server keeps the data of its entries (FITS_SERVER_STORAGE).
+// Entries are always named by a filename; with fd based storages, the server passes the fd
+// along with the messages that refer to an entry (SCM_RIGHTS) and the filename is only an identifier
+class CacheStorage {
+public:
+	virtual ~CacheStorage() {}
+
+	// Reserve the storage of a new entry. False if the name is already taken
+	virtual bool create(const std::string & filename) = 0;
+	// Drop the storage of an entry. Mappings already established remain valid
+	virtual void remove(const std::string & filename) = 0;
+	// Descriptor to send to the producer of the entry, -1 when peers open basePath + filename themselves
+	virtual int fd(const std::string & filename) const = 0;
+	// Same, as read only for its consumers
+	virtual int readFd(const std::string & filename) const = 0;
+	// New read only descriptor on the data of an entry, owned by the caller. -1 on failure
+	virtual int open(const std::string & filename) const = 0;
+	// True if entries survive a restart of the server (allows FITS_SERVER_CACHE_PERSIST)
+	virtual bool persistent() const = 0;
+	virtual const char * name() const = 0;
+
+	// FITS_SERVER_STORAGE: file (default) or memfd
+	static CacheStorage * build(const std::string & basePath);
+};
+
+// One file per entry in the cache directory
+class FileStorage : public CacheStorage {
+	std::string basePath;
+public:
+	FileStorage(const std::string & basePath);
+
+	virtual bool create(const std::string & filename);
+	virtual void remove(const std::string & filename);
+	virtual int fd(const std::string & filename) const { return -1; }
+	virtual int readFd(const std::string & filename) const { return -1; }
+	virtual int open(const std::string & filename) const;
+	virtual bool persistent() const { return true; }
+	virtual const char * name() const { return "file"; }
+};
+
+// Anonymous memory files (memfd_create): always in RAM, whatever the cache directory is on
+class MemfdStorage : public CacheStorage {
+	struct Fds {
+		int writable;
+		// Reopened through /proc: consumers can't map it for writing
+		int readOnly;
+	};
+	std::map<std::string, Fds> fds;
+public:
+	MemfdStorage();
+	virtual ~MemfdStorage();
+
+	virtual bool create(const std::string & filename);
+	virtual void remove(const std::string & filename);
+	virtual int fd(const std::string & filename) const;
+	virtual int readFd(const std::string & filename) const;
+	virtual int open(const std::string & filename) const;
+	virtual bool persistent() const { return false; }
+	virtual const char * name() const { return "memfd"; }
+};
+
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef CONTENTKEY_H_
+#define CONTENTKEY_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+namespace SharedCache {
+	// Canonical identifier of a content, with a precomputed digest.
+	// Built once per request; comparison checks the digest before the canonical form
+	class ContentKey {
+		std::string canonical;
+		uint64_t digest;
+
+		// FNV-1a, followed by a final avalanche (murmur3 fmix64)
+		static uint64_t computeDigest(const std::string & str) {
+			uint64_t h = 14695981039346656037ULL;
+			for(size_t i = 0; i < str.size(); ++i) {
+				h ^= (uint8_t)str[i];
+				h *= 1099511628211ULL;
+			}
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdULL;
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ULL;
+			h ^= h >> 33;
+			return h;
+		}
+	public:
+		ContentKey() : canonical(), digest(0) {}
+		explicit ContentKey(const std::string & canonical) : canonical(canonical), digest(computeDigest(canonical)) {}
+
+		const std::string & str() const { return canonical; }
+		uint64_t hash() const { return digest; }
+		bool empty() const { return canonical.empty(); }
+
+		bool operator==(const ContentKey & other) const {
+			return digest == other.digest && canonical == other.canonical;
+		}
+		bool operator!=(const ContentKey & other) const {
+			return !(*this == other);
+		}
+	};
+
+	struct ContentKeyHash {
+		size_t operator()(const ContentKey & key) const {
+			return (size_t)key.hash();
+		}
+	};
+}
+
+#endif
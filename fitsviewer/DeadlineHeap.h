@@ -0,0 +1,107 @@
+#ifndef DEADLINEHEAP_H_
+#define DEADLINEHEAP_H_
+
+#include <chrono>
+#include <vector>
+
+namespace SharedCache {
+
+template<class Owner> class DeadlineHeap;
+
+// A deadline, stored inline in its owner. Armed deadlines are kept in a DeadlineHeap
+template<class Owner> class Deadline {
+	friend class DeadlineHeap<Owner>;
+	// Position in the heap, -1 when not armed
+	long heapIndex;
+public:
+	Owner * const owner;
+	std::chrono::time_point<std::chrono::steady_clock> when;
+
+	Deadline(Owner * owner) : heapIndex(-1), owner(owner), when() {}
+	Deadline(const Deadline &) = delete;
+	Deadline & operator=(const Deadline &) = delete;
+
+	bool armed() const { return heapIndex != -1; }
+};
+
+// Binary min-heap of deadlines. Arming, moving or disarming one is O(log n); finding the next is O(1)
+template<class Owner> class DeadlineHeap {
+	std::vector<Deadline<Owner> *> heap;
+
+	void place(Deadline<Owner> * d, size_t pos) {
+		heap[pos] = d;
+		d->heapIndex = pos;
+	}
+
+	void siftUp(size_t pos) {
+		Deadline<Owner> * d = heap[pos];
+		while(pos > 0) {
+			size_t parent = (pos - 1) / 2;
+			if (!(d->when < heap[parent]->when)) {
+				break;
+			}
+			place(heap[parent], pos);
+			pos = parent;
+		}
+		place(d, pos);
+	}
+
+	void siftDown(size_t pos) {
+		Deadline<Owner> * d = heap[pos];
+		while(true) {
+			size_t child = 2 * pos + 1;
+			if (child >= heap.size()) {
+				break;
+			}
+			if (child + 1 < heap.size() && heap[child + 1]->when < heap[child]->when) {
+				child++;
+			}
+			if (!(heap[child]->when < d->when)) {
+				break;
+			}
+			place(heap[child], pos);
+			pos = child;
+		}
+		place(d, pos);
+	}
+
+public:
+	// Arm the deadline, or move it if already armed
+	void arm(Deadline<Owner> * d, const std::chrono::time_point<std::chrono::steady_clock> & when) {
+		d->when = when;
+		if (!d->armed()) {
+			heap.push_back(d);
+			d->heapIndex = heap.size() - 1;
+			siftUp(d->heapIndex);
+			return;
+		}
+		siftUp(d->heapIndex);
+		siftDown(d->heapIndex);
+	}
+
+	void disarm(Deadline<Owner> * d) {
+		if (!d->armed()) {
+			return;
+		}
+		size_t pos = d->heapIndex;
+		d->heapIndex = -1;
+		Deadline<Owner> * last = heap.back();
+		heap.pop_back();
+		if (last == d) {
+			return;
+		}
+		place(last, pos);
+		siftUp(pos);
+		siftDown(last->heapIndex);
+	}
+
+	bool empty() const { return heap.empty(); }
+	size_t size() const { return heap.size(); }
+
+	// Earliest armed deadline. The heap must not be empty
+	Deadline<Owner> * top() const { return heap.front(); }
+};
+
+}
+
+#endif
@@ -0,0 +1,281 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "FastFitsReader.h"
+#include "PixelKernels.h"
+#include "SharedCache.h"
+#include "RawDataStorage.h"
+#include "Trace.h"
+
+static const size_t BLOCK_SIZE = 2880;
+static const size_t CARD_SIZE = 80;
+// readHeader gives up on longer headers
+static const size_t MAX_HEADER_BLOCKS = 64;
+// Pixels converted between progress reports
+static const size_t CONVERT_BAND_PIXELS = 1 << 20;
+
+static std::string trim(const std::string & str)
+{
+	size_t end = str.find_last_not_of(' ');
+	return end == std::string::npos ? "" : str.substr(0, end + 1);
+}
+
+// Value of a card, without comment. Strings are unquoted
+static bool cardValue(const char * card, std::string & value, bool & isString)
+{
+	if (card[8] != '=' || card[9] != ' ') {
+		return false;
+	}
+	size_t pos = 10;
+	while(pos < CARD_SIZE && card[pos] == ' ') {
+		pos++;
+	}
+	if (pos < CARD_SIZE && card[pos] == '\'') {
+		isString = true;
+		value.clear();
+		for(pos++; pos < CARD_SIZE; pos++) {
+			if (card[pos] == '\'') {
+				// Quotes are doubled inside strings
+				if (pos + 1 < CARD_SIZE && card[pos + 1] == '\'') {
+					value += '\'';
+					pos++;
+					continue;
+				}
+				value = trim(value);
+				return true;
+			}
+			value += card[pos];
+		}
+		return false;
+	}
+	isString = false;
+	size_t end = pos;
+	while(end < CARD_SIZE && card[end] != '/' && card[end] != ' ') {
+		end++;
+	}
+	value = std::string(card + pos, end - pos);
+	return !value.empty();
+}
+
+static bool parseLong(const std::string & value, long & result)
+{
+	char * end;
+	result = strtol(value.c_str(), &end, 10);
+	return *end == 0;
+}
+
+static bool parseDouble(const std::string & value, double & result)
+{
+	// Fortran exponents are allowed in headers
+	std::string copy = value;
+	std::replace(copy.begin(), copy.end(), 'D', 'E');
+	char * end;
+	result = strtod(copy.c_str(), &end);
+	return *end == 0;
+}
+
+bool FastFitsReader::parseHeader(const char * data, size_t size, Header & header)
+{
+	return parseHeader(data, size, size, header);
+}
+
+bool FastFitsReader::parseHeader(const char * data, size_t size, size_t fileSize, Header & header)
+{
+	long bitpix = 0, naxis = -1, naxis1 = 0, naxis2 = 0;
+	double bzero = 0, bscale = 1;
+	header.bayer.clear();
+	header.dataOffset = 0;
+
+	for(size_t offset = 0; offset + CARD_SIZE <= size; offset += CARD_SIZE) {
+		const char * card = data + offset;
+		std::string keyword = trim(std::string(card, 8));
+		if (offset == 0 && keyword != "SIMPLE") {
+			return false;
+		}
+		if (keyword == "END") {
+			header.dataOffset = (offset / BLOCK_SIZE + 1) * BLOCK_SIZE;
+			if (naxis != 2 || naxis1 <= 0 || naxis2 <= 0) {
+				return false;
+			}
+			// Bytes are stored as is: they must not be scaled
+			if (bitpix != 16 && bitpix != 32 && bitpix != -32 && (bitpix != 8 || bzero != 0 || bscale != 1)) {
+				return false;
+			}
+			if (header.dataOffset + (labs(bitpix) / 8) * (size_t)naxis1 * naxis2 > fileSize) {
+				// Truncated
+				return false;
+			}
+			header.w = naxis1;
+			header.h = naxis2;
+			header.bitpix = bitpix;
+			header.bzero = bzero;
+			header.bscale = bscale;
+			return true;
+		}
+		std::string value;
+		bool isString;
+		if (!cardValue(card, value, isString)) {
+			continue;
+		}
+		bool valid = true;
+		if (keyword == "SIMPLE") {
+			valid = value == "T";
+		} else if (keyword == "BITPIX") {
+			valid = parseLong(value, bitpix);
+		} else if (keyword == "NAXIS") {
+			valid = parseLong(value, naxis);
+		} else if (keyword == "NAXIS1") {
+			valid = parseLong(value, naxis1);
+		} else if (keyword == "NAXIS2") {
+			valid = parseLong(value, naxis2);
+		} else if (keyword == "BZERO") {
+			valid = parseDouble(value, bzero);
+		} else if (keyword == "BSCALE") {
+			valid = parseDouble(value, bscale);
+		} else if (keyword == "BAYERPAT" && isString) {
+			header.bayer = value;
+		}
+		if (!valid) {
+			return false;
+		}
+	}
+	return false;
+}
+
+bool FastFitsReader::read(const char * data, size_t size, SharedCache::WriteableEntry * entry)
+{
+	Header header;
+	if (!parseHeader(data, size, header)) {
+		return false;
+	}
+	SharedCache::Trace::Span span("fastRead", "worker");
+	if (header.bayer.size()) {
+		bool valid = header.bayer.size() == 4;
+		for(size_t i = 0; valid && i < 4; ++i) {
+			valid = RawDataStorage::getRGBIndex(header.bayer[i]) != -1;
+		}
+		if (!valid) {
+			fprintf(stderr, "Ignoring bayer pattern: %s\n", header.bayer.c_str());
+			header.bayer = "";
+		}
+	}
+
+	RawDataStorage::SampleType sampleType = header.sampleType();
+	entry->allocate(RawDataStorage::requiredStorage(header.w, header.h, sampleType));
+	RawDataStorage * storage = (RawDataStorage*)entry->data();
+	storage->setSize(header.w, header.h);
+	storage->setBayer(header.bayer);
+	storage->setSampleType(sampleType);
+
+	const uint8_t * pixels = (const uint8_t *)data + header.dataOffset;
+	size_t count = (size_t)header.w * header.h;
+	if (sampleType == RawDataStorage::SampleU8) {
+		for(size_t done = 0; done < count;) {
+			size_t band = std::min(CONVERT_BAND_PIXELS, count - done);
+			memcpy(storage->samples<uint8_t>() + done, pixels + done, band);
+			done += band;
+			entry->progress((double)done / count);
+		}
+		return true;
+	}
+
+	PixelKernels::SourceType type;
+	switch(header.bitpix) {
+		case 16:
+			type = PixelKernels::Int16;
+			break;
+		case 32:
+			type = PixelKernels::Int32;
+			break;
+		default:
+			type = PixelKernels::Float32;
+	}
+	int pixelSize = PixelKernels::pixelSize(type);
+
+	for(size_t done = 0; done < count;) {
+		size_t band = std::min(CONVERT_BAND_PIXELS, count - done);
+		const uint8_t * from = pixels + pixelSize * done;
+		switch(sampleType) {
+			case RawDataStorage::SampleI32:
+				PixelKernels::decodeInt32(from, storage->samples<int32_t>() + done, band);
+				break;
+			case RawDataStorage::SampleF32:
+				PixelKernels::decodeFloat32(type, from, storage->samples<float>() + done, band, header.bscale, header.bzero);
+				break;
+			default:
+				PixelKernels::convert(type, from, storage->samples<uint16_t>() + done, band, header.bscale, header.bzero);
+		}
+		done += band;
+		entry->progress((double)done / count);
+	}
+	storage->computeLevels();
+	return true;
+}
+
+bool FastFitsReader::readHeader(const std::string & path, Header & header)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return false;
+	}
+	// Read blocks until the END card
+	std::string blocks;
+	bool result = false;
+	while(blocks.size() < MAX_HEADER_BLOCKS * BLOCK_SIZE) {
+		size_t offset = blocks.size();
+		blocks.resize(offset + BLOCK_SIZE);
+		ssize_t rd = pread(fd, &blocks[offset], BLOCK_SIZE, offset);
+		if (rd != (ssize_t)BLOCK_SIZE || blocks.compare(0, 6, "SIMPLE")) {
+			break;
+		}
+		result = parseHeader(blocks.data(), blocks.size(), st.st_size, header);
+		if (result || header.dataOffset != 0) {
+			// Parsed, or unsupported
+			break;
+		}
+	}
+	close(fd);
+	return result;
+}
+
+bool FastFitsReader::read(const std::string & path, SharedCache::WriteableEntry * entry)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		// Let cfitsio report the error (or handle its extended file name syntax)
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < (off_t)BLOCK_SIZE) {
+		close(fd);
+		return false;
+	}
+	void * data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	bool result;
+	try {
+		result = read((const char*)data, st.st_size, entry);
+	} catch(...) {
+		munmap(data, st.st_size);
+		throw;
+	}
+	munmap(data, st.st_size);
+	return result;
+}
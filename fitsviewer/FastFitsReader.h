@@ -0,0 +1,58 @@
+#ifndef FASTFITSREADER_H_
+#define FASTFITSREADER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "RawDataStorage.h"
+
+namespace SharedCache {
+	class WriteableEntry;
+}
+
+// Reader for uncompressed primary images of 16 or 32 bits integers or 32 bits floats (that covers
+// camera frames). Converts the pixels directly from the file mapping or the memory blob with
+// PixelKernels, without cfitsio nor temporary buffer. Unscaled bytes are copied as 8 bits samples,
+// unscaled 32 bits integers as 32 bits samples; floats and scaled 32 bits integers become floats.
+// Anything else is left to cfitsio (RawContent::readFits)
+class FastFitsReader {
+public:
+	struct Header {
+		int w, h;
+		// 8, 16, 32 or -32
+		int bitpix;
+		double bzero, bscale;
+		// Empty if none (or invalid)
+		std::string bayer;
+		// Start of the pixels in the file
+		size_t dataOffset;
+
+		// Type of the samples once read (the same as RawContent::readFits)
+		RawDataStorage::SampleType sampleType() const {
+			switch(bitpix) {
+				case 8:
+					return RawDataStorage::SampleU8;
+				case 32:
+					return bzero == 0 && bscale == 1 ? RawDataStorage::SampleI32 : RawDataStorage::SampleF32;
+				case -32:
+					return RawDataStorage::SampleF32;
+				default:
+					return RawDataStorage::SampleU16;
+			}
+		}
+	};
+
+	// Parse the primary header. False if the image does not have a supported layout
+	static bool parseHeader(const char * data, size_t size, Header & header);
+	// Same, when data only holds the start of a file of fileSize bytes
+	static bool parseHeader(const char * data, size_t size, size_t fileSize, Header & header);
+	// Parse the primary header of a file, reading only the header blocks
+	static bool readHeader(const std::string & path, Header & header);
+
+	// Read an image in memory. False if not supported (entry is then untouched)
+	static bool read(const char * data, size_t size, SharedCache::WriteableEntry * entry);
+	// Read a file. False if not supported or not readable this way (entry is then untouched)
+	static bool read(const std::string & path, SharedCache::WriteableEntry * entry);
+};
+
+#endif
@@ -1,3 +1,9 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
 #include <stdexcept>
 #include "FitsFile.h"
 #include "SharedCacheServer.h"
@@ -5,6 +11,8 @@
 FitsFile::FitsFile()
 {
     fptr = nullptr;
+    mapping = nullptr;
+    mappingSize = 0;
 }
 
 FitsFile::~FitsFile() {
@@ -17,6 +25,7 @@ FitsFile::~FitsFile() {
         }
         fptr = nullptr;
     }
+    unmap();
 }
 
 void FitsFile::close() {
@@ -25,6 +34,14 @@ void FitsFile::close() {
         fits_close_file(fptr, &status);
         fptr = nullptr;
     }
+    unmap();
+}
+
+void FitsFile::unmap() {
+    if (mapping) {
+        munmap(mapping, mappingSize);
+        mapping = nullptr;
+    }
 }
 
 void FitsFile::create(const std::string & path) {
@@ -47,6 +64,8 @@ void FitsFile::open(const std::string & path) {
 	if (fits_open_file(&fptr, path.c_str(), READONLY, &status)) {
         throwFitsIOError(std::string("unable to open : ") + path, status);
     }
+    this->path = path;
+    moveToImage();
 }
 
 void FitsFile::openMemory(void * data, size_t len) {
@@ -60,6 +79,27 @@ void FitsFile::openMemory(void * data, size_t len) {
 	if (fits_open_memfile(&fptr, "blob", READONLY, &this->data, &this->dataSize, 0, nullptr, &status)) {
         throwFitsIOError(std::string("unable to open blob"), status);
     }
+    moveToImage();
+}
+
+void FitsFile::moveToImage() {
+    int status = 0;
+    int naxis;
+    if (fits_get_img_dim(fptr, &naxis, &status) || naxis > 0) {
+        return;
+    }
+    // Compressed images (fpack) follow an empty primary HDU
+    for(int hdu = 2; ; ++hdu) {
+        int hduType;
+        if (fits_movabs_hdu(fptr, hdu, &hduType, &status)) {
+            break;
+        }
+        if (hduType == IMAGE_HDU && !fits_get_img_dim(fptr, &naxis, &status) && naxis > 0) {
+            return;
+        }
+    }
+    status = 0;
+    fits_movabs_hdu(fptr, 1, nullptr, &status);
 }
 
 bool FitsFile::openIfExists(const std::string & path) {
@@ -72,9 +112,43 @@ bool FitsFile::openIfExists(const std::string & path) {
         return false;
     }
     isnew = false;
+    this->path = path;
     return true;
 }
 
+void FitsFile::openSibling(const FitsFile & other) {
+    if (other.path.empty()) {
+        openMemory(other.data, other.dataSize);
+    } else {
+        int fd = ::open(other.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror(other.path.c_str());
+            throw SharedCache::WorkerError("unable to open : " + other.path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            perror("fstat");
+            ::close(fd);
+            throw SharedCache::WorkerError("unable to stat : " + other.path);
+        }
+        void * data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            perror("mmap");
+            throw SharedCache::WorkerError("unable to map : " + other.path);
+        }
+        mapping = data;
+        mappingSize = st.st_size;
+        openMemory(mapping, mappingSize);
+    }
+    int status = 0;
+    int hdu;
+    fits_get_hdu_num(other.fptr, &hdu);
+    if (fits_movabs_hdu(fptr, hdu, nullptr, &status)) {
+        throwFitsIOError("unable to move to HDU", status);
+    }
+}
+
 double FitsFile::getDoubleKey(const std::string & key) {
 
     int status = 0;
@@ -9,17 +9,31 @@ class FitsFile {
 
 	void * data;
 	size_t dataSize;
+	// Empty for memory blobs
+	std::string path;
+	// Mapping of the file of a sibling
+	void * mapping;
+	size_t mappingSize;
+
+	void unmap();
+	// Move to the first HDU with pixels, if the primary HDU has none
+	void moveToImage();
 public:
 	fitsfile * fptr;
 
 	FitsFile();
 	~FitsFile();
 
+    // Open on the first image HDU
     void open(const std::string & path);
     bool openIfExists(const std::string & path);
     void create(const std::string & path);
 
+	// Open on the first image HDU
 	void openMemory(void * buffer, size_t len);
+	// Open the same file (or blob) again, on the same HDU. A fitsfile must not be used by two threads at once.
+	// Files are mapped and opened as blobs: cfitsio would otherwise share its buffers with the first handle
+	void openSibling(const FitsFile & other);
 
     // Error if not found
     std::string getStrKey(const std::string & key);
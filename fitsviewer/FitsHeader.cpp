@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "fitsio.h"
+#include "json.hpp"
+#include "FitsFile.h"
+#include "SharedCache.h"
+#include "SharedCacheServer.h"
+#include "RawDataStorage.h"
+#include "FitsHeaderStorage.h"
+
+FitsHeaderStorage * FitsHeaderStorage::build(int width, int height, int bitpix, const std::vector<Keyword> & keywords, std::function<void* (long int)> allocator)
+{
+	uint32_t stringSize = 0;
+	for(auto & k : keywords) {
+		stringSize += k.keyword.size() + k.value.size() + k.comment.size() + 3;
+	}
+
+	FitsHeaderStorage * result = (FitsHeaderStorage*)allocator(requiredStorage(keywords.size(), stringSize));
+	result->width = width;
+	result->height = height;
+	result->bitpix = bitpix;
+	result->cardCount = keywords.size();
+	result->bucketCount = requiredBuckets(keywords.size());
+	result->stringSize = stringSize;
+
+	Card * cards = (Card*)result->cards();
+	uint32_t * buckets = (uint32_t*)result->buckets();
+	char * strings = (char*)result->strings();
+	memset(buckets, 0, sizeof(uint32_t) * result->bucketCount);
+
+	uint32_t offset = 0;
+	auto store = [&strings, &offset](const std::string & str) {
+		uint32_t start = offset;
+		memcpy(strings + offset, str.c_str(), str.size() + 1);
+		offset += str.size() + 1;
+		return start;
+	};
+
+	uint32_t mask = result->bucketCount - 1;
+	for(uint32_t i = 0; i < keywords.size(); ++i) {
+		Card & card = cards[i];
+		card.hash = hashKeyword(keywords[i].keyword.c_str());
+		card.keyword = store(keywords[i].keyword);
+		card.value = store(keywords[i].value);
+		card.comment = store(keywords[i].comment);
+		card.isString = keywords[i].isString;
+
+		if (result->find(keywords[i].keyword.c_str()) != nullptr) {
+			// Duplicate: lookups return the first one
+			continue;
+		}
+		uint32_t bucket = card.hash & mask;
+		while(buckets[bucket] != 0) {
+			bucket = (bucket + 1) & mask;
+		}
+		buckets[bucket] = i + 1;
+	}
+	return result;
+}
+
+// Value of a card as returned by cfitsio: quoted strings get unquoted
+static bool unquote(std::string & value)
+{
+	if (value.size() < 2 || value[0] != '\'') {
+		return false;
+	}
+	std::string result;
+	for(size_t i = 1; i < value.size(); ++i) {
+		if (value[i] == '\'') {
+			if (i + 1 < value.size() && value[i + 1] == '\'') {
+				result += '\'';
+				i++;
+				continue;
+			}
+			break;
+		}
+		result += value[i];
+	}
+	// Trailing spaces are not significant
+	size_t end = result.find_last_not_of(' ');
+	value = end == std::string::npos ? "" : result.substr(0, end + 1);
+	return true;
+}
+
+static nlohmann::json valueToJson(const char * value, bool isString)
+{
+	if (isString) {
+		return value;
+	}
+	if (!strcmp(value, "T")) {
+		return true;
+	}
+	if (!strcmp(value, "F")) {
+		return false;
+	}
+	char * end;
+	long l = strtol(value, &end, 10);
+	if (*value && !*end) {
+		return l;
+	}
+	// Fortran exponents are allowed in headers
+	std::string copy(value);
+	std::replace(copy.begin(), copy.end(), 'D', 'E');
+	double d = strtod(copy.c_str(), &end);
+	if (!copy.empty() && !*end) {
+		return d;
+	}
+	return value;
+}
+
+long SharedCache::Messages::FitsHeader::estimateSize() const
+{
+	// A few hundred cards
+	return 64 * 1024;
+}
+
+void SharedCache::Messages::FitsHeader::produce(Entry * entry)
+{
+	std::vector<FitsHeaderStorage::Keyword> keywords;
+	auto allocator = [&entry](long int size){
+		entry->allocate(size);
+		return entry->data();
+	};
+
+	if (source.path.empty()) {
+		// Stream frames are not kept as FITS: only what the RawContent knows
+		ContentRequest sourceRequest;
+		sourceRequest.fitsContent = new RawContent(source);
+		EntryRef sourceEntry(entry->getServer()->getEntry(sourceRequest));
+		if (sourceEntry->hasError()) {
+			sourceEntry->release();
+			throw WorkerError(std::string("Source error : ") + sourceEntry->getErrorDetails());
+		}
+		RawDataStorage * rcs = (RawDataStorage*)sourceEntry->data();
+		if (rcs->hasColors()) {
+			keywords.push_back({"BAYERPAT", rcs->getBayer(), "", true});
+		}
+		int bitpix = rcs->sampleType == RawDataStorage::SampleF32 ? -32 : rcs->bitpix;
+		FitsHeaderStorage::build(rcs->w, rcs->h, bitpix, keywords, allocator);
+		return;
+	}
+
+	FitsFile file;
+	file.open(source.path);
+
+	int status = 0;
+	int bitpix, naxis;
+	long naxes[2] = {0, 0};
+	if (fits_get_img_param(file.fptr, 2, &bitpix, &naxis, naxes, &status)) {
+		file.throwFitsIOError("fits_get_img_param", status);
+	}
+
+	int nkeys;
+	if (fits_get_hdrspace(file.fptr, &nkeys, NULL, &status)) {
+		file.throwFitsIOError("fits_get_hdrspace", status);
+	}
+	for(int i = 1; i <= nkeys; ++i) {
+		char keyword[FLEN_KEYWORD], value[FLEN_VALUE], comment[FLEN_COMMENT];
+		if (fits_read_keyn(file.fptr, i, keyword, value, comment, &status)) {
+			file.throwFitsIOError("fits_read_keyn", status);
+		}
+		// COMMENT, HISTORY, ... have no value
+		if (!keyword[0] || !value[0]) {
+			continue;
+		}
+		FitsHeaderStorage::Keyword k;
+		k.keyword = keyword;
+		k.value = value;
+		k.comment = comment;
+		k.isString = unquote(k.value);
+		keywords.push_back(k);
+	}
+	FitsHeaderStorage::build(naxes[0], naxes[1], bitpix, keywords, allocator);
+}
+
+bool SharedCache::Messages::FitsHeader::asJsonResult(Entry * e, nlohmann::json&j, const nlohmann::json& jsonOptions) const {
+	FitsHeaderOptions options = jsonOptions;
+	FitsHeaderStorage * storage = (FitsHeaderStorage *)e->data();
+
+	nlohmann::json cards = nlohmann::json::object();
+	if (options.keys.empty()) {
+		for(uint32_t i = 0; i < storage->cardCount; ++i) {
+			const FitsHeaderStorage::Card & card = storage->cards()[i];
+			if (cards.find(storage->keyword(card)) == cards.end()) {
+				cards[storage->keyword(card)] = valueToJson(storage->value(card), card.isString);
+			}
+		}
+	} else {
+		for(auto & key : options.keys) {
+			const FitsHeaderStorage::Card * card = storage->find(key.c_str());
+			if (card != nullptr) {
+				cards[key] = valueToJson(storage->value(*card), card->isString);
+			}
+		}
+	}
+
+	bool color = false;
+	const FitsHeaderStorage::Card * bayer = storage->find("BAYERPAT");
+	if (bayer != nullptr && bayer->isString && strlen(storage->value(*bayer)) == 4) {
+		color = true;
+		for(int i = 0; i < 4; ++i) {
+			color = color && RawDataStorage::getRGBIndex(storage->value(*bayer)[i]) != -1;
+		}
+	}
+
+	j = nlohmann::json::object();
+	j["width"] = storage->width;
+	j["height"] = storage->height;
+	j["bitpix"] = storage->bitpix;
+	j["color"] = color;
+	j["cards"] = cards;
+	return true;
+}
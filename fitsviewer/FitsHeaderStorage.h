@@ -0,0 +1,99 @@
+#ifndef FITSHEADERSTORAGE_H
+#define FITSHEADERSTORAGE_H 1
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Valued keywords of a FITS header, as stored in the cache. Cards are kept in header order,
+// followed by an open addressing index on the keyword (the first card wins for duplicates).
+// Layout: FitsHeaderStorage, Card[cardCount], uint32_t buckets[bucketCount], strings
+struct FitsHeaderStorage {
+	struct Card {
+		uint32_t hash;
+		// Offsets of nul terminated texts in the strings
+		uint32_t keyword, value, comment;
+		// The value was quoted
+		uint32_t isString;
+	};
+
+	// Card before storage
+	struct Keyword {
+		std::string keyword, value, comment;
+		bool isString;
+	};
+
+	// Image dimensions and type (from cfitsio: also valid for compressed images)
+	int32_t width, height;
+	int32_t bitpix;
+	uint32_t cardCount;
+	// Power of two. Holds card index + 1, 0 for empty buckets
+	uint32_t bucketCount;
+	uint32_t stringSize;
+	char datas[0];
+
+	const Card * cards() const {
+		return (const Card *)datas;
+	}
+
+	const uint32_t * buckets() const {
+		return (const uint32_t*)(datas + sizeof(Card) * cardCount);
+	}
+
+	const char * strings() const {
+		return (const char*)(buckets() + bucketCount);
+	}
+
+	const char * keyword(const Card & card) const {
+		return strings() + card.keyword;
+	}
+
+	const char * value(const Card & card) const {
+		return strings() + card.value;
+	}
+
+	const char * comment(const Card & card) const {
+		return strings() + card.comment;
+	}
+
+	// nullptr if the keyword is not present
+	const Card * find(const char * keyword) const {
+		uint32_t hash = hashKeyword(keyword);
+		uint32_t mask = bucketCount - 1;
+		for(uint32_t i = hash & mask; buckets()[i] != 0; i = (i + 1) & mask) {
+			const Card & card = cards()[buckets()[i] - 1];
+			if (card.hash == hash && !strcmp(this->keyword(card), keyword)) {
+				return &card;
+			}
+		}
+		return nullptr;
+	}
+
+	// FNV-1a
+	static uint32_t hashKeyword(const char * keyword) {
+		uint32_t h = 2166136261U;
+		for(; *keyword; ++keyword) {
+			h ^= (uint8_t)*keyword;
+			h *= 16777619U;
+		}
+		return h;
+	}
+
+	static uint32_t requiredBuckets(uint32_t cardCount) {
+		// At most half full
+		uint32_t result = 1;
+		while(result < 2 * cardCount) {
+			result *= 2;
+		}
+		return result;
+	}
+
+	static long int requiredStorage(uint32_t cardCount, uint32_t stringSize) {
+		return sizeof(FitsHeaderStorage) + sizeof(Card) * cardCount + sizeof(uint32_t) * requiredBuckets(cardCount) + stringSize;
+	}
+
+	static FitsHeaderStorage * build(int width, int height, int bitpix, const std::vector<Keyword> & keywords, std::function<void* (long int)> allocator);
+};
+
+#endif
@@ -13,6 +13,7 @@
 
 FitsRenderer::FitsRenderer(FitsRendererParam param):
     data(param.data),
+    sampleLevels(param.levels),
     w(param.w),
     h(param.h),
     bin(param.bin),
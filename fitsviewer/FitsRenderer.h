@@ -11,7 +11,11 @@
 
 class FitsRendererParam {
 public:
-    const uint16_t * data;
+    // Samples of sampleType
+    const void * data;
+    RawDataStorage::SampleType sampleType = RawDataStorage::SampleU16;
+    // Levels of the samples (RawDataStorage::levels)
+    SampleLevels levels = {0, 1};
     int w, h, bin;
     double low, med, high;
     std::string bayer;
@@ -21,7 +25,9 @@ public:
 class FitsRenderer {
 
 protected:
-    const uint16_t * data;
+    // Samples, typed by the subclasses (templated on the sample type)
+    const void * data;
+    SampleLevels sampleLevels;
     int w, h;
     int bin;
     double low, med, high;
@@ -35,10 +41,6 @@ protected:
 
     static FitsRenderer * buildBayer(FitsRendererParam param);
     static FitsRenderer * buildGreyscale(FitsRendererParam param);
-    
-    const uint16_t * getPix(int x, int y) const {
-		return data + x + w * y; 
-	}
 
 
 public:
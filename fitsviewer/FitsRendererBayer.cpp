@@ -1,5 +1,6 @@
 #include "FitsRenderer.h"
 
+template<class Sample>
 class FitsRendererBayer : public FitsRenderer {
     int levels[3][3];
     std::string bayer;
@@ -22,6 +23,10 @@ public:
     virtual uint8_t * render(int x0, int y0, int rw, int rh);
 
 private:
+	const Sample * getPix(int x, int y) const {
+		return (const Sample*)data + x + w * y;
+	}
+
 	int16_t toBayerOffset(int8_t bayer)
 	{
 		if (bayer == -1) return -1;
@@ -60,7 +65,7 @@ private:
 
 
 	// Assume data is aligned to a bayer start
-	inline void rectSumBayerRGGB(const uint16_t * data, int sx, int sy,
+	inline void rectSumBayerRGGB(const Sample * data, int sx, int sy,
 								 int32_t & r, int32_t & g, int32_t & b)
 	{
 		r = 0;
@@ -70,17 +75,17 @@ private:
 		while(sy > 0) {
 			for(int i = 0; i < sx; i += 2)
 			{
-				r += table_r->fastGet(data[i]);
-				g += table_g->fastGet(data[i + 1]);
-				g += table_g->fastGet(data[i + w]);
-				b += table_b->fastGet(data[i + w + 1]);
+				r += table_r->fastGet(sampleLevels(data[i]));
+				g += table_g->fastGet(sampleLevels(data[i + 1]));
+				g += table_g->fastGet(sampleLevels(data[i + w]));
+				b += table_b->fastGet(sampleLevels(data[i + w + 1]));
 			}
 			data += 2*w;
 			sy-=2;
 		}
 	}
 
-	inline void rectSumBayer(const uint16_t * data, int sx, int sy,
+	inline void rectSumBayer(const Sample * data, int sx, int sy,
 								int32_t & r, int32_t & g, int32_t & b)
 	{
 		r = 0;
@@ -90,12 +95,12 @@ private:
 		while(sy > 0) {
 			for(int i = 0; i < sx; i += 2)
 			{
-				r += table_r->fastGet(data[i + offset_r]);
-				if (second_r != -1) r += table_r->fastGet(data[i + second_r]);
-				g += table_g->fastGet(data[i + offset_g]);
-				if (second_g != -1) g += table_g->fastGet(data[i + second_g]);
-				b += table_b->fastGet(data[i + offset_b]);
-				if (second_b != -1) b += table_b->fastGet(data[i + second_b]);
+				r += table_r->fastGet(sampleLevels(data[i + offset_r]));
+				if (second_r != -1) r += table_r->fastGet(sampleLevels(data[i + second_r]));
+				g += table_g->fastGet(sampleLevels(data[i + offset_g]));
+				if (second_g != -1) g += table_g->fastGet(sampleLevels(data[i + second_g]));
+				b += table_b->fastGet(sampleLevels(data[i + offset_b]));
+				if (second_b != -1) b += table_b->fastGet(sampleLevels(data[i + second_b]));
 			}
 			data += 2*w;
 			sy-=2;
@@ -205,27 +210,27 @@ private:
 			for(int bx = 0; bx < sx; bx += 2)
 			{
 				{
-					int32_t v_r = table_r->fastGet(src[bx + offset_r]);
+					int32_t v_r = table_r->fastGet(sampleLevels(src[bx + offset_r]));
 					if (second_r != -1) {
-						v_r += table_r->fastGet(src[bx + second_r]);
+						v_r += table_r->fastGet(sampleLevels(src[bx + second_r]));
 						v_r = v_r / 2;
 					}
 					result[i++] = v_r;
 				}
 
 				{
-					int32_t v_g = table_g->fastGet(src[bx + offset_g]);
+					int32_t v_g = table_g->fastGet(sampleLevels(src[bx + offset_g]));
 					if (second_g != -1) {
-						v_g += table_g->fastGet(src[bx + second_g]);
+						v_g += table_g->fastGet(sampleLevels(src[bx + second_g]));
 						v_g = v_g / 2;
 					}
 					result[i++] = v_g;
 				}
 
 				{
-					int32_t v_b = table_b->fastGet(src[bx + offset_b]);
+					int32_t v_b = table_b->fastGet(sampleLevels(src[bx + offset_b]));
 					if (second_b != -1) {
-						v_b += table_b->fastGet(src[bx + second_b]);
+						v_b += table_b->fastGet(sampleLevels(src[bx + second_b]));
 						v_b = v_b / 2;
 					}
 					result[i++] = v_b;
@@ -252,23 +257,35 @@ private:
 };
 
 FitsRenderer * FitsRenderer::buildBayer(FitsRendererParam param) {
-    return new FitsRendererBayer(param);
+    switch(param.sampleType) {
+        case RawDataStorage::SampleU8:
+            return new FitsRendererBayer<uint8_t>(param);
+        case RawDataStorage::SampleI32:
+            return new FitsRendererBayer<int32_t>(param);
+        case RawDataStorage::SampleF32:
+            return new FitsRendererBayer<float>(param);
+        default:
+            return new FitsRendererBayer<uint16_t>(param);
+    }
 }
 
-FitsRendererBayer::FitsRendererBayer(FitsRendererParam param):
+template<class Sample>
+FitsRendererBayer<Sample>::FitsRendererBayer(FitsRendererParam param):
     FitsRenderer(param),
     bayer(param.bayer),
     table_r(nullptr), table_g(nullptr), table_b(nullptr)
 {
 }
 
-FitsRendererBayer::~FitsRendererBayer() {
+template<class Sample>
+FitsRendererBayer<Sample>::~FitsRendererBayer() {
     if (table_r) delete table_r;
     if (table_g) delete table_g;
     if (table_b) delete table_b;
 }
 
-void FitsRendererBayer::prepare() {
+template<class Sample>
+void FitsRendererBayer<Sample>::prepare() {
     for(int i = 0; i < 3; ++i) {
         auto channelStorage = histogramStorage->channel(i);
         levels[i][0]= channelStorage->getLevel(low);
@@ -288,7 +305,8 @@ void FitsRendererBayer::prepare() {
     table_b = new LookupTable(levels[2][0], levels[2][1], levels[2][2]);
 }
 
-uint8_t * FitsRendererBayer::render(int x0, int y0, int rw, int rh) {
+template<class Sample>
+uint8_t * FitsRendererBayer<Sample>::render(int x0, int y0, int rw, int rh) {
     int outputStride = 3 * binDiv(rw, bin);
 	allocOutput(outputStride * binDiv(rh, bin));
     applyScaleBinBayer(x0, y0, rw, rh, bin, output, outputStride);
@@ -1,6 +1,7 @@
 #include "FitsRenderer.h"
 
 
+template<class Sample>
 class FitsRendererGreyscale : public FitsRenderer {
 
     LookupTable * lookupTable;
@@ -13,13 +14,17 @@ public:
     virtual uint8_t * render(int x0, int y0, int rw, int rh);
 
 private:
+	const Sample * getPix(int x, int y) const {
+		return (const Sample*)data + x + w * y;
+	}
+
 	inline void applyScale(int x0, int y0, int sx, int sy, uint8_t * result, int result_stride) {
 		auto src = getPix(x0, y0);
 
 		for(int y = 0; y < sy; ++y) {
 			int i = 0;
 			for(int x = 0; x < sx; ++x) {
-				result[i++] = lookupTable->fastGet(src[x]);
+				result[i++] = lookupTable->fastGet(sampleLevels(src[x]));
 			}
 			src += w;
 			result += result_stride;
@@ -27,12 +32,12 @@ private:
 
 	}
 
-	inline int32_t rectSum(const uint16_t * data, int sx, int sy) const
+	inline int32_t rectSum(const Sample * data, int sx, int sy) const
 	{
 		int32_t result = 0;
 		while(sy > 0) {
 			for(int i = 0; i < sx; ++i)
-				result += lookupTable->fastGet(data[i]);
+				result += lookupTable->fastGet(sampleLevels(data[i]));
 			data += w;
 			sy--;
 		}
@@ -47,10 +52,10 @@ private:
 			int i = 0;
 			for(int bx = 0; bx < sx; bx += 2)
 			{
-				int16_t v = lookupTable->fastGet(src[bx]);
-				v += lookupTable->fastGet(src[bx + 1]);
-				v += lookupTable->fastGet(src[bx + w]);
-				v += lookupTable->fastGet(src[bx + w + 1]);
+				int16_t v = lookupTable->fastGet(sampleLevels(src[bx]));
+				v += lookupTable->fastGet(sampleLevels(src[bx + 1]));
+				v += lookupTable->fastGet(sampleLevels(src[bx + w]));
+				v += lookupTable->fastGet(sampleLevels(src[bx + w + 1]));
 				v /= 4;
 				result[i++] = v;
 			}
@@ -105,20 +110,32 @@ private:
 };
 
 FitsRenderer * FitsRenderer::buildGreyscale(FitsRendererParam param) {
-    return new FitsRendererGreyscale(param);
+    switch(param.sampleType) {
+        case RawDataStorage::SampleU8:
+            return new FitsRendererGreyscale<uint8_t>(param);
+        case RawDataStorage::SampleI32:
+            return new FitsRendererGreyscale<int32_t>(param);
+        case RawDataStorage::SampleF32:
+            return new FitsRendererGreyscale<float>(param);
+        default:
+            return new FitsRendererGreyscale<uint16_t>(param);
+    }
 }
 
-FitsRendererGreyscale::FitsRendererGreyscale(FitsRendererParam param):
+template<class Sample>
+FitsRendererGreyscale<Sample>::FitsRendererGreyscale(FitsRendererParam param):
     FitsRenderer(param),
     lookupTable(nullptr)
 {
 }
 
-FitsRendererGreyscale::~FitsRendererGreyscale() {
+template<class Sample>
+FitsRendererGreyscale<Sample>::~FitsRendererGreyscale() {
     if (lookupTable) delete lookupTable;
 }
 
-void FitsRendererGreyscale::prepare() {
+template<class Sample>
+void FitsRendererGreyscale<Sample>::prepare() {
     auto channelStorage = histogramStorage->channel(0);
 
     int lowAdu = channelStorage->getLevel(low);
@@ -127,7 +144,8 @@ void FitsRendererGreyscale::prepare() {
     lookupTable = new LookupTable(lowAdu, medAdu, highAdu);
 }
 
-uint8_t * FitsRendererGreyscale::render(int x0, int y0, int rw, int rh) {
+template<class Sample>
+uint8_t * FitsRendererGreyscale<Sample>::render(int x0, int y0, int rw, int rh) {
     int result_stride = binDiv(rw, bin);
 	allocOutput(result_stride * binDiv(rh, bin));
 	
@@ -10,13 +10,14 @@
 #include "HistogramStorage.h"
 
 
-void HistogramChannelData::scanPlane(const u_int16_t * data, int w, int interline, int h)
+template<class Sample>
+void HistogramChannelData::scanPlane(const Sample * data, const SampleLevels & levels, int w, int interline, int h)
 {
 	pixcount += w*h;
 	while(h > 0) {
 		int tw = w;
 		while(tw > 0) {
-			this->data[*data - min]++;
+			this->data[levels(*data) - min]++;
 			data++;
 			tw--;
 		}
@@ -26,14 +27,15 @@ void HistogramChannelData::scanPlane(const u_int16_t * data, int w, int interlin
 }
 
 // w and h must be even
-void HistogramChannelData::scanBayer(const u_int16_t * data, int w, int interline, int h)
+template<class Sample>
+void HistogramChannelData::scanBayer(const Sample * data, const SampleLevels & levels, int w, int interline, int h)
 {
 	pixcount += w * h / 4;
 	int th = h / 2;
 	while(th > 0) {
 		int tw = w / 2;
 		while(tw > 0) {
-			uint16_t v = *data;
+			uint16_t v = levels(*data);
 			if (v < min) {
 				std::cerr << v << "<" << min << "\n";
 			}
@@ -49,12 +51,13 @@ void HistogramChannelData::scanBayer(const u_int16_t * data, int w, int interlin
 	}
 }
 
-void HistogramChannelData::scanPlaneMinMax(const u_int16_t * data, int w, int interline, int h, u_int16_t & min, u_int16_t & max)
+template<class Sample>
+void HistogramChannelData::scanPlaneMinMax(const Sample * data, const SampleLevels & levels, int w, int interline, int h, u_int16_t & min, u_int16_t & max)
 {
 	while(h > 0) {
 		int tw = w;
 		while(tw > 0) {
-			uint16_t v = *data;
+			uint16_t v = levels(*data);
 			if (v < min) min = v;
 			if (v > max) max = v;
 			data++;
@@ -66,13 +69,14 @@ void HistogramChannelData::scanPlaneMinMax(const u_int16_t * data, int w, int in
 }
 
 // w and h must be even
-void HistogramChannelData::scanBayerMinMax(const u_int16_t * data, int w, int interline, int h, u_int16_t & min, u_int16_t & max)
+template<class Sample>
+void HistogramChannelData::scanBayerMinMax(const Sample * data, const SampleLevels & levels, int w, int interline, int h, u_int16_t & min, u_int16_t & max)
 {
 	int th = h / 2;
 	while(th > 0) {
 		int tw = w / 2;
 		while(tw > 0) {
-			uint16_t v = *data;
+			uint16_t v = levels(*data);
 			if (v < min) min = v;
 			if (v > max) max = v;
 			data += 2;
@@ -156,6 +160,14 @@ double HistogramChannelData::getStdDev(int minAdu, int maxAdu)
 }
 
 
+long SharedCache::Messages::Histogram::estimateSize() const
+{
+	// Worst case: three full range 16 bits channels
+	uint16_t min[3] = {0, 0, 0};
+	uint16_t max[3] = {65535, 65535, 65535};
+	return HistogramStorage::requiredStorage(3, min, max);
+}
+
 void SharedCache::Messages::Histogram::produce(Entry * entry)
 {
 	ContentRequest sourceRequest;
@@ -263,11 +275,13 @@ static bool flatWindow(int interline, int x0, int y0, int x1, int y1, int & offs
 
 const char *channelNames[] =  {"red", "green", "blue"};
 
-HistogramStorage * HistogramStorage::build(
+template<class Sample>
+static HistogramStorage * buildHistogram(
 						const RawDataStorage *rcs,
 						int x0, int y0, int x1, int y1,
 						std::function<void* (long int)> allocator) {
 	std::string bayer = rcs->getBayer();
+	const Sample * samples = rcs->samples<Sample>();
 	// int w = rcs->w;
 	// int h = rcs->h;
 
@@ -282,7 +296,7 @@ HistogramStorage * HistogramStorage::build(
 			if (bayerWindow(rcs->w, x0, y0, x1, y1, i & 1, (i & 2) >> 1, offset, w, h))
 			{
 				int hist = RawDataStorage::getRGBIndex(bayer[i]);
-				HistogramChannelData::scanBayerMinMax(rcs->data + offset, w, rcs->w, h, min[hist], max[hist]);
+				HistogramChannelData::scanBayerMinMax(samples + offset, rcs->levels, w, rcs->w, h, min[hist], max[hist]);
 			}
 
 		}
@@ -291,13 +305,14 @@ HistogramStorage * HistogramStorage::build(
 		channelCount = 1;
 		int offset, w, h;
 		if (flatWindow(rcs->w, x0, y0, x1, y1, offset, w, h)) {
-			HistogramChannelData::scanPlaneMinMax(rcs->data + offset, w, rcs->w, h, min[0], max[0]);
+			HistogramChannelData::scanPlaneMinMax(samples + offset, rcs->levels, w, rcs->w, h, min[0], max[0]);
 		}
 	}
 	long int size = HistogramStorage::requiredStorage(channelCount, min, max);
 	
 	HistogramStorage * hs = (HistogramStorage *)allocator(size);
-	hs->bitpix = 16;
+	// Wider samples are binned in 16 bits levels
+	hs->bitpix = sizeof(Sample) == 1 ? 8 : 16;
 	hs->init(channelCount, min, max);
 	if (rcs->hasColors()) {
 		for(int i = 0; i < 4; ++i) {
@@ -305,13 +320,13 @@ HistogramStorage * HistogramStorage::build(
 			if (bayerWindow(rcs->w, x0, y0, x1, y1, i & 1, (i & 2) >> 1, offset, w, h))
 			{
 				int hist = RawDataStorage::getRGBIndex(bayer[i]);
-				hs->channel(hist)->scanBayer(rcs->data + offset, w, rcs->w, h);
+				hs->channel(hist)->scanBayer(samples + offset, rcs->levels, w, rcs->w, h);
 			}
 		}
 	} else {
 		int offset, w, h;
 		if (flatWindow(rcs->w, x0, y0, x1, y1, offset, w, h)) {
-			hs->channel(0)->scanPlane(rcs->data + offset, w, rcs->w, h);
+			hs->channel(0)->scanPlane(samples + offset, rcs->levels, w, rcs->w, h);
 		}
 	}
 	for(int i = 0; i < channelCount; ++i) {
@@ -321,6 +336,22 @@ HistogramStorage * HistogramStorage::build(
 	return hs;
 }
 
+HistogramStorage * HistogramStorage::build(
+						const RawDataStorage *rcs,
+						int x0, int y0, int x1, int y1,
+						std::function<void* (long int)> allocator) {
+	switch(rcs->sampleType) {
+		case RawDataStorage::SampleU8:
+			return buildHistogram<uint8_t>(rcs, x0, y0, x1, y1, allocator);
+		case RawDataStorage::SampleI32:
+			return buildHistogram<int32_t>(rcs, x0, y0, x1, y1, allocator);
+		case RawDataStorage::SampleF32:
+			return buildHistogram<float>(rcs, x0, y0, x1, y1, allocator);
+		default:
+			return buildHistogram<uint16_t>(rcs, x0, y0, x1, y1, allocator);
+	}
+}
+
 HistogramChannelData * HistogramChannelData::resample(
 						const HistogramChannelData  *rcs,
 						int shift,
@@ -2,6 +2,8 @@
 #define HISTOGRAMSTORAGE_H 1
 #include <stdint.h>
 
+struct SampleLevels;
+
 struct HistogramChannelData {
 	uint16_t min, max;
 	uint32_t pixcount;
@@ -34,13 +36,13 @@ struct HistogramChannelData {
 		return cumulatedAtAdu(value) - cumulatedAtAdu(value - 1);
 	}
 
-	/* ==== functions for productions ==== */
-	void scanBayer(const uint16_t * data, int w, int interline, int h);
-	void scanPlane(const uint16_t * data, int w, int interline, int h);
+	/* ==== functions for productions (Sample: uint8_t, uint16_t, int32_t or float). Counts levels ==== */
+	template<class Sample> void scanBayer(const Sample * data, const SampleLevels & levels, int w, int interline, int h);
+	template<class Sample> void scanPlane(const Sample * data, const SampleLevels & levels, int w, int interline, int h);
 	// value for an adu X will be the count of adu of value up to X. This is the default form
 	void cumulative();
-	static void scanBayerMinMax(const uint16_t * data, int w, int interline, int h, uint16_t & min, uint16_t & max);
-	static void scanPlaneMinMax(const uint16_t * data, int w, int interline, int h, uint16_t & min, uint16_t & max);
+	template<class Sample> static void scanBayerMinMax(const Sample * data, const SampleLevels & levels, int w, int interline, int h, uint16_t & min, uint16_t & max);
+	template<class Sample> static void scanPlaneMinMax(const Sample * data, const SampleLevels & levels, int w, int interline, int h, uint16_t & min, uint16_t & max);
 
 	/* ==== functions for usage ==== */
 	uint32_t findFirstWithAtLeast(uint32_t wantedCount) const;
@@ -0,0 +1,75 @@
+#include <list>
+
+#include "LocalEntryTable.h"
+
+namespace SharedCache {
+
+LocalEntryTable::LocalEntryTable(size_t maxKept) : maxKept(maxKept)
+{
+}
+
+LocalMapping * LocalEntryTable::acquire(const ContentKey & key)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = byKey.find(key);
+	if (it == byKey.end()) {
+		return nullptr;
+	}
+	it->second->refs++;
+	return it->second;
+}
+
+LocalMapping * LocalEntryTable::publish(const ContentKey & key, const std::string & filename, void * data, unsigned long int size, const ChildPtr<Messages::ContentRequest> & actualRequest)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (byKey.find(key) != byKey.end()) {
+		return nullptr;
+	}
+	LocalMapping * mapping = new LocalMapping();
+	mapping->key = key;
+	mapping->filename = filename;
+	mapping->data = data;
+	mapping->size = size;
+	mapping->actualRequest = actualRequest;
+	mapping->refs = 1;
+	byKey[key] = mapping;
+	return mapping;
+}
+
+bool LocalEntryTable::release(LocalMapping * mapping)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	if (--mapping->refs > 0) {
+		return false;
+	}
+	byKey.erase(mapping->key);
+	delete(mapping);
+	return true;
+}
+
+LocalMapping * LocalEntryTable::keep(LocalMapping * mapping)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	kept.push_back(mapping);
+	if (kept.size() <= maxKept) {
+		return nullptr;
+	}
+	LocalMapping * oldest = kept.front();
+	kept.pop_front();
+	return oldest;
+}
+
+bool LocalEntryTable::shareable(const Messages::ContentRequest & request)
+{
+	Messages::ContentRequest copy(request);
+	std::list<Messages::RawContent *> rawContents;
+	copy.collectRawContents(rawContents);
+	for(auto it = rawContents.begin(); it != rawContents.end(); ++it) {
+		if (!(*it)->stream.empty()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+}
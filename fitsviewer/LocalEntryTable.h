@@ -0,0 +1,52 @@
+#ifndef LOCALENTRYTABLE_H_
+#define LOCALENTRYTABLE_H_
+
+#include <string>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "ContentKey.h"
+#include "SharedCache.h"
+
+namespace SharedCache {
+
+// A content mapped by a thread of a worker process, lent to the other threads
+struct LocalMapping {
+	ContentKey key;
+	std::string filename;
+	void * data;
+	unsigned long int size;
+	ChildPtr<Messages::ContentRequest> actualRequest;
+	// Entries using the mapping. The server sees a single reader
+	long refs;
+};
+
+// Contents currently read by the threads of a threaded worker (FITS_SERVER_WORKER_THREADS).
+// A dependency already held by one thread is handed to the others without asking the server
+class LocalEntryTable {
+	std::mutex lock;
+	std::unordered_map<ContentKey, LocalMapping*, ContentKeyHash> byKey;
+	// Finished productions of the worker, each with a reference of the table. Oldest first
+	std::list<LocalMapping*> kept;
+	size_t maxKept;
+public:
+	LocalEntryTable(size_t maxKept = 0);
+
+	// Take a reference on a mapped content. nullptr if no thread holds it
+	LocalMapping * acquire(const ContentKey & key);
+	// Lend a freshly mapped content. nullptr if another thread was faster (caller keeps its own mapping)
+	LocalMapping * publish(const ContentKey & key, const std::string & filename, void * data, unsigned long int size, const ChildPtr<Messages::ContentRequest> & actualRequest);
+	// Drop a reference. When the last one goes, the mapping is forgotten and true is returned:
+	// the caller must then unmap and release the content on the server
+	bool release(LocalMapping * mapping);
+	// Keep a published production mapped for its dependents: the table takes over the reference of the producer.
+	// Returns the mapping pushed out (or mapping itself if none are kept), whose reference the caller must release
+	LocalMapping * keep(LocalMapping * mapping);
+
+	// Contents that depend on a stream may be upgraded by the server, and are never shared
+	static bool shareable(const Messages::ContentRequest & request);
+};
+
+}
+
+#endif
@@ -18,6 +18,9 @@ namespace SharedCache {
 			if (i.exactSerial) {
 				j["exactSerial"] = i.exactSerial;
 			}
+			if (!i.identity.empty()) {
+				j["identity"] = i.identity;
+			}
 		}
 
 		void from_json(const nlohmann::json& j, RawContent & p) {
@@ -38,6 +41,9 @@ namespace SharedCache {
 			} else {
 				p.exactSerial = false;
 			}
+			if (j.find("identity") != j.end()) {
+				p.identity = j.at("identity").get<std::string>();
+			}
 		}
 
 		void to_json(nlohmann::json&j, const Histogram & i)
@@ -56,6 +62,22 @@ namespace SharedCache {
 			}
 		}
 
+		void to_json(nlohmann::json&j, const FitsHeader & i)
+		{
+			j = nlohmann::json::object();
+			j["source"] = i.source;
+		}
+
+		void from_json(const nlohmann::json& j, FitsHeader & p) {
+			p.source = j.at("source").get<RawContent>();
+		}
+
+		void from_json(const nlohmann::json& j, FitsHeaderOptions & p) {
+			if (j.find("keys") != j.end()) {
+				p.keys = j.at("keys").get<std::vector<std::string>>();
+			}
+		}
+
 		void to_json(nlohmann::json&j, const StarField & i)
 		{
 			j = nlohmann::json::object();
@@ -158,6 +180,17 @@ namespace SharedCache {
 			if (i.astrometry) {
 				j["astrometry"] = *i.astrometry;
 			}
+			if (i.fitsHeader) {
+				j["fitsHeader"] = *i.fitsHeader;
+			}
+			if (i.priority == PriorityInteractive) {
+				j["priority"] = "interactive";
+			} else if (i.priority == PriorityBackground) {
+				j["priority"] = "background";
+			}
+			if (!i.traceId.empty()) {
+				j["traceId"] = i.traceId;
+			}
 		}
 
 		void from_json(const nlohmann::json& j, ContentRequest & p) {
@@ -173,6 +206,23 @@ namespace SharedCache {
 			if (j.find("astrometry") != j.end()) {
 				p.astrometry = new Astrometry(j.at("astrometry").get<Astrometry>());
 			}
+			if (j.find("fitsHeader") != j.end()) {
+				p.fitsHeader = new FitsHeader(j.at("fitsHeader").get<FitsHeader>());
+			}
+			p.priority = PriorityNormal;
+			if (j.find("priority") != j.end()) {
+				std::string priority = j.at("priority").get<std::string>();
+				if (priority == "interactive") {
+					p.priority = PriorityInteractive;
+				} else if (priority == "background") {
+					p.priority = PriorityBackground;
+				} else if (priority != "normal") {
+					throw std::runtime_error("invalid priority: " + priority);
+				}
+			}
+			if (j.find("traceId") != j.end()) {
+				p.traceId = j.at("traceId").get<std::string>();
+			}
 		}
 
 		void to_json(nlohmann::json&j, const StreamWatchRequest & i)
@@ -230,6 +280,9 @@ namespace SharedCache {
 				j["content"] = *i.content;
 			}
 			j["filename"] = i.filename;
+			if (!i.spilled.empty()) {
+				j["spilled"] = i.spilled;
+			}
 		}
 
 		void from_json(const nlohmann::json& j, WorkResponse & p) {
@@ -237,6 +290,9 @@ namespace SharedCache {
 				p.content = new ContentRequest(j.at("content").get<ContentRequest>());
 			}
 			p.filename = j["filename"].get<std::string>();
+			if (j.find("spilled") != j.end()) {
+				p.spilled = j.at("spilled").get<std::string>();
+			}
 		}
 
 
@@ -247,6 +303,7 @@ namespace SharedCache {
 			j["error"] = i.error;
 			j["filename"] = i.filename;
 			j["errorDetails"] = i.errorDetails;
+			j["keep"] = i.keep;
 		}
 
 		void from_json(const nlohmann::json& j, FinishedAnnounce & p) {
@@ -254,6 +311,7 @@ namespace SharedCache {
 			p.size = j.at("size").get<long>();
 			p.filename = j.at("filename").get<std::string>();
 			p.errorDetails = j.at("errorDetails").get<std::string>();
+			p.keep = j.find("keep") != j.end() && j.at("keep").get<bool>();
 		}
 
 
@@ -268,6 +326,19 @@ namespace SharedCache {
 		}
 
 
+		void to_json(nlohmann::json&j, const ProgressAnnounce & i)
+		{
+			j = nlohmann::json::object();
+			j["filename"] = i.filename;
+			j["progress"] = i.progress;
+		}
+
+		void from_json(const nlohmann::json& j, ProgressAnnounce & p) {
+			p.filename = j.at("filename").get<std::string>();
+			p.progress = j.at("progress").get<double>();
+		}
+
+
 		void to_json(nlohmann::json&j, const Request & i)
 		{
 			j = nlohmann::json::object();
@@ -278,6 +349,9 @@ namespace SharedCache {
 			if (i.releasedAnnounce) j["releasedAnnounce"] = *i.releasedAnnounce;
 			if (i.streamPublishRequest) j["streamPublishRequest"] = *i.streamPublishRequest;
 			if (i.streamStartImageRequest) j["streamStartImageRequest"] = *i.streamStartImageRequest;
+			if (i.statsRequest) j["statsRequest"] = *i.statsRequest;
+			if (i.progressAnnounce) j["progressAnnounce"] = *i.progressAnnounce;
+			if (i.batchRequest) j["batchRequest"] = *i.batchRequest;
 		}
 
 		void from_json(const nlohmann::json& j, Request & p) {
@@ -316,6 +390,21 @@ namespace SharedCache {
 			} else {
 				p.streamStartImageRequest = nullptr;
 			}
+			if (j.find("statsRequest") != j.end()) {
+				p.statsRequest = new StatsRequest(j.at("statsRequest").get<StatsRequest>());
+			} else {
+				p.statsRequest = nullptr;
+			}
+			if (j.find("progressAnnounce") != j.end()) {
+				p.progressAnnounce = new ProgressAnnounce(j.at("progressAnnounce").get<ProgressAnnounce>());
+			} else {
+				p.progressAnnounce = nullptr;
+			}
+			if (j.find("batchRequest") != j.end()) {
+				p.batchRequest = new BatchRequest(j.at("batchRequest").get<BatchRequest>());
+			} else {
+				p.batchRequest = nullptr;
+			}
 		}
 
 
@@ -347,6 +436,9 @@ namespace SharedCache {
 			if (i.todoResult) j["todoResult"] = *i.todoResult;
 			if (i.streamPublishResult) j["streamPublishResult"] = *i.streamPublishResult;
 			if (i.streamStartImageResult) j["streamStartImageResult"] = *i.streamStartImageResult;
+			if (i.statsResult) j["statsResult"] = *i.statsResult;
+			if (i.batchResult) j["batchResult"] = *i.batchResult;
+			if (i.progressResult) j["progressResult"] = *i.progressResult;
 		}
 		void from_json(const nlohmann::json& j, Result & p)
 		{
@@ -375,6 +467,21 @@ namespace SharedCache {
 			} else {
 				p.streamStartImageResult = nullptr;
 			}
+			if (j.find("statsResult") != j.end()) {
+				p.statsResult = new StatsResult(j.at("statsResult").get<StatsResult>());
+			} else {
+				p.statsResult = nullptr;
+			}
+			if (j.find("batchResult") != j.end()) {
+				p.batchResult = new BatchResult(j.at("batchResult").get<BatchResult>());
+			} else {
+				p.batchResult = nullptr;
+			}
+			if (j.find("progressResult") != j.end()) {
+				p.progressResult = new ProgressResult(j.at("progressResult").get<ProgressResult>());
+			} else {
+				p.progressResult = nullptr;
+			}
 		}
 
 
@@ -422,5 +529,120 @@ namespace SharedCache {
 		{
 			p.serial = j.at("serial").get<long>();
 		}
+
+		void to_json(nlohmann::json&j, const StatsRequest & i)
+		{
+			j = nlohmann::json::object();
+		}
+
+		void from_json(const nlohmann::json& j, StatsRequest & p)
+		{}
+
+		void to_json(nlohmann::json&j, const ProductStats & i)
+		{
+			j = nlohmann::json::object();
+			j["product"] = i.product;
+			j["hits"] = i.hits;
+			j["misses"] = i.misses;
+			j["productions"] = i.productions;
+			j["failures"] = i.failures;
+			j["productionTime"] = i.productionTime;
+			j["evictions"] = i.evictions;
+			j["evictedBytes"] = i.evictedBytes;
+		}
+
+		void from_json(const nlohmann::json& j, ProductStats & p)
+		{
+			p.product = j.at("product").get<std::string>();
+			p.hits = j.at("hits").get<long>();
+			p.misses = j.at("misses").get<long>();
+			p.productions = j.at("productions").get<long>();
+			p.failures = j.at("failures").get<long>();
+			p.productionTime = j.at("productionTime").get<long>();
+			p.evictions = j.at("evictions").get<long>();
+			p.evictedBytes = j.at("evictedBytes").get<long>();
+		}
+
+		void to_json(nlohmann::json&j, const StatsResult & i)
+		{
+			j = nlohmann::json::object();
+			j["maxSize"] = i.maxSize;
+			j["currentSize"] = i.currentSize;
+			j["reservedSize"] = i.reservedSize;
+			j["contentCount"] = i.contentCount;
+			j["waitingConsumers"] = i.waitingConsumers;
+			j["waitingWorkers"] = i.waitingWorkers;
+			j["streamWatchers"] = i.streamWatchers;
+			j["startedWorkers"] = i.startedWorkers;
+			j["activeWorkers"] = i.activeWorkers;
+			j["blockedWorkers"] = i.blockedWorkers;
+			j["workerSpawns"] = i.workerSpawns;
+			j["workerSpawnTime"] = i.workerSpawnTime;
+			j["firstProductions"] = i.firstProductions;
+			j["firstProductionTime"] = i.firstProductionTime;
+			j["spillMaxSize"] = i.spillMaxSize;
+			j["spillSize"] = i.spillSize;
+			j["spillHits"] = i.spillHits;
+			j["spillMisses"] = i.spillMisses;
+			j["spillWrites"] = i.spillWrites;
+			j["products"] = i.products;
+		}
+
+		void from_json(const nlohmann::json& j, StatsResult & p)
+		{
+			p.maxSize = j.at("maxSize").get<long>();
+			p.currentSize = j.at("currentSize").get<long>();
+			p.reservedSize = j.at("reservedSize").get<long>();
+			p.contentCount = j.at("contentCount").get<long>();
+			p.waitingConsumers = j.at("waitingConsumers").get<long>();
+			p.waitingWorkers = j.at("waitingWorkers").get<long>();
+			p.streamWatchers = j.at("streamWatchers").get<long>();
+			p.startedWorkers = j.at("startedWorkers").get<long>();
+			p.activeWorkers = j.at("activeWorkers").get<long>();
+			p.blockedWorkers = j.at("blockedWorkers").get<long>();
+			p.workerSpawns = j.at("workerSpawns").get<long>();
+			p.workerSpawnTime = j.at("workerSpawnTime").get<long>();
+			p.firstProductions = j.at("firstProductions").get<long>();
+			p.firstProductionTime = j.at("firstProductionTime").get<long>();
+			p.spillMaxSize = j.at("spillMaxSize").get<long>();
+			p.spillSize = j.at("spillSize").get<long>();
+			p.spillHits = j.at("spillHits").get<long>();
+			p.spillMisses = j.at("spillMisses").get<long>();
+			p.spillWrites = j.at("spillWrites").get<long>();
+			p.products = j.at("products").get<std::vector<ProductStats>>();
+		}
+
+		void to_json(nlohmann::json&j, const BatchRequest & i)
+		{
+			j = nlohmann::json::object();
+			j["contents"] = i.contents;
+		}
+
+		void from_json(const nlohmann::json& j, BatchRequest & p)
+		{
+			p.contents = j.at("contents").get<std::vector<ContentRequest>>();
+		}
+
+		void to_json(nlohmann::json&j, const BatchResult & i)
+		{
+			j = nlohmann::json::object();
+			j["contents"] = i.contents;
+		}
+
+		void from_json(const nlohmann::json& j, BatchResult & p)
+		{
+			p.contents = j.at("contents").get<std::vector<ContentResult>>();
+		}
+
+		void to_json(nlohmann::json&j, const ProgressResult & i)
+		{
+			j = nlohmann::json::object();
+			j["cancel"] = i.cancel;
+		}
+
+		void from_json(const nlohmann::json& j, ProgressResult & p)
+		{
+			p.cancel = j.at("cancel").get<bool>();
+		}
 	}
 }
@@ -27,6 +27,17 @@ void MultiStarFinder::onStarmaskComputed(const BitMask & starMask) {
 }
 
 
+template<class Sample>
+void MultiStarFinder::markAboveLimit(const Sample * samples, const int * limitByChannel, BitMask & into) const
+{
+    int ptr = 0;
+    for(int y = 0; y < content->h; ++y)
+        for(int x = 0; x < content->w; ++x)
+            if (content->levels(samples[ptr++]) > limitByChannel[channelMode.getChannelId(x, y)]) {
+                into.set(x, y, 1);
+            }
+}
+
 std::vector<StarOccurence> MultiStarFinder::proceed(int maxCount) {
     int blackLevelByChannel[channelMode.channelCount];
     int blackStddevByChannel[channelMode.channelCount];
@@ -48,12 +59,19 @@ std::vector<StarOccurence> MultiStarFinder::proceed(int maxCount) {
         cerr << "channel " << i << " black at " << blackLevelByChannel[i] << " limit at " << limitByChannel[i] <<"\n";
     }
     BitMask notBlack(0, 0, content->w - 1, content->h - 1);
-    int ptr = 0;
-    for(int y = 0; y < content->h; ++y)
-        for(int x = 0; x < content->w; ++x)
-            if (content->data[ptr++] > limitByChannel[channelMode.getChannelId(x, y)]) {
-                notBlack.set(x, y, 1);
-            }
+    switch(content->sampleType) {
+        case RawDataStorage::SampleU8:
+            markAboveLimit(content->samples<uint8_t>(), limitByChannel, notBlack);
+            break;
+        case RawDataStorage::SampleI32:
+            markAboveLimit(content->samples<int32_t>(), limitByChannel, notBlack);
+            break;
+        case RawDataStorage::SampleF32:
+            markAboveLimit(content->samples<float>(), limitByChannel, notBlack);
+            break;
+        default:
+            markAboveLimit(content->samples<uint16_t>(), limitByChannel, notBlack);
+    }
 
     BitMask tmp(notBlack);
     notBlack.erode();
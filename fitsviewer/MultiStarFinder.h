@@ -30,6 +30,9 @@ class MultiStarFinder {
 	const RawDataStorage * content;
 	const HistogramStorage * histogram;
 	const ChannelMode channelMode;
+
+	template<class Sample>
+	void markAboveLimit(const Sample * samples, const int * limitByChannel, BitMask & into) const;
 protected:
     virtual void onStarmaskComputed(const BitMask & starMask);
 
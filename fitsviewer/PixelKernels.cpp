@@ -0,0 +1,409 @@
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PIXEL_KERNELS_X86 1
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "PixelKernels.h"
+
+/* Scalar reference. The vector variants must give the same results */
+
+static inline uint16_t clampToAdu(float v)
+{
+	// NaN gives 0
+	if (!(v > 0)) {
+		return 0;
+	}
+	if (v >= 65535.0f) {
+		return 65535;
+	}
+	return (uint16_t)v;
+}
+
+static inline uint16_t clampToAdu(double v)
+{
+	if (!(v > 0)) {
+		return 0;
+	}
+	if (v >= 65535.0) {
+		return 65535;
+	}
+	return (uint16_t)v;
+}
+
+static inline int16_t loadInt16(const uint8_t * p)
+{
+	return (int16_t)((p[0] << 8) | p[1]);
+}
+
+static inline int32_t loadInt32(const uint8_t * p)
+{
+	return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+static inline float loadFloat32(const uint8_t * p)
+{
+	uint32_t bits = (uint32_t)loadInt32(p);
+	float result;
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+static void scalarInt16(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	float s = scale, o = offset;
+	for(size_t i = 0; i < count; ++i) {
+		to[i] = clampToAdu(loadInt16(from + 2 * i) * s + o);
+	}
+}
+
+static void scalarInt32(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	for(size_t i = 0; i < count; ++i) {
+		to[i] = clampToAdu(loadInt32(from + 4 * i) * scale + offset);
+	}
+}
+
+static void scalarFloat32(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	float s = scale, o = offset;
+	for(size_t i = 0; i < count; ++i) {
+		to[i] = clampToAdu(loadFloat32(from + 4 * i) * s + o);
+	}
+}
+
+static void scalarUnsigned16(const uint8_t * from, uint16_t * to, size_t count)
+{
+	for(size_t i = 0; i < count; ++i) {
+		to[i] = ((from[2 * i] << 8) | from[2 * i + 1]) ^ 0x8000;
+	}
+}
+
+static const PixelKernels::Variant scalarVariant = { "scalar", scalarInt16, scalarInt32, scalarFloat32, scalarUnsigned16 };
+
+#ifdef __SSE2__
+
+static inline __m128i sse2Swap16(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static inline __m128i sse2Swap32(__m128i v)
+{
+	v = sse2Swap16(v);
+	return _mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16));
+}
+
+static inline __m128i sse2ToAdu(__m128 v, __m128 zero, __m128 max)
+{
+	// max_ps returns its second operand for NaN
+	return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(v, zero), max));
+}
+
+// Two vectors of int32 in 0 - 65535 to 8 uint16 (SSE2 only has a signed pack)
+static inline __m128i sse2Pack(__m128i lo, __m128i hi)
+{
+	const __m128i bias = _mm_set1_epi32(32768);
+	const __m128i flip = _mm_set1_epi16((short)0x8000);
+	return _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(lo, bias), _mm_sub_epi32(hi, bias)), flip);
+}
+
+static void sse2Int16(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	const __m128 s = _mm_set1_ps(scale), o = _mm_set1_ps(offset);
+	const __m128 zero = _mm_setzero_ps(), max = _mm_set1_ps(65535.0f);
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8) {
+		__m128i raw = sse2Swap16(_mm_loadu_si128((const __m128i*)(from + 2 * i)));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(raw, raw), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(raw, raw), 16);
+		lo = sse2ToAdu(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), s), o), zero, max);
+		hi = sse2ToAdu(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), s), o), zero, max);
+		_mm_storeu_si128((__m128i*)(to + i), sse2Pack(lo, hi));
+	}
+	scalarInt16(from + 2 * i, to + i, count - i, scale, offset);
+}
+
+static void sse2Int32(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	const __m128d s = _mm_set1_pd(scale), o = _mm_set1_pd(offset);
+	const __m128d zero = _mm_setzero_pd(), max = _mm_set1_pd(65535.0);
+	size_t i = 0;
+	for(; i + 4 <= count; i += 4) {
+		__m128i raw = sse2Swap32(_mm_loadu_si128((const __m128i*)(from + 4 * i)));
+		__m128d lo = _mm_cvtepi32_pd(raw);
+		__m128d hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(raw, _MM_SHUFFLE(1, 0, 3, 2)));
+		lo = _mm_min_pd(_mm_max_pd(_mm_add_pd(_mm_mul_pd(lo, s), o), zero), max);
+		hi = _mm_min_pd(_mm_max_pd(_mm_add_pd(_mm_mul_pd(hi, s), o), zero), max);
+		__m128i values = _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+		_mm_storel_epi64((__m128i*)(to + i), sse2Pack(values, values));
+	}
+	scalarInt32(from + 4 * i, to + i, count - i, scale, offset);
+}
+
+static void sse2Float32(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	const __m128 s = _mm_set1_ps(scale), o = _mm_set1_ps(offset);
+	const __m128 zero = _mm_setzero_ps(), max = _mm_set1_ps(65535.0f);
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8) {
+		__m128 lo = _mm_castsi128_ps(sse2Swap32(_mm_loadu_si128((const __m128i*)(from + 4 * i))));
+		__m128 hi = _mm_castsi128_ps(sse2Swap32(_mm_loadu_si128((const __m128i*)(from + 4 * i + 16))));
+		__m128i ilo = sse2ToAdu(_mm_add_ps(_mm_mul_ps(lo, s), o), zero, max);
+		__m128i ihi = sse2ToAdu(_mm_add_ps(_mm_mul_ps(hi, s), o), zero, max);
+		_mm_storeu_si128((__m128i*)(to + i), sse2Pack(ilo, ihi));
+	}
+	scalarFloat32(from + 4 * i, to + i, count - i, scale, offset);
+}
+
+static void sse2Unsigned16(const uint8_t * from, uint16_t * to, size_t count)
+{
+	const __m128i flip = _mm_set1_epi16((short)0x8000);
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8) {
+		__m128i v = sse2Swap16(_mm_loadu_si128((const __m128i*)(from + 2 * i)));
+		_mm_storeu_si128((__m128i*)(to + i), _mm_xor_si128(v, flip));
+	}
+	scalarUnsigned16(from + 2 * i, to + i, count - i);
+}
+
+static const PixelKernels::Variant sse2Variant = { "sse2", sse2Int16, sse2Int32, sse2Float32, sse2Unsigned16 };
+
+#endif
+
+#ifdef PIXEL_KERNELS_X86
+
+// Compiled for avx2 whatever the target, only called when the cpu has it
+#define AVX2_KERNEL __attribute__((target("avx2")))
+
+#define AVX2_SWAP16 _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, \
+									1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14)
+#define AVX2_SWAP32 _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, \
+									3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12)
+
+AVX2_KERNEL static void avx2Int16(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	const __m256i swap = AVX2_SWAP16;
+	const __m256 s = _mm256_set1_ps(scale), o = _mm256_set1_ps(offset);
+	const __m256 zero = _mm256_setzero_ps(), max = _mm256_set1_ps(65535.0f);
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i raw = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(from + 2 * i)), swap);
+		__m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(raw)));
+		__m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(raw, 1)));
+		lo = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(lo, s), o), zero), max);
+		hi = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(hi, s), o), zero), max);
+		// packus works per 128 bits lane: restore the order
+		__m256i packed = _mm256_packus_epi32(_mm256_cvttps_epi32(lo), _mm256_cvttps_epi32(hi));
+		_mm256_storeu_si256((__m256i*)(to + i), _mm256_permute4x64_epi64(packed, 0xD8));
+	}
+	scalarInt16(from + 2 * i, to + i, count - i, scale, offset);
+}
+
+AVX2_KERNEL static void avx2Int32(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	const __m256i swap = AVX2_SWAP32;
+	const __m256d s = _mm256_set1_pd(scale), o = _mm256_set1_pd(offset);
+	const __m256d zero = _mm256_setzero_pd(), max = _mm256_set1_pd(65535.0);
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8) {
+		__m256i raw = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(from + 4 * i)), swap);
+		__m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(raw));
+		__m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(raw, 1));
+		lo = _mm256_min_pd(_mm256_max_pd(_mm256_add_pd(_mm256_mul_pd(lo, s), o), zero), max);
+		hi = _mm256_min_pd(_mm256_max_pd(_mm256_add_pd(_mm256_mul_pd(hi, s), o), zero), max);
+		__m128i packed = _mm_packus_epi32(_mm256_cvttpd_epi32(lo), _mm256_cvttpd_epi32(hi));
+		_mm_storeu_si128((__m128i*)(to + i), packed);
+	}
+	scalarInt32(from + 4 * i, to + i, count - i, scale, offset);
+}
+
+AVX2_KERNEL static void avx2Float32(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	const __m256i swap = AVX2_SWAP32;
+	const __m256 s = _mm256_set1_ps(scale), o = _mm256_set1_ps(offset);
+	const __m256 zero = _mm256_setzero_ps(), max = _mm256_set1_ps(65535.0f);
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256 lo = _mm256_castsi256_ps(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(from + 4 * i)), swap));
+		__m256 hi = _mm256_castsi256_ps(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(from + 4 * i + 32)), swap));
+		lo = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(lo, s), o), zero), max);
+		hi = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(hi, s), o), zero), max);
+		__m256i packed = _mm256_packus_epi32(_mm256_cvttps_epi32(lo), _mm256_cvttps_epi32(hi));
+		_mm256_storeu_si256((__m256i*)(to + i), _mm256_permute4x64_epi64(packed, 0xD8));
+	}
+	scalarFloat32(from + 4 * i, to + i, count - i, scale, offset);
+}
+
+AVX2_KERNEL static void avx2Unsigned16(const uint8_t * from, uint16_t * to, size_t count)
+{
+	const __m256i swap = AVX2_SWAP16;
+	const __m256i flip = _mm256_set1_epi16((short)0x8000);
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(from + 2 * i)), swap);
+		_mm256_storeu_si256((__m256i*)(to + i), _mm256_xor_si256(v, flip));
+	}
+	scalarUnsigned16(from + 2 * i, to + i, count - i);
+}
+
+static const PixelKernels::Variant avx2Variant = { "avx2", avx2Int16, avx2Int32, avx2Float32, avx2Unsigned16 };
+
+#endif
+
+#ifdef __ARM_NEON
+
+// vcvtq_u32_f32 saturates (NaN and negatives give 0), then vqmovn_u32 saturates to 65535
+static inline uint16x4_t neonToAdu(float32x4_t v)
+{
+	return vqmovn_u32(vcvtq_u32_f32(v));
+}
+
+static void neonInt16(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	const float32x4_t s = vdupq_n_f32(scale), o = vdupq_n_f32(offset);
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8) {
+		int16x8_t raw = vreinterpretq_s16_u8(vrev16q_u8(vld1q_u8(from + 2 * i)));
+		float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(raw)));
+		float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(raw)));
+		lo = vaddq_f32(vmulq_f32(lo, s), o);
+		hi = vaddq_f32(vmulq_f32(hi, s), o);
+		vst1q_u16(to + i, vcombine_u16(neonToAdu(lo), neonToAdu(hi)));
+	}
+	scalarInt16(from + 2 * i, to + i, count - i, scale, offset);
+}
+
+static void neonFloat32(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	const float32x4_t s = vdupq_n_f32(scale), o = vdupq_n_f32(offset);
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8) {
+		float32x4_t lo = vreinterpretq_f32_u8(vrev32q_u8(vld1q_u8(from + 4 * i)));
+		float32x4_t hi = vreinterpretq_f32_u8(vrev32q_u8(vld1q_u8(from + 4 * i + 16)));
+		lo = vaddq_f32(vmulq_f32(lo, s), o);
+		hi = vaddq_f32(vmulq_f32(hi, s), o);
+		vst1q_u16(to + i, vcombine_u16(neonToAdu(lo), neonToAdu(hi)));
+	}
+	scalarFloat32(from + 4 * i, to + i, count - i, scale, offset);
+}
+
+static void neonUnsigned16(const uint8_t * from, uint16_t * to, size_t count)
+{
+	const uint16x8_t flip = vdupq_n_u16(0x8000);
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8) {
+		uint16x8_t v = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(from + 2 * i)));
+		vst1q_u16(to + i, veorq_u16(v, flip));
+	}
+	scalarUnsigned16(from + 2 * i, to + i, count - i);
+}
+
+// int32 needs double precision, not available on all NEON units: scalar
+static const PixelKernels::Variant neonVariant = { "neon", neonInt16, scalarInt32, neonFloat32, neonUnsigned16 };
+
+#endif
+
+int PixelKernels::pixelSize(SourceType type)
+{
+	return type == Int16 ? 2 : 4;
+}
+
+const PixelKernels::Variant & PixelKernels::scalar()
+{
+	return scalarVariant;
+}
+
+std::vector<const PixelKernels::Variant *> PixelKernels::available()
+{
+	std::vector<const Variant *> result;
+	result.push_back(&scalarVariant);
+#ifdef __SSE2__
+	result.push_back(&sse2Variant);
+#endif
+#ifdef PIXEL_KERNELS_X86
+	if (__builtin_cpu_supports("avx2")) {
+		result.push_back(&avx2Variant);
+	}
+#endif
+#ifdef __ARM_NEON
+	result.push_back(&neonVariant);
+#endif
+	return result;
+}
+
+static const PixelKernels::Variant * selectVariant()
+{
+	std::vector<const PixelKernels::Variant *> variants = PixelKernels::available();
+	const char * env = getenv("FITS_PIXEL_KERNELS");
+	if (env != nullptr && env[0]) {
+		for(auto it = variants.begin(); it != variants.end(); ++it) {
+			if (!strcmp((*it)->name, env)) {
+				return *it;
+			}
+		}
+		std::cerr << "Pixel kernels " << env << " not available, using " << variants.back()->name << "\n";
+	}
+	return variants.back();
+}
+
+const PixelKernels::Variant & PixelKernels::selected()
+{
+	static const Variant * result = selectVariant();
+	return *result;
+}
+
+void PixelKernels::convert(SourceType type, const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	convert(selected(), type, from, to, count, scale, offset);
+}
+
+void PixelKernels::convert(const Variant & variant, SourceType type, const uint8_t * from, uint16_t * to, size_t count, double scale, double offset)
+{
+	switch(type) {
+		case Int16:
+			if (scale == 1 && offset == 32768) {
+				variant.unsigned16(from, to, count);
+			} else {
+				variant.int16(from, to, count, scale, offset);
+			}
+			return;
+		case Int32:
+			variant.int32(from, to, count, scale, offset);
+			return;
+		case Float32:
+			variant.float32(from, to, count, scale, offset);
+			return;
+	}
+}
+
+void PixelKernels::decodeInt32(const uint8_t * from, int32_t * to, size_t count)
+{
+	for(size_t i = 0; i < count; ++i) {
+		to[i] = loadInt32(from + 4 * i);
+	}
+}
+
+void PixelKernels::decodeFloat32(SourceType type, const uint8_t * from, float * to, size_t count, double scale, double offset)
+{
+	if (type == Int32) {
+		for(size_t i = 0; i < count; ++i) {
+			to[i] = loadInt32(from + 4 * i) * scale + offset;
+		}
+	} else if (scale == 1 && offset == 0) {
+		for(size_t i = 0; i < count; ++i) {
+			to[i] = loadFloat32(from + 4 * i);
+		}
+	} else {
+		float s = scale, o = offset;
+		for(size_t i = 0; i < count; ++i) {
+			to[i] = loadFloat32(from + 4 * i) * s + o;
+		}
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef PIXELKERNELS_H_
+#define PIXELKERNELS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Conversion of big endian FITS pixels to the 16 bits ADU of RawDataStorage:
+// to[i] = clamp(from[i] * scale + offset, 0, 65535), truncated (NaN gives 0).
+// Each instruction set has its own variant; the best one supported by the cpu is picked at
+// first use (FITS_PIXEL_KERNELS=scalar|sse2|avx2|neon forces one)
+class PixelKernels {
+public:
+	enum SourceType {
+		Int16,
+		Int32,
+		Float32,
+	};
+
+	typedef void (*Kernel)(const uint8_t * from, uint16_t * to, size_t count, double scale, double offset);
+	// int16 with scale 1 and offset 32768 (unsigned 16 bits): no arithmetic needed
+	typedef void (*UnsignedKernel)(const uint8_t * from, uint16_t * to, size_t count);
+
+	struct Variant {
+		const char * name;
+		Kernel int16;
+		Kernel int32;
+		Kernel float32;
+		UnsignedKernel unsigned16;
+	};
+
+	// Bytes per pixel of a source type
+	static int pixelSize(SourceType type);
+
+	// Convert count pixels with the selected variant
+	static void convert(SourceType type, const uint8_t * from, uint16_t * to, size_t count, double scale, double offset);
+	static void convert(const Variant & variant, SourceType type, const uint8_t * from, uint16_t * to, size_t count, double scale, double offset);
+
+	// Big endian 32 bits pixels to native samples (RawDataStorage::SampleI32, SampleF32), without
+	// clamping. Plain loops: compilers vectorize them well enough
+	static void decodeInt32(const uint8_t * from, int32_t * to, size_t count);
+	// from[i] * scale + offset, for Int32 or Float32 pixels
+	static void decodeFloat32(SourceType type, const uint8_t * from, float * to, size_t count, double scale, double offset);
+
+	static const Variant & scalar();
+	// The variant used by convert
+	static const Variant & selected();
+	// All the variants that the cpu supports, scalar first
+	static std::vector<const Variant *> available();
+};
+
+#endif
@@ -1,7 +1,24 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <exception>
+#include <cmath>
+
 #include "FitsFile.h"
+#include "FastFitsReader.h"
 #include "SharedCache.h"
 #include "SharedCacheServer.h"
 #include "RawDataStorage.h"
+#include "Trace.h"
+
+// Pixels read per fits_read_pix call
+static const int READ_BAND_PIXELS = 1 << 20;
 
 
 std::string RawDataStorage::getBayer() const {
@@ -38,9 +55,62 @@ void RawDataStorage::setBitPix(uint8_t bitpix)
 	this->bitpix = bitpix;
 }
 
-long int RawDataStorage::requiredStorage(int w, int h)
+void RawDataStorage::setSampleType(SampleType sampleType)
+{
+	this->sampleType = sampleType;
+	this->bitpix = 8 * sampleSize(sampleType);
+	this->levels.offset = 0;
+	this->levels.scale = 1;
+}
+
+// Levels for samples that fill [0, unit] use the scale of 16 bits ADU (unit is 65535 for integers,
+// 1 for floats). Otherwise they span the actual range of the samples
+template<class Sample>
+static SampleLevels spreadLevels(const Sample * samples, long count, double unit)
+{
+	double min = INFINITY, max = -INFINITY;
+	for(long i = 0; i < count; ++i) {
+		double v = samples[i];
+		if (!std::isfinite(v)) {
+			continue;
+		}
+		if (v < min) min = v;
+		if (v > max) max = v;
+	}
+	SampleLevels levels;
+	if (min >= 0 && max <= unit) {
+		levels.offset = 0;
+		levels.scale = 65535 / unit;
+	} else if (min < max) {
+		levels.offset = min;
+		levels.scale = 65535 / (max - min);
+	} else {
+		levels.offset = min <= max ? min : 0;
+		levels.scale = 1;
+	}
+	return levels;
+}
+
+void RawDataStorage::computeLevels()
+{
+	long count = (long)w * h;
+	switch(sampleType) {
+		case SampleI32:
+			levels = spreadLevels(samples<int32_t>(), count, 65535);
+			// Integers don't need more levels than values
+			levels.scale = std::min(levels.scale, 1.0);
+			break;
+		case SampleF32:
+			levels = spreadLevels(samples<float>(), count, 1);
+			break;
+		default:
+			break;
+	}
+}
+
+long int RawDataStorage::requiredStorage(int w, int h, SampleType sampleType)
 {
-	return sizeof(RawDataStorage) + (sizeof(uint16_t) * w * h);
+	return sizeof(RawDataStorage) + ((long)sampleSize(sampleType) * w * h);
 }
 
 static bool readKey(fitsfile * fptr, const std::string & key, std::string * o_value)
@@ -71,8 +141,137 @@ int RawDataStorage::getRGBIndex(char c)
 	return -1;
 }
 
+// Unscaled bytes and 32 bits integers are kept as is. Floats and scaled 32 bits integers are read
+// as floats. Anything else is converted to 16 bits. FastFitsReader::Header::sampleType must agree
+static RawDataStorage::SampleType getSampleType(fitsfile * fptr, int bitpix, int * status)
+{
+	int equivType;
+	if (fits_get_img_equivtype(fptr, &equivType, status)) {
+		return RawDataStorage::SampleU16;
+	}
+	switch(equivType) {
+		case BYTE_IMG:
+			return RawDataStorage::SampleU8;
+		case LONG_IMG:
+			return RawDataStorage::SampleI32;
+	}
+	if (bitpix == LONG_IMG || bitpix < 0) {
+		return RawDataStorage::SampleF32;
+	}
+	return RawDataStorage::SampleU16;
+}
+
+// Read rows [y, y + rows) of the image into the samples of storage
+static int readRows(fitsfile * fptr, RawDataStorage * storage, int y, int rows, int * status)
+{
+	long fpixels[2]= {1, y + 1};
+	long offset = (long)storage->w * y;
+	long count = (long)storage->w * rows;
+	switch(storage->sampleType) {
+		case RawDataStorage::SampleU8:
+			return fits_read_pix(fptr, TBYTE, fpixels, count, NULL, storage->samples<uint8_t>() + offset, NULL, status);
+		case RawDataStorage::SampleI32:
+			return fits_read_pix(fptr, TINT, fpixels, count, NULL, storage->samples<int32_t>() + offset, NULL, status);
+		case RawDataStorage::SampleF32:
+			return fits_read_pix(fptr, TFLOAT, fpixels, count, NULL, storage->samples<float>() + offset, NULL, status);
+		default:
+			return fits_read_pix(fptr, TUSHORT, fpixels, count, NULL, storage->samples<uint16_t>() + offset, NULL, status);
+	}
+}
+
+// Threads decoding a tile compressed image (cfitsio does it on a single one)
+static int getDecodeThreads()
+{
+	const char * env = getenv("FITS_SERVER_DECODE_THREADS");
+	int result;
+	if (env == nullptr) {
+		// Up to getMaxActiveWorkers() productions run at once: share the cores with them
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		result = std::max(1L, cores / SharedCache::SharedCacheServer::getMaxActiveWorkers());
+	} else {
+		result = atoi(env);
+		if (result < 1) {
+			throw std::runtime_error("invalid decode threads: " + std::string(env));
+		}
+	}
+	if (result > 1 && !fits_is_reentrant()) {
+		return 1;
+	}
+	return std::max(result, 1);
+}
+
+// Decode bands of tile rows in parallel, each thread with its own fitsfile. Every band
+// is read by the same fits_read_pix call as the sequential code, so the result is identical
+static void readCompressedRows(FitsFile & file, int w, int h, int threads, SharedCache::WriteableEntry * entry)
+{
+	int status = 0;
+	long tileSize[2] = {w, 1};
+	fits_get_tile_dim(file.fptr, 2, tileSize, &status);
+	status = 0;
+	int tileHeight = std::max(1L, tileSize[1]);
+	// Bands are made of whole tiles, so that no tile is decoded twice
+	int bandHeight = std::max(1, READ_BAND_PIXELS / std::max(w, 1));
+	bandHeight = (bandHeight + tileHeight - 1) / tileHeight * tileHeight;
+	threads = std::min(threads, (h + bandHeight - 1) / bandHeight);
+
+	std::vector<std::unique_ptr<FitsFile>> siblings;
+	for(int i = 1; i < threads; ++i) {
+		siblings.push_back(std::unique_ptr<FitsFile>(new FitsFile()));
+		siblings.back()->openSibling(file);
+	}
+
+	RawDataStorage * storage = (RawDataStorage*)entry->data();
+	std::atomic<int> nextRow(0);
+	std::atomic<int> rowsDone(0);
+	// First fits error, or -1 to abort
+	std::atomic<int> failure(0);
+	auto decode = [&](fitsfile * fptr, bool reportProgress) {
+		int status = 0;
+		while(!failure) {
+			int y = nextRow.fetch_add(bandHeight);
+			if (y >= h) {
+				break;
+			}
+			int rows = std::min(bandHeight, h - y);
+			if (readRows(fptr, storage, y, rows, &status)) {
+				int none = 0;
+				failure.compare_exchange_strong(none, status);
+				break;
+			}
+			int done = (rowsDone += rows);
+			if (reportProgress) {
+				entry->progress((double)done / h);
+			}
+		}
+	};
+
+	fprintf(stderr, "Decoding compressed image with %d threads\n", threads);
+	std::vector<std::thread> helpers;
+	for(auto & sibling : siblings) {
+		helpers.push_back(std::thread(decode, sibling->fptr, false));
+	}
+	// This thread takes its share and reports progress
+	std::exception_ptr error;
+	try {
+		decode(file.fptr, true);
+	} catch(...) {
+		error = std::current_exception();
+		failure = -1;
+	}
+	for(auto & helper : helpers) {
+		helper.join();
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+	if (failure) {
+		file.throwFitsIOError("fits_read_pix failed", failure);
+	}
+}
+
 void SharedCache::Messages::RawContent::readFits(FitsFile & file, WriteableEntry * entry)
 {
+	Trace::Span span("readFits", "worker");
 	int status = 0;
 	int bitpix, naxis;
 	long naxes[2] = {1,1};
@@ -137,45 +336,40 @@ void SharedCache::Messages::RawContent::readFits(FitsFile & file, WriteableEntry
 			}
 		}
 
-		entry->allocate(RawDataStorage::requiredStorage(w, h));
+		RawDataStorage::SampleType sampleType = getSampleType(file.fptr, bitpix, &status);
+		if (status) {
+			file.throwFitsIOError("fits_get_img_equivtype", status);
+		}
+		entry->allocate(RawDataStorage::requiredStorage(w, h, sampleType));
 		RawDataStorage * storage = (RawDataStorage*)entry->data();
 
 		storage->setSize(w, h);
 		storage->setBayer(bayer);
-		switch(bitpix) {
-			case BYTE_IMG:
-				storage->setBitPix(8);
-			case SHORT_IMG:
-			default:
-				storage->setBitPix(16);
-		}
+		storage->setSampleType(sampleType);
 
 
-		long fpixels[2]= {1,1};
-		if (bitpix < 0) {
-			fprintf(stderr, "Scaling float pixels\n");
-			// Assume float are in the range 0 - 1
-			float * temp = (float*)malloc(w * h * sizeof(float));
-			
-			if (!fits_read_pix(file.fptr, TFLOAT, fpixels, naxes[0] * naxes[1], NULL, temp, NULL, &status)) {
-				for(int i = 0; i < w*h; ++i) {
-					float f = temp[i] * 65535;
-					if (f < 0) f = 0;
-					if (f > 65535) f = 65535;
-					storage->data[i] = f;
-				}
-
-				free(temp);
-				return;
-			}
+		int compressed = fits_is_compressed_image(file.fptr, &status);
+		status = 0;
+		int threads = compressed ? getDecodeThreads() : 1;
+		if (threads > 1) {
+			readCompressedRows(file, w, h, threads, entry);
+			storage->computeLevels();
+			return;
+		}
 
-			free(temp);
-		} else {
-			if (!fits_read_pix(file.fptr, TUSHORT, fpixels, naxes[0] * naxes[1], NULL, &storage->data, NULL, &status)) {
-				return;
+		// Read by bands of rows, to report progress
+		int bandHeight = std::max(1, READ_BAND_PIXELS / std::max(w, 1));
+		for(int y = 0; y < h; y += bandHeight) {
+			int rows = std::min(bandHeight, h - y);
+			if (readRows(file.fptr, storage, y, rows, &status)) {
+				break;
 			}
+			entry->progress((double)(y + rows) / h);
+		}
+		if (!status) {
+			storage->computeLevels();
+			return;
 		}
-
 
 		file.throwFitsIOError("fits_read_pix failed", status);
 
@@ -185,8 +379,46 @@ void SharedCache::Messages::RawContent::readFits(FitsFile & file, WriteableEntry
 
 }
 
+long SharedCache::Messages::RawContent::estimateSize() const
+{
+	// Stream frames are allocated by their producer
+	if (path.empty()) {
+		return 0;
+	}
+	// Called by the server loop: don't open the file with cfitsio there
+	FastFitsReader::Header header;
+	if (FastFitsReader::readHeader(path, header)) {
+		return RawDataStorage::requiredStorage(header.w, header.h, header.sampleType());
+	}
+	// Other layouts (compressed, scaled bytes, ...): the size of the file is close enough
+	struct stat st;
+	if (stat(path.c_str(), &st) == -1) {
+		return 0;
+	}
+	return sizeof(RawDataStorage) + st.st_size;
+}
+
+void SharedCache::Messages::RawContent::stampIdentity()
+{
+	identity.clear();
+	if (path.empty() || !stream.empty()) {
+		return;
+	}
+	struct stat st;
+	if (stat(path.c_str(), &st) == -1) {
+		// The production will report the error
+		return;
+	}
+	std::ostringstream oss;
+	oss << st.st_dev << ':' << st.st_ino << ':' << st.st_size << ':' << (st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec);
+	identity = oss.str();
+}
+
 void SharedCache::Messages::RawContent::produce(WriteableEntry * entry)
 {
+	if (FastFitsReader::read(path, entry)) {
+		return;
+	}
 	FitsFile file;
 	file.open(path.c_str());
 
@@ -1,12 +1,65 @@
 #ifndef RAWDATASTORAGE_H
 #define RAWDATASTORAGE_H 1
 
+#include <stdint.h>
 #include <string>
+#include <math.h>
+
+// Maps samples to the 16 bits levels that histograms, renderers and star finders work on.
+// 8 and 16 bits samples are their own level. 32 bits samples (int or float) keep their precision
+// in the storage: level = (sample - offset) * scale, clamped to 0 - 65535 (NaN gives 0)
+struct SampleLevels {
+	double offset, scale;
+
+	uint16_t operator()(uint8_t v) const {
+		return v;
+	}
+
+	uint16_t operator()(uint16_t v) const {
+		return v;
+	}
+
+	uint16_t operator()(int32_t v) const {
+		return clamp((v - offset) * scale);
+	}
+
+	uint16_t operator()(float v) const {
+		return clamp((v - offset) * scale);
+	}
+
+	// Sample value of a level
+	double toSample(double level) const {
+		return level / scale + offset;
+	}
+
+	static uint16_t clamp(double level) {
+		if (!(level > 0)) {
+			return 0;
+		}
+		if (level >= 65535) {
+			return 65535;
+		}
+		return (uint16_t)level;
+	}
+};
 
 struct RawDataStorage {
+	// Type of the stored samples. Pixel kernels are templated on it (uint8_t, uint16_t, int32_t, float)
+	// Changing this layout requires a bump of CacheIndex::storageLayout
+	enum SampleType {
+		SampleU16 = 0,
+		SampleU8 = 1,
+		SampleI32 = 2,
+		SampleF32 = 3,
+	};
+
 	int w, h; 		// naxes[0], naxes[1]
-	uint8_t bitpix;	// 8 or 16
+	uint8_t bitpix;	// 8, 16 or 32
 	char bayer[4];
+	uint8_t sampleType;
+	// Set by computeLevels for 32 bits samples
+	SampleLevels levels;
+	// Samples of sampleType: use samples<T>()
 	uint16_t data[0];
 
 	// Empty for grayscale. pattern in the form RGGB otherwise
@@ -16,16 +69,66 @@ struct RawDataStorage {
 	void setSize(int w, int h);
 	void setBayer(const std::string & bayer);
 	void setBitPix(uint8_t bitpix);
+	// Also sets bitpix, and identity levels
+	void setSampleType(SampleType sampleType);
+	// Once the samples are stored: spread the levels over the range of 32 bits samples
+	void computeLevels();
+
+	template<class Sample> const Sample * samples() const {
+		return (const Sample*)data;
+	}
+
+	template<class Sample> Sample * samples() {
+		return (Sample*)data;
+	}
 
+	// Level of a pixel (the sample itself for 8 and 16 bits)
 	uint16_t getAdu(int x, int y) const {
-		return data[x + y * w];
+		long offset = x + (long)y * w;
+		switch(sampleType) {
+			case SampleU8:
+				return samples<uint8_t>()[offset];
+			case SampleI32:
+				return levels(samples<int32_t>()[offset]);
+			case SampleF32:
+				return levels(samples<float>()[offset]);
+			default:
+				return data[offset];
+		}
 	}
 
+	// Store the sample of a level
 	void setAdu(int x, int y, uint16_t adu) {
-		data[x + y * w] = adu;
+		long offset = x + (long)y * w;
+		switch(sampleType) {
+			case SampleU8:
+				samples<uint8_t>()[offset] = adu;
+				break;
+			case SampleI32:
+				// Integers span at least one sample per level: the first one
+				samples<int32_t>()[offset] = ceil(levels.toSample(adu));
+				break;
+			case SampleF32:
+				samples<float>()[offset] = levels.toSample(adu + 0.5);
+				break;
+			default:
+				data[offset] = adu;
+		}
+	}
+
+	static int sampleSize(SampleType sampleType) {
+		switch(sampleType) {
+			case SampleU8:
+				return 1;
+			case SampleI32:
+			case SampleF32:
+				return 4;
+			default:
+				return 2;
+		}
 	}
 
-	static long int requiredStorage(int w, int h);
+	static long int requiredStorage(int w, int h, SampleType sampleType = SampleU16);
 
 	static int getRGBIndex(char c);
 };
@@ -15,9 +15,33 @@
 #include <iostream>
 #include "ChildProcess.h"
 #include "SharedCache.h"
+#include "LocalEntryTable.h"
 #include "SharedCacheServer.h"
+#include "Trace.h"
 
 namespace SharedCache {
+	// Minimum delay between two progress messages of a production
+	static const long PROGRESS_INTERVAL_MS = 100;
+	// Smallest mapping worth a transparent huge page
+	static const unsigned long HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+	// FITS_SERVER_HUGEPAGES=1: map large entries with transparent huge pages (shmem_enabled must allow it for memfd storage)
+	static bool useHugePages()
+	{
+		static const bool value = getenv("FITS_SERVER_HUGEPAGES") != nullptr && atoi(getenv("FITS_SERVER_HUGEPAGES")) != 0;
+		return value;
+	}
+
+	static void adviseHugePages(void * addr, unsigned long size)
+	{
+#ifdef MADV_HUGEPAGE
+		if (size >= HUGE_PAGE_SIZE && useHugePages()) {
+			// Only a hint
+			madvise(addr, size, MADV_HUGEPAGE);
+		}
+#endif
+	}
+
 	EntryRef::EntryRef(Entry * e) :entry(e) {
 	}
 
@@ -40,11 +64,12 @@ namespace SharedCache {
 		dataSize = 0;
 		wasMmapped = false;
 		fd = -1;
+		shared = nullptr;
 		if (!result.error) {
 			error = false;
 			errorDetails = "";
 			released = false;
-			
+			fd = result.fd;
 		} else {
 			error = true;
 			errorDetails = result.errorDetails;
@@ -53,6 +78,22 @@ namespace SharedCache {
 
 	}
 
+	Entry::Entry(Cache * cache, LocalMapping * shared):
+			cache(cache),
+			filename(shared->filename),
+			wasReady(true),
+			streamId(),
+			actualRequest(shared->actualRequest)
+	{
+		this->shared = shared;
+		mmapped = shared->data;
+		dataSize = shared->size;
+		wasMmapped = true;
+		fd = -1;
+		error = false;
+		released = false;
+	}
+
 	Entry::Entry(Cache * cache, const Messages::WorkResponse & result):
 						cache(cache),
 						filename(result.filename),
@@ -64,7 +105,9 @@ namespace SharedCache {
 		dataSize = 0;
 		wasMmapped = false;
 		released = false;
-		fd = -1;
+		fd = result.fd;
+		shared = nullptr;
+		lastProgress = std::chrono::steady_clock::now();
 	}
 
 	Entry::Entry(Cache * cache, const Messages::StreamStartImageResult & result):
@@ -78,11 +121,15 @@ namespace SharedCache {
 		dataSize = 0;
 		wasMmapped = false;
 		released = false;
-		fd = -1;
+		fd = result.fd;
+		shared = nullptr;
 	}
 
 	Entry::~Entry()
 	{
+		if (shared && !released) {
+			release();
+		}
 		if (wasMmapped && mmapped) {
 			munmap(mmapped, dataSize);
 		}
@@ -126,6 +173,7 @@ namespace SharedCache {
 				std::cerr << "mmap of fd " << fd << " for " << filename << " failed\n";
 				throw std::runtime_error("Mmap failed");
 			}
+			adviseHugePages(mmapped, size);
 		}
 		dataSize = size;
 	}
@@ -146,6 +194,7 @@ namespace SharedCache {
 					perror("mmap");
 					throw std::runtime_error("Mmap failed");
 				}
+				adviseHugePages(mmapped, dataSize);
 			}
 			wasMmapped = true;
 		}
@@ -162,14 +211,32 @@ namespace SharedCache {
 		return dataSize;
 	}
 
-	void Entry::produced() {
+	void Entry::produced(const Messages::ContentRequest * lend) {
+		if (lend != nullptr && cache->localEntries != nullptr && wasMmapped && mmapped) {
+			// Borrowers get a read-only mapping, as with data()
+			void * readOnly = mmap(0, dataSize, PROT_READ, MAP_SHARED, fd, 0);
+			if (readOnly == MAP_FAILED) {
+				perror("mmap");
+			} else {
+				munmap(mmapped, dataSize);
+				mmapped = readOnly;
+				// Before the announce: the server may hand a dependent to another thread right after
+				actualRequest = new Messages::ContentRequest(*lend);
+				shared = cache->localEntries->publish(lend->contentKey(), filename, mmapped, dataSize, actualRequest);
+			}
+		}
 		Messages::Request request;
 		request.finishedAnnounce = new Messages::FinishedAnnounce();
 		request.finishedAnnounce->filename = filename;
 		request.finishedAnnounce->size = dataSize;
 		request.finishedAnnounce->error = false;
 		request.finishedAnnounce->errorDetails = "";
+		request.finishedAnnounce->keep = shared != nullptr;
 		cache->clientSend(request);
+		if (shared != nullptr) {
+			wasReady = true;
+			return;
+		}
 		released = true;
 	}
 
@@ -184,6 +251,22 @@ namespace SharedCache {
 		return *result.streamPublishResult;
 	}
 
+	void Entry::progress(double done) {
+		auto now = std::chrono::steady_clock::now();
+		if (wasReady || !streamId.empty() || now - lastProgress < std::chrono::milliseconds(PROGRESS_INTERVAL_MS)) {
+			return;
+		}
+		lastProgress = now;
+		Messages::Request request;
+		request.progressAnnounce.build();
+		request.progressAnnounce->filename = filename;
+		request.progressAnnounce->progress = done;
+		Messages::Result result = cache->clientSend(request);
+		if (result.progressResult && result.progressResult->cancel) {
+			throw WorkerError("production cancelled");
+		}
+	}
+
 	void Entry::failed(const std::string & str) {
 		Messages::Request request;
 		request.finishedAnnounce = new Messages::FinishedAnnounce();
@@ -196,6 +279,17 @@ namespace SharedCache {
 	}
 
 	void Entry::release() {
+		if (shared) {
+			bool last = cache->localEntries->release(shared);
+			shared = nullptr;
+			if (!last) {
+				// Still used by another thread
+				mmapped = nullptr;
+				wasMmapped = false;
+				released = true;
+				return;
+			}
+		}
 		Messages::Request request;
 		request.releasedAnnounce = new Messages::ReleasedAnnounce();
 		request.releasedAnnounce->filename = filename;
@@ -208,6 +302,21 @@ namespace SharedCache {
 	}
 
 
+	long parseSize(const char * str)
+	{
+		long result = atoll(str);
+		auto len = strlen(str);
+		switch(len ? str[len - 1] : 0) {
+			case 'G':
+				return result * 1024 * 1024 * 1024;
+			case 'M':
+				return result * 1024 * 1024;
+			case 'K':
+				return result * 1024;
+		}
+		return result;
+	}
+
 	static void getCacheLocation(std::string & basePath, long & maxSize) {
 		const char * envCachePath = getenv("FITS_SERVER_CACHE_PATH");
 		const char * envCacheSize = getenv("FITS_SERVER_CACHE_SIZE");
@@ -221,17 +330,7 @@ namespace SharedCache {
 
 
 		basePath = envCachePath;
-		maxSize = atoll(envCacheSize);
-		auto envCacheSizeLen = strlen(envCacheSize);
-		char unit = envCacheSizeLen ? envCacheSize[envCacheSizeLen - 1] : 0;
-		switch(unit) {
-			case 'G':
-				maxSize *= 1024;
-			case 'M':
-				maxSize *= 1024;
-			case 'K':
-				maxSize *= 1024;
-		}
+		maxSize = parseSize(envCacheSize);
 
 		if (basePath.length() == 0 || basePath[0] != '/') {
 			throw std::runtime_error("invalid cache path: " + std::string(envCachePath));
@@ -250,43 +349,216 @@ namespace SharedCache {
 				basePath()
 	{
 		getCacheLocation(basePath, maxSize);
+		wireFormat = Wire::defaultFormat();
+		localEntries = nullptr;
+		nextRequestId = 1;
 
 
 
 		init();
 	}
 
-	Cache::Cache(const SharedCacheServer & parent, int fd) :
-				basePath(parent.getBasePath())
+	Cache::Cache(const std::string & basePath, int fd) :
+				basePath(basePath)
 	{
 		this->maxSize = maxSize;
 		this->clientFd = fd;
+		this->wireFormat = Wire::defaultFormat();
+		this->localEntries = nullptr;
+		this->nextRequestId = 1;
+	}
+
+	Cache * Cache::connectRunning()
+	{
+		std::string basePath;
+		long maxSize;
+		getCacheLocation(basePath, maxSize);
+		Cache * cache = new Cache(basePath, -1);
+		cache->maxSize = maxSize;
+		if (!cache->connectExisting()) {
+			delete(cache);
+			return nullptr;
+		}
+		return cache;
 	}
 
 	Messages::Result Cache::clientSend(const Messages::Request & request)
 	{
-		std::string str;
-		{
-			nlohmann::json j = request;
-			str = j.dump();
+		std::string frame;
+		Wire::encode(request, wireFormat, frame);
+		if (wireFormat == Wire::Json) {
+			std::cerr << getpid() << ": Sending to server: " << frame.substr(sizeof(Wire::FrameHeader)) << "\n";
+		}
+		clientSendMessage(frame);
+
+		while(true) {
+			std::string received;
+			uint32_t requestId;
+			std::vector<int> fds;
+			uint8_t format = clientWaitMessage(received, requestId, fds);
+			if (format == Wire::Json) {
+				std::cerr << getpid() << ": Received from server: " << received << "\n";
+			}
+			Messages::Result result = decodeResult(received, format, fds);
+			if (requestId == 0) {
+				return result;
+			}
+			// Completion of an asynchronous request. Dispatched by the next processAsync
+			asyncResults.push_back(std::make_pair(requestId, result));
 		}
-		std::cerr << getpid() << ": Sending to server: " << str << "\n";
-		clientSendMessage(str.data(), str.length());
-		char buffer[SharedCache::MAX_MESSAGE_SIZE];
-		int sze = clientWaitMessage(buffer);
-		std::string received(buffer, sze);
-		std::cerr << getpid() << ": Received from server: " << received << "\n";
-		auto jsonResult = nlohmann::json::parse(received);
-		return jsonResult.get<Messages::Result>();
+	}
+
+	void Cache::receiveAsyncResult()
+	{
+		std::string received;
+		uint32_t requestId;
+		std::vector<int> fds;
+		uint8_t format = clientWaitMessage(received, requestId, fds);
+		if (format == Wire::Json) {
+			std::cerr << getpid() << ": Received from server: " << received << "\n";
+		}
+		Messages::Result result = decodeResult(received, format, fds);
+		if (requestId == 0) {
+			throw std::runtime_error("Unexpected synchronous reply");
+		}
+		asyncResults.push_back(std::make_pair(requestId, result));
+	}
+
+	// Tag a request with the id of the current trace context (a new one if none)
+	static void setTraceId(Messages::ContentRequest & request)
+	{
+		if (Trace::enabled() && request.traceId.empty()) {
+			request.traceId = Trace::currentId().empty() ? Trace::newId() : Trace::currentId();
+		}
+	}
+
+	uint32_t Cache::getEntryAsync(const Messages::ContentRequest & wanted, EntryCallback callback)
+	{
+		uint32_t requestId = nextRequestId++;
+		if (nextRequestId == 0) {
+			nextRequestId = 1;
+		}
+
+		Messages::Request request;
+		request.contentRequest = new Messages::ContentRequest(wanted);
+		setTraceId(*request.contentRequest);
+
+		std::string frame;
+		Wire::encode(request, wireFormat, frame, requestId);
+		if (wireFormat == Wire::Json) {
+			std::cerr << getpid() << ": Sending to server: " << frame.substr(sizeof(Wire::FrameHeader)) << "\n";
+		}
+		clientSendMessage(frame);
+		asyncCallbacks[requestId] = callback;
+		return requestId;
+	}
+
+	bool Cache::processAsync(int timeout)
+	{
+		if (asyncResults.empty()) {
+			if (asyncCallbacks.empty()) {
+				return false;
+			}
+			struct pollfd pfd;
+			pfd.fd = clientFd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			int rslt;
+			do {
+				rslt = poll(&pfd, 1, timeout);
+			} while(rslt == -1 && errno == EINTR);
+			if (rslt == -1) {
+				perror("poll");
+				throw std::runtime_error("poll");
+			}
+			if (rslt == 0) {
+				return false;
+			}
+			receiveAsyncResult();
+		}
+
+		while(!asyncResults.empty()) {
+			std::pair<uint32_t, Messages::Result> done = asyncResults.front();
+			asyncResults.pop_front();
+			auto callback = asyncCallbacks.find(done.first);
+			if (callback == asyncCallbacks.end() || !done.second.contentResult) {
+				throw std::runtime_error("Unexpected asynchronous reply");
+			}
+			EntryCallback todo = callback->second;
+			asyncCallbacks.erase(callback);
+			todo(new Entry(this, *done.second.contentResult));
+		}
+		return true;
 	}
 
 	Entry * Cache::getEntry(const Messages::ContentRequest & wanted)
 	{
+		ContentKey key;
+		bool shareable = localEntries != nullptr && LocalEntryTable::shareable(wanted);
+		if (shareable) {
+			key = wanted.contentKey();
+			LocalMapping * mapping = localEntries->acquire(key);
+			if (mapping != nullptr) {
+				return new Entry(this, mapping);
+			}
+		}
+
 		Messages::Request request;
 		request.contentRequest = new Messages::ContentRequest(wanted);
+		setTraceId(*request.contentRequest);
+		Trace::Context context(request.contentRequest->traceId);
+		Trace::Span span(Messages::productTypeName(wanted.productType()), "getEntry");
 
 		Messages::Result r = clientSend(request);
-		return new Entry(this, *r.contentResult);
+		Entry * entry = new Entry(this, *r.contentResult);
+		if (shareable && !entry->error) {
+			entry->data();
+			entry->shared = localEntries->publish(key, entry->filename, entry->mmapped, entry->dataSize, entry->actualRequest);
+		}
+		return entry;
+	}
+
+	std::vector<Entry *> Cache::getEntries(const std::vector<Messages::ContentRequest> & wanted)
+	{
+		std::vector<Entry *> entries(wanted.size(), nullptr);
+		std::vector<ContentKey> keys(wanted.size());
+		std::vector<size_t> missing;
+		Messages::Request request;
+		request.batchRequest.build();
+		// One trace for the whole batch
+		Trace::Context context(Trace::enabled() && Trace::currentId().empty() ? Trace::newId() : Trace::currentId());
+		for(size_t i = 0; i < wanted.size(); ++i) {
+			if (localEntries != nullptr && LocalEntryTable::shareable(wanted[i])) {
+				keys[i] = wanted[i].contentKey();
+				LocalMapping * mapping = localEntries->acquire(keys[i]);
+				if (mapping != nullptr) {
+					entries[i] = new Entry(this, mapping);
+					continue;
+				}
+			}
+			missing.push_back(i);
+			request.batchRequest->contents.push_back(wanted[i]);
+			setTraceId(request.batchRequest->contents.back());
+		}
+		if (missing.empty()) {
+			return entries;
+		}
+		Trace::Span span("batch", "getEntry");
+
+		Messages::Result r = clientSend(request);
+		if (!r.batchResult || r.batchResult->contents.size() != missing.size()) {
+			throw std::runtime_error("Invalid batch result");
+		}
+		for(size_t m = 0; m < missing.size(); ++m) {
+			size_t i = missing[m];
+			Entry * entry = new Entry(this, r.batchResult->contents[m]);
+			if (!keys[i].empty() && !entry->error) {
+				entry->data();
+				entry->shared = localEntries->publish(keys[i], entry->filename, entry->mmapped, entry->dataSize, entry->actualRequest);
+			}
+			entries[i] = entry;
+		}
+		return entries;
 	}
 
 	bool Cache::waitStreamFrame(const std::string streamId, long serial, int timeout, bool & dead)
@@ -302,6 +574,14 @@ namespace SharedCache {
 		return !r.streamWatchResult->timedout;
 	}
 
+	Messages::StatsResult Cache::getStats()
+	{
+		Messages::Request request;
+		request.statsRequest.build();
+		Messages::Result r = clientSend(request);
+		return *r.statsResult;
+	}
+
 	Entry * Cache::startStreamImage()
 	{
 	    SharedCache::Messages::Request request;
@@ -333,54 +613,143 @@ namespace SharedCache {
 		return true;
 	}
 
-	void Cache::clientSendMessage(const void * data, int length)
+	void Cache::clientSendMessage(const std::string & frame)
 	{
-		if (length > MAX_MESSAGE_SIZE - 2) {
+		if (frame.size() > sizeof(Wire::FrameHeader) + MAX_MESSAGE_SIZE) {
 			throw std::runtime_error("Message too big");
 		}
-		uint16_t size = length + 2;
-		int wr = write(clientFd, &size, 2);
-		if (wr == -1) {
-			perror("write");
-			throw std::runtime_error("write");
+		size_t done = 0;
+		while(done < frame.size()) {
+			ssize_t wr = write(clientFd, frame.data() + done, frame.size() - done);
+			if (wr == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("write");
+				throw std::runtime_error("write");
+			}
+			done += wr;
 		}
-		if (wr < 2) {
-			throw std::runtime_error("short write");
+	}
+
+	static void readFully(int fd, void * buffer, size_t length)
+	{
+		size_t done = 0;
+		while(done < length) {
+			ssize_t readen = read(fd, ((char*)buffer) + done, length - done);
+			if (readen == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("read");
+				throw std::runtime_error("read");
+			}
+			if (readen == 0) {
+				throw std::runtime_error("short read");
+			}
+			done += readen;
 		}
+	}
 
-		wr = write(clientFd, data, length);
-		if (wr == -1) {
-			perror("write");
-			throw std::runtime_error("write");
+	// Read the start of a frame, with the descriptors that come along
+	static void readFullyWithFds(int fd, void * buffer, size_t length, std::vector<int> & fds)
+	{
+		char control[CMSG_SPACE(sizeof(int) * MAX_BATCH_SIZE)];
+		size_t done = 0;
+		while(done < length) {
+			struct iovec iov;
+			iov.iov_base = ((char*)buffer) + done;
+			iov.iov_len = length - done;
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			ssize_t readen = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+			if (readen == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("recvmsg");
+				throw std::runtime_error("recvmsg");
+			}
+			for(struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+					size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+					for(size_t i = 0; i < count; ++i) {
+						int received;
+						memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+						fds.push_back(received);
+					}
+				}
+			}
+			if (msg.msg_flags & MSG_CTRUNC) {
+				throw std::runtime_error("too many descriptors received");
+			}
+			if (readen == 0) {
+				throw std::runtime_error("short read");
+			}
+			done += readen;
+		}
+	}
+
+	uint8_t Cache::clientWaitMessage(std::string & payload, uint32_t & requestId, std::vector<int> & fds)
+	{
+		Wire::FrameHeader header;
+		readFullyWithFds(clientFd, &header, sizeof(header), fds);
+		if (!Wire::isValidFormat(header.format)) {
+			throw std::runtime_error(Wire::formatError(header.format));
 		}
-		if (wr < length) {
-			throw std::runtime_error("short write");
+		if (header.size > MAX_MESSAGE_SIZE) {
+			throw std::runtime_error("invalid size");
+		}
+		payload.resize(header.size);
+		if (header.size) {
+			readFully(clientFd, &payload[0], header.size);
 		}
+		requestId = header.requestId;
+		return header.format;
 	}
 
-	int Cache::clientWaitMessage(char * buffer)
+	Messages::Result Cache::decodeResult(const std::string & payload, uint8_t format, std::vector<int> & fds)
 	{
-		uint16_t size;
-		int readen = read(clientFd, &size, 2);
-		if (readen == -1) {
-			perror("read");
-			throw std::runtime_error("read");
+		Messages::Result result;
+		try {
+			Wire::decode(payload.data(), payload.size(), format, result);
+		} catch(...) {
+			for(auto it = fds.begin(); it != fds.end(); ++it) {
+				close(*it);
+			}
+			throw;
 		}
-		if (readen < 2) {
-			throw std::runtime_error("short read");
+		// Same order as SharedCacheServer::dataFds
+		std::vector<int*> targets;
+		if (result.contentResult && !result.contentResult->error) {
+			targets.push_back(&result.contentResult->fd);
 		}
-		if (size > MAX_MESSAGE_SIZE) {
-			throw std::runtime_error("invalid size");
+		if (result.batchResult) {
+			for(auto it = result.batchResult->contents.begin(); it != result.batchResult->contents.end(); ++it) {
+				if (!it->error) {
+					targets.push_back(&it->fd);
+				}
+			}
 		}
-		readen = read(clientFd, buffer, size);
-		if (readen == -1) {
-			perror("read");
-			throw std::runtime_error("read");
+		if (result.todoResult) {
+			targets.push_back(&result.todoResult->fd);
 		}
-		if (readen < size) {
-			throw std::runtime_error("short read");
+		if (result.streamStartImageResult) {
+			targets.push_back(&result.streamStartImageResult->fd);
+		}
+		for(size_t i = 0; i < fds.size(); ++i) {
+			if (i < targets.size()) {
+				*targets[i] = fds[i];
+			} else {
+				close(fds[i]);
+			}
 		}
-		return size;
+		fds.clear();
+		return result;
 	}
 
 	void Cache::setSockAddr(const std::string basePath, struct sockaddr_un & addr, int & len)
@@ -4,7 +4,12 @@
 #include <string>
 #include <list>
 #include <vector>
+#include <chrono>
+#include <map>
+#include <functional>
 #include "json.hpp"
+#include "WireFormat.h"
+#include "ContentKey.h"
 
 
 class FitsFile;
@@ -15,7 +20,11 @@ class FitsFile;
 // create a semaphore
 // mark it ready
 namespace SharedCache {
-	const int MAX_MESSAGE_SIZE = 32768;
+	// Sanity limit for a single message
+	const uint32_t MAX_MESSAGE_SIZE = 64 * 1024 * 1024;
+	// Sanity limit for the number of contents in a batch request
+	// Each item of a batch result may carry a descriptor: stay well below SCM_MAX_FD (253)
+	const int32_t MAX_BATCH_SIZE = 64;
 	class Entry;
 	class WriteableEntry;
 
@@ -72,6 +81,8 @@ namespace SharedCache {
 
 	namespace Messages {
 
+		struct ContentRequest;
+
 		struct RawContent {
 			std::string path;
 			std::string stream;
@@ -79,25 +90,40 @@ namespace SharedCache {
 			long serial;
 			// Need exactly this serial - fixme: this must not enter the key
 			bool exactSerial;
+			// Device, inode, size and mtime of the file, stamped by the server on reception.
+			// Part of the key: an overwritten file gets read again
+			std::string identity;
 
+			// Set identity from the file as it is now (empty for streams and missing files)
+			void stampIdentity();
 			void produce(WriteableEntry * entry);
 			static void readFits(FitsFile & fitsFile, WriteableEntry * entry);
+
+			// Expected size of the produced data (0 if unknown). Used for cache space reservation
+			long estimateSize() const;
 		};
 
 		void to_json(nlohmann::json&j, const RawContent & i);
 		void from_json(const nlohmann::json& j, RawContent & p);
+		void to_binary(BinaryWriter & w, const RawContent & i);
+		void from_binary(BinaryReader & r, RawContent & p);
 
 		struct Histogram {
 			RawContent source;
 			void produce(Entry * entry);
+			long estimateSize() const;
 
 			void collectRawContents(std::list<RawContent *> & into);
+			// Contents read by produce (RawContent)
+			void collectDependencies(std::list<ContentRequest> & into) const;
 
 			bool asJsonResult(Entry * e, nlohmann::json& j, const nlohmann::json & options) const;
 		};
 
 		void to_json(nlohmann::json&j, const Histogram & i);
 		void from_json(const nlohmann::json& j, Histogram & p);
+		void to_binary(BinaryWriter & w, const Histogram & i);
+		void from_binary(BinaryReader & r, Histogram & p);
 
 		struct HistogramOptions {
 			int maxBits = -1;
@@ -105,6 +131,31 @@ namespace SharedCache {
 
 		void from_json(const nlohmann::json& j, HistogramOptions & p);
 
+		// Keywords of the image header, without reading the pixels (see FitsHeaderStorage)
+		struct FitsHeader {
+			RawContent source;
+			void produce(Entry * entry);
+			long estimateSize() const;
+
+			void collectRawContents(std::list<RawContent *> & into);
+			// Contents read by produce (RawContent, for streams only)
+			void collectDependencies(std::list<ContentRequest> & into) const;
+
+			bool asJsonResult(Entry * e, nlohmann::json& j, const nlohmann::json & options) const;
+		};
+
+		void to_json(nlohmann::json&j, const FitsHeader & i);
+		void from_json(const nlohmann::json& j, FitsHeader & p);
+		void to_binary(BinaryWriter & w, const FitsHeader & i);
+		void from_binary(BinaryReader & r, FitsHeader & p);
+
+		struct FitsHeaderOptions {
+			// Only return these keywords (all if empty)
+			std::vector<std::string> keys;
+		};
+
+		void from_json(const nlohmann::json& j, FitsHeaderOptions & p);
+
 		struct StarOccurence {
 			double x, y;
 			double peak;
@@ -120,11 +171,16 @@ namespace SharedCache {
 		struct StarField {
 			RawContent source;
 			void produce(Entry * entry);
+			long estimateSize() const;
 
 			void collectRawContents(std::list<RawContent *> & into);
+			// Contents read by produce (RawContent and Histogram)
+			void collectDependencies(std::list<ContentRequest> & into) const;
 		};
 		void to_json(nlohmann::json&j, const StarField & i);
 		void from_json(const nlohmann::json& j, StarField & p);
+		void to_binary(BinaryWriter & w, const StarField & i);
+		void from_binary(BinaryReader & r, StarField & p);
 
 		struct StarFieldResult {
 			int width, height;
@@ -153,29 +209,64 @@ namespace SharedCache {
 			int numberOfBinInUniformize;
 
 			void produce(Entry * entry);
+			long estimateSize() const;
 
 			void collectRawContents(std::list<RawContent *> & into);
+			// Contents read by produce (StarField)
+			void collectDependencies(std::list<ContentRequest> & into) const;
 		};
 		void to_json(nlohmann::json&j, const Astrometry & i);
 		void from_json(const nlohmann::json& j, Astrometry & p);
+		void to_binary(BinaryWriter & w, const Astrometry & i);
+		void from_binary(BinaryReader & r, Astrometry & p);
+
+		enum ProductType {
+			ProductRawContent,
+			ProductHistogram,
+			ProductStarField,
+			ProductAstrometry,
+			ProductFitsHeader,
+			ProductTypeCount
+		};
+
+		const char * productTypeName(int productType);
+
+		// Scheduling class of a ContentRequest. Lower values are served first.
+		// Dependencies inherit the priority of the content that needs them
+		enum Priority {
+			PriorityInteractive = 0,
+			PriorityNormal = 1,
+			PriorityBackground = 2,
+		};
 
 		struct ContentRequest {
 			ChildPtr<RawContent> fitsContent;
 			ChildPtr<Histogram> histogram;
 			ChildPtr<StarField> starField;
 			ChildPtr<Astrometry> astrometry;
+			ChildPtr<FitsHeader> fitsHeader;
+			int priority = PriorityNormal;
+			// Correlates the trace events of the request and of the productions it triggers (see Trace)
+			std::string traceId;
 
-			std::string uniqKey();
+			// Identifier of the produced content. exactSerial, priority and traceId do not enter the key
+			ContentKey contentKey() const;
 
 			void produce(Entry * entry);
+			long estimateSize() const;
+			ProductType productType() const;
 
 			void collectRawContents(std::list<RawContent *> & into);
+			// Contents that must be available before this one can be produced (direct dependencies only)
+			void collectDependencies(std::list<ContentRequest> & into) const;
 
 			bool asJsonResult(Entry * e, nlohmann::json & j, const nlohmann::json & options) const;
 		};
 
 		void to_json(nlohmann::json&j, const ContentRequest & i);
 		void from_json(const nlohmann::json& j, ContentRequest & p);
+		void to_binary(BinaryWriter & w, const ContentRequest & i);
+		void from_binary(BinaryReader & r, ContentRequest & p);
 
 		// Wait until a stream frame gets obsoleted
 		struct StreamWatchRequest {
@@ -186,6 +277,8 @@ namespace SharedCache {
 
 		void to_json(nlohmann::json&j, const StreamWatchRequest & i);
 		void from_json(const nlohmann::json& j, StreamWatchRequest & p);
+		void to_binary(BinaryWriter & w, const StreamWatchRequest & i);
+		void from_binary(BinaryReader & r, StreamWatchRequest & p);
 
 		// Wait until a stream frame gets obsoleted
 		struct StreamWatchResult {
@@ -194,31 +287,45 @@ namespace SharedCache {
 		};
 		void to_json(nlohmann::json&j, const StreamWatchResult & i);
 		void from_json(const nlohmann::json& j, StreamWatchResult & p);
+		void to_binary(BinaryWriter & w, const StreamWatchResult & i);
+		void from_binary(BinaryReader & r, StreamWatchResult & p);
 
 		struct WorkRequest {
 		};
 
 		void to_json(nlohmann::json&j, const WorkRequest & i);
 		void from_json(const nlohmann::json& j, WorkRequest & p);
+		void to_binary(BinaryWriter & w, const WorkRequest & i);
+		void from_binary(BinaryReader & r, WorkRequest & p);
 
 
 		struct WorkResponse {
 			ChildPtr<ContentRequest> content;
 			std::string filename;
+			// Second tier copy to restore instead of producing (empty if none)
+			std::string spilled;
+			// Data descriptor with fd based storages. Received out of band (SCM_RIGHTS), not serialized
+			int fd = -1;
 		};
 
 		void to_json(nlohmann::json&j, const WorkResponse & i);
 		void from_json(const nlohmann::json& j, WorkResponse & p);
+		void to_binary(BinaryWriter & w, const WorkResponse & i);
+		void from_binary(BinaryReader & r, WorkResponse & p);
 
 		struct FinishedAnnounce {
 			bool error;
 			long size;
 			std::string filename;
 			std::string errorDetails;
+			// The producer keeps reading the content (threaded workers lend it to its dependents)
+			bool keep;
 		};
 
 		void to_json(nlohmann::json&j, const FinishedAnnounce & i);
 		void from_json(const nlohmann::json& j, FinishedAnnounce & p);
+		void to_binary(BinaryWriter & w, const FinishedAnnounce & i);
+		void from_binary(BinaryReader & r, FinishedAnnounce & p);
 
 		struct ReleasedAnnounce {
 			std::string filename;
@@ -226,19 +333,39 @@ namespace SharedCache {
 
 		void to_json(nlohmann::json&j, const ReleasedAnnounce & i);
 		void from_json(const nlohmann::json& j, ReleasedAnnounce & p);
+		void to_binary(BinaryWriter & w, const ReleasedAnnounce & i);
+		void from_binary(BinaryReader & r, ReleasedAnnounce & p);
+
+		// Sent by workers while producing. Used to spare almost finished productions
+		struct ProgressAnnounce {
+			std::string filename;
+			// 0 - 1
+			double progress;
+		};
+
+		void to_json(nlohmann::json&j, const ProgressAnnounce & i);
+		void from_json(const nlohmann::json& j, ProgressAnnounce & p);
+		void to_binary(BinaryWriter & w, const ProgressAnnounce & i);
+		void from_binary(BinaryReader & r, ProgressAnnounce & p);
 
 		struct StreamStartImageRequest {
 			std::string streamId;
 		};
 		void to_json(nlohmann::json&j, const StreamStartImageRequest & i);
 		void from_json(const nlohmann::json& j, StreamStartImageRequest & p);
+		void to_binary(BinaryWriter & w, const StreamStartImageRequest & i);
+		void from_binary(BinaryReader & r, StreamStartImageRequest & p);
 
 		struct StreamStartImageResult {
 			std::string filename;
 			std::string streamId;
+			// Data descriptor with fd based storages. Received out of band (SCM_RIGHTS), not serialized
+			int fd = -1;
 		};
 		void to_json(nlohmann::json&j, const StreamStartImageResult & i);
 		void from_json(const nlohmann::json& j, StreamStartImageResult & p);
+		void to_binary(BinaryWriter & w, const StreamStartImageResult & i);
+		void from_binary(BinaryReader & r, StreamStartImageResult & p);
 
 		struct StreamPublishRequest {
 			long size;
@@ -246,14 +373,83 @@ namespace SharedCache {
 		};
 		void to_json(nlohmann::json&j, const StreamPublishRequest & i);
 		void from_json(const nlohmann::json& j, StreamPublishRequest & p);
+		void to_binary(BinaryWriter & w, const StreamPublishRequest & i);
+		void from_binary(BinaryReader & r, StreamPublishRequest & p);
 
 		struct StreamPublishResult {
 			long serial;
 		};
 		void to_json(nlohmann::json&j, const StreamPublishResult & i);
 		void from_json(const nlohmann::json& j, StreamPublishResult & p);
+		void to_binary(BinaryWriter & w, const StreamPublishResult & i);
+		void from_binary(BinaryReader & r, StreamPublishResult & p);
 
 
+		// Snapshot of the server counters
+		struct StatsRequest {
+		};
+		void to_json(nlohmann::json&j, const StatsRequest & i);
+		void from_json(const nlohmann::json& j, StatsRequest & p);
+		void to_binary(BinaryWriter & w, const StatsRequest & i);
+		void from_binary(BinaryReader & r, StatsRequest & p);
+
+		// Counters for one product type, since server start
+		struct ProductStats {
+			std::string product;
+			// Requests served from cache or already in production / requests that started a production
+			long hits = 0;
+			long misses = 0;
+			long productions = 0;
+			long failures = 0;
+			// Sum of production durations (ms)
+			long productionTime = 0;
+			long evictions = 0;
+			long evictedBytes = 0;
+		};
+		void to_json(nlohmann::json&j, const ProductStats & i);
+		void from_json(const nlohmann::json& j, ProductStats & p);
+		void to_binary(BinaryWriter & w, const ProductStats & i);
+		void from_binary(BinaryReader & r, ProductStats & p);
+
+		struct StatsResult {
+			long maxSize;
+			long currentSize;
+			long reservedSize;
+			long contentCount;
+			long waitingConsumers;
+			long waitingWorkers;
+			long streamWatchers;
+			long startedWorkers;
+			long activeWorkers;
+			long blockedWorkers;
+			// Workers started, and total time until they were ready for work (us)
+			long workerSpawns;
+			long workerSpawnTime;
+			// Number and total duration (ms) of the first production of each worker
+			long firstProductions;
+			long firstProductionTime;
+			// Second tier (0 when disabled): capacity, compressed size, lookups that found a copy or not, copies written
+			long spillMaxSize;
+			long spillSize;
+			long spillHits;
+			long spillMisses;
+			long spillWrites;
+			std::vector<ProductStats> products;
+		};
+		void to_json(nlohmann::json&j, const StatsResult & i);
+		void from_json(const nlohmann::json& j, StatsResult & p);
+		void to_binary(BinaryWriter & w, const StatsResult & i);
+		void from_binary(BinaryReader & r, StatsResult & p);
+
+		// Several contents in a single round trip. They are all returned at once, in the same order
+		struct BatchRequest {
+			std::vector<ContentRequest> contents;
+		};
+		void to_json(nlohmann::json&j, const BatchRequest & i);
+		void from_json(const nlohmann::json& j, BatchRequest & p);
+		void to_binary(BinaryWriter & w, const BatchRequest & i);
+		void from_binary(BinaryReader & r, BatchRequest & p);
+
 		struct Request {
 			ChildPtr<ContentRequest> contentRequest;
 			ChildPtr<StreamWatchRequest> streamWatchRequest;
@@ -262,10 +458,15 @@ namespace SharedCache {
 			ChildPtr<ReleasedAnnounce> releasedAnnounce;
 			ChildPtr<StreamStartImageRequest> streamStartImageRequest;
 			ChildPtr<StreamPublishRequest> streamPublishRequest;
+			ChildPtr<StatsRequest> statsRequest;
+			ChildPtr<ProgressAnnounce> progressAnnounce;
+			ChildPtr<BatchRequest> batchRequest;
 		};
 
 		void to_json(nlohmann::json&j, const Request & i);
 		void from_json(const nlohmann::json& j, Request & p);
+		void to_binary(BinaryWriter & w, const Request & i);
+		void from_binary(BinaryReader & r, Request & p);
 
 		// Return a content key (a file).
 		// if not ready, it is up to the caller to actually produce the content
@@ -274,10 +475,32 @@ namespace SharedCache {
 			std::string filename;
 			std::string errorDetails;
 			ChildPtr<ContentRequest> actualRequest;
+			// Data descriptor with fd based storages. Received out of band (SCM_RIGHTS), not serialized
+			int fd = -1;
 		};
 
 		void to_json(nlohmann::json&j, const ContentResult & i);
 		void from_json(const nlohmann::json& j, ContentResult & p);
+		void to_binary(BinaryWriter & w, const ContentResult & i);
+		void from_binary(BinaryReader & r, ContentResult & p);
+
+		struct BatchResult {
+			std::vector<ContentResult> contents;
+		};
+		void to_json(nlohmann::json&j, const BatchResult & i);
+		void from_json(const nlohmann::json& j, BatchResult & p);
+		void to_binary(BinaryWriter & w, const BatchResult & i);
+		void from_binary(BinaryReader & r, BatchResult & p);
+
+		// Reply to a ProgressAnnounce
+		struct ProgressResult {
+			// The production is no longer wanted: the worker should give up (threaded workers can't be killed)
+			bool cancel;
+		};
+		void to_json(nlohmann::json&j, const ProgressResult & i);
+		void from_json(const nlohmann::json& j, ProgressResult & p);
+		void to_binary(BinaryWriter & w, const ProgressResult & i);
+		void from_binary(BinaryReader & r, ProgressResult & p);
 
 		struct Result {
 			ChildPtr<ContentResult> contentResult;
@@ -285,11 +508,15 @@ namespace SharedCache {
 			ChildPtr<WorkResponse> todoResult;
 			ChildPtr<StreamStartImageResult> streamStartImageResult;
 			ChildPtr<StreamPublishResult> streamPublishResult;
-
+			ChildPtr<StatsResult> statsResult;
+			ChildPtr<BatchResult> batchResult;
+			ChildPtr<ProgressResult> progressResult;
 		};
 
 		void to_json(nlohmann::json&j, const Result & i);
 		void from_json(const nlohmann::json& j, Result & p);
+		void to_binary(BinaryWriter & w, const Result & i);
+		void from_binary(BinaryReader & r, Result & p);
 
 	}
 
@@ -313,9 +540,13 @@ namespace SharedCache {
 		virtual void allocate(unsigned long int size) = 0;
 		virtual void * data() = 0;
 		virtual unsigned long int size() = 0;
+		// Report production progress (0 - 1). May be ignored
+		virtual void progress(double done) {}
 	};
 
 	class Cache;
+	class LocalEntryTable;
+	struct LocalMapping;
 	class Entry : public WriteableEntry {
 		friend class Cache;
 		friend class EntryRef;
@@ -338,7 +569,14 @@ namespace SharedCache {
 
 		ChildPtr<Messages::ContentRequest> actualRequest;
 
+		// Set when the mapping is shared with other threads of the worker
+		LocalMapping * shared;
+
+		// Last progress sent to the server (progress calls are throttled)
+		std::chrono::time_point<std::chrono::steady_clock> lastProgress;
+
 		Entry(Cache * cache, const Messages::ContentResult & result);
+		Entry(Cache * cache, LocalMapping * shared);
 		Entry(Cache * cache, const Messages::WorkResponse & tobuild);
 		Entry(Cache * cache, const Messages::StreamStartImageResult & tobuild);
 		void open();
@@ -346,7 +584,9 @@ namespace SharedCache {
 		~Entry();
 
 		bool ready() const;
-		void produced();
+		// With lend (threaded workers), the entry stays mapped read-only, lent to the other threads
+		// as the content lend. It is then shared and must still be released
+		void produced(const Messages::ContentRequest * lend = nullptr);
 		SharedCache::Messages::StreamPublishResult streamPublish();
 		void failed(const std::string & str);
 		void release();
@@ -354,6 +594,8 @@ namespace SharedCache {
 		virtual void allocate(unsigned long int size);
 		virtual void * data();
 		virtual unsigned long int size();
+		// Throws a WorkerError once the server cancelled the production (threaded workers)
+		virtual void progress(double done);
 
 		bool hasError() const { return error; };
 		std::string getErrorDetails() const { return errorDetails; };
@@ -363,30 +605,66 @@ namespace SharedCache {
 		Cache * getServer() const;
 	};
 
+	// Receives the entry of an asynchronous request. The callee owns it
+	typedef std::function<void(Entry *)> EntryCallback;
+
+	// Size setting with an optional K, M or G suffix (FITS_SERVER_CACHE_SIZE, ...)
+	long parseSize(const char * str);
+
 	class Cache {
 		friend class Entry;
 		friend class SharedCacheServer;
 		std::string basePath;
 		int clientFd;
 		long maxSize;
-
-		// Wait a message and returns its size
-		int clientWaitMessage(char * buffer);
-		void clientSendMessage(const void * data, int length);
+		Wire::Format wireFormat;
+		// Shared by the threads of a threaded worker. nullptr otherwise
+		LocalEntryTable * localEntries;
+
+		// Asynchronous requests in flight, by requestId
+		uint32_t nextRequestId;
+		std::map<uint32_t, EntryCallback> asyncCallbacks;
+		// Replies to asynchronous requests, received but not yet dispatched
+		std::list<std::pair<uint32_t, Messages::Result>> asyncResults;
+
+		// Wait a message and returns its format
+		uint8_t clientWaitMessage(std::string & payload, uint32_t & requestId, std::vector<int> & fds);
+		// Decode a received message, and hand the received descriptors to its entries
+		static Messages::Result decodeResult(const std::string & payload, uint8_t format, std::vector<int> & fds);
+		void clientSendMessage(const std::string & frame);
 		Messages::Result clientSend(const Messages::Request & request);
+		// Read one message and queue it as an asynchronous result (it must not be a synchronous reply)
+		void receiveAsyncResult();
 
 		// Try to connect
 		void init();
 		bool connectExisting();
 
-		Cache(const class SharedCacheServer & parent, int fd);
-
 	public:
 		Cache();
+		// Talk to the server over an already connected socket
+		Cache(const std::string & basePath, int fd);
+		// Connect to the running server, without starting one. nullptr if none runs
+		static Cache * connectRunning();
 
 		Entry * getEntry(const Messages::ContentRequest & wanted);
+		// Entries for all the wanted contents, in the same order. Shared dependencies are produced once, first
+		std::vector<Entry *> getEntries(const std::vector<Messages::ContentRequest> & wanted);
+
+		// Send the request without waiting. Requests are served in parallel and complete in any order:
+		// callback is called from processAsync once the entry is ready. Returns the request id
+		uint32_t getEntryAsync(const Messages::ContentRequest & wanted, EntryCallback callback);
+		// Number of asynchronous requests not yet completed
+		size_t pendingAsync() const { return asyncCallbacks.size(); }
+		// Dispatch the completed asynchronous requests, waiting up to timeout ms (-1: forever) for one.
+		// Returns false on timeout
+		bool processAsync(int timeout = -1);
+		// For use in a poll loop: readable when asynchronous replies arrive. Replies received during a
+		// synchronous call are queued without making it readable; processAsync(0) dispatches them
+		int getFd() const { return clientFd; }
 		Entry * startStreamImage();
 		bool waitStreamFrame(const std::string streamId, long serial, int timeout, bool & dead);
+		Messages::StatsResult getStats();
 
 		static void setSockAddr(const std::string basePath, struct sockaddr_un & addr, int & len);
 	};
@@ -13,9 +13,11 @@
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <stdint.h>
+#include <limits.h>
+#include <string.h>
 #include <signal.h>
 #include <assert.h>
 #include <iostream>
@@ -23,16 +25,29 @@
 #include <iomanip>
 #include <dirent.h>
 
+#include <algorithm>
 #include <chrono>
+#include <thread>
+#include <unordered_set>
 
 #include "SharedCacheServer.h"
 #include "SharedCacheServerClient.h"
 #include "Stream.h"
+#include "CacheIndex.h"
+#include "CacheStorage.h"
+#include "SpillCache.h"
+#include "Trace.h"
+#include "LocalEntryTable.h"
+#include "WorkerZygote.h"
 #include "uuid.h"
+#include "fitsio.h"
 
 namespace SharedCache {
 
 static long nowCpt = 0;
+// Waiting time that raises a consumer by one priority class
+static const long PRIORITY_AGING_MS = 5000;
+
 long now()
 {
 	return nowCpt++;
@@ -71,19 +86,53 @@ void ClientFifo::remove(Client * c) {
 
 Client::~Client()
 {
+	while(!pipelined.empty()) {
+		pipelined.front()->destroy();
+	}
+	if (connection != nullptr) {
+		connection->pipelined.remove(this);
+		connection = nullptr;
+	}
 	if (this->fd != -1) {
+		if (server->epollFd != -1) {
+			// Workers may hold a copy of the fd; make sure it leaves the epoll set now
+			epoll_ctl(server->epollFd, EPOLL_CTL_DEL, this->fd, nullptr);
+		}
 		::close(this->fd);
 		this->fd = -1;
 	}
 	delete(activeRequest);
 	activeRequest = nullptr;
 
+	for(auto it = writeFds.begin(); it != writeFds.end(); ++it) {
+		for(auto fd = it->second.begin(); fd != it->second.end(); ++fd) {
+			::close(*fd);
+		}
+	}
+	writeFds.clear();
+
+	// Entries of a threaded worker are shared by its threads: another thread will release them
+	Client * sibling = nullptr;
+	if (worker && server->workerThreads > 1) {
+		for(auto it = server->clients.begin(); it != server->clients.end(); ++it) {
+			if (*it != this && (*it)->worker && (*it)->workerPid == workerPid) {
+				sibling = *it;
+				break;
+			}
+		}
+	}
+	if (sibling != nullptr) {
+		sibling->reading.splice(sibling->reading.end(), reading);
+	}
 	for(auto it = reading.begin(); it != reading.end(); ++it)
 	{
 		(*it)->removeReader();
 	}
 	reading.clear();
 
+	if (worker && !producing.empty()) {
+		server->producingWorkerCount--;
+	}
 	producing.clear();
 
 	if (worker && isWaitingConsumer()) {
@@ -92,6 +141,8 @@ Client::~Client()
 	server->waitingWorkers.remove(this);
 	server->waitingConsumers.remove(this);
 	server->streamWatchers.remove(this);
+	server->pendingIoClients.remove(this);
+	server->producingWorkers.remove(this);
 	if (worker) {
 		server->startedWorkerCount--;
 		worker = false;
@@ -99,17 +150,20 @@ Client::~Client()
 
 	server->clients.erase(this);
 
-	free(readBuffer);
-	free(writeBuffer);
-	if (watcherExpiry != nullptr) {
-		delete watcherExpiry;
-	}
+	server->watcherDeadlines.disarm(&watcherExpiry);
+	clearCancelDeadline();
 
 	if (this->producedStream != nullptr) {
 		this->producedStream->producerDead();
 	}
 }
 
+void Client::cancel()
+{
+	std::cerr << "Cancelling production of client " << this->identifier() << "\n";
+	cancelled = true;
+}
+
 void Client::kill()
 {
 	if (killed) {
@@ -125,16 +179,126 @@ SharedCacheServer::SharedCacheServer(const std::string & path, long maxSize):
 			maxSize(maxSize),
 			waitingWorkers(&Client::isWaitingWorker, &Client::setWaitingWorker),
 			waitingConsumers(&Client::isWaitingConsumer, &Client::setWaitingConsumer),
-			streamWatchers(&Client::isStreamWatcher, &Client::setStreamWatcher)
+			streamWatchers(&Client::isStreamWatcher, &Client::setStreamWatcher),
+			pendingIoClients(&Client::isPendingIo, &Client::setPendingIo),
+			producingWorkers(&Client::isProducingWorker, &Client::setProducingWorker)
 {
 	serverFd = -1;
+	epollFd = -1;
 	fileGenerator = 0;
 	startedWorkerCount = 0;
 	waitingContentWorkerCount = 0;
+	producingWorkerCount = 0;
+	maxActiveWorkers = getMaxActiveWorkers();
+	workerThreads = getWorkerThreads();
+	cancelGraceMs = getCancelGraceMs();
+	cancelFinishRatio = getCancelFinishRatio();
+	useZygote = WorkerZygote::enabled();
+	zygote = nullptr;
+	workerSpawns = 0;
+	workerSpawnTime = 0;
+	firstProductions = 0;
+	firstProductionTime = 0;
+	evictionPolicy = getEvictionPolicy();
+	evictionInflation = 0;
+	index = nullptr;
+	storage = CacheStorage::build(basePath);
+	spill = nullptr;
+	obsoleteCount = 0;
 	currentSize = 0;
+	reservedSize = 0;
+	for(int i = 0; i < Messages::ProductTypeCount; ++i) {
+		productStats[i].product = Messages::productTypeName(i);
+	}
+}
+
+bool SharedCacheServer::getPersistent()
+{
+	const char * env = getenv("FITS_SERVER_CACHE_PERSIST");
+	return env != nullptr && env[0] && strcmp(env, "0");
+}
+
+SharedCacheServer::EvictionPolicy SharedCacheServer::getEvictionPolicy()
+{
+	const char * env = getenv("FITS_SERVER_CACHE_POLICY");
+	if (env == nullptr || !strcmp(env, "gds")) {
+		return GreedyDualSize;
+	}
+	if (!strcmp(env, "lru")) {
+		return LeastRecentlyUsed;
+	}
+	throw std::runtime_error("invalid cache policy: " + std::string(env));
+}
+
+long SharedCacheServer::getMaxActiveWorkers()
+{
+	const char * env = getenv("FITS_SERVER_MAX_ACTIVE_WORKERS");
+	long result;
+	if (env != nullptr) {
+		result = atol(env);
+		if (result < 1) {
+			throw std::runtime_error("invalid max active workers: " + std::string(env));
+		}
+	} else {
+		result = sysconf(_SC_NPROCESSORS_ONLN);
+		if (result < 1) {
+			result = 1;
+		}
+	}
+	return result;
+}
+
+long SharedCacheServer::getCancelGraceMs()
+{
+	const char * env = getenv("FITS_SERVER_CANCEL_GRACE_MS");
+	if (env == nullptr) {
+		return 1000;
+	}
+	long result = atol(env);
+	if (result < 0) {
+		throw std::runtime_error("invalid cancel grace: " + std::string(env));
+	}
+	return result;
+}
+
+double SharedCacheServer::getCancelFinishRatio()
+{
+	const char * env = getenv("FITS_SERVER_CANCEL_FINISH_PERCENT");
+	if (env == nullptr) {
+		return 0.5;
+	}
+	long result = atol(env);
+	if (result < 0) {
+		throw std::runtime_error("invalid cancel finish percent: " + std::string(env));
+	}
+	// Above 100: never spare a production
+	return result / 100.0;
+}
+
+int SharedCacheServer::getWorkerThreads()
+{
+	const char * env = getenv("FITS_SERVER_WORKER_THREADS");
+	if (env == nullptr) {
+		return 1;
+	}
+	int result = atoi(env);
+	if (result < 1) {
+		throw std::runtime_error("invalid worker threads: " + std::string(env));
+	}
+	if (result > 1 && !fits_is_reentrant()) {
+		std::cerr << "cfitsio is not reentrant; ignoring FITS_SERVER_WORKER_THREADS\n";
+		return 1;
+	}
+	return result;
 }
 
 SharedCacheServer::~SharedCacheServer() {
+	// Forked workers share the epoll instance with the server: never touch it from there
+	if (epollFd != -1) {
+		close(epollFd);
+		epollFd = -1;
+	}
+
 	for(auto it = clients.begin(); it != clients.end();)
 	{
 		Client * c = *(it++);
@@ -146,27 +310,55 @@ SharedCacheServer::~SharedCacheServer() {
 		CacheFileDesc* item = (it++)->second;
 		delete(item);
 	}
+
+	delete(index);
+	index = nullptr;
+
+	delete(zygote);
+	zygote = nullptr;
+
+	delete(spill);
+	spill = nullptr;
+
+	delete(storage);
+	storage = nullptr;
 }
 
 
 std::string SharedCacheServer::newFilename() {
 	std::string result;
-	int fd;
 	do {
 		std::ostringstream oss;
 		oss << "data" << std::setfill('0') << std::setw(12) << (fileGenerator++);
 		result = oss.str();
-		std::string path = basePath + result;
-		fd = open(path.c_str(), O_CREAT | O_EXCL, 0600);
-		if (fd == -1 && errno != EEXIST) {
-			perror(path.c_str());
-			throw std::runtime_error("Failed to create data file");
-		}
-	} while(fd == -1);
-	close(fd);
+	} while(!storage->create(result));
 	return result;
 }
 
+void SharedCacheServer::dataFds(const Messages::Result & result, std::vector<int> & into) const
+{
+	if (result.contentResult && !result.contentResult->error) {
+		into.push_back(storage->readFd(result.contentResult->filename));
+	}
+	if (result.batchResult) {
+		for(auto it = result.batchResult->contents.begin(); it != result.batchResult->contents.end(); ++it) {
+			if (!it->error) {
+				into.push_back(storage->readFd(it->filename));
+			}
+		}
+	}
+	if (result.todoResult) {
+		into.push_back(storage->fd(result.todoResult->filename));
+	}
+	if (result.streamStartImageResult) {
+		into.push_back(storage->fd(result.streamStartImageResult->filename));
+	}
+	// Storage without descriptors
+	if (!into.empty() && into[0] == -1) {
+		into.clear();
+	}
+}
+
 void SharedCacheServer::init() {
 	serverFd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (serverFd < 0) {
@@ -248,27 +440,51 @@ static void handleErrno(const char * msg)
 
 void SharedCacheServer::doAccept()
 {
-	// Accept a new client
-	int fd;
-	if ((fd = accept(serverFd, 0, 0)) == -1) {
-		handleErrno("accept");
-		return;
+	// Edge triggered: accept until the backlog is empty
+	while(true) {
+		int fd;
+		if ((fd = accept4(serverFd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			handleErrno("accept");
+			return;
+		}
+
+		addClient(new Client(this, fd, -1));
 	}
+}
 
-	clients.insert(new Client(this, fd, -1));
+void SharedCacheServer::addClient(Client * c)
+{
+	clients.insert(c);
+
+	epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+		perror("epoll_ctl");
+		throw std::runtime_error("Unable to register client");
+	}
 }
 
-void SharedCacheServer::receiveMessage(Client * c, uint16_t size)
+void SharedCacheServer::receiveMessage(Client * c)
 {
-//		printf("Message from %d (%d):\n", c->fd, c->readBufferPos);
-	std::string jsonStr(c->readBuffer + 2, c->readBufferPos - 2);
-//		printf("%s\n", jsonStr.c_str());
 	c->readBufferPos = 0;
-	auto json = nlohmann::json::parse(jsonStr);
-	c->activeRequest = new Messages::Request(json.get<Messages::Request>());
+	c->wireFormat = c->readHeader.format;
+	c->activeRequestId = c->readHeader.requestId;
+	Messages::Request * request = new Messages::Request();
+	try {
+		Wire::decode(c->readBuffer.data(), c->readBuffer.size(), c->wireFormat, *request);
+	} catch(...) {
+		delete request;
+		throw;
+	}
+	c->activeRequest = request;
 
-	nlohmann::json debug = *c->activeRequest;
-	std::cerr << "Server received request from " << c->identifier() << " : " << debug.dump(0) << "\n";
+	if (c->wireFormat == Wire::Json) {
+		std::cerr << "Server received request from " << c->identifier() << " : " << c->readBuffer << "\n";
+	}
 }
 
 long SharedCacheServer::isExpiredContent(const Messages::RawContent * content) const
@@ -288,30 +504,58 @@ long SharedCacheServer::isExpiredContent(const Messages::RawContent * content) c
 	return content->serial;
 }
 
-void SharedCacheServer::upgradeContentRequest(Client * consumerClient)
+// Dependencies of a content, recursively, with their keys
+static void collectDependencyKeys(const Messages::ContentRequest & request, std::vector<ContentDependency> & into)
 {
-	std::list<Messages::RawContent*> rawContents;
+	std::list<Messages::ContentRequest> dependencies;
+	request.collectDependencies(dependencies);
+	into.clear();
+	into.resize(dependencies.size());
+	auto dependency = into.begin();
+	for(auto it = dependencies.begin(); it != dependencies.end(); ++it, ++dependency) {
+		dependency->request = *it;
+		dependency->request.traceId = request.traceId;
+		dependency->key = it->contentKey();
+		collectDependencyKeys(dependency->request, dependency->dependencies);
+	}
+}
 
-	consumerClient->activeRequest->contentRequest->collectRawContents(rawContents);
-	for(auto it = rawContents.begin(); it != rawContents.end();) {
-		auto rawContent = *it;
-		it++;
+void SharedCacheServer::updateWantedKey(Client * c, size_t i)
+{
+	c->wantedKeys[i] = c->wanted[i]->contentKey();
+	c->wantedEstimates[i] = -1;
+	collectDependencyKeys(*c->wanted[i], c->wantedDependencies[i]);
+}
 
-		if (rawContent->exactSerial) {
+void SharedCacheServer::upgradeContentRequest(Client * consumerClient)
+{
+	for(size_t i = 0; i < consumerClient->wanted.size(); ++i) {
+		if (consumerClient->served[i] != nullptr) {
 			continue;
 		}
+		std::list<Messages::RawContent*> rawContents;
 
-		long newSerial = this->isExpiredContent(rawContent);
-		if (newSerial != rawContent->serial) {
-			rawContent->serial = newSerial;
+		consumerClient->wanted[i]->collectRawContents(rawContents);
+		for(auto it = rawContents.begin(); it != rawContents.end();) {
+			auto rawContent = *it;
+			it++;
 
-			std::string identifier = consumerClient->activeRequest->contentRequest->uniqKey();
-			auto result = contentByIdentifier.find(identifier);
-			// Production started. Lock that
-			if (result != contentByIdentifier.end()) {
-				rawContent->exactSerial = true;
+			if (rawContent->exactSerial) {
 				continue;
 			}
+
+			long newSerial = this->isExpiredContent(rawContent);
+			if (newSerial != rawContent->serial) {
+				rawContent->serial = newSerial;
+
+				updateWantedKey(consumerClient, i);
+				auto result = contentByIdentifier.find(consumerClient->wantedKeys[i]);
+				// Production started. Lock that
+				if (result != contentByIdentifier.end()) {
+					rawContent->exactSerial = true;
+					continue;
+				}
+			}
 		}
 	}
 
@@ -341,10 +585,7 @@ void SharedCacheServer::killStream(Stream * stream)
 
 void SharedCacheServer::replyStreamWatcher(Client * watcher, bool expired, bool dead)
 {
-	if (watcher->watcherExpiry != nullptr) {
-		delete watcher->watcherExpiry;
-		watcher->watcherExpiry = nullptr;
-	}
+	watcherDeadlines.disarm(&watcher->watcherExpiry);
 
 	this->streamWatchers.remove(watcher);
 
@@ -379,25 +620,71 @@ void SharedCacheServer::checkAllStreamWatchersForFrame() {
 	}
 }
 
-void SharedCacheServer::checkStreamWatcherForTimeout(Client *c , const std::chrono::time_point<std::chrono::steady_clock> & now) {
-	if (c->watcherExpiry != nullptr && (*c->watcherExpiry <= now)) {
-		this->replyStreamWatcher(c, true, false);
+void SharedCacheServer::checkAllStreamWatchersForTimeout() {
+	// Only the expired ones are visited (replyStreamWatcher disarms them)
+	auto now = std::chrono::steady_clock::now();
+	while(!watcherDeadlines.empty() && watcherDeadlines.top()->when <= now) {
+		this->replyStreamWatcher(watcherDeadlines.top()->owner, true, false);
 	}
 }
 
-void SharedCacheServer::checkAllStreamWatchersForTimeout() {
-	// Dispatch the new frame to stream watchers
-	auto now = std::chrono::steady_clock::now();
-	for(auto it = streamWatchers.begin(); it != streamWatchers.end();)
-	{
-		Client * c = (*it++);
-		this->checkStreamWatcherForTimeout(c, now);
+Messages::StatsResult SharedCacheServer::getStats() const
+{
+	Messages::StatsResult r;
+	r.maxSize = maxSize;
+	r.currentSize = currentSize;
+	r.reservedSize = reservedSize;
+	r.contentCount = contentByFilename.size();
+	r.waitingConsumers = waitingConsumers.size();
+	r.waitingWorkers = waitingWorkers.size();
+	r.streamWatchers = streamWatchers.size();
+	r.startedWorkers = startedWorkerCount;
+	r.activeWorkers = activeWorkerCount();
+	r.blockedWorkers = waitingContentWorkerCount;
+	r.workerSpawns = workerSpawns;
+	r.workerSpawnTime = workerSpawnTime;
+	r.firstProductions = firstProductions;
+	r.firstProductionTime = firstProductionTime;
+	SpillCache::Stats spillStats = {};
+	if (spill != nullptr) {
+		spillStats = spill->getStats();
 	}
+	r.spillMaxSize = spillStats.maxSize;
+	r.spillSize = spillStats.size;
+	r.spillHits = spillStats.hits;
+	r.spillMisses = spillStats.misses;
+	r.spillWrites = spillStats.writes;
+	r.products.assign(productStats, productStats + Messages::ProductTypeCount);
+	return r;
 }
 
 // Either proceed directly the message, or put the client in a waiting queue
 void SharedCacheServer::proceedNewMessage(Client * c)
 {
+	if (c->activeRequestId != 0 && (c->activeRequest->contentRequest || c->activeRequest->batchRequest)) {
+		if (c->worker) {
+			throw ClientError("Workers cannot pipeline requests");
+		}
+		Client * pipelined = new Client(this, -1, -1);
+		pipelined->connection = c;
+		pipelined->wireFormat = c->wireFormat;
+		pipelined->activeRequest = c->activeRequest;
+		pipelined->activeRequestId = c->activeRequestId;
+		c->activeRequest = nullptr;
+		c->activeRequestId = 0;
+		c->pipelined.push_back(pipelined);
+		// The connection is ready for its next request
+		pendingIoClients.add(c);
+		c = pipelined;
+	}
+
+	if (c->activeRequest->statsRequest) {
+		Messages::Result result;
+		result.statsResult = new Messages::StatsResult(getStats());
+		c->reply(result);
+		return;
+	}
+
 	if (c->activeRequest->streamStartImageRequest) {
 		if (c->producedStream == nullptr) {
 			createStream(c);
@@ -437,9 +724,7 @@ void SharedCacheServer::proceedNewMessage(Client * c)
 		}
 
 		c->producing.erase(cfdLocInProducing);
-		cfd->produced = true;
-		cfd->size = c->activeRequest->streamPublishRequest->size;
-		cfd->lastUse = now();
+		cfd->prodSucceeded(c->activeRequest->streamPublishRequest->size);
 		currentSize += cfd->size;
 
 		c->producedStream->setLatest(cfd);
@@ -467,7 +752,7 @@ void SharedCacheServer::proceedNewMessage(Client * c)
 	if (c->activeRequest->streamWatchRequest) {
 		streamWatchers.add(c);
 		if (c->activeRequest->streamWatchRequest->timeout != 0) {
-			c->watcherExpiry = new std::chrono::time_point<std::chrono::steady_clock>(std::chrono::steady_clock::now() +
+			watcherDeadlines.arm(&c->watcherExpiry, std::chrono::steady_clock::now() +
 										std::chrono::milliseconds(c->activeRequest->streamWatchRequest->timeout));
 		}
 
@@ -475,19 +760,56 @@ void SharedCacheServer::proceedNewMessage(Client * c)
 		return;
 	}
 
-	if (c->activeRequest->contentRequest) {
+	if (c->activeRequest->contentRequest || c->activeRequest->batchRequest) {
+		if (c->activeRequest->contentRequest) {
+			c->wanted.push_back(&(*c->activeRequest->contentRequest));
+		} else {
+			auto & contents = c->activeRequest->batchRequest->contents;
+			if (contents.empty()) {
+				throw ClientError("Empty batch request");
+			}
+			for(auto it = contents.begin(); it != contents.end(); ++it) {
+				c->wanted.push_back(&(*it));
+			}
+		}
+		c->wantedKeys.resize(c->wanted.size());
+		c->wantedDependencies.resize(c->wanted.size());
+		c->wantedEstimates.resize(c->wanted.size());
+		for(size_t i = 0; i < c->wanted.size(); ++i) {
+			checkSources(c->wanted[i]);
+			updateWantedKey(c, i);
+		}
+		c->served.assign(c->wanted.size(), nullptr);
+
 		// Ici: upgrader les requetes à l'entrée
 		waitingConsumers.add(c);
 		if (c->worker) {
 			waitingContentWorkerCount++;
 		}
+		c->waitingSince = std::chrono::steady_clock::now();
 		this->upgradeContentRequest(c);
+
+		for(size_t i = 0; i < c->wanted.size(); ++i) {
+			Messages::ProductStats & stats = productStats[c->wanted[i]->productType()];
+			if (contentByIdentifier.find(c->wantedKeys[i]) != contentByIdentifier.end()) {
+				stats.hits++;
+			} else {
+				stats.misses++;
+			}
+		}
 		return;
 	}
 	if (c->activeRequest->workRequest) {
 		if (c->workerPid == -1) {
 			throw new std::runtime_error("Client is not a worker");
 		}
+		if (c->spawning) {
+			c->spawning = false;
+			long spawnTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - c->spawnedAt).count();
+			workerSpawns++;
+			workerSpawnTime += spawnTime;
+			std::cerr << "Worker " << c->identifier() << " ready in " << spawnTime << "us\n";
+		}
 		waitingWorkers.add(c);
 		return;
 	}
@@ -508,14 +830,37 @@ void SharedCacheServer::proceedNewMessage(Client * c)
 		}
 
 		c->producing.erase(cfdLocInProducing);
-		if (c->activeRequest->finishedAnnounce->error) {
+		if (c->worker && c->producing.empty()) {
+			producingWorkerCount--;
+			producingWorkers.remove(c);
+			c->clearCancelDeadline();
+		}
+		Trace::complete(Messages::productTypeName(cfd->productType), "production", Trace::at(cfd->prodStart), Trace::now(), cfd->traceId);
+		if (c->activeRequest->finishedAnnounce->error && c->cancelled) {
+			// Gave up on cancel: not an error of the content
+			cfd->prodAborted();
+		} else if (c->activeRequest->finishedAnnounce->error) {
 			cfd->prodFailed(c->activeRequest->finishedAnnounce->errorDetails);
+			productStats[cfd->productType].failures++;
 		} else {
-			cfd->produced = true;
-			cfd->size = c->activeRequest->finishedAnnounce->size;
-			cfd->lastUse = now();
+			cfd->prodSucceeded(c->activeRequest->finishedAnnounce->size);
 			currentSize += cfd->size;
+			if (c->activeRequest->finishedAnnounce->keep) {
+				cfd->addReader();
+				c->reading.push_back(cfd);
+			}
+			productStats[cfd->productType].productions++;
+			productStats[cfd->productType].productionTime += cfd->prodDuration;
+			if (c->firstProduction) {
+				firstProductions++;
+				firstProductionTime += cfd->prodDuration;
+			}
+			if (index != nullptr) {
+				persist(cfd);
+			}
 		}
+		c->firstProduction = false;
+		c->cancelled = false;
 		Messages::Result result;
 		c->reply(result);
 		if (c->killed) {
@@ -523,6 +868,23 @@ void SharedCacheServer::proceedNewMessage(Client * c)
 		}
 		return;
 	}
+	if (c->activeRequest->progressAnnounce) {
+		std::string filename = c->activeRequest->progressAnnounce->filename;
+		auto cfdLoc = contentByFilename.find(filename);
+		if (cfdLoc == contentByFilename.end()) {
+			throw ClientError("Progress of unknown file rejected");
+		}
+		CacheFileDesc * cfd = cfdLoc->second;
+		if (std::find(c->producing.begin(), c->producing.end(), cfd) == c->producing.end()) {
+			throw ClientError("Progress for not producing rejected");
+		}
+		cfd->progress = c->activeRequest->progressAnnounce->progress;
+		Messages::Result result;
+		result.progressResult.build();
+		result.progressResult->cancel = c->cancelled;
+		c->reply(result);
+		return;
+	}
 	if (c->activeRequest->releasedAnnounce) {
 		std::string filename = c->activeRequest->releasedAnnounce->filename;
 		auto cfdLoc = contentByFilename.find(filename);
@@ -533,12 +895,26 @@ void SharedCacheServer::proceedNewMessage(Client * c)
 		if (!cfd->produced) {
 			throw ClientError("Release of not produced rejected");
 		}
-		auto cfdLocInProducing = std::find(c->reading.begin(), c->reading.end(), cfd);
-		if (cfdLocInProducing == c->reading.end()) {
+		// Threads of a worker process share their entries. Any of them may release it
+		Client * reader = nullptr;
+		if (std::find(c->reading.begin(), c->reading.end(), cfd) != c->reading.end()) {
+			reader = c;
+		} else if (c->worker && workerThreads > 1) {
+			for(auto it = clients.begin(); it != clients.end(); ++it) {
+				Client * sibling = *it;
+				if (sibling->worker && sibling->workerPid == c->workerPid
+					&& std::find(sibling->reading.begin(), sibling->reading.end(), cfd) != sibling->reading.end())
+				{
+					reader = sibling;
+					break;
+				}
+			}
+		}
+		if (reader == nullptr) {
 			throw ClientError("Release for not read rejected");
 		}
 
-		c->reading.erase(cfdLocInProducing);
+		reader->reading.erase(std::find(reader->reading.begin(), reader->reading.end(), cfd));
 		cfd->clientCount--;
 		Messages::Result result;
 		c->reply(result);
@@ -550,44 +926,183 @@ void SharedCacheServer::proceedNewMessage(Client * c)
 
 
 class SharedCacheServer::RequirementEvaluator {
+	struct Requirement {
+		Messages::ContentRequest request;
+		ContentKey key;
+		int priority;
+		// Dependencies, all available. Held by the production until it ends
+		std::vector<ContentKey> inputs;
+		// Size to reserve when started
+		long estimate;
+	};
+
 	SharedCacheServer * server;
 
-	std::set<std::string> dedup;
-	std::list<std::pair<Messages::ContentRequest, std::string>> requirements;
+	std::list<Requirement> requirements;
+	// Requirements already handled by startFirst. Kept so that dedup iterators remain valid
+	std::list<Requirement> started;
+	std::unordered_map<ContentKey, std::list<Requirement>::iterator, ContentKeyHash> dedup;
+	// Inputs of the requirements. Must not be evicted before they get started
+	std::unordered_set<ContentKey, ContentKeyHash> inputs;
+	bool sorted;
 
+	static bool compare_priority(const Requirement & a, const Requirement & b) {
+		return a.priority < b.priority;
+	}
 public:
-	RequirementEvaluator(SharedCacheServer * server) : server(server) {}
-
-	void markAsRequired(const Messages::ContentRequest & r, const std::string & key) {
-		if (!dedup.insert(key).second) {
+	RequirementEvaluator(SharedCacheServer * server) : server(server), sorted(true) {}
+
+	// Requirements are started by priority, then in the order they were marked.
+	// estimate is the size cache of the consumer, filled on first use (nullptr for running productions)
+	void markAsRequired(const Messages::ContentRequest & r, const ContentKey & key, int priority, const std::vector<ContentKey> & requirementInputs, long * estimate) {
+		inputs.insert(requirementInputs.begin(), requirementInputs.end());
+		auto existing = dedup.find(key);
+		if (existing != dedup.end()) {
+			if (priority < existing->second->priority) {
+				existing->second->priority = priority;
+				sorted = false;
+			}
 			return;
 		}
-		requirements.push_back(std::pair<Messages::ContentRequest, std::string>(r, key));
+		Requirement requirement;
+		requirement.request = r;
+		requirement.key = key;
+		requirement.priority = priority;
+		requirement.inputs = requirementInputs;
+		if (estimate != nullptr && *estimate == -1) {
+			*estimate = r.estimateSize();
+		}
+		requirement.estimate = estimate != nullptr ? *estimate : 0;
+		requirements.push_back(requirement);
+		dedup[key] = std::prev(requirements.end());
+		sorted = false;
 	}
 
 	bool required(const CacheFileDesc * cfd)
 	{
-		return (dedup.find(cfd->identifier) != dedup.end());
+		return (dedup.find(cfd->identifier) != dedup.end()) || (inputs.find(cfd->identifier) != inputs.end());
 	}
 
-	std::pair<CacheFileDesc *, Messages::ContentRequest> startFirst() {
+	// Next requirement that startFirst would start (nullptr if none), with its estimated size
+	const Messages::ContentRequest * peekFirst(long * estimate = nullptr) {
+		if (!sorted) {
+			// stable
+			requirements.sort(compare_priority);
+			sorted = true;
+		}
 		while (!requirements.empty()) {
-			std::pair<Messages::ContentRequest, std::string> r = requirements.front();
-			requirements.pop_front();
-			auto exists = server->contentByIdentifier.find(r.second);
+			Requirement & r = requirements.front();
+			auto exists = server->contentByIdentifier.find(r.key);
 			if (exists != server->contentByIdentifier.end()) {
 				// Already producing. Ingore.
+				started.splice(started.end(), requirements, requirements.begin());
 				continue;
 			}
-			return
-					std::pair<CacheFileDesc *, Messages::ContentRequest>(
-						new CacheFileDesc(server, r.second, server->newFilename()),
-						r.first);
+			if (estimate != nullptr) {
+				*estimate = r.estimate;
+			}
+			return &r.request;
+		}
+		return nullptr;
+	}
+
+	std::pair<CacheFileDesc *, Messages::ContentRequest> startFirst() {
+		if (peekFirst() == nullptr) {
+			return std::pair<CacheFileDesc *, Messages::ContentRequest>(nullptr, Messages::ContentRequest());
+		}
+		Requirement & r = requirements.front();
+		started.splice(started.end(), requirements, requirements.begin());
+		CacheFileDesc * cfd = new CacheFileDesc(server, r.key, server->newFilename());
+		cfd->setSources(r.request);
+		cfd->priority = r.priority;
+		cfd->productType = r.request.productType();
+		cfd->traceId = r.request.traceId;
+		for(auto it = r.inputs.begin(); it != r.inputs.end(); ++it) {
+			auto input = server->contentByIdentifier.find(*it);
+			if (input != server->contentByIdentifier.end()) {
+				cfd->holdInput(input->second);
+			}
 		}
-		return std::pair<CacheFileDesc *, Messages::ContentRequest>(nullptr, Messages::ContentRequest());
+		return std::pair<CacheFileDesc *, Messages::ContentRequest>(cfd, r.request);
 	}
 };
 
+int SharedCacheServer::consumerPriority(Client * c, const Messages::ContentRequest & wanted, const std::chrono::time_point<std::chrono::steady_clock> & now) const
+{
+	int priority = wanted.priority;
+	// A worker waiting for a dependency runs at the priority of its production
+	for(auto it = c->producing.begin(); it != c->producing.end(); ++it) {
+		priority = std::min(priority, (*it)->priority);
+	}
+	// Aging: go up one class for every PRIORITY_AGING_MS spent waiting
+	long waited = std::chrono::duration_cast<std::chrono::milliseconds>(now - c->waitingSince).count();
+	priority -= waited / PRIORITY_AGING_MS;
+	return std::max(priority, (int)Messages::PriorityInteractive);
+}
+
+bool SharedCacheServer::requireWantedContents(Client * c, RequirementEvaluator & evaluator, const std::chrono::time_point<std::chrono::steady_clock> & now)
+{
+	std::vector<size_t> missing;
+	for(size_t i = 0; i < c->wanted.size(); ++i) {
+		if (c->served[i] != nullptr) {
+			continue;
+		}
+		auto result = contentByIdentifier.find(c->wantedKeys[i]);
+		if (result == contentByIdentifier.end() || ((!result->second->produced) && (!result->second->error))) {
+			missing.push_back(i);
+			continue;
+		}
+		// Keep it while the others are produced
+		CacheFileDesc * entry = result->second;
+		entry->addReader();
+		c->reading.push_back(entry);
+		c->served[i] = entry;
+	}
+	if (missing.empty()) {
+		return true;
+	}
+
+	for(size_t m = 0; m < missing.size(); ++m) {
+		size_t i = missing[m];
+		requireContent(*c->wanted[i], c->wantedKeys[i], c->wantedEstimates[i], c->wantedDependencies[i], consumerPriority(c, *c->wanted[i], now), evaluator);
+	}
+	return false;
+}
+
+bool SharedCacheServer::requireContent(const Messages::ContentRequest & request, const ContentKey & key, long & estimate, std::vector<ContentDependency> & dependencies, int priority, RequirementEvaluator & evaluator)
+{
+	auto result = contentByIdentifier.find(key);
+	if (result != contentByIdentifier.end()) {
+		CacheFileDesc * entry = result->second;
+		if (entry->produced || entry->error) {
+			return true;
+		}
+		if (priority < entry->priority) {
+			// Raise the running production, so that its dependencies follow
+			entry->priority = priority;
+		}
+		// Still wanted: don't cancel it
+		evaluator.markAsRequired(request, key, priority, std::vector<ContentKey>(), nullptr);
+		return false;
+	}
+
+	// Leaves first: a production is only handed out once its inputs are there.
+	// Otherwise its worker would just sit waiting for them
+	std::vector<ContentKey> inputs;
+	bool ready = true;
+	for(auto it = dependencies.begin(); it != dependencies.end(); ++it) {
+		if (requireContent(it->request, it->key, it->estimate, it->dependencies, priority, evaluator)) {
+			inputs.push_back(it->key);
+		} else {
+			ready = false;
+		}
+	}
+	if (ready) {
+		evaluator.markAsRequired(request, key, priority, inputs, &estimate);
+	}
+	return false;
+}
+
 void SharedCacheServer::workerLogic(Cache * cache)
 {
 	while(true) {
@@ -601,9 +1116,15 @@ void SharedCacheServer::workerLogic(Cache * cache)
 
 		// FIXME: report errors
 		try {
-			work.todoResult->content->produce(entry);
+			Trace::Context context(work.todoResult->content->traceId);
+			Trace::Span span(Messages::productTypeName(work.todoResult->content->productType()), "worker");
+			// Fall back to a real production if the spilled copy vanished
+			if (work.todoResult->spilled.empty() || !SpillCache::restore(work.todoResult->spilled, entry)) {
+				work.todoResult->content->produce(entry);
+			}
 
-			entry->produced();
+			bool lend = cache->localEntries != nullptr && LocalEntryTable::shareable(*work.todoResult->content);
+			entry->produced(lend ? &*work.todoResult->content : nullptr);
 		} catch(const WorkerError & e) {
 			std::cerr << "Worker produce failed with WorkerError: "<< e.what() << "\n";
 			entry->failed(e.what());
@@ -612,10 +1133,46 @@ void SharedCacheServer::workerLogic(Cache * cache)
 			entry->failed(std::string("internal error:") + e.what());
 			_exit(255);
 		}
+		if (entry->shared != nullptr) {
+			// Dependents of the production usually come next, on a thread of this worker: keep it for them
+			LocalMapping * dropped = cache->localEntries->keep(entry->shared);
+			entry->shared = nullptr;
+			entry->mmapped = nullptr;
+			entry->wasMmapped = false;
+			entry->released = true;
+			if (dropped != nullptr) {
+				// Hand the reference of the table to an entry, and release it
+				Entry * old = new Entry(cache, dropped);
+				old->release();
+				delete(old);
+			}
+		}
 		delete(entry);
 	}
 }
 
+void SharedCacheServer::threadedWorkerLogic(std::vector<Cache *> caches)
+{
+	// Keep the last production of each thread for its dependents
+	LocalEntryTable * localEntries = new LocalEntryTable(caches.size());
+	std::vector<std::thread> threads;
+	for(auto it = caches.begin(); it != caches.end(); ++it) {
+		Cache * cache = *it;
+		cache->localEntries = localEntries;
+		threads.push_back(std::thread([cache]() {
+			try {
+				workerLogic(cache);
+			} catch(const std::exception& e) {
+				// The server dropped this thread (too many idle workers). Others keep running
+				std::cerr << "Worker thread of #" << getpid() << " ended: " << e.what() << "\n";
+			}
+		}));
+	}
+	for(auto it = threads.begin(); it != threads.end(); ++it) {
+		it->join();
+	}
+}
+
 void Messages::ContentRequest::produce(Entry * entry)
 {
 	if (this->fitsContent) {
@@ -638,14 +1195,75 @@ void Messages::ContentRequest::produce(Entry * entry)
 
 		return;
 	}
+	if (this->fitsHeader) {
+		this->fitsHeader->produce(entry);
+		return;
+	}
 	throw WorkerError("Invalid ContentRequest");
 
 }
 
+long Messages::ContentRequest::estimateSize() const
+{
+	if (this->fitsContent) {
+		return this->fitsContent->estimateSize();
+	}
+	if (this->histogram) {
+		return this->histogram->estimateSize();
+	}
+	if (this->starField) {
+		return this->starField->estimateSize();
+	}
+	if (this->astrometry) {
+		return this->astrometry->estimateSize();
+	}
+	if (this->fitsHeader) {
+		return this->fitsHeader->estimateSize();
+	}
+	return 0;
+}
+
+Messages::ProductType Messages::ContentRequest::productType() const
+{
+	if (this->histogram) {
+		return ProductHistogram;
+	}
+	if (this->starField) {
+		return ProductStarField;
+	}
+	if (this->astrometry) {
+		return ProductAstrometry;
+	}
+	if (this->fitsHeader) {
+		return ProductFitsHeader;
+	}
+	return ProductRawContent;
+}
+
+const char * Messages::productTypeName(int productType)
+{
+	switch(productType) {
+		case ProductRawContent:
+			return "fitsContent";
+		case ProductHistogram:
+			return "histogram";
+		case ProductStarField:
+			return "starField";
+		case ProductAstrometry:
+			return "astrometry";
+		case ProductFitsHeader:
+			return "fitsHeader";
+	}
+	return "unknown";
+}
+
 bool Messages::ContentRequest::asJsonResult(Entry * e, nlohmann::json & j, const nlohmann::json & options) const {
 	if (histogram) {
 		return histogram->asJsonResult(e, j, options);
 	}
+	if (fitsHeader) {
+		return fitsHeader->asJsonResult(e, j, options);
+	}
 	return false;
 }
 
@@ -664,6 +1282,11 @@ void Messages::Histogram::collectRawContents(std::list<Messages::RawContent*> &
 	into.push_back(&this->source);
 }
 
+void Messages::FitsHeader::collectRawContents(std::list<Messages::RawContent*> & into)
+{
+	into.push_back(&this->source);
+}
+
 void Messages::ContentRequest::collectRawContents(std::list<Messages::RawContent*> & into)
 {
 	if (this->fitsContent) {
@@ -678,53 +1301,132 @@ void Messages::ContentRequest::collectRawContents(std::list<Messages::RawContent
 	if (this->astrometry) {
 		this->astrometry->collectRawContents(into);
 	}
+	if (this->fitsHeader) {
+		this->fitsHeader->collectRawContents(into);
+	}
 }
 
-std::string Messages::ContentRequest::uniqKey()
+void Messages::Histogram::collectDependencies(std::list<Messages::ContentRequest> & into) const
 {
-	std::list<RawContent *> rawContents;
-	collectRawContents(rawContents);
-	for(auto it = rawContents.begin(); it != rawContents.end();)
-	{
-		auto v = *it;
-		if (v->exactSerial) {
-			v->exactSerial = false;
-			it++;
-		} else {
-			it = rawContents.erase(it);
-		}
-	}
+	into.emplace_back();
+	into.back().fitsContent = new RawContent(this->source);
+}
 
-	nlohmann::json debug = *this;
+void Messages::StarField::collectDependencies(std::list<Messages::ContentRequest> & into) const
+{
+	into.emplace_back();
+	into.back().fitsContent = new RawContent(this->source);
+	into.emplace_back();
+	into.back().histogram.build();
+	into.back().histogram->source = this->source;
+}
 
-	for(auto it = rawContents.begin(); it != rawContents.end();)
-	{
-		auto v = *(it++);
-		v->exactSerial = true;
+void Messages::FitsHeader::collectDependencies(std::list<Messages::ContentRequest> & into) const
+{
+	// Files are read directly
+	if (this->source.path.empty()) {
+		into.emplace_back();
+		into.back().fitsContent = new RawContent(this->source);
 	}
-
-	return debug.dump(0);
 }
 
+void Messages::Astrometry::collectDependencies(std::list<Messages::ContentRequest> & into) const
+{
+	into.emplace_back();
+	into.back().starField = new StarField(this->source);
+}
 
-void SharedCacheServer::startWorker()
+void Messages::ContentRequest::collectDependencies(std::list<Messages::ContentRequest> & into) const
 {
-	// FIXME: close all sockets...
-	int fd[2];
-	if (socketpair(PF_LOCAL, SOCK_STREAM, 0, fd) == -1) {
-		perror("socketpair");
-		throw std::runtime_error("failed to create socket pair");
+	if (this->histogram) {
+		this->histogram->collectDependencies(into);
 	}
-	int on = 1;
-	if (ioctl(fd[0], FIONBIO, (char *)&on) == -1)
-	{
-		perror("ioctl");
-		close(fd[0]);
-		close(fd[1]);
-		throw std::runtime_error("Unable to setup socket");
+	if (this->starField) {
+		this->starField->collectDependencies(into);
+	}
+	if (this->astrometry) {
+		this->astrometry->collectDependencies(into);
+	}
+	if (this->fitsHeader) {
+		this->fitsHeader->collectDependencies(into);
 	}
+}
 
-	// prevent process from vanishing between for/setpgid
+ContentKey Messages::ContentRequest::contentKey() const
+{
+	ContentRequest copy(*this);
+	copy.priority = PriorityNormal;
+	copy.traceId.clear();
+	std::list<RawContent *> rawContents;
+	copy.collectRawContents(rawContents);
+	for(auto it = rawContents.begin(); it != rawContents.end(); ++it)
+	{
+		(*it)->exactSerial = false;
+	}
+
+	nlohmann::json j = copy;
+	return ContentKey(j.dump(0));
+}
+
+
+void SharedCacheServer::workerMain(const std::string & basePath, const std::vector<int> & fds)
+{
+	try {
+		std::vector<Cache *> clientCaches;
+		for(auto it = fds.begin(); it != fds.end(); ++it) {
+			clientCaches.push_back(new Cache(basePath, *it));
+		}
+
+		// restore child process handling to default
+		signal(SIGCHLD, SIG_DFL);
+		Trace::setProcessName("fits-server worker");
+
+		if (clientCaches.size() == 1) {
+			workerLogic(clientCaches[0]);
+		} else {
+			threadedWorkerLogic(clientCaches);
+		}
+	}catch(const std::exception& e) {
+		std::cerr << "Worker #" << getpid() << " dead: " << e.what() << "\n";
+		_exit(255);
+	}catch(...) {
+		std::cerr << "Worker #" << getpid() << " with exception\n";
+		_exit(255);
+	}
+	std::cerr << "Worker dead\n";
+	_exit(0);
+}
+
+void SharedCacheServer::startZygote()
+{
+	int fd[2];
+	if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, fd) == -1) {
+		perror("socketpair");
+		return;
+	}
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close(fd[0]);
+		close(fd[1]);
+		return;
+	}
+	if (pid == 0) {
+		close(fd[0]);
+		close(serverFd);
+		std::string path = basePath;
+		// free all server
+		delete(this);
+		WorkerZygote::run(fd[1], path, &SharedCacheServer::workerMain);
+	}
+	close(fd[1]);
+	zygote = new WorkerZygote(fd[0], pid);
+	std::cerr << "Worker zygote started: #" << pid << "\n";
+}
+
+pid_t SharedCacheServer::forkWorker(const std::vector<int> & serverFds, const std::vector<int> & workerFds)
+{
+	// prevent process from vanishing between for/setpgid
 	signal(SIGCHLD, SIG_DFL);
 
 	pid_t pid = fork();
@@ -734,33 +1436,21 @@ void SharedCacheServer::startWorker()
 	}
 	if (pid == 0) {
 
-		close(fd[0]); /* Close the parent file descriptor */
+		/* Close the parent file descriptors */
+		for(auto it = serverFds.begin(); it != serverFds.end(); ++it) {
+			close(*it);
+		}
 
 		/* Go in own process group */
 		if (setpgid(0, 0) == -1) {
 			perror("child setpgid");
 		}
 		// FIXME: close all but fd[1]...
-		try {
-			Cache * clientCache = new Cache(*this, fd[1]);
-			// free all server
-			delete(this);
-
-			// restore child process handling to default
-			signal(SIGCHLD, SIG_DFL);
-
-			workerLogic(clientCache);
-		}catch(const std::exception& e) {
-			std::cerr << "Worker #" << getpid() << " dead: " << e.what() << "\n";
-			_exit(255);
-		}catch(...) {
-			std::cerr << "Worker #" << getpid() << " with exception\n";
-			_exit(255);
-		}
-		std::cerr << "Worker dead\n";
-		_exit(0);
+		std::string path = basePath;
+		// free all server
+		delete(this);
+		workerMain(path, workerFds);
 	}
-	close(fd[1]);
 	/* Put in its own process group (race with setpgid above) */
 	if (setpgid(pid, pid) == -1) {
 		perror("parent setpgid");
@@ -783,12 +1473,63 @@ void SharedCacheServer::startWorker()
 		perror("waitpid");
 		break;
 	}
+	return pid;
+}
 
-	Client * worker = new Client(this, fd[0], pid);
-	worker->worker = true;
-	clients.insert(worker);
-	std::cerr << "New worker started: "<<  worker->identifier() << "\n";
-	startedWorkerCount ++;
+void SharedCacheServer::startWorker()
+{
+	auto spawnStart = std::chrono::steady_clock::now();
+	// Before the socketpairs: the zygote must not inherit a copy of them
+	if (useZygote && zygote == nullptr) {
+		startZygote();
+	}
+	// FIXME: close all sockets...
+	// One connection per production thread of the worker process
+	std::vector<int> serverFds, workerFds;
+	for(int i = 0; i < workerThreads; ++i) {
+		int fd[2];
+		if (socketpair(PF_LOCAL, SOCK_STREAM, 0, fd) == -1) {
+			perror("socketpair");
+			throw std::runtime_error("failed to create socket pair");
+		}
+		int on = 1;
+		if (ioctl(fd[0], FIONBIO, (char *)&on) == -1)
+		{
+			perror("ioctl");
+			close(fd[0]);
+			close(fd[1]);
+			throw std::runtime_error("Unable to setup socket");
+		}
+		serverFds.push_back(fd[0]);
+		workerFds.push_back(fd[1]);
+	}
+
+	pid_t pid = -1;
+	if (zygote != nullptr) {
+		pid = zygote->spawn(workerFds);
+		if (pid == -1) {
+			std::cerr << "Worker zygote #" << zygote->getPid() << " lost\n";
+			delete(zygote);
+			zygote = nullptr;
+		}
+	}
+	if (pid == -1) {
+		pid = forkWorker(serverFds, workerFds);
+	}
+	for(auto it = workerFds.begin(); it != workerFds.end(); ++it) {
+		close(*it);
+	}
+
+	for(auto it = serverFds.begin(); it != serverFds.end(); ++it) {
+		Client * worker = new Client(this, *it, pid);
+		worker->worker = true;
+		worker->spawning = true;
+		worker->firstProduction = true;
+		worker->spawnedAt = spawnStart;
+		addClient(worker);
+		startedWorkerCount ++;
+	}
+	std::cerr << "New worker started: #" << pid << (workerThreads > 1 ? " with " + std::to_string(workerThreads) + " threads" : "") << "\n";
 }
 
 void SharedCacheServer::clearWorkingDirectory()
@@ -804,6 +1545,10 @@ void SharedCacheServer::clearWorkingDirectory()
 		if (name == "." || name == "..") {
 			continue;
 		}
+		// Keep restored contents
+		if (index != nullptr && (name == CacheIndex::fileName || contentByFilename.find(name) != contentByFilename.end())) {
+			continue;
+		}
 		name = basePath + "/" + name;
 		if (unlink(name.c_str()) == -1) {
 			perror(name.c_str());
@@ -815,175 +1560,497 @@ void SharedCacheServer::clearWorkingDirectory()
 
 void SharedCacheServer::evict(CacheFileDesc * item)
 {
-	std::cerr << "Server evicts " << item->filename << " of size " << item->size << " used at " << item->lastUse << "\n";
+	std::cerr << "Server evicts " << item->filename << " of size " << item->size << " produced in " << item->prodDuration << "ms used at " << item->lastUse << "\n";
+	if (evictionPolicy == GreedyDualSize && item->evictionValue > evictionInflation) {
+		evictionInflation = item->evictionValue;
+	}
 	currentSize -= item->size;
+	productStats[item->productType].evictions++;
+	productStats[item->productType].evictedBytes += item->size;
+	if (item->persisted) {
+		index->removed(item->filename);
+	}
+	if (spill != nullptr && item->productType == Messages::ProductRawContent && !item->error && !item->obsolete && item->size > 0) {
+		// The copy keeps the data alive until the spill thread is done with it
+		int fd = storage->open(item->filename);
+		if (fd != -1) {
+			spill->store(item->identifier, fd, item->size);
+		}
+	}
 	item->unlink();
 	delete(item);
 }
 
 int SharedCacheServer::nextTimeout() const {
-	// Find the timeout
-	std::chrono::time_point<std::chrono::steady_clock> * nextTimeout = nullptr;
-	for(auto it = streamWatchers.begin(); it != streamWatchers.end();)
-	{
-		Client * c = *(it++);
+	const std::chrono::time_point<std::chrono::steady_clock> * nextTimeout = nullptr;
+	if (!watcherDeadlines.empty()) {
+		nextTimeout = &watcherDeadlines.top()->when;
+	}
+	// Obsolete productions to cancel
+	if (!cancelDeadlines.empty() && (nextTimeout == nullptr || cancelDeadlines.top()->when < *nextTimeout)) {
+		nextTimeout = &cancelDeadlines.top()->when;
+	}
+	if (nextTimeout == nullptr) {
+		// Everything else is driven by io
+		return -1;
+	}
+	auto timeout = *nextTimeout - std::chrono::steady_clock::now();
+	if (timeout <= std::chrono::steady_clock::duration::zero()) {
+		return 0;
+	}
+	// Round up: waking before the deadline would just loop again
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(timeout + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1)).count();
+	return ms > INT_MAX ? INT_MAX : ms;
+}
 
-		if (c->watcherExpiry == nullptr) {
-			continue;
-		}
-		if (nextTimeout == nullptr || *(c->watcherExpiry) < *nextTimeout) {
-			nextTimeout = c->watcherExpiry;
+
+
+void SharedCacheServer::waitEvents()
+{
+	epoll_event events[64];
+
+	// Don't block if some io are known to be possible
+	int timeout = pendingIoClients.empty() ? this->nextTimeout() : 0;
+	int count = epoll_wait(epollFd, events, 64, timeout);
+	if (count == -1) {
+		if (errno == EINTR) {
+			return;
 		}
+		perror("epoll_wait");
+		throw std::runtime_error("Unable to wait events");
 	}
-	if (nextTimeout != nullptr) {
-		auto timeout = *nextTimeout - std::chrono::steady_clock::now();
-		auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(timeout).count();
-		if (ms < 0) {
-			return 0;
+
+	for(int i = 0; i < count; ++i) {
+		Client * c = (Client*)events[i].data.ptr;
+		if (c == nullptr) {
+			doAccept();
+			continue;
 		}
-		if (ms > 1000) {
-			return 1000;
+		if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			c->readReady = true;
 		}
-		return ms;
+		if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+			c->writeReady = true;
+		}
+		pendingIoClients.add(c);
 	}
-	return 1000;
 }
 
+void SharedCacheServer::proceedPendingIo()
+{
+	// Clients queued during this pass (new replies) are handled on next pass
+	for(size_t left = pendingIoClients.size(); left > 0 && !pendingIoClients.empty(); --left) {
+		Client * c = pendingIoClients.front();
+		pendingIoClients.remove(c);
+		proceedClientIo(c);
+	}
+}
 
-
-void SharedCacheServer::server()
+// write(), with optional descriptors attached (SCM_RIGHTS)
+static int sendWithFds(int fd, const char * data, size_t length, const std::vector<int> * fds)
 {
-	clearWorkingDirectory();
-	// sigpipe condition is handled by checking write result code
-	// don't let sigpipe interrupt server
-	signal(SIGPIPE, SIG_IGN);
+	if (fds == nullptr) {
+		return write(fd, data, length);
+	}
+	struct iovec iov;
+	iov.iov_base = (void*)data;
+	iov.iov_len = length;
+
+	std::vector<char> control(CMSG_SPACE(sizeof(int) * fds->size()));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data();
+	msg.msg_controllen = control.size();
+
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds->size());
+	memcpy(CMSG_DATA(cmsg), fds->data(), sizeof(int) * fds->size());
+
+	return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
 
-	// Cleanup the directory
+// Consume the readiness of a client until it would block, or a message was received
+void SharedCacheServer::proceedClientIo(Client * c)
+{
+	if (c->sendFailed) {
+		c->release();
+		return;
+	}
 	while(true) {
-		// FIXME: ensure that we never have more than two active workers (running)
-		// For this, we should not answer back to getResource to workers untils they
-		// the active workers is low enough
+		// Pipelining clients may send requests while replies are pending: a full socket does not prevent reading
+		if (c->writeBufferLeft && c->writeReady) {
+			// Descriptors leave with the first byte of their frame; never let them join an earlier write
+			size_t length = c->writeBufferLeft;
+			const std::vector<int> * fds = nullptr;
+			auto nextFds = c->writeFds.begin();
+			if (nextFds != c->writeFds.end() && nextFds->first == c->writeBufferPos) {
+				fds = &nextFds->second;
+				++nextFds;
+			}
+			if (nextFds != c->writeFds.end()) {
+				length = std::min(length, nextFds->first - c->writeBufferPos);
+			}
+			int wr = sendWithFds(c->fd, c->writeBuffer.data() + c->writeBufferPos, length, fds);
+			if (wr == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN) {
+					c->writeReady = false;
+					return;
+				}
+				c->release();
+				return;
+			}
+			if (fds != nullptr) {
+				for(auto it = fds->begin(); it != fds->end(); ++it) {
+					::close(*it);
+				}
+				c->writeFds.pop_front();
+			}
+			c->writeBufferPos += wr;
+			c->writeBufferLeft -= wr;
+			if (c->writeBufferLeft == 0) {
+				c->writeBuffer.clear();
+				c->writeBufferPos = 0;
+			}
+			continue;
+		}
 
-		// Always keep 2 idle workers ready to run
-		while(startedWorkerCount < 2 + waitingContentWorkerCount) {
-			std::cerr << "Starting new worker due to high number of consumers : " << startedWorkerCount << " with " << waitingContentWorkerCount << " stucks\n";
-			startWorker();
+		if (!c->readReady) {
+			return;
+		}
+		// Read exactly the header, then exactly the payload
+		const size_t headerSize = sizeof(Wire::FrameHeader);
+		char * target;
+		size_t wanted;
+		if (c->readBufferPos < headerSize) {
+			target = ((char*)&c->readHeader) + c->readBufferPos;
+			wanted = headerSize - c->readBufferPos;
+		} else {
+			target = &c->readBuffer[0] + (c->readBufferPos - headerSize);
+			wanted = headerSize + c->readBuffer.size() - c->readBufferPos;
+		}
+		// No data is expected while a request is active. Still read, to detect it
+		char overflow;
+		if (c->activeRequest) {
+			target = &overflow;
+			wanted = 1;
+		}
+		int rd = read(c->fd, target, wanted);
+		if (rd == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				c->readReady = false;
+				return;
+			}
+			c->release();
+			return;
+		}
+		if (rd == 0 || c->activeRequest) {
+			if (rd != 0) {
+				std::cerr << "Client " << c->fd << " sent too much data\n";
+			} else {
+				std::cerr << "Client " << c->fd << " terminated\n";
+			}
+			c->release();
+			return;
 		}
 
-		// don't allow too many idle workers (shrink back)
-		while(waitingWorkers.size() > 2) {
-			// Kill some workers
-			auto remove = (*waitingWorkers.begin());
-			std::cerr << "Too many waiting workers (" << waitingWorkers.size() << ") ; dropping " << remove->identifier() << "\n";
-			remove->release();
+		c->readBufferPos += rd;
+		if (c->readBufferPos < headerSize) {
+			continue;
+		}
+		if (c->readBufferPos == headerSize) {
+			if (!Wire::isValidFormat(c->readHeader.format)) {
+				std::cerr << "Client " << c->fd << " rejected: " << Wire::formatError(c->readHeader.format) << "\n";
+				c->release();
+				return;
+			}
+			if (c->readHeader.size > MAX_MESSAGE_SIZE) {
+				std::cerr << "Client " << c->fd << " sent an invalid frame\n";
+				c->release();
+				return;
+			}
+			c->readBuffer.resize(c->readHeader.size);
+		}
+		if (c->readBufferPos < headerSize + c->readBuffer.size()) {
+			continue;
+		}
+
+		// Process a message for the client.
+		try {
+			receiveMessage(c);
+		} catch(const std::exception& ex) {
+			std::cerr << "Error on client " << c->fd << ": "<< ex.what() << "\n";
+			c->release();
+			return;
 		}
+		try {
+			proceedNewMessage(c);
+		} catch(const ClientError & ex) {
+			std::cerr << "Error on client " << c->fd << ": "<< ex.what() << "\n";
+			c->release();
+		}
+		// Client may be gone at this point. A reply, if any, queued it for the next pass
+		return;
+	}
+}
 
-		pollfd polls[clients.size() + 1];
+void SharedCacheServer::checkSources(Messages::ContentRequest * request)
+{
+	std::list<Messages::RawContent *> rawContents;
+	request->collectRawContents(rawContents);
+	for(auto it = rawContents.begin(); it != rawContents.end(); ++it) {
+		Messages::RawContent * rawContent = *it;
+		rawContent->stampIdentity();
+		if (rawContent->identity.empty()) {
+			continue;
+		}
+		auto file = sourceFiles.find(rawContent->path);
+		if (file != sourceFiles.end() && file->second.identity != rawContent->identity) {
+			invalidateSource(rawContent->path, rawContent->identity);
+		}
+	}
+}
 
-		pollfd * server;
-		int pollCount = 0;
+void SharedCacheServer::invalidateSource(const std::string & path, const std::string & identity)
+{
+	std::cerr << "Source " << path << " changed, dropping the contents computed from it\n";
+	sourceFiles[path].identity = identity;
+	for(auto it = contentByIdentifier.begin(); it != contentByIdentifier.end(); ++it) {
+		CacheFileDesc * cfd = it->second;
+		if (cfd->obsolete || std::find(cfd->sources.begin(), cfd->sources.end(), path) == cfd->sources.end()) {
+			continue;
+		}
+		cfd->obsolete = true;
+		obsoleteCount++;
+		if (cfd->persisted) {
+			// Not worth restoring
+			index->removed(cfd->filename);
+			cfd->persisted = false;
+		}
+	}
+	dropObsolete();
+}
 
-		server = polls + (pollCount++);
-		server->fd = serverFd;
-		server->events = POLLIN;
+void SharedCacheServer::dropObsolete()
+{
+	if (obsoleteCount == 0) {
+		return;
+	}
+	std::list<CacheFileDesc *> removables;
+	for(auto it = contentByIdentifier.begin(); it != contentByIdentifier.end(); ++it) {
+		CacheFileDesc * cfd = it->second;
+		// Productions in progress are dropped once done
+		if (cfd->obsolete && cfd->produced && !cfd->clientCount) {
+			removables.push_back(cfd);
+		}
+	}
+	for(auto it = removables.begin(); it != removables.end(); ++it) {
+		evict(*it);
+	}
+}
 
-		for(auto it = clients.begin(); it != clients.end();)
+void SharedCacheServer::trimCache(RequirementEvaluator * evaluator, long incoming)
+{
+	dropObsolete();
+	if (usedSize() + incoming > maxSize) {
+		long wanted = usedSize() + incoming - maxSize;
+		std::cerr << "Out of space condition detected. current size is " << currentSize << " (+" << reservedSize << " reserved, +" << (usedSize() - currentSize - reservedSize) << " spilling, +" << incoming << " incoming)/" << maxSize << "\n";
+
+		std::list<CacheFileDesc *> removables;
+		long removableSize = 0;
+		for(auto it = contentByIdentifier.begin(); it != contentByIdentifier.end();)
 		{
-			Client * c = *it;
-			it++;
+			CacheFileDesc * cfd = (it++)->second;
+			if (!cfd->produced) {
+				continue;
+			}
+			if (cfd->clientCount) {
+				continue;
+			}
+			if (evaluator != nullptr && evaluator->required(cfd)) {
+				// For the moment, do not drop entry that are required in the future
+				// FIXME: use a level to indidcate when it will be required, then fall back to drop them
+				continue;
+			}
 
-			c->poll = polls + (pollCount++);
-			c->poll->fd = c->fd;
-			if (c->writeBufferLeft) {
-				c->poll->events=POLLOUT|POLLIN;
+			removables.push_back(cfd);
+			removableSize += cfd->size;
+		}
+
+		if (removables.size() > 1) {
+			if (evictionPolicy == GreedyDualSize) {
+				// Cheapest to recompute per byte, aged by recency
+				removables.sort(CacheFileDesc::compare_eviction_value);
 			} else {
-				c->poll->events=POLLIN;
+				// Sort by last recent usage
+				removables.sort(CacheFileDesc::compare_last_use);
 			}
 		}
 
-		int timeout = this->nextTimeout();
-		if (poll(polls, pollCount, timeout) == -1) {
-			perror("poll");
-			throw std::runtime_error("Unable to poll");
+		while(wanted > 0 && removables.size()) {
+			CacheFileDesc * item = removables.front();
+			removables.pop_front();
+			wanted -= item->size;
+			evict(item);
 		}
+	}
+}
 
-		if (server->revents & POLLIN) {
-			doAccept();
-		}
+long SharedCacheServer::usedSize() const
+{
+	long result = currentSize + reservedSize;
+	if (spill != nullptr) {
+		result += spill->getPendingSize();
+	}
+	return result;
+}
 
-		for(auto it = clients.begin(); it != clients.end();) {
-			Client * c = *it++;
-			if (!c->poll) {
+bool SharedCacheServer::reserveSpace(RequirementEvaluator * evaluator, long size)
+{
+	if (usedSize() + size <= maxSize) {
+		return true;
+	}
+	trimCache(evaluator, size);
+	if (usedSize() + size <= maxSize) {
+		return true;
+	}
+	// Running productions will release their reservation. If none is running (all are waiting
+	// for dependencies, that may be this one), waiting won't help
+	return reservedSize == 0 || activeWorkerCount() == 0;
+}
+
+void SharedCacheServer::persist(CacheFileDesc * item)
+{
+	CacheIndex::Record record;
+	record.identifier = item->identifier;
+	if (item->obsolete || !CacheIndex::stampSources(item->identifier, record.sources)) {
+		return;
+	}
+	record.filename = item->filename;
+	record.size = item->size;
+	record.prodDuration = item->prodDuration;
+	index->added(record);
+	item->persisted = true;
+
+	// Compact the journal when mostly made of obsolete records
+	if (index->getJournalLength() > 1024 + 2 * (long)contentByFilename.size()) {
+		std::list<CacheIndex::Record> records;
+		for(auto it = contentByFilename.begin(); it != contentByFilename.end(); ++it) {
+			CacheFileDesc * cfd = it->second;
+			if (!cfd->persisted) {
 				continue;
 			}
-			if (c->writeBufferLeft && (c->poll->revents & POLLOUT)) {
-				int wr = write(c->fd, c->writeBuffer + c->writeBufferPos, c->writeBufferLeft);
-				if (wr == -1) {
-					if (errno == EAGAIN || errno == EINTR) {
-						// Just ignore
-						continue;
-					} else {
-						c->release();
-						continue;
-					}
-				} else {
-					c->writeBufferLeft -= wr;
-					if (c->writeBufferLeft == 0) {
-						c->readBufferPos = 0;
-					}
-				}
-			} else if ((!c->writeBufferLeft) && (c->poll->revents & POLLIN)) {
-				int rd = read(c->fd, c->readBuffer + c->readBufferPos, MAX_MESSAGE_SIZE - c->readBufferPos);
-				if (rd == -1) {
-					if (errno == EAGAIN || errno == EINTR) {
-						// Just ignore
-						continue;
-					} else {
-						c->release();
-						continue;
-					}
-				} else if (rd == 0 || c->activeRequest) {
-					if (rd != 0) {
-						std::cerr << "Client " << c->fd << " sent too much data\n";
-					} else {
-						std::cerr << "Client " << c->fd << " terminated\n";
-					}
-					c->release();
-					continue;
-				} else {
-					// FIXME: read 0 ? possible ?
-					c->readBufferPos += rd;
-					if (c->readBufferPos > 2) {
-						uint16_t size = *(uint16_t*)c->readBuffer;
-						if (size >= MAX_MESSAGE_SIZE || size <= 2) {
-							c->release();
-							continue;
-						} else if (size >= c->readBufferPos){
-							// Process a message for the client.
-							try {
-								receiveMessage(c, size);
-
-							} catch(const std::exception& ex) {
-								std::cerr << "Error on client " << c->fd << ": "<< ex.what() << "\n";
-								c->release();
-								continue;
-							}
-							try {
-								proceedNewMessage(c);
-							} catch(const ClientError & ex) {
-								std::cerr << "Error on client " << c->fd << ": "<< ex.what() << "\n";
-								c->release();
-								continue;
-							}
-
-						} else if (c->readBufferPos == MAX_MESSAGE_SIZE) {
-							c->release();
-							continue;
-						}
-					}
-				}
-			}
+			CacheIndex::Record r;
+			r.identifier = cfd->identifier;
+			r.filename = cfd->filename;
+			r.size = cfd->size;
+			r.prodDuration = cfd->prodDuration;
+			CacheIndex::stampSources(cfd->identifier, r.sources);
+			records.push_back(r);
+		}
+		index->rewrite(records);
+	}
+}
+
+void SharedCacheServer::restoreIndex()
+{
+	index = new CacheIndex(basePath);
+	std::list<CacheIndex::Record> records = index->load();
+	for(auto it = records.begin(); it != records.end(); ++it)
+	{
+		if (contentByIdentifier.find(it->identifier) != contentByIdentifier.end()) {
+			continue;
+		}
+		CacheFileDesc * cfd = new CacheFileDesc(this, it->identifier, it->filename);
+		cfd->produced = true;
+		cfd->persisted = true;
+		cfd->size = it->size;
+		cfd->prodDuration = it->prodDuration;
+		Messages::ContentRequest request = nlohmann::json::parse(it->identifier.str()).get<Messages::ContentRequest>();
+		cfd->productType = request.productType();
+		cfd->setSources(request);
+		cfd->touch();
+		currentSize += cfd->size;
+	}
+	std::cerr << "Restored " << contentByFilename.size() << " cached contents (" << currentSize << " bytes)\n";
+
+	trimCache(nullptr);
+
+	// Start from a compact journal
+	std::list<CacheIndex::Record> live;
+	for(auto it = records.begin(); it != records.end(); ++it)
+	{
+		if (contentByFilename.find(it->filename) != contentByFilename.end()) {
+			live.push_back(*it);
 		}
+	}
+	index->rewrite(live);
+}
+
+void SharedCacheServer::server()
+{
+	Trace::setProcessName("fits-server");
+	if (getPersistent()) {
+		if (storage->persistent()) {
+			restoreIndex();
+		} else {
+			std::cerr << "Cache persistence is not available with " << storage->name() << " storage\n";
+		}
+	}
+	clearWorkingDirectory();
+	spill = SpillCache::build();
+	// sigpipe condition is handled by checking write result code
+	// don't let sigpipe interrupt server
+	signal(SIGPIPE, SIG_IGN);
+
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd == -1) {
+		perror("epoll_create1");
+		throw std::runtime_error("Unable to create epoll");
+	}
+	{
+		epoll_event ev;
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = nullptr;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, serverFd, &ev) == -1) {
+			perror("epoll_ctl");
+			throw std::runtime_error("Unable to register server socket");
+		}
+	}
+
+	std::cerr << "Running at most " << maxActiveWorkers << " active workers, using " << (evictionPolicy == GreedyDualSize ? "gds" : "lru") << " eviction and " << storage->name() << " storage\n";
+
+	// Cleanup the directory
+	while(true) {
+		// Keep up to 2 idle workers ready to run, as long as the active limit allows them to start.
+		// Workers waiting for a dependency keep their process, but don't count as active
+		long idleWanted = std::min(2L, std::max(0L, maxActiveWorkers - activeWorkerCount()));
+		while(startedWorkerCount < producingWorkerCount + idleWanted) {
+			std::cerr << "Starting new worker : " << startedWorkerCount << " started, " << activeWorkerCount() << " active, " << waitingContentWorkerCount << " stucks\n";
+			startWorker();
+		}
+
+		// don't allow too many idle workers (shrink back). Worker processes come with workerThreads threads
+		long maxIdleWorkers = workerThreads > 1 ? workerThreads + 1 : 2;
+		while((long)waitingWorkers.size() > maxIdleWorkers) {
+			// Kill some workers
+			auto remove = (*waitingWorkers.begin());
+			std::cerr << "Too many waiting workers (" << waitingWorkers.size() << ") ; dropping " << remove->identifier() << "\n";
+			remove->release();
+		}
+
+		waitEvents();
+
+		proceedPendingIo();
 
 		RequirementEvaluator evaluator(this);
 
@@ -991,44 +2058,41 @@ void SharedCacheServer::server()
 		// Compute required resources, and their dependencies
 		// Distribute the first required resource to a worker
 
+		auto loopTime = std::chrono::steady_clock::now();
 		for(auto it = waitingConsumers.begin(); it != waitingConsumers.end();)
 		{
 			Client * c = (*it++);
 
-			std::string identifier = c->activeRequest->contentRequest->uniqKey();
+			if (!requireWantedContents(c, evaluator, loopTime)) {
+				continue;
+			}
 
-			auto result = contentByIdentifier.find(identifier);
-			if (result == contentByIdentifier.end() || ((!result->second->produced) && (!result->second->error))) {
-				evaluator.markAsRequired(*(c->activeRequest->contentRequest), identifier);
+			Messages::Result resultMessage;
+			if (c->activeRequest->contentRequest) {
+				resultMessage.contentResult = new Messages::ContentResult(c->served[0]->toContentResult(c->wanted[0]));
 			} else {
-				CacheFileDesc * entry = result->second;
-				Messages::Result resultMessage;
-				resultMessage.contentResult = new Messages::ContentResult(entry->toContentResult(&(*c->activeRequest->contentRequest)));
-
-				waitingConsumers.remove(c);
-				if (c->worker) {
-					waitingContentWorkerCount--;
+				resultMessage.batchResult.build();
+				for(size_t i = 0; i < c->wanted.size(); ++i) {
+					resultMessage.batchResult->contents.push_back(c->served[i]->toContentResult(c->wanted[i]));
 				}
-				entry->addReader();
-				c->reading.push_back(entry);
-				c->reply(resultMessage);
 			}
+
+			waitingConsumers.remove(c);
+			if (c->worker) {
+				waitingContentWorkerCount--;
+			}
+			Trace::complete(Messages::productTypeName(c->wanted[0]->productType()), "queue", Trace::at(c->waitingSince), Trace::at(loopTime), c->wanted[0]->traceId);
+			c->reply(resultMessage);
 		}
 
-		for(auto it = clients.begin(); it != clients.end();) {
+		for(auto it = producingWorkers.begin(); it != producingWorkers.end();) {
 			Client * c = (*it++);
-			if (c->producing.empty()) {
-				continue;
-			}
 			if (c->killed) {
 				continue;
 			}
-			if (c->producedStream) {
-				// Don't kill stream producers
-				continue;
-			}
 
 			bool reallyUsed = false;
+			double progress = 0;
 			for(auto producingIt = c->producing.begin(); producingIt != c->producing.end();) {
 				CacheFileDesc * producing = (*producingIt++);
 
@@ -1036,75 +2100,82 @@ void SharedCacheServer::server()
 					reallyUsed = true;
 					break;
 				}
+				progress = std::max(progress, producing->progress);
 			}
 			if (reallyUsed) {
+				if (c->cancelDeadline.armed() || c->cancelled) {
+					std::cerr << "Production by " << c->identifier() << " is required again\n";
+					c->clearCancelDeadline();
+					c->cancelled = false;
+				}
+				continue;
+			}
+			if (c->cancelled) {
+				continue;
+			}
+			// Almost done: keep the result, another consumer may want it shortly
+			if (progress >= cancelFinishRatio) {
+				c->clearCancelDeadline();
+				continue;
+			}
+			// Bursts of requests (brightness changes) often ask again for the same content: wait a bit before killing
+			if (!c->cancelDeadline.armed()) {
+				cancelDeadlines.arm(&c->cancelDeadline, loopTime + std::chrono::milliseconds(cancelGraceMs));
+			}
+			if (c->cancelDeadline.when > loopTime) {
 				continue;
 			}
-			// FIXME: delay the kill call for some ms...
-			// (for the case of brightness burst requests)
-			c->kill();
+			if (workerThreads > 1) {
+				// A signal would kill the other threads of the worker process
+				c->cancel();
+			} else {
+				c->kill();
+			}
+			c->clearCancelDeadline();
 		}
 
 		this->checkAllStreamWatchersForTimeout();
 
-		// Distribute some works
-		// FIXME: check space is ok (ie don't start under low space condition)
+		// Distribute some works. Requirements not dispatched stay queued in the evaluator
+		// and are evaluated again at next iteration, in the same order
 		for(auto it = waitingWorkers.begin(); it != waitingWorkers.end();)
 		{
 			Client * c = (*it++);
 
-			std::pair<CacheFileDesc *, Messages::ContentRequest> entry = evaluator.startFirst();
-			if (entry.first == nullptr) {
+			if (activeWorkerCount() >= maxActiveWorkers) {
+				break;
+			}
+
+			long estimate;
+			const Messages::ContentRequest * next = evaluator.peekFirst(&estimate);
+			if (next == nullptr) {
+				break;
+			}
+			// Don't start under low space condition
+			if (!reserveSpace(&evaluator, estimate)) {
+				std::cerr << "Deferring production of " << estimate << " bytes: " << currentSize << " used, " << reservedSize << " reserved, of " << maxSize << "\n";
 				break;
 			}
 
+			std::pair<CacheFileDesc *, Messages::ContentRequest> entry = evaluator.startFirst();
+			entry.first->reserve(estimate);
+
 			Messages::Result resultMessage;
 			resultMessage.todoResult.build();
 			resultMessage.todoResult->content = new Messages::ContentRequest(entry.second);
 			resultMessage.todoResult->filename = entry.first->filename;
+			if (spill != nullptr && entry.first->productType == Messages::ProductRawContent) {
+				spill->lookup(entry.first->identifier, resultMessage.todoResult->spilled);
+			}
 			waitingWorkers.remove(c);
 			c->producing.push_back(entry.first);
+			producingWorkerCount++;
+			producingWorkers.add(c);
 			c->reply(resultMessage);
 		}
 
 		// Keep cache under its nominal size
-		if (currentSize > maxSize) {
-			long wanted = currentSize - maxSize;
-			std::cerr << "Out of space condition detected. current size is " << currentSize << "/" << maxSize << "\n";
-
-			std::list<CacheFileDesc *> removables;
-			long removableSize = 0;
-			for(auto it = contentByIdentifier.begin(); it != contentByIdentifier.end();)
-			{
-				CacheFileDesc * cfd = (it++)->second;
-				if (!cfd->produced) {
-					continue;
-				}
-				if (cfd->clientCount) {
-					continue;
-				}
-				if (evaluator.required(cfd)) {
-					// For the moment, do not drop entry that are required in the future
-					// FIXME: use a level to indidcate when it will be required, then fall back to drop them
-					continue;
-				}
-
-				removables.push_back(cfd);
-				removableSize += cfd->size;
-			}
-
-			if (removableSize >= wanted && removables.size() > 1) {
-				// Sort by last recent usage
-				removables.sort(CacheFileDesc::compare_last_use);
-			}
-
-			while(wanted > 0 && removables.size()) {
-				CacheFileDesc * item = removables.front();
-				removables.pop_front();
-				wanted -= item->size;
-				evict(item);
-			}
-		}
+		trimCache(&evaluator);
 
 	}
 }
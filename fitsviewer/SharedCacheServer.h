@@ -11,16 +11,23 @@
 #include <string>
 #include <list>
 #include <set>
+#include <unordered_map>
 #include <chrono>
 #include "json.hpp"
 #include "SharedCache.h"
+#include "DeadlineHeap.h"
 
 namespace SharedCache {
 
 
 class Client;
+struct ContentDependency;
 class Stream;
 class CacheFileDesc;
+class CacheIndex;
+class CacheStorage;
+class SpillCache;
+class WorkerZygote;
 
 class ClientError : public std::runtime_error {
 public:
@@ -49,13 +56,30 @@ public:
 
 class SharedCacheServer {
 	class RequirementEvaluator;
+
+	enum EvictionPolicy {
+		LeastRecentlyUsed,
+		// Evict the lowest recompute cost per byte, aged by recency
+		GreedyDualSize,
+	};
 	friend class Client;
 	friend class Stream;
 	friend class CacheFileDesc;
 
-	std::map<std::string, CacheFileDesc*> contentByIdentifier;
+	std::unordered_map<ContentKey, CacheFileDesc*, ContentKeyHash> contentByIdentifier;
 	std::map<std::string, CacheFileDesc*> contentByFilename;
 
+	struct SourceFile {
+		// Latest identity seen in requests (see RawContent::identity)
+		std::string identity;
+		// Contents computed from this file
+		long users = 0;
+	};
+	// Source files of the cached contents, by path
+	std::unordered_map<std::string, SourceFile> sourceFiles;
+	// Obsolete contents not yet dropped
+	long obsoleteCount;
+
 
 	std::map<std::string, Stream*> streams;
 
@@ -69,15 +93,72 @@ class SharedCacheServer {
 	// Clients that waits for stream frames
 	ClientFifo streamWatchers;
 
+	// Clients with io readiness (or pending output) not yet consumed
+	ClientFifo pendingIoClients;
+
+	// Workers with a production assigned: the only clients checked for cancellation
+	ClientFifo producingWorkers;
+
+	// Timeouts of the stream watchers (Client::watcherExpiry)
+	DeadlineHeap<Client> watcherDeadlines;
+	// Kill deadlines of the workers whose productions are all obsolete (Client::cancelDeadline)
+	DeadlineHeap<Client> cancelDeadlines;
+
 	// Number of workers awaiting for resources (allow temporary increase of the number of workers)
 	long waitingContentWorkerCount;
 
+	// Number of workers with a production assigned (including those awaiting for resources)
+	long producingWorkerCount;
+
+	// Limit of activeWorkerCount() for dispatching new work (FITS_SERVER_MAX_ACTIVE_WORKERS, default to core count)
+	long maxActiveWorkers;
+
+	// Production threads per worker process (FITS_SERVER_WORKER_THREADS, default to 1: one process per worker)
+	int workerThreads;
+
+	// Obsolete productions are killed after this delay (FITS_SERVER_CANCEL_GRACE_MS, default to 1000)...
+	long cancelGraceMs;
+	// ...unless they are that much done (FITS_SERVER_CANCEL_FINISH_PERCENT, default to 50)
+	double cancelFinishRatio;
+
+	// Workers are forked from the zygote when possible (FITS_SERVER_ZYGOTE)
+	bool useZygote;
+	WorkerZygote * zygote;
+
+	// Time from startWorker to the first work request (us)
+	long workerSpawns;
+	long workerSpawnTime;
+	// Duration of the first production of each worker (ms)
+	long firstProductions;
+	long firstProductionTime;
+
+	// FITS_SERVER_CACHE_POLICY (lru or gds, default to gds)
+	EvictionPolicy evictionPolicy;
+	// GreedyDual-Size aging: value of the last evicted entry
+	double evictionInflation;
+
+	// Counters reported by statsRequest, indexed by Messages::ProductType
+	Messages::ProductStats productStats[Messages::ProductTypeCount];
+
+	// Journal of produced contents. Only set when FITS_SERVER_CACHE_PERSIST is set
+	CacheIndex * index;
+
+	// Data of the entries (FITS_SERVER_STORAGE)
+	CacheStorage * storage;
+
+	// Second tier for evicted raw contents. Only set when FITS_SERVER_SPILL_PATH is set
+	SpillCache * spill;
+
 	// Starts and terminate with '/'
 	std::string basePath;
 	long maxSize;
+	// Size of produced contents
 	long currentSize;
+	// Estimated size of contents in production
+	long reservedSize;
 
 	int serverFd;
+	int epollFd;
 	long fileGenerator;
 	long streamGenerator;
 
@@ -85,8 +166,28 @@ class SharedCacheServer {
 
 	[[ noreturn ]] void server();
 	void evict(CacheFileDesc * item);
+	// Stamp the source files of a request. Contents computed from a previous version of them become obsolete
+	void checkSources(Messages::ContentRequest * request);
+	// Mark all the contents computed from a file as obsolete (descendants included)
+	void invalidateSource(const std::string & path, const std::string & identity);
+	// Evict the obsolete contents that are no more used
+	void dropObsolete();
+	// Evict until the cache fits its nominal size, with incoming more bytes. Contents required by evaluator are kept
+	void trimCache(RequirementEvaluator * evaluator, long incoming = 0);
+	// Produced, reserved and evicted contents still held by the spill thread
+	long usedSize() const;
+	// Make room for a new production. False if it must be deferred
+	bool reserveSpace(RequirementEvaluator * evaluator, long size);
 	void clearWorkingDirectory();
-	void receiveMessage(Client * client, uint16_t size);
+	// Reload contents from the journal (persistent mode)
+	void restoreIndex();
+	// Record a produced content in the journal (persistent mode)
+	void persist(CacheFileDesc * item);
+	void receiveMessage(Client * client);
+	void addClient(Client * client);
+	void waitEvents();
+	void proceedPendingIo();
+	void proceedClientIo(Client * client);
 	// True if the client is no more blocked
 	void proceedNewMessage(Client * blocked);
 
@@ -94,24 +195,56 @@ class SharedCacheServer {
 
 	void doAccept();
 	std::string newFilename();
+	// Descriptors of the entries referred to by a reply, for fd based storage (empty otherwise)
+	void dataFds(const Messages::Result & result, std::vector<int> & into) const;
 
 	void startWorker();
-
-	static void workerLogic(Cache * cache);
+	void startZygote();
+	pid_t forkWorker(const std::vector<int> & serverFds, const std::vector<int> & workerFds);
+	[[ noreturn ]] static void workerMain(const std::string & basePath, const std::vector<int> & fds);
 
 	// Return -1 if expired
 	long isExpiredContent(const Messages::RawContent * content) const;
 	void upgradeContentRequest(Client * consumerClient);
+	// Compute the key and the dependencies of a wanted content, after it changed
+	void updateWantedKey(Client * c, size_t i);
 	void checkAllStreamWatchersForFrame();
 	void checkStreamWatcherForFrame(Client * client);
+	// Reply to the stream watchers whose timeout expired
 	void checkAllStreamWatchersForTimeout();
-	void checkStreamWatcherForTimeout(Client * client, const std::chrono::time_point<std::chrono::steady_clock> & now);
 	void replyStreamWatcher(Client * watcher, bool expired, bool dead);
+	Messages::StatsResult getStats() const;
 
 	Stream * createStream(Client * c);
 	void killStream(Stream * s);
+	// Time to the next deadline, in ms (-1 if none)
 	int nextTimeout() const;
+
+	// Priority of a content wanted by a waiting consumer, including inheritance and aging
+	int consumerPriority(Client * c, const Messages::ContentRequest & wanted, const std::chrono::time_point<std::chrono::steady_clock> & now) const;
+	// Mark the missing contents of a waiting consumer as required. True if they are all available
+	bool requireWantedContents(Client * c, RequirementEvaluator & evaluator, const std::chrono::time_point<std::chrono::steady_clock> & now);
+	// Mark a content as required once its dependencies are available, its missing dependencies otherwise.
+	// True if the content is available (produced or failed)
+	// estimate caches the size of the content for the next loops (computed once)
+	bool requireContent(const Messages::ContentRequest & request, const ContentKey & key, long & estimate, std::vector<ContentDependency> & dependencies, int priority, RequirementEvaluator & evaluator);
+
+	// Workers actually running a production. Those blocked on a dependency are not counted
+	long activeWorkerCount() const { return producingWorkerCount - waitingContentWorkerCount; }
+	static int getWorkerThreads();
+	static long getCancelGraceMs();
+	static double getCancelFinishRatio();
+	static EvictionPolicy getEvictionPolicy();
+	static bool getPersistent();
 public:
+	// Also used by the workers to share the cores between productions
+	static long getMaxActiveWorkers();
+
+	// Production loop of a worker connection. Throws when the server drops it
+	static void workerLogic(Cache * cache);
+	// Body of a worker process running one production thread per cache
+	static void threadedWorkerLogic(std::vector<Cache *> caches);
+
 	SharedCacheServer(const std::string & path, long maxSize);
 	virtual ~SharedCacheServer();
 
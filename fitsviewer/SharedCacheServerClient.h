@@ -3,10 +3,10 @@
 
 #include <chrono>
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
 #include "SharedCacheServer.h"
 
-struct pollfd;
-
 namespace SharedCache {
 
 
@@ -20,30 +20,60 @@ class CacheFileDesc {
 
 	SharedCacheServer * server;
 	long size;
+	// Estimated size, accounted in server's reservedSize while in production
+	long reservedSize;
+	// Time to produce, in ms
 	long prodDuration;
+	std::chrono::time_point<std::chrono::steady_clock> prodStart;
 	long lastUse;
+	// GreedyDual-Size value: inflation at last use + cost / size. Lowest gets evicted first
+	double evictionValue;
 
 	bool produced;
+	// Recorded in the cache index
+	bool persisted;
+	// Best priority of the consumers waiting for this content. Inherited by its dependencies
+	int priority;
+	// As reported by the producer (0 - 1)
+	double progress;
+	// Messages::ProductType, for statistics
+	int productType;
 	long clientCount;
 	long serial;
 	bool error;
 	std::string errorDetails;
-
-	std::string identifier;
+	// Paths of the files this content is computed from (registered in server's sourceFiles)
+	std::vector<std::string> sources;
+	// One of the sources was overwritten since: unreachable, dropped once unused
+	bool obsolete;
+	// Dependencies read by the production, kept (as reader) until it ends
+	std::vector<CacheFileDesc *> inputs;
+	// Request that triggered the production, for tracing
+	std::string traceId;
+
+	ContentKey identifier;
 	// Path, without the basePath.
 	std::string filename;
 
-	CacheFileDesc(SharedCacheServer * server, const std::string & identifier, const std::string & filename):
+	CacheFileDesc(SharedCacheServer * server, const ContentKey & identifier, const std::string & filename):
 		identifier(identifier),
 		filename(filename)
 	{
 		this->server = server;
 		size = 0;
+		reservedSize = 0;
 		prodDuration = 0;
+		prodStart = std::chrono::steady_clock::now();
 		lastUse = now();
+		evictionValue = 0;
 		produced = false;
+		persisted = false;
+		priority = Messages::PriorityNormal;
+		progress = 0;
+		productType = Messages::ProductRawContent;
 		clientCount = 0;
 		error = false;
+		obsolete = false;
 		serial = 0;
 		server->contentByIdentifier[identifier] = this;
 		server->contentByFilename[filename] = this;
@@ -51,6 +81,17 @@ class CacheFileDesc {
 
 	~CacheFileDesc()
 	{
+		releaseReservation();
+		releaseInputs();
+		if (obsolete) {
+			server->obsoleteCount--;
+		}
+		for(auto it = sources.begin(); it != sources.end(); ++it) {
+			auto file = server->sourceFiles.find(*it);
+			if (--file->second.users == 0) {
+				server->sourceFiles.erase(file);
+			}
+		}
 		server->contentByIdentifier.erase(identifier);
 		if (filename.size()) {
 			server->contentByFilename.erase(filename);
@@ -59,21 +100,77 @@ class CacheFileDesc {
 
 	void unlink();
 
+	// Register the source files of the request it was created for
+	void setSources(const Messages::ContentRequest & request) {
+		std::list<Messages::RawContent *> rawContents;
+		const_cast<Messages::ContentRequest&>(request).collectRawContents(rawContents);
+		for(auto it = rawContents.begin(); it != rawContents.end(); ++it) {
+			if ((*it)->identity.empty()) {
+				continue;
+			}
+			SharedCacheServer::SourceFile & file = server->sourceFiles[(*it)->path];
+			if (file.users++ == 0) {
+				file.identity = (*it)->identity;
+			}
+			sources.push_back((*it)->path);
+		}
+	}
+
 	void addReader() {
 		clientCount++;
+		touch();
+	}
+
+	void touch() {
 		lastUse = now();
+		// Avoid zero cost for instant productions; and zero size for empty ones
+		evictionValue = server->evictionInflation + (double)(prodDuration + 1) / (size > 0 ? size : 1);
+	}
+
+	void reserve(long size) {
+		releaseReservation();
+		reservedSize = size;
+		server->reservedSize += size;
+	}
+
+	void releaseReservation() {
+		server->reservedSize -= reservedSize;
+		reservedSize = 0;
+	}
+
+	void prodSucceeded(long size) {
+		releaseReservation();
+		releaseInputs();
+		produced = true;
+		this->size = size;
+		prodDuration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - prodStart).count();
+		touch();
 	}
 
 	void removeReader() {
 		clientCount--;
 	}
 
+	void holdInput(CacheFileDesc * input) {
+		input->addReader();
+		inputs.push_back(input);
+	}
+
+	void releaseInputs() {
+		for(auto it = inputs.begin(); it != inputs.end(); ++it) {
+			(*it)->removeReader();
+		}
+		inputs.clear();
+	}
+
 
 	void prodFailed(const std::string & message) {
 		// FIXME: mark as error
 		// Remove the producing.
 		// Remove the file as well
-		std::cerr << "Production of " << identifier << " in " << filename << " failed\n";
+		std::cerr << "Production of " << identifier.str() << " in " << filename << " failed\n";
+		releaseReservation();
+		releaseInputs();
 		unlink();
 		error = true;
 		errorDetails = message;
@@ -97,9 +194,27 @@ class CacheFileDesc {
 	{
 		return first->lastUse < second->lastUse;
 	}
+
+	static bool compare_eviction_value (const CacheFileDesc * first, const CacheFileDesc * second)
+	{
+		if (first->evictionValue != second->evictionValue) {
+			return first->evictionValue < second->evictionValue;
+		}
+		return first->lastUse < second->lastUse;
+	}
 };
 
 
+// A dependency of a wanted content, with its key and its own dependencies.
+// Computed once per wanted content: contentKey is a json dump and a hash
+struct ContentDependency {
+	Messages::ContentRequest request;
+	ContentKey key;
+	std::vector<ContentDependency> dependencies;
+	// Estimated size, -1 until the content gets required
+	long estimate = -1;
+};
+
 class Client {
 	friend class SharedCacheServer;
 	friend class ClientFifo;
@@ -115,32 +230,83 @@ class Client {
 	// Is it looking for new frame in a stream
 	bool streamWatcher;
 
+	// Is it queued for io processing
+	bool pendingIo;
+
+	// Is it a worker with productions assigned
+	bool producingWorker;
+
 	int fd;
 	pid_t workerPid;
 
-	char * readBuffer;
-	int readBufferPos;
+	// Frame header, then payload once the header is complete
+	Wire::FrameHeader readHeader;
+	std::string readBuffer;
+	size_t readBufferPos;
+
+	// Format of the last request. Replies use the same
+	uint8_t wireFormat;
 
 	Messages::Request * activeRequest;
+	// Frame requestId of activeRequest. Echoed in the reply
+	uint32_t activeRequestId;
+	// Contents of activeRequest: its contentRequest, or the contents of its batchRequest
+	std::vector<Messages::ContentRequest *> wanted;
+	// Key of each wanted content. Updated when the request gets upgraded
+	std::vector<ContentKey> wantedKeys;
+	// Dependencies of each wanted content. Updated with wantedKeys
+	std::vector<std::vector<ContentDependency>> wantedDependencies;
+	// Estimated size of each wanted content, -1 until it gets required. Updated with wantedKeys
+	std::vector<long> wantedEstimates;
+	// Entry of each wanted content once available (already in reading), nullptr before
+	std::vector<CacheFileDesc *> served;
+	// Start of the wait for contentRequest (for priority aging)
+	std::chrono::time_point<std::chrono::steady_clock> waitingSince;
 	std::list<CacheFileDesc *> reading;
 	std::list<CacheFileDesc *> producing;
 
-	std::chrono::time_point<std::chrono::steady_clock> * watcherExpiry;
+	// Armed in server's watcherDeadlines while a watch with timeout is pending
+	Deadline<Client> watcherExpiry;
 
-	char * writeBuffer;
-	int writeBufferPos;
-	int writeBufferLeft;
+	std::string writeBuffer;
+	size_t writeBufferPos;
+	size_t writeBufferLeft;
+	// Descriptors to pass (SCM_RIGHTS) with the frame starting at the given writeBuffer position. Owned
+	std::list<std::pair<size_t, std::vector<int>>> writeFds;
 
 	bool worker;
 
-	pollfd * poll;
+	// Edge triggered readiness, as reported by epoll. Cleared when read/write hits EAGAIN
+	bool readReady;
+	bool writeReady;
+
+	// Worker that has not yet asked for work, since spawnedAt
+	bool spawning;
+	std::chrono::time_point<std::chrono::steady_clock> spawnedAt;
+	// Worker that has not yet finished a production
+	bool firstProduction;
+
+	// Armed in server's cancelDeadlines when all the productions of the client became obsolete. Killed after that
+	Deadline<Client> cancelDeadline;
 
 	// Set when a signal has been sent to client. The client will be closed at its next "finished" message
 	bool killed;
+	// Threaded worker told to give up its production, at its next progress announce
+	bool cancelled;
+	// A frame could not be queued. Released by the next proceedPendingIo
+	bool sendFailed;
 
 	Stream* producedStream;
 
+	// Content requests with a requestId don't block the connection: each is served by its own Client,
+	// without fd, that replies through the connection and then goes away
+	Client * connection;
+	std::list<Client *> pipelined;
+
 	std::string identifier() const {
+		if (connection != nullptr) {
+			return connection->identifier() + "/" + std::to_string(activeRequestId);
+		}
 		if (workerPid != -1) {
 			return "#" + std::to_string(workerPid);
 		} else {
@@ -148,24 +314,31 @@ class Client {
 		}
 	}
 
-	Client(SharedCacheServer * server, int fd, pid_t workerPid) :readBuffer(), writeBuffer() {
+	Client(SharedCacheServer * server, int fd, pid_t workerPid) :readBuffer(), watcherExpiry(this), writeBuffer(), cancelDeadline(this) {
 		this->fd = fd;
 		this->server = server;
 		this->workerPid = workerPid;
-		poll = nullptr;
+		readReady = false;
+		writeReady = false;
+		pendingIo = false;
+		producingWorker = false;
 		activeRequest = nullptr;
+		activeRequestId = 0;
+		connection = nullptr;
 		writeBufferPos = 0;
 		writeBufferLeft = 0;
 		readBufferPos = 0;
-		readBuffer = (char*)malloc(MAX_MESSAGE_SIZE);
-		writeBuffer = (char*)malloc(MAX_MESSAGE_SIZE);
+		wireFormat = Wire::defaultFormat();
 		waitingConsumer = false;
 		waitingWorker = false;
 		worker = false;
+		spawning = false;
+		firstProduction = false;
 		killed = false;
+		cancelled = false;
+		sendFailed = false;
 		producedStream = nullptr;
 		streamWatcher = false;
-		watcherExpiry = nullptr;
 	}
 
 	void release() {
@@ -184,39 +357,87 @@ class Client {
 		delete(this);
 	}
 
+	// Release later, from proceedPendingIo. The caller of send may be iterating over clients,
+	// and releasing a connection destroys its pipelined clients
+	void fail() {
+		sendFailed = true;
+		server->pendingIoClients.add(this);
+	}
+
 	void kill();
+	// Ask a threaded worker to give up its production
+	void cancel();
+
+	void clearCancelDeadline() {
+		server->cancelDeadlines.disarm(&cancelDeadline);
+	}
 
 private:
 	~Client();
 public:
-	bool send(const std::string & str)
+	// Queue a full frame (header included), after the pending ones. fds are sent along with it
+	bool send(const std::string & frame, const std::vector<int> & fds)
 	{
-		unsigned long l = str.length();
-		if (l > MAX_MESSAGE_SIZE - 2) {
-			std::cerr << "Unable to send message to" << this->identifier() << " : " << str << "\n";
-			release();
+		if (frame.size() > sizeof(Wire::FrameHeader) + MAX_MESSAGE_SIZE) {
+			std::cerr << "Unable to send message of " << frame.size() << " bytes to " << this->identifier() << "\n";
+			fail();
 			return false;
 		} else {
-
-			*((uint16_t*)writeBuffer) = l;
-			memcpy(writeBuffer + 2, str.c_str(), l);
-			writeBufferPos = 0;
-			writeBufferLeft = 2 + l;
+			if (writeBufferLeft == 0) {
+				writeBuffer.clear();
+				writeBufferPos = 0;
+			}
+			if (!fds.empty()) {
+				// The entries may be evicted before the frame leaves
+				std::vector<int> copies;
+				for(auto it = fds.begin(); it != fds.end(); ++it) {
+					int copy = fcntl(*it, F_DUPFD_CLOEXEC, 0);
+					if (copy == -1) {
+						perror("dup");
+						for(auto c = copies.begin(); c != copies.end(); ++c) {
+							::close(*c);
+						}
+						fail();
+						return false;
+					}
+					copies.push_back(copy);
+				}
+				writeFds.push_back(std::make_pair(writeBuffer.size(), copies));
+			}
+			writeBuffer += frame;
+			writeBufferLeft += frame.size();
+			server->pendingIoClients.add(this);
 			return true;
 		}
 	}
 
 	bool reply(const Messages::Result & result) {
-		nlohmann::json j = result;
-		std::string reply = j.dump(0);
+		std::string frame;
+		Wire::encode(result, (Wire::Format)wireFormat, frame, activeRequestId);
+		std::vector<int> fds;
+		server->dataFds(result, fds);
 
-		if (!send(reply)) {
+		if (wireFormat == Wire::Json) {
+			std::cerr << "Server reply to " << this->identifier() << " : " << frame.substr(sizeof(Wire::FrameHeader)) << "\n";
+		}
+		if (connection != nullptr) {
+			// Served: the connection keeps the entries until they are released
+			Client * target = connection;
+			target->reading.splice(target->reading.end(), reading);
+			destroy();
+			return target->send(frame, fds);
+		}
+		if (!send(frame, fds)) {
 			return false;
 		}
-		std::cerr << "Server reply to " << this->identifier() << " : " << reply << "\n";
 
 		delete activeRequest;
 		activeRequest = nullptr;
+		wanted.clear();
+		wantedKeys.clear();
+		wantedDependencies.clear();
+		wantedEstimates.clear();
+		served.clear();
 		return true;
 	}
 
@@ -231,6 +452,12 @@ public:
 	bool isStreamWatcher() const { return streamWatcher; }
 	void setStreamWatcher(bool b) { streamWatcher = b; }
 
+	bool isPendingIo() const { return pendingIo; }
+	void setPendingIo(bool b) { pendingIo = b; }
+
+	bool isProducingWorker() const { return producingWorker; }
+	void setProducingWorker(bool b) { producingWorker = b; }
+
 	SharedCacheServer * getServer() {
 		return server;
 	}
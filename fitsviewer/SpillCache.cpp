@@ -0,0 +1,448 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+
+#include "SpillCache.h"
+#include "SharedCache.h"
+#include "SharedCacheServer.h"
+#include "RawDataStorage.h"
+
+namespace SharedCache {
+
+// Evicted contents waiting for the thread. Others are dropped (their memory is held, and counted in the cache size, until written)
+static const size_t MAX_PENDING_JOBS = 4;
+
+static const char SPILL_MAGIC[4] = {'M', 'S', 'P', '1'};
+
+struct SpillHeader {
+	char magic[4];
+	uint32_t codec;
+	uint64_t size;
+};
+
+SpillCache * SpillCache::build()
+{
+	const char * env = getenv("FITS_SERVER_SPILL_PATH");
+	if (env == nullptr || !env[0]) {
+		return nullptr;
+	}
+	std::string basePath = env;
+	if (basePath[0] != '/') {
+		throw std::runtime_error("invalid spill path: " + basePath);
+	}
+	if (basePath[basePath.length() - 1] != '/') {
+		basePath += '/';
+	}
+	return new SpillCache(basePath, getMaxSize(), getCodec());
+}
+
+long SpillCache::getMaxSize()
+{
+	const char * env = getenv("FITS_SERVER_SPILL_SIZE");
+	if (env == nullptr) {
+		env = "1G";
+	}
+	long result = parseSize(env);
+	if (result < 65536) {
+		throw std::runtime_error("invalid spill size: " + std::string(env));
+	}
+	return result;
+}
+
+SpillCache::Codec SpillCache::getCodec()
+{
+	const char * env = getenv("FITS_SERVER_SPILL_CODEC");
+	if (env == nullptr || !strcmp(env, "shuffle")) {
+		return ShuffleDeflate;
+	}
+	if (!strcmp(env, "deflate")) {
+		return Deflate;
+	}
+	if (!strcmp(env, "raw")) {
+		return Raw;
+	}
+	throw std::runtime_error("invalid spill codec: " + std::string(env));
+}
+
+SpillCache::SpillCache(const std::string & basePath, long maxSize, Codec codec):
+	basePath(basePath),
+	maxSize(maxSize),
+	codec(codec)
+{
+	owner = getpid();
+	thread = nullptr;
+	stopping = false;
+	currentSize = 0;
+	pendingSize = 0;
+	fileGenerator = 0;
+	stats.maxSize = maxSize;
+	stats.size = 0;
+	stats.hits = 0;
+	stats.misses = 0;
+	stats.writes = 0;
+
+	int rslt = mkdir(basePath.c_str(), 0777);
+	if (rslt == -1 && errno != EEXIST) {
+		perror(basePath.c_str());
+		throw std::runtime_error("Unable to create spill directory");
+	}
+	clearDirectory();
+}
+
+SpillCache::~SpillCache()
+{
+	if (getpid() != owner) {
+		// The thread does not exist in this process
+		return;
+	}
+	if (thread != nullptr) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		thread->join();
+		delete(thread);
+		thread = nullptr;
+	}
+	for(auto it = jobs.begin(); it != jobs.end(); ++it) {
+		close(it->fd);
+	}
+	jobs.clear();
+}
+
+void SpillCache::clearDirectory()
+{
+	DIR* dir = opendir(basePath.c_str());
+	if (dir == nullptr) {
+		perror("opendir");
+		return;
+	}
+	dirent * entry;
+	while((entry = readdir(dir))) {
+		std::string name(entry->d_name);
+		if (name.compare(0, 5, "spill") != 0) {
+			continue;
+		}
+		name = basePath + name;
+		if (unlink(name.c_str()) == -1) {
+			perror(name.c_str());
+		}
+	}
+	closedir(dir);
+}
+
+void SpillCache::store(const ContentKey & identifier, int fd, long size)
+{
+	Job job;
+	job.identifier = identifier;
+	job.fd = fd;
+	job.size = size;
+	// Streams have no source to compare against
+	if (!CacheIndex::stampSources(identifier, job.sources)) {
+		close(fd);
+		return;
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	auto existing = itemByIdentifier.find(identifier);
+	if (existing != itemByIdentifier.end() && existing->second->sources == job.sources) {
+		items.splice(items.begin(), items, existing->second);
+		close(fd);
+		return;
+	}
+	if (jobs.size() >= MAX_PENDING_JOBS) {
+		std::cerr << "Spill queue full, dropping evicted content of " << size << " bytes\n";
+		close(fd);
+		return;
+	}
+	jobs.push_back(job);
+	pendingSize += size;
+	if (thread == nullptr) {
+		thread = new std::thread([this]() { run(); });
+	}
+	wakeup.notify_one();
+}
+
+void SpillCache::run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while(true) {
+		wakeup.wait(guard, [this]() { return stopping || !jobs.empty(); });
+		if (stopping) {
+			return;
+		}
+		Job job = jobs.front();
+		jobs.pop_front();
+
+		guard.unlock();
+		try {
+			write(job);
+		} catch(const std::exception & e) {
+			std::cerr << "Failed to spill content: " << e.what() << "\n";
+		}
+		close(job.fd);
+		guard.lock();
+		pendingSize -= job.size;
+	}
+}
+
+void SpillCache::write(Job & job)
+{
+	void * data = mmap(0, job.size, PROT_READ, MAP_SHARED, job.fd, 0);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		throw std::runtime_error("Mmap failed");
+	}
+	std::string encoded;
+	SpillHeader header;
+	memcpy(header.magic, SPILL_MAGIC, sizeof(header.magic));
+	header.codec = codec;
+	header.size = job.size;
+	encoded.append((const char*)&header, sizeof(header));
+	encode(codec, (const char*)data, job.size, encoded);
+	munmap(data, job.size);
+
+	if ((long)encoded.size() > maxSize) {
+		return;
+	}
+
+	std::string filename;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		std::ostringstream oss;
+		oss << "spill" << std::setfill('0') << std::setw(12) << (fileGenerator++);
+		filename = oss.str();
+	}
+	std::string path = basePath + filename;
+	std::string tmpPath = path + ".tmp";
+	int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		perror(tmpPath.c_str());
+		throw std::runtime_error("Unable to create spill file");
+	}
+	size_t done = 0;
+	while(done < encoded.size()) {
+		ssize_t wr = ::write(fd, encoded.data() + done, encoded.size() - done);
+		if (wr == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror(tmpPath.c_str());
+			close(fd);
+			unlink(tmpPath.c_str());
+			throw std::runtime_error("Unable to write spill file");
+		}
+		done += wr;
+	}
+	close(fd);
+	// Workers only ever see complete files
+	if (rename(tmpPath.c_str(), path.c_str()) == -1) {
+		perror(path.c_str());
+		unlink(tmpPath.c_str());
+		throw std::runtime_error("Unable to write spill file");
+	}
+	std::cerr << "Spilled " << job.size << " bytes to " << filename << " (" << encoded.size() << " bytes)\n";
+
+	std::lock_guard<std::mutex> guard(lock);
+	auto existing = itemByIdentifier.find(job.identifier);
+	if (existing != itemByIdentifier.end()) {
+		drop(existing->second);
+	}
+	Item item;
+	item.identifier = job.identifier;
+	item.filename = filename;
+	item.size = encoded.size();
+	item.sources = job.sources;
+	items.push_front(item);
+	itemByIdentifier[job.identifier] = items.begin();
+	currentSize += item.size;
+	stats.writes++;
+
+	while(currentSize > maxSize) {
+		drop(std::prev(items.end()));
+	}
+	stats.size = currentSize;
+}
+
+void SpillCache::drop(std::list<Item>::iterator item)
+{
+	// A worker may still be reading it: unlink is fine
+	std::string path = basePath + item->filename;
+	if (unlink(path.c_str()) == -1) {
+		perror(path.c_str());
+	}
+	currentSize -= item->size;
+	stats.size = currentSize;
+	itemByIdentifier.erase(item->identifier);
+	items.erase(item);
+}
+
+bool SpillCache::lookup(const ContentKey & identifier, std::string & path)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto existing = itemByIdentifier.find(identifier);
+	if (existing == itemByIdentifier.end()) {
+		stats.misses++;
+		return false;
+	}
+	std::vector<CacheIndex::SourceStamp> sources;
+	if (!CacheIndex::stampSources(identifier, sources) || existing->second->sources != sources) {
+		std::cerr << "Dropping outdated spilled content " << existing->second->filename << "\n";
+		drop(existing->second);
+		stats.misses++;
+		return false;
+	}
+	items.splice(items.begin(), items, existing->second);
+	path = basePath + existing->second->filename;
+	stats.hits++;
+	return true;
+}
+
+SpillCache::Stats SpillCache::getStats()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return stats;
+}
+
+long SpillCache::getPendingSize()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return pendingSize;
+}
+
+void SpillCache::shuffle(const char * from, char * into, size_t size, bool reverse)
+{
+	// The RawDataStorage header stays as is; it gives the sample size of the planes
+	size_t headerSize = sizeof(RawDataStorage);
+	if (size < headerSize) {
+		memcpy(into, from, size);
+		return;
+	}
+	memcpy(into, from, headerSize);
+	const RawDataStorage * storage = (const RawDataStorage *)(reverse ? into : from);
+	size_t lanes = RawDataStorage::sampleSize((RawDataStorage::SampleType)storage->sampleType);
+
+	size_t count = (size - headerSize) / lanes;
+	const char * src = from + headerSize;
+	char * dst = into + headerSize;
+	for(size_t lane = 0; lane < lanes; ++lane) {
+		for(size_t i = 0; i < count; ++i) {
+			if (reverse) {
+				dst[i * lanes + lane] = src[lane * count + i];
+			} else {
+				dst[lane * count + i] = src[i * lanes + lane];
+			}
+		}
+	}
+	// Trailing bytes that don't make a sample
+	size_t done = headerSize + count * lanes;
+	memcpy(into + done, from + done, size - done);
+}
+
+void SpillCache::encode(Codec codec, const char * data, size_t size, std::string & into)
+{
+	if (codec == Raw) {
+		into.append(data, size);
+		return;
+	}
+	std::string shuffled;
+	if (codec == ShuffleDeflate) {
+		shuffled.resize(size);
+		shuffle(data, &shuffled[0], size, false);
+		data = shuffled.data();
+	}
+	size_t offset = into.size();
+	uLongf length = compressBound(size);
+	into.resize(offset + length);
+	if (compress2((Bytef*)&into[offset], &length, (const Bytef*)data, size, Z_BEST_SPEED) != Z_OK) {
+		throw std::runtime_error("compress failed");
+	}
+	into.resize(offset + length);
+}
+
+bool SpillCache::decode(Codec codec, const char * from, size_t fromSize, char * into, size_t size)
+{
+	if (codec == Raw) {
+		if (fromSize != size) {
+			return false;
+		}
+		memcpy(into, from, size);
+		return true;
+	}
+	if (codec != Deflate && codec != ShuffleDeflate) {
+		return false;
+	}
+	std::string shuffled;
+	char * target = into;
+	if (codec == ShuffleDeflate) {
+		shuffled.resize(size);
+		target = &shuffled[0];
+	}
+	uLongf length = size;
+	if (uncompress((Bytef*)target, &length, (const Bytef*)from, fromSize) != Z_OK || length != size) {
+		return false;
+	}
+	if (codec == ShuffleDeflate) {
+		shuffle(shuffled.data(), into, size, true);
+	}
+	return true;
+}
+
+bool SpillCache::restore(const std::string & path, WriteableEntry * entry)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		// Dropped meanwhile
+		perror(path.c_str());
+		return false;
+	}
+	std::string content;
+	char buffer[65536];
+	while(true) {
+		ssize_t readen = read(fd, buffer, sizeof(buffer));
+		if (readen == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror(path.c_str());
+			close(fd);
+			return false;
+		}
+		if (readen == 0) {
+			break;
+		}
+		content.append(buffer, readen);
+	}
+	close(fd);
+
+	SpillHeader header;
+	if (content.size() < sizeof(header)) {
+		return false;
+	}
+	memcpy(&header, content.data(), sizeof(header));
+	if (memcmp(header.magic, SPILL_MAGIC, sizeof(header.magic))) {
+		return false;
+	}
+
+	entry->allocate(header.size);
+	if (!decode((Codec)header.codec, content.data() + sizeof(header), content.size() - sizeof(header), (char*)entry->data(), header.size)) {
+		throw WorkerError("corrupted spill file " + path);
+	}
+	return true;
+}
+
+}
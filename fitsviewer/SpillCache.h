@@ -0,0 +1,114 @@
+#ifndef SPILLCACHE_H_
+#define SPILLCACHE_H_
+
+#include <sys/types.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "ContentKey.h"
+#include "CacheIndex.h"
+
+namespace SharedCache {
+
+class WriteableEntry;
+
+// Second tier for the raw contents evicted from the cache (FITS_SERVER_SPILL_PATH).
+// A background thread of fits-server compresses them to local disk; a worker then restores
+// them instead of decoding the FITS file again. Not persistent: emptied at startup
+class SpillCache {
+public:
+	enum Codec {
+		// Stored as is
+		Raw,
+		Deflate,
+		// Each byte of the samples in its own plane, then deflate
+		ShuffleDeflate,
+	};
+
+	struct Stats {
+		long maxSize;
+		long size;
+		long hits;
+		long misses;
+		long writes;
+	};
+
+private:
+	struct Item {
+		ContentKey identifier;
+		std::string filename;
+		long size;
+		std::vector<CacheIndex::SourceStamp> sources;
+	};
+
+	struct Job {
+		ContentKey identifier;
+		// Read only descriptor on the evicted data. Owned
+		int fd;
+		long size;
+		std::vector<CacheIndex::SourceStamp> sources;
+	};
+
+	// Starts and terminate with '/'
+	std::string basePath;
+	long maxSize;
+	Codec codec;
+	// Forked workers inherit the object, but not its thread
+	pid_t owner;
+
+	// Protects everything below
+	std::mutex lock;
+	std::condition_variable wakeup;
+	std::thread * thread;
+	bool stopping;
+	std::list<Job> jobs;
+	// Size of the jobs, queued or being written
+	long pendingSize;
+	// Most recently used first
+	std::list<Item> items;
+	std::unordered_map<ContentKey, std::list<Item>::iterator, ContentKeyHash> itemByIdentifier;
+	long currentSize;
+	long fileGenerator;
+	Stats stats;
+
+	void run();
+	void write(Job & job);
+	void drop(std::list<Item>::iterator item);
+	void clearDirectory();
+
+	// Split the samples of a RawDataStorage into byte planes (or join them back)
+	static void shuffle(const char * from, char * into, size_t size, bool reverse);
+
+	static long getMaxSize();
+	static Codec getCodec();
+public:
+	SpillCache(const std::string & basePath, long maxSize, Codec codec);
+	~SpillCache();
+
+	// Queue an evicted content for compression. Takes ownership of fd
+	void store(const ContentKey & identifier, int fd, long size);
+	// Path of the spilled copy of a content, if any and still up to date with its sources
+	bool lookup(const ContentKey & identifier, std::string & path);
+	Stats getStats();
+	// The evicted contents are held in memory until written: they still count in the cache size
+	long getPendingSize();
+
+	// Decompress a spilled copy into an entry. False if the file is not usable (nothing was allocated then)
+	static bool restore(const std::string & path, WriteableEntry * entry);
+
+	// data is a RawDataStorage
+	static void encode(Codec codec, const char * data, size_t size, std::string & into);
+	// False if from is not a valid encoding of exactly size bytes
+	static bool decode(Codec codec, const char * from, size_t fromSize, char * into, size_t size);
+
+	// Null unless FITS_SERVER_SPILL_PATH is set
+	static SpillCache * build();
+};
+
+}
+
+#endif
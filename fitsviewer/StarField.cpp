@@ -23,6 +23,12 @@ using namespace std;
 
 using nlohmann::json;
 
+long SharedCache::Messages::StarField::estimateSize() const
+{
+	// json for up to 200 stars
+	return 64 * 1024;
+}
+
 void SharedCache::Messages::StarField::produce(SharedCache::Entry* entry)
 {
 	SharedCache::Messages::ContentRequest contentRequest;
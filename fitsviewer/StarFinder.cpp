@@ -222,7 +222,8 @@ bool StarFinder::perform(StarOccurence & result) {
     result.minStddev = minFwhm / 2.35;
     result.minFwhmAngle = minAngle;
     result.flux = aduSum;
+    // Levels of wider samples have 16 bits
     result.peak = maxAbsAdu / (content->bitpix == 8 ? 255.0 : 65535.0);
-    result.sat = (maxAbsAdu << (content->bitpix - 16)) >= 65535*0.9;
+    result.sat = result.peak >= 0.9;
     return true;
 }
\ No newline at end of file
@@ -30,10 +30,8 @@ namespace SharedCache {
         contentRequest.fitsContent->serial = this->serial;
         contentRequest.fitsContent->stream = this->id;
 
-        std::string identifier = contentRequest.uniqKey();
-
         auto ret = new CacheFileDesc(server,
-                            identifier,
+                            contentRequest.contentKey(),
                             server->newFilename());
 
         ret->serial = this->serial;
@@ -0,0 +1,162 @@
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+
+#include "Trace.h"
+#include "json.hpp"
+
+namespace SharedCache {
+
+static std::mutex traceLock;
+// Process that opened traceFd, and named itself in the trace
+static pid_t traceOwner = -1;
+static int traceFd = -1;
+static bool traceNamed = false;
+static std::string processName;
+
+static std::atomic<long> idGenerator(0);
+
+static thread_local std::string currentTraceId;
+
+std::string Trace::fileName()
+{
+	const char * env = getenv("FITS_SERVER_TRACE");
+	return env == nullptr ? "" : env;
+}
+
+bool Trace::enabled()
+{
+	static const bool result = !fileName().empty();
+	return result;
+}
+
+int64_t Trace::now()
+{
+	return at(std::chrono::steady_clock::now());
+}
+
+int64_t Trace::at(const std::chrono::time_point<std::chrono::steady_clock> & time)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+}
+
+void Trace::setProcessName(const std::string & name)
+{
+	std::lock_guard<std::mutex> guard(traceLock);
+	processName = name;
+	traceNamed = false;
+}
+
+std::string Trace::newId()
+{
+	std::ostringstream oss;
+	oss << getpid() << '.' << now() << '.' << (idGenerator++);
+	return oss.str();
+}
+
+const std::string & Trace::currentId()
+{
+	return currentTraceId;
+}
+
+// Called with traceLock held
+int Trace::fd()
+{
+	if (traceOwner != getpid()) {
+		// Forked processes keep the inherited descriptor (O_APPEND), but name themselves
+		traceOwner = getpid();
+		traceNamed = false;
+	}
+	if (traceFd == -1) {
+		std::string path = fileName();
+		traceFd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if (traceFd != -1) {
+			if (::write(traceFd, "[\n", 2) == -1) {
+				perror(path.c_str());
+			}
+		} else if (errno == EEXIST) {
+			traceFd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+		}
+		if (traceFd == -1) {
+			perror(path.c_str());
+		}
+	}
+	return traceFd;
+}
+
+void Trace::write(const std::string & event)
+{
+	std::lock_guard<std::mutex> guard(traceLock);
+	int f = fd();
+	if (f == -1) {
+		return;
+	}
+	std::string line;
+	if (!traceNamed) {
+		traceNamed = true;
+		nlohmann::json meta;
+		meta["name"] = "process_name";
+		meta["ph"] = "M";
+		meta["pid"] = getpid();
+		meta["args"]["name"] = processName.empty() ? std::string("pid ") + std::to_string(getpid()) : processName;
+		line = meta.dump() + ",\n";
+	}
+	line += event + ",\n";
+	// A single append per event: concurrent writers don't interleave
+	if (::write(f, line.data(), line.size()) == -1) {
+		perror("trace");
+	}
+}
+
+void Trace::complete(const char * name, const char * category, int64_t start, int64_t end, const std::string & traceId)
+{
+	if (!enabled()) {
+		return;
+	}
+	nlohmann::json event;
+	event["name"] = name;
+	event["cat"] = category;
+	event["ph"] = "X";
+	event["ts"] = start;
+	event["dur"] = end - start;
+	event["pid"] = getpid();
+	event["tid"] = (long)syscall(SYS_gettid);
+	if (!traceId.empty()) {
+		event["args"]["traceId"] = traceId;
+	}
+	write(event.dump());
+}
+
+Trace::Context::Context(const std::string & traceId):
+	previous(currentTraceId)
+{
+	currentTraceId = traceId;
+}
+
+Trace::Context::~Context()
+{
+	currentTraceId = previous;
+}
+
+Trace::Span::Span(const char * name, const char * category):
+	name(name),
+	category(category),
+	start(enabled() ? now() : 0)
+{
+}
+
+Trace::Span::~Span()
+{
+	if (enabled()) {
+		complete(name, category, start, now(), currentTraceId);
+	}
+}
+
+}
@@ -0,0 +1,55 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <string>
+#include <chrono>
+
+namespace SharedCache {
+
+// Production tracing (FITS_SERVER_TRACE=/path/to/trace.json). Server, workers and clients append
+// Chrome trace events to the same file, tagged with the traceId of the request they work for.
+// The file is left open ended (allowed by the format): load it in chrome://tracing or ui.perfetto.dev
+class Trace {
+	static std::string fileName();
+	static int fd();
+	static void write(const std::string & event);
+public:
+	// Current time, in trace unit (us of the monotonic clock, shared by all processes)
+	static int64_t now();
+	static int64_t at(const std::chrono::time_point<std::chrono::steady_clock> & time);
+
+	static bool enabled();
+	// Name of the process in the trace
+	static void setProcessName(const std::string & name);
+	// Unique among all processes
+	static std::string newId();
+
+	// Id of the request the calling thread works for (see Context). Empty if none
+	static const std::string & currentId();
+
+	// Record a span. Does nothing when tracing is disabled
+	static void complete(const char * name, const char * category, int64_t start, int64_t end, const std::string & traceId);
+
+	// Set the id of the request the calling thread works for, until destruction
+	class Context {
+		std::string previous;
+	public:
+		Context(const std::string & traceId);
+		~Context();
+	};
+
+	// Record a span from construction to destruction, for the current request
+	class Span {
+		const char * name;
+		const char * category;
+		int64_t start;
+	public:
+		Span(const char * name, const char * category);
+		~Span();
+	};
+};
+
+}
+
+#endif
@@ -0,0 +1,490 @@
+#include <stdlib.h>
+
+#include "SharedCache.h"
+#include "WireFormat.h"
+
+namespace SharedCache {
+	namespace Wire {
+		bool isValidFormat(uint8_t format)
+		{
+			return format == Json || format == Binary;
+		}
+
+		std::string formatError(uint8_t format)
+		{
+			if (isValidFormat(format)) {
+				return "";
+			}
+			if (format >= FirstBinary && format < Json) {
+				return "Binary protocol version " + std::to_string(format) + " is not supported (this build uses "
+						+ std::to_string(Binary) + "): fits-server and its clients must come from the same build";
+			}
+			return "Invalid message format " + std::to_string(format);
+		}
+
+		Format defaultFormat()
+		{
+			const char * env = getenv("FITS_SERVER_PROTOCOL");
+			if (env != nullptr && !strcmp(env, "json")) {
+				return Json;
+			}
+			return Binary;
+		}
+	}
+
+	namespace Messages {
+		template<class M> static void to_binary(BinaryWriter & w, const ChildPtr<M> & i)
+		{
+			w.writeBool(i);
+			if (i) {
+				to_binary(w, *i);
+			}
+		}
+
+		template<class M> static void from_binary(BinaryReader & r, ChildPtr<M> & p)
+		{
+			if (r.readBool()) {
+				from_binary(r, *p.build());
+			} else {
+				p.clear();
+			}
+		}
+
+		void to_binary(BinaryWriter & w, const RawContent & i)
+		{
+			w.writeString(i.path);
+			w.writeString(i.stream);
+			w.writeLong(i.serial);
+			w.writeBool(i.exactSerial);
+			w.writeString(i.identity);
+		}
+
+		void from_binary(BinaryReader & r, RawContent & p)
+		{
+			p.path = r.readString();
+			p.stream = r.readString();
+			p.serial = r.readLong();
+			p.exactSerial = r.readBool();
+			p.identity = r.readString();
+		}
+
+		void to_binary(BinaryWriter & w, const Histogram & i)
+		{
+			to_binary(w, i.source);
+		}
+
+		void from_binary(BinaryReader & r, Histogram & p)
+		{
+			from_binary(r, p.source);
+		}
+
+		void to_binary(BinaryWriter & w, const FitsHeader & i)
+		{
+			to_binary(w, i.source);
+		}
+
+		void from_binary(BinaryReader & r, FitsHeader & p)
+		{
+			from_binary(r, p.source);
+		}
+
+		void to_binary(BinaryWriter & w, const StarField & i)
+		{
+			to_binary(w, i.source);
+		}
+
+		void from_binary(BinaryReader & r, StarField & p)
+		{
+			from_binary(r, p.source);
+		}
+
+		void to_binary(BinaryWriter & w, const Astrometry & i)
+		{
+			to_binary(w, i.source);
+			w.writeString(i.exePath);
+			w.writeString(i.libraryPath);
+			w.writeDouble(i.fieldMin);
+			w.writeDouble(i.fieldMax);
+			w.writeDouble(i.searchRadius);
+			w.writeDouble(i.raCenterEstimate);
+			w.writeDouble(i.decCenterEstimate);
+			w.writeInt(i.numberOfBinInUniformize);
+		}
+
+		void from_binary(BinaryReader & r, Astrometry & p)
+		{
+			from_binary(r, p.source);
+			p.exePath = r.readString();
+			p.libraryPath = r.readString();
+			p.fieldMin = r.readDouble();
+			p.fieldMax = r.readDouble();
+			p.searchRadius = r.readDouble();
+			p.raCenterEstimate = r.readDouble();
+			p.decCenterEstimate = r.readDouble();
+			p.numberOfBinInUniformize = r.readInt();
+		}
+
+		void to_binary(BinaryWriter & w, const ContentRequest & i)
+		{
+			to_binary(w, i.fitsContent);
+			to_binary(w, i.histogram);
+			to_binary(w, i.starField);
+			to_binary(w, i.astrometry);
+			to_binary(w, i.fitsHeader);
+			w.writeInt(i.priority);
+			w.writeString(i.traceId);
+		}
+
+		void from_binary(BinaryReader & r, ContentRequest & p)
+		{
+			from_binary(r, p.fitsContent);
+			from_binary(r, p.histogram);
+			from_binary(r, p.starField);
+			from_binary(r, p.astrometry);
+			from_binary(r, p.fitsHeader);
+			p.priority = r.readInt();
+			if (p.priority < PriorityInteractive || p.priority > PriorityBackground) {
+				throw std::runtime_error("invalid priority");
+			}
+			p.traceId = r.readString();
+		}
+
+		void to_binary(BinaryWriter & w, const StreamWatchRequest & i)
+		{
+			w.writeString(i.stream);
+			w.writeLong(i.serial);
+			w.writeInt(i.timeout);
+		}
+
+		void from_binary(BinaryReader & r, StreamWatchRequest & p)
+		{
+			p.stream = r.readString();
+			p.serial = r.readLong();
+			p.timeout = r.readInt();
+		}
+
+		void to_binary(BinaryWriter & w, const StreamWatchResult & i)
+		{
+			w.writeBool(i.timedout);
+			w.writeBool(i.dead);
+		}
+
+		void from_binary(BinaryReader & r, StreamWatchResult & p)
+		{
+			p.timedout = r.readBool();
+			p.dead = r.readBool();
+		}
+
+		void to_binary(BinaryWriter & w, const WorkRequest & i)
+		{
+		}
+
+		void from_binary(BinaryReader & r, WorkRequest & p)
+		{
+		}
+
+		void to_binary(BinaryWriter & w, const WorkResponse & i)
+		{
+			to_binary(w, i.content);
+			w.writeString(i.filename);
+			w.writeString(i.spilled);
+		}
+
+		void from_binary(BinaryReader & r, WorkResponse & p)
+		{
+			from_binary(r, p.content);
+			p.filename = r.readString();
+			p.spilled = r.readString();
+		}
+
+		void to_binary(BinaryWriter & w, const FinishedAnnounce & i)
+		{
+			w.writeBool(i.error);
+			w.writeLong(i.size);
+			w.writeString(i.filename);
+			w.writeString(i.errorDetails);
+			w.writeBool(i.keep);
+		}
+
+		void from_binary(BinaryReader & r, FinishedAnnounce & p)
+		{
+			p.error = r.readBool();
+			p.size = r.readLong();
+			p.filename = r.readString();
+			p.errorDetails = r.readString();
+			p.keep = r.readBool();
+		}
+
+		void to_binary(BinaryWriter & w, const ReleasedAnnounce & i)
+		{
+			w.writeString(i.filename);
+		}
+
+		void from_binary(BinaryReader & r, ReleasedAnnounce & p)
+		{
+			p.filename = r.readString();
+		}
+
+		void to_binary(BinaryWriter & w, const ProgressAnnounce & i)
+		{
+			w.writeString(i.filename);
+			w.writeDouble(i.progress);
+		}
+
+		void from_binary(BinaryReader & r, ProgressAnnounce & p)
+		{
+			p.filename = r.readString();
+			p.progress = r.readDouble();
+		}
+
+		void to_binary(BinaryWriter & w, const StreamStartImageRequest & i)
+		{
+		}
+
+		void from_binary(BinaryReader & r, StreamStartImageRequest & p)
+		{
+		}
+
+		void to_binary(BinaryWriter & w, const StreamStartImageResult & i)
+		{
+			w.writeString(i.filename);
+			w.writeString(i.streamId);
+		}
+
+		void from_binary(BinaryReader & r, StreamStartImageResult & p)
+		{
+			p.filename = r.readString();
+			p.streamId = r.readString();
+		}
+
+		void to_binary(BinaryWriter & w, const StreamPublishRequest & i)
+		{
+			w.writeLong(i.size);
+			w.writeString(i.filename);
+		}
+
+		void from_binary(BinaryReader & r, StreamPublishRequest & p)
+		{
+			p.size = r.readLong();
+			p.filename = r.readString();
+		}
+
+		void to_binary(BinaryWriter & w, const StreamPublishResult & i)
+		{
+			w.writeLong(i.serial);
+		}
+
+		void from_binary(BinaryReader & r, StreamPublishResult & p)
+		{
+			p.serial = r.readLong();
+		}
+
+		void to_binary(BinaryWriter & w, const StatsRequest & i)
+		{
+		}
+
+		void from_binary(BinaryReader & r, StatsRequest & p)
+		{
+		}
+
+		void to_binary(BinaryWriter & w, const ProductStats & i)
+		{
+			w.writeString(i.product);
+			w.writeLong(i.hits);
+			w.writeLong(i.misses);
+			w.writeLong(i.productions);
+			w.writeLong(i.failures);
+			w.writeLong(i.productionTime);
+			w.writeLong(i.evictions);
+			w.writeLong(i.evictedBytes);
+		}
+
+		void from_binary(BinaryReader & r, ProductStats & p)
+		{
+			p.product = r.readString();
+			p.hits = r.readLong();
+			p.misses = r.readLong();
+			p.productions = r.readLong();
+			p.failures = r.readLong();
+			p.productionTime = r.readLong();
+			p.evictions = r.readLong();
+			p.evictedBytes = r.readLong();
+		}
+
+		void to_binary(BinaryWriter & w, const StatsResult & i)
+		{
+			w.writeLong(i.maxSize);
+			w.writeLong(i.currentSize);
+			w.writeLong(i.reservedSize);
+			w.writeLong(i.contentCount);
+			w.writeLong(i.waitingConsumers);
+			w.writeLong(i.waitingWorkers);
+			w.writeLong(i.streamWatchers);
+			w.writeLong(i.startedWorkers);
+			w.writeLong(i.activeWorkers);
+			w.writeLong(i.blockedWorkers);
+			w.writeLong(i.workerSpawns);
+			w.writeLong(i.workerSpawnTime);
+			w.writeLong(i.firstProductions);
+			w.writeLong(i.firstProductionTime);
+			w.writeLong(i.spillMaxSize);
+			w.writeLong(i.spillSize);
+			w.writeLong(i.spillHits);
+			w.writeLong(i.spillMisses);
+			w.writeLong(i.spillWrites);
+			w.writeInt(i.products.size());
+			for(auto it = i.products.begin(); it != i.products.end(); ++it) {
+				to_binary(w, *it);
+			}
+		}
+
+		void from_binary(BinaryReader & r, StatsResult & p)
+		{
+			p.maxSize = r.readLong();
+			p.currentSize = r.readLong();
+			p.reservedSize = r.readLong();
+			p.contentCount = r.readLong();
+			p.waitingConsumers = r.readLong();
+			p.waitingWorkers = r.readLong();
+			p.streamWatchers = r.readLong();
+			p.startedWorkers = r.readLong();
+			p.activeWorkers = r.readLong();
+			p.blockedWorkers = r.readLong();
+			p.workerSpawns = r.readLong();
+			p.workerSpawnTime = r.readLong();
+			p.firstProductions = r.readLong();
+			p.firstProductionTime = r.readLong();
+			p.spillMaxSize = r.readLong();
+			p.spillSize = r.readLong();
+			p.spillHits = r.readLong();
+			p.spillMisses = r.readLong();
+			p.spillWrites = r.readLong();
+			int32_t count = r.readInt();
+			if (count < 0 || count > ProductTypeCount) {
+				throw std::runtime_error("invalid product count");
+			}
+			p.products.resize(count);
+			for(int32_t i = 0; i < count; ++i) {
+				from_binary(r, p.products[i]);
+			}
+		}
+
+		void to_binary(BinaryWriter & w, const BatchRequest & i)
+		{
+			w.writeInt(i.contents.size());
+			for(auto it = i.contents.begin(); it != i.contents.end(); ++it) {
+				to_binary(w, *it);
+			}
+		}
+
+		void from_binary(BinaryReader & r, BatchRequest & p)
+		{
+			int32_t count = r.readInt();
+			if (count < 0 || count > MAX_BATCH_SIZE) {
+				throw std::runtime_error("invalid batch size");
+			}
+			p.contents.resize(count);
+			for(int32_t i = 0; i < count; ++i) {
+				from_binary(r, p.contents[i]);
+			}
+		}
+
+		void to_binary(BinaryWriter & w, const Request & i)
+		{
+			to_binary(w, i.contentRequest);
+			to_binary(w, i.streamWatchRequest);
+			to_binary(w, i.workRequest);
+			to_binary(w, i.finishedAnnounce);
+			to_binary(w, i.releasedAnnounce);
+			to_binary(w, i.streamStartImageRequest);
+			to_binary(w, i.streamPublishRequest);
+			to_binary(w, i.statsRequest);
+			to_binary(w, i.progressAnnounce);
+			to_binary(w, i.batchRequest);
+		}
+
+		void from_binary(BinaryReader & r, Request & p)
+		{
+			from_binary(r, p.contentRequest);
+			from_binary(r, p.streamWatchRequest);
+			from_binary(r, p.workRequest);
+			from_binary(r, p.finishedAnnounce);
+			from_binary(r, p.releasedAnnounce);
+			from_binary(r, p.streamStartImageRequest);
+			from_binary(r, p.streamPublishRequest);
+			from_binary(r, p.statsRequest);
+			from_binary(r, p.progressAnnounce);
+			from_binary(r, p.batchRequest);
+		}
+
+		void to_binary(BinaryWriter & w, const ContentResult & i)
+		{
+			w.writeBool(i.error);
+			w.writeString(i.filename);
+			w.writeString(i.errorDetails);
+			to_binary(w, i.actualRequest);
+		}
+
+		void from_binary(BinaryReader & r, ContentResult & p)
+		{
+			p.error = r.readBool();
+			p.filename = r.readString();
+			p.errorDetails = r.readString();
+			from_binary(r, p.actualRequest);
+		}
+
+		void to_binary(BinaryWriter & w, const BatchResult & i)
+		{
+			w.writeInt(i.contents.size());
+			for(auto it = i.contents.begin(); it != i.contents.end(); ++it) {
+				to_binary(w, *it);
+			}
+		}
+
+		void from_binary(BinaryReader & r, BatchResult & p)
+		{
+			int32_t count = r.readInt();
+			if (count < 0 || count > MAX_BATCH_SIZE) {
+				throw std::runtime_error("invalid batch size");
+			}
+			p.contents.resize(count);
+			for(int32_t i = 0; i < count; ++i) {
+				from_binary(r, p.contents[i]);
+			}
+		}
+
+		void to_binary(BinaryWriter & w, const ProgressResult & i)
+		{
+			w.writeBool(i.cancel);
+		}
+
+		void from_binary(BinaryReader & r, ProgressResult & p)
+		{
+			p.cancel = r.readBool();
+		}
+
+		void to_binary(BinaryWriter & w, const Result & i)
+		{
+			to_binary(w, i.contentResult);
+			to_binary(w, i.streamWatchResult);
+			to_binary(w, i.todoResult);
+			to_binary(w, i.streamStartImageResult);
+			to_binary(w, i.streamPublishResult);
+			to_binary(w, i.statsResult);
+			to_binary(w, i.batchResult);
+			to_binary(w, i.progressResult);
+		}
+
+		void from_binary(BinaryReader & r, Result & p)
+		{
+			from_binary(r, p.contentResult);
+			from_binary(r, p.streamWatchResult);
+			from_binary(r, p.todoResult);
+			from_binary(r, p.streamStartImageResult);
+			from_binary(r, p.streamPublishResult);
+			from_binary(r, p.statsResult);
+			from_binary(r, p.batchResult);
+			from_binary(r, p.progressResult);
+		}
+	}
+}
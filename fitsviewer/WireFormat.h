@@ -0,0 +1,137 @@
+#ifndef WIREFORMAT_H_
+#define WIREFORMAT_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#include "json.hpp"
+
+namespace SharedCache {
+
+	// Encoding of messages exchanged between Cache and SharedCacheServer.
+	// Every message is a FrameHeader followed by size bytes of payload.
+	// Binary is the default; json is kept for debugging (FITS_SERVER_PROTOCOL=json)
+	namespace Wire {
+		enum Format : uint8_t {
+			Json = 'J',
+			// Version of the binary layout. Bump it on any change of a to_binary/from_binary,
+			// so that peers from another build get rejected instead of misreading the fields
+			Binary = 4,
+		};
+		// Binary layouts are numbered from 1 to Binary
+		static const uint8_t FirstBinary = 1;
+
+		struct FrameHeader {
+			// Payload size (header excluded)
+			uint32_t size;
+			uint8_t format;
+			uint8_t padding[3];
+			// 0 for synchronous requests. Otherwise, the reply carries the same id, possibly out of order
+			uint32_t requestId;
+		};
+
+		bool isValidFormat(uint8_t format);
+		// Why a frame of that format can't be decoded (empty if it can)
+		std::string formatError(uint8_t format);
+
+		// Read FITS_SERVER_PROTOCOL
+		Format defaultFormat();
+	}
+
+	// Fixed layout, host order encoding (peers always run on the same host)
+	class BinaryWriter {
+		std::string & into;
+
+		template<typename T> void raw(const T & v) {
+			into.append((const char*)&v, sizeof(T));
+		}
+	public:
+		BinaryWriter(std::string & into) : into(into) {}
+
+		void writeBool(bool b) { raw<uint8_t>(b ? 1 : 0); }
+		void writeInt(int32_t v) { raw(v); }
+		void writeLong(int64_t v) { raw(v); }
+		void writeDouble(double v) { raw(v); }
+		void writeString(const std::string & str) {
+			raw<uint32_t>(str.size());
+			into.append(str);
+		}
+	};
+
+	class BinaryReader {
+		const char * ptr;
+		const char * end;
+
+		template<typename T> T raw() {
+			T v;
+			need(sizeof(T));
+			memcpy(&v, ptr, sizeof(T));
+			ptr += sizeof(T);
+			return v;
+		}
+
+		void need(size_t length) {
+			if ((size_t)(end - ptr) < length) {
+				throw std::runtime_error("Truncated message");
+			}
+		}
+	public:
+		BinaryReader(const char * data, size_t length) : ptr(data), end(data + length) {}
+
+		bool readBool() { return raw<uint8_t>() != 0; }
+		int32_t readInt() { return raw<int32_t>(); }
+		int64_t readLong() { return raw<int64_t>(); }
+		double readDouble() { return raw<double>(); }
+		std::string readString() {
+			uint32_t length = raw<uint32_t>();
+			need(length);
+			std::string result(ptr, length);
+			ptr += length;
+			return result;
+		}
+
+		bool atEnd() const { return ptr == end; }
+	};
+
+	namespace Wire {
+		// Append a full frame (header + payload) to into
+		template<class M> void encode(const M & message, Format format, std::string & into, uint32_t requestId = 0)
+		{
+			size_t headerPos = into.size();
+			into.append(sizeof(FrameHeader), 0);
+			if (format == Json) {
+				nlohmann::json j = message;
+				into += j.dump();
+			} else {
+				BinaryWriter writer(into);
+				to_binary(writer, message);
+			}
+			FrameHeader header;
+			memset(&header, 0, sizeof(header));
+			header.size = into.size() - headerPos - sizeof(FrameHeader);
+			header.format = format;
+			header.requestId = requestId;
+			memcpy(&into[headerPos], &header, sizeof(header));
+		}
+
+		template<class M> void decode(const char * payload, uint32_t size, uint8_t format, M & into)
+		{
+			if (format == Json) {
+				into = nlohmann::json::parse(std::string(payload, size)).get<M>();
+				return;
+			}
+			if (!isValidFormat(format)) {
+				throw std::runtime_error(formatError(format));
+			}
+			BinaryReader reader(payload, size);
+			from_binary(reader, into);
+			if (!reader.atEnd()) {
+				throw std::runtime_error("Trailing data in message");
+			}
+		}
+	}
+}
+
+#endif
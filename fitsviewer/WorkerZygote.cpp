@@ -0,0 +1,219 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <iostream>
+#include <stdexcept>
+
+#include "WorkerZygote.h"
+#include "FitsFile.h"
+
+namespace SharedCache {
+
+// Limit of connections passed for one worker
+static const int MAX_WORKER_FDS = 64;
+
+WorkerZygote::WorkerZygote(int controlFd, pid_t pid)
+{
+	this->controlFd = controlFd;
+	this->pid = pid;
+}
+
+WorkerZygote::~WorkerZygote()
+{
+	// The zygote exits on hangup
+	if (controlFd != -1) {
+		close(controlFd);
+		controlFd = -1;
+	}
+}
+
+bool WorkerZygote::enabled()
+{
+	const char * env = getenv("FITS_SERVER_ZYGOTE");
+	return env == nullptr || strcmp(env, "0");
+}
+
+static bool writeFully(int fd, const void * data, size_t length)
+{
+	while(length) {
+		ssize_t wr = write(fd, data, length);
+		if (wr == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data = (const char*)data + wr;
+		length -= wr;
+	}
+	return true;
+}
+
+static bool readFully(int fd, void * data, size_t length)
+{
+	while(length) {
+		ssize_t rd = read(fd, data, length);
+		if (rd == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if (rd == 0) {
+			return false;
+		}
+		data = (char*)data + rd;
+		length -= rd;
+	}
+	return true;
+}
+
+pid_t WorkerZygote::spawn(const std::vector<int> & fds)
+{
+	if (controlFd == -1 || fds.empty() || fds.size() > MAX_WORKER_FDS) {
+		return -1;
+	}
+	// The fd count is the payload; the fds go as ancillary data
+	int32_t count = fds.size();
+	struct iovec iov;
+	iov.iov_base = &count;
+	iov.iov_len = sizeof(count);
+
+	char control[CMSG_SPACE(sizeof(int) * MAX_WORKER_FDS)];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+	struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+	memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+	ssize_t sent;
+	do {
+		sent = sendmsg(controlFd, &msg, MSG_NOSIGNAL);
+	} while(sent == -1 && errno == EINTR);
+
+	pid_t result;
+	if (sent != sizeof(count) || !readFully(controlFd, &result, sizeof(result)) || result <= 0) {
+		perror("zygote");
+		close(controlFd);
+		controlFd = -1;
+		return -1;
+	}
+	return result;
+}
+
+void WorkerZygote::warmUp()
+{
+	// Smallest valid image: a header block and a data block
+	const int width = 8, height = 8;
+	std::string header;
+	const char * cards[] = { "SIMPLE  =                    T", "BITPIX  =                   16", "NAXIS   =                    2",
+							 "NAXIS1  =                    8", "NAXIS2  =                    8", "END" };
+	for(auto card : cards) {
+		std::string c(card);
+		c.resize(80, ' ');
+		header += c;
+	}
+	header.resize(2880, ' ');
+	header.resize(2 * 2880, 0);
+
+	try {
+		FitsFile file;
+		file.openMemory((void*)header.data(), header.size());
+		int bitpix, naxis;
+		long naxes[2];
+		int status = 0;
+		if (fits_get_img_param(file.fptr, 2, &bitpix, &naxis, naxes, &status)) {
+			file.throwFitsIOError("fits_get_img_param", status);
+		}
+		uint16_t pixels[width * height];
+		long firstPixel[2] = { 1, 1 };
+		if (fits_read_pix(file.fptr, TUSHORT, firstPixel, width * height, nullptr, pixels, nullptr, &status)) {
+			file.throwFitsIOError("fits_read_pix", status);
+		}
+		file.close();
+	} catch(const std::exception & e) {
+		std::cerr << "Worker zygote warm up failed: " << e.what() << "\n";
+	}
+}
+
+void WorkerZygote::run(int controlFd, const std::string & basePath, WorkerMain workerMain)
+{
+	// Workers are not waited for
+	signal(SIGCHLD, SIG_IGN);
+	warmUp();
+
+	while(true) {
+		int32_t count;
+		struct iovec iov;
+		iov.iov_base = &count;
+		iov.iov_len = sizeof(count);
+		char control[CMSG_SPACE(sizeof(int) * MAX_WORKER_FDS)];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t rd = recvmsg(controlFd, &msg, MSG_CMSG_CLOEXEC);
+		if (rd == -1 && errno == EINTR) {
+			continue;
+		}
+		if (rd <= 0) {
+			// Server is gone
+			_exit(0);
+		}
+
+		std::vector<int> fds;
+		for(struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+				size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				int * received = (int*)CMSG_DATA(cmsg);
+				fds.insert(fds.end(), received, received + n);
+			}
+		}
+
+		pid_t child = -1;
+		if (rd == sizeof(count) && (size_t)count == fds.size()) {
+			child = fork();
+			if (child == -1) {
+				perror("fork");
+			}
+		} else {
+			std::cerr << "Worker zygote: invalid spawn request\n";
+		}
+		if (child == 0) {
+			close(controlFd);
+			/* Go in own process group */
+			if (setpgid(0, 0) == -1) {
+				perror("child setpgid");
+			}
+			// Connections were received close-on-exec: helpers started by workers (solver) do not inherit them
+			workerMain(basePath, fds);
+			_exit(0);
+		}
+		if (child > 0 && setpgid(child, child) == -1 && errno != EACCES) {
+			perror("zygote setpgid");
+		}
+		for(auto it = fds.begin(); it != fds.end(); ++it) {
+			close(*it);
+		}
+		if (!writeFully(controlFd, &child, sizeof(child))) {
+			_exit(0);
+		}
+	}
+}
+
+}
@@ -0,0 +1,40 @@
+#ifndef WORKERZYGOTE_H_
+#define WORKERZYGOTE_H_
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+namespace SharedCache {
+
+// Process forked once from the server, with production libraries already warmed up.
+// Workers are forked from it: cheaper than forking the whole server, and they don't
+// pay the cold start of cfitsio (FITS_SERVER_ZYGOTE, enabled by default)
+class WorkerZygote {
+public:
+	// Run by the worker process, with one connection to the server per production thread
+	typedef void (*WorkerMain)(const std::string & basePath, const std::vector<int> & fds);
+private:
+	int controlFd;
+	pid_t pid;
+
+	// Exercise cfitsio once so that its pages and symbols are resolved before the workers fork
+	static void warmUp();
+public:
+	WorkerZygote(int controlFd, pid_t pid);
+	~WorkerZygote();
+
+	// Create a worker connected through fds. Returns its pid, -1 if the zygote is not usable
+	pid_t spawn(const std::vector<int> & fds);
+
+	pid_t getPid() const { return pid; }
+
+	// Zygote process body
+	[[ noreturn ]] static void run(int controlFd, const std::string & basePath, WorkerMain workerMain);
+
+	static bool enabled();
+};
+
+}
+
+#endif
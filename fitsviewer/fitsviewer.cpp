@@ -40,6 +40,7 @@
 #include "RawDataStorage.h"
 #include "HistogramStorage.h"
 #include "LookupTable.h"
+#include "Trace.h"
 
 #include "FitsRenderer.h"
 
@@ -551,16 +552,82 @@ public:
 		}
 	}
 
+	// Size of a file, from its header only
+	void sendSize()
+	{
+		SharedCache::Messages::ContentRequest headerRequest;
+		headerRequest.fitsHeader.build();
+		headerRequest.fitsHeader->source.path = path;
+		headerRequest.priority = SharedCache::Messages::PriorityInteractive;
+
+		SharedCache::EntryRef header(cache->getEntry(headerRequest));
+		if (header->hasError()) {
+			throw ResponseException(header->getErrorDetails());
+		}
+		nlohmann::json result;
+		headerRequest.asJsonResult(header, result, nlohmann::json({{"keys", nlohmann::json::array({"BAYERPAT"})}}));
+
+		cgicc::HTTPResponseHeader httpHeader("HTTP/1.1", 200, "OK");
+		httpHeader.addHeader("Content-Type", "application/json");
+		httpHeader.addHeader("connection", "close");
+		sendHttpHeader(httpHeader);
+
+		ImageDesc desc;
+		desc.width = result["width"].get<int>();
+		desc.height = result["height"].get<int>();
+		desc.color = result["color"].get<bool>();
+
+		nlohmann::json j = desc;
+		cout << j.dump() << "\n";
+		exit(0);
+	}
+
 	void sendJpeg()
 	{
+		SharedCache::Trace::Context trace(SharedCache::Trace::enabled() ? SharedCache::Trace::newId() : "");
+		SharedCache::Trace::Span span("sendJpeg", "cgi");
+
+		if (wantSize && !streaming) {
+			sendSize();
+		}
+
 		SharedCache::Messages::ContentRequest contentRequest;
 		contentRequest.fitsContent = new SharedCache::Messages::RawContent();
 		contentRequest.fitsContent->path = !streaming ? path : "";
 		contentRequest.fitsContent->stream = streaming ? stream : "";
 		contentRequest.fitsContent->serial = lastSerialStream;
+		contentRequest.priority = SharedCache::Messages::PriorityInteractive;
+
+		double low = parseFormFloat(formData, "low", 0.05);
+		double med = parseFormFloat(formData, "med", 0.5);
+		double high = parseFormFloat(formData, "high", 0.999);
 
-		SharedCache::EntryRef aduPlane(cache->getEntry(contentRequest));
+		SharedCache::Messages::ContentRequest histogramRequest;
+		histogramRequest.histogram.build();
+		histogramRequest.priority = SharedCache::Messages::PriorityInteractive;
+		// histogramRequest.histogram->source.exactSerial = true;
+
+		SharedCache::Entry * aduPlaneEntry = nullptr;
+		SharedCache::Entry * histogramEntry = nullptr;
+		if (!streaming) {
+			// A file does not change between the two requests: keep both in flight, so the histogram
+			// gets computed as soon as the image is loaded, without waiting for a round trip
+			histogramRequest.histogram->source = *contentRequest.fitsContent;
+			cache->getEntryAsync(contentRequest, [&aduPlaneEntry](SharedCache::Entry * e) { aduPlaneEntry = e; });
+			cache->getEntryAsync(histogramRequest, [&histogramEntry](SharedCache::Entry * e) { histogramEntry = e; });
+			while(cache->pendingAsync()) {
+				cache->processAsync();
+			}
+		} else {
+			aduPlaneEntry = cache->getEntry(contentRequest);
+		}
+
+		SharedCache::EntryRef aduPlane(aduPlaneEntry);
 		if (aduPlane->hasError()) {
+			if (histogramEntry != nullptr) {
+				// Released right away
+				SharedCache::EntryRef histogram(histogramEntry);
+			}
 			throw ResponseException(aduPlane->getErrorDetails());
 		}
 		contentRequest = SharedCache::Messages::ContentRequest(*aduPlane->getActualRequest());
@@ -584,16 +651,12 @@ public:
 			exit(0);
 		}
 
-		double low = parseFormFloat(formData, "low", 0.05);
-		double med = parseFormFloat(formData, "med", 0.5);
-		double high = parseFormFloat(formData, "high", 0.999);
-
-		SharedCache::Messages::ContentRequest histogramRequest;
-		histogramRequest.histogram.build();
-		histogramRequest.histogram->source = *contentRequest.fitsContent;
-		// histogramRequest.histogram->source.exactSerial = true;
-
-		SharedCache::EntryRef histogram(cache->getEntry(histogramRequest));
+		if (histogramEntry == nullptr) {
+			// Streams: the histogram of the frame that was actually served
+			histogramRequest.histogram->source = *contentRequest.fitsContent;
+			histogramEntry = cache->getEntry(histogramRequest);
+		}
+		SharedCache::EntryRef histogram(histogramEntry);
 		if (histogram->hasError()) {
 			throw ResponseException(histogram->getErrorDetails());
 		}
@@ -606,8 +669,6 @@ public:
 		int h = storage->h;
 		std::string bayer = storage->getBayer();
 
-		uint16_t * data = storage->data;
-
 		bool color = forceGreyscale ? false : bayer.length() > 0;
 
 		if (color) {
@@ -619,10 +680,13 @@ public:
 
 		calcBoundingBox(w, h);
 
+		SharedCache::Trace::Span renderSpan("render", "cgi");
 		FitsRenderer * renderer;
 		{
 			FitsRendererParam r;
-			r.data = data;
+			r.data = storage->data;
+			r.sampleType = (RawDataStorage::SampleType)storage->sampleType;
+			r.levels = storage->levels;
 			r.w = w;
 			r.h = h;
 			r.bin = bin;
@@ -695,6 +759,7 @@ public:
 };
 
 int main (int argc, char ** argv) {
+	SharedCache::Trace::setProcessName("fitsviewer.cgi");
 	ResponseGenerator resp;
 	resp.init(argc, argv);
 	resp.perform();
@@ -18,10 +18,61 @@ using nlohmann::json;
 
 
 int main (int argc, char ** argv) {
+	if ((argc == 2) && (!strcmp(argv[1], "--stats"))) {
+		// Don't start a server just to report that it is idle
+		SharedCache::Cache * cache = SharedCache::Cache::connectRunning();
+		SharedCache::Messages::StatsResult result = {};
+		if (cache != nullptr) {
+			result = cache->getStats();
+		}
+		json stats = result;
+		std::string t = stats.dump();
+		write(1, t.data(), t.length());
+		return 0;
+	}
+
     json rawRequest;
 	json options;
     std::cin >> rawRequest;
 
+	if (rawRequest.is_array()) {
+		// Batch: all the results are returned at once, as an array
+		std::vector<SharedCache::Messages::ContentRequest> contentRequests;
+		std::vector<json> batchOptions;
+		for(auto it = rawRequest.begin(); it != rawRequest.end(); ++it) {
+			json item = *it;
+			if (item.contains("options")) {
+				batchOptions.push_back(item["options"]);
+				item.erase("options");
+			} else {
+				batchOptions.push_back(nullptr);
+			}
+			contentRequests.push_back(item.get<SharedCache::Messages::ContentRequest>());
+		}
+
+		SharedCache::Cache * cache = new SharedCache::Cache();
+		std::vector<SharedCache::Entry *> results = cache->getEntries(contentRequests);
+		json prettyResults = json::array();
+		for(size_t i = 0; i < results.size(); ++i) {
+			SharedCache::EntryRef result(results[i]);
+			if (result->hasError()) {
+				cerr << result->getErrorDetails();
+				exit(1);
+			}
+			json prettyResult;
+			if (!contentRequests[i].asJsonResult(result, prettyResult, batchOptions[i])) {
+				// Contents produced as json
+				const char * data = (const char*)result->data();
+				prettyResult = json::parse(data, data + result->size());
+			}
+			prettyResults.push_back(prettyResult);
+			result->release();
+		}
+		std::string t = prettyResults.dump();
+		write(1, t.data(), t.length());
+		return 0;
+	}
+
 	if (rawRequest.contains("options")) {
 		options = rawRequest["options"];
 		rawRequest.erase("options");
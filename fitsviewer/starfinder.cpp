@@ -87,10 +87,9 @@ public:
 			cerr << "channel " << i << " black at " << blackLevelByChannel[i] << " limit at " << limitByChannel[i] <<"\n";
 		}
 		BitMask notBlack(0, 0, content->w - 1, content->h - 1);
-		int ptr = 0;
 		for(int y = 0; y < content->h; ++y)
 			for(int x = 0; x < content->w; ++x)
-				if (content->data[ptr++] > limitByChannel[getChannelId(x, y)]) {
+				if (content->getAdu(x, y) > limitByChannel[getChannelId(x, y)]) {
 					notBlack.set(x, y, 1);
 				}
 
@@ -21,6 +21,7 @@
 #include "SharedCacheServer.h"
 #include "RawDataStorage.h"
 #include "FitsFile.h"
+#include "FastFitsReader.h"
 
 using namespace std;
 
@@ -281,12 +282,14 @@ int main (int argc, char ** argv) {
 
         SharedCache::WorkerError * nextEntryError = nullptr;
 
-        FitsFile file;
-        file.openMemory(data, size);
-        try {
-            SharedCache::Messages::RawContent::readFits(file, nextEntry);
-        } catch(const SharedCache::WorkerError & error) {
-            nextEntryError = new SharedCache::WorkerError(error);
+        if (!FastFitsReader::read((const char*)data, size, nextEntry)) {
+            FitsFile file;
+            file.openMemory(data, size);
+            try {
+                SharedCache::Messages::RawContent::readFits(file, nextEntry);
+            } catch(const SharedCache::WorkerError & error) {
+                nextEntryError = new SharedCache::WorkerError(error);
+            }
         }
 
         if (nextEntryError != nullptr) {
@@ -0,0 +1,81 @@
+#include <sys/socket.h>
+#include <unistd.h>
+#include "catch.hpp"
+
+#include "../SharedCache.h"
+
+using namespace SharedCache;
+
+// Read one request frame, as the server does
+static Messages::Request readRequest(int fd, uint32_t & requestId) {
+    Wire::FrameHeader header;
+    REQUIRE(read(fd, &header, sizeof(header)) == sizeof(header));
+    std::string payload(header.size, '\0');
+    REQUIRE(read(fd, &payload[0], header.size) == header.size);
+    requestId = header.requestId;
+
+    Messages::Request request;
+    Wire::decode(payload.data(), header.size, header.format, request);
+    return request;
+}
+
+static void replyError(int fd, uint32_t requestId, const std::string & details) {
+    Messages::Result result;
+    result.contentResult.build();
+    result.contentResult->error = true;
+    result.contentResult->errorDetails = details;
+
+    std::string frame;
+    Wire::encode(result, Wire::Binary, frame, requestId);
+    REQUIRE(write(fd, frame.data(), frame.size()) == (ssize_t)frame.size());
+}
+
+static Messages::ContentRequest fitsHeaderRequest(const std::string & path) {
+    Messages::ContentRequest request;
+    request.fitsHeader.build();
+    request.fitsHeader->source.path = path;
+    return request;
+}
+
+TEST_CASE( "Asynchronous requests complete out of order", "[AsyncCache]" ) {
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    Cache cache("/tmp/", fds[0]);
+
+    std::vector<std::string> completed;
+    uint32_t first = cache.getEntryAsync(fitsHeaderRequest("/first.fits"), [&completed](Entry * e) {
+        EntryRef entry(e);
+        completed.push_back("first:" + entry->getErrorDetails());
+    });
+    uint32_t second = cache.getEntryAsync(fitsHeaderRequest("/second.fits"), [&completed](Entry * e) {
+        EntryRef entry(e);
+        completed.push_back("second:" + entry->getErrorDetails());
+    });
+    REQUIRE(first != second);
+    REQUIRE(cache.pendingAsync() == 2);
+
+    uint32_t id;
+    Messages::Request request = readRequest(fds[1], id);
+    REQUIRE(id == first);
+    REQUIRE(request.contentRequest->fitsHeader->source.path == "/first.fits");
+    request = readRequest(fds[1], id);
+    REQUIRE(id == second);
+    REQUIRE(request.contentRequest->fitsHeader->source.path == "/second.fits");
+
+    // Nothing is ready yet
+    REQUIRE(!cache.processAsync(0));
+
+    replyError(fds[1], second, "2");
+    REQUIRE(cache.processAsync(1000));
+    REQUIRE(completed == std::vector<std::string>({"second:2"}));
+    REQUIRE(cache.pendingAsync() == 1);
+
+    replyError(fds[1], first, "1");
+    REQUIRE(cache.processAsync(1000));
+    REQUIRE(completed == std::vector<std::string>({"second:2", "first:1"}));
+    REQUIRE(cache.pendingAsync() == 0);
+    REQUIRE(!cache.processAsync(0));
+
+    close(fds[0]);
+    close(fds[1]);
+}
@@ -0,0 +1,64 @@
+#include "catch.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+
+#include "../SharedCache.h"
+#include "../CacheIndex.h"
+
+using namespace SharedCache;
+
+static void writeFile(const std::string & path, const std::string & content) {
+    std::ofstream out(path, std::ios::trunc);
+    out << content;
+}
+
+TEST_CASE( "Cache index drops entries of another storage layout", "[CacheIndex]" ) {
+    char dir[] = "/tmp/cacheindex-XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string base = std::string(dir) + "/";
+    std::string source = base + "image.fits";
+    writeFile(source, "pixels");
+
+    Messages::ContentRequest request;
+    request.histogram.build();
+    request.histogram->source.path = source;
+
+    CacheIndex::Record record;
+    record.identifier = request.contentKey();
+    record.size = 4;
+    record.prodDuration = 10;
+    REQUIRE(CacheIndex::stampSources(record.identifier, record.sources));
+
+    record.filename = "current";
+    writeFile(base + record.filename, "data");
+    {
+        CacheIndex index(base);
+        index.added(record);
+    }
+
+    // A record written before the layout was versioned
+    writeFile(base + "old", "data");
+    {
+        std::ofstream journal(base + CacheIndex::fileName, std::ios::app);
+        nlohmann::json src = nlohmann::json::array();
+        for(auto it = record.sources.begin(); it != record.sources.end(); ++it) {
+            src.push_back(nlohmann::json::array({it->path, it->size, it->mtime}));
+        }
+        nlohmann::json j = {{"k", record.identifier.str()}, {"f", "old"}, {"s", 4}, {"d", 10}, {"src", src}};
+        journal << j.dump() << "\n";
+    }
+
+    CacheIndex index(base);
+    std::list<CacheIndex::Record> records = index.load();
+    REQUIRE(records.size() == 1);
+    REQUIRE(records.front().filename == "current");
+    REQUIRE(records.front().identifier == record.identifier);
+
+    unlink((base + CacheIndex::fileName).c_str());
+    unlink((base + "current").c_str());
+    unlink((base + "old").c_str());
+    unlink(source.c_str());
+    rmdir(dir);
+}
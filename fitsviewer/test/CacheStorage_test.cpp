@@ -0,0 +1,70 @@
+#include "catch.hpp"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "../CacheStorage.h"
+
+using namespace SharedCache;
+
+TEST_CASE( "File storage reserves unique names", "[CacheStorage]" ) {
+    char dir[] = "/tmp/cachestorage-XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string basePath = std::string(dir) + "/";
+
+    FileStorage storage(basePath);
+    REQUIRE(storage.persistent());
+    REQUIRE(storage.create("data000000000001"));
+    REQUIRE(!storage.create("data000000000001"));
+    REQUIRE(storage.fd("data000000000001") == -1);
+    REQUIRE(storage.readFd("data000000000001") == -1);
+
+    struct stat statbuf;
+    REQUIRE(stat((basePath + "data000000000001").c_str(), &statbuf) == 0);
+    storage.remove("data000000000001");
+    REQUIRE(stat((basePath + "data000000000001").c_str(), &statbuf) == -1);
+
+    rmdir(dir);
+}
+
+TEST_CASE( "Memfd storage keeps descriptors per entry", "[CacheStorage]" ) {
+    MemfdStorage storage;
+    REQUIRE(!storage.persistent());
+    REQUIRE(storage.fd("data000000000001") == -1);
+    REQUIRE(storage.create("data000000000001"));
+    REQUIRE(!storage.create("data000000000001"));
+
+    int fd = storage.fd("data000000000001");
+    REQUIRE(fd != -1);
+    REQUIRE(ftruncate(fd, 4096) == 0);
+    struct stat statbuf;
+    REQUIRE(fstat(fd, &statbuf) == 0);
+    REQUIRE(statbuf.st_size == 4096);
+    REQUIRE(pwrite(fd, "plop", 4, 0) == 4);
+
+    // Consumers only get read only descriptors
+    int readFd = storage.readFd("data000000000001");
+    REQUIRE(readFd != -1);
+    REQUIRE(readFd != fd);
+    REQUIRE((fcntl(readFd, F_GETFL) & O_ACCMODE) == O_RDONLY);
+    REQUIRE(mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, readFd, 0) == MAP_FAILED);
+    void * data = mmap(0, 4096, PROT_READ, MAP_SHARED, readFd, 0);
+    REQUIRE(data != MAP_FAILED);
+    REQUIRE(std::string((const char*)data, 4) == "plop");
+    munmap(data, 4096);
+
+    int copy = storage.open("data000000000001");
+    REQUIRE(copy != -1);
+    REQUIRE((fcntl(copy, F_GETFL) & O_ACCMODE) == O_RDONLY);
+    close(copy);
+
+    storage.remove("data000000000001");
+    REQUIRE(storage.fd("data000000000001") == -1);
+    REQUIRE(storage.readFd("data000000000001") == -1);
+    REQUIRE(fstat(fd, &statbuf) == -1);
+    REQUIRE(fstat(readFd, &statbuf) == -1);
+}
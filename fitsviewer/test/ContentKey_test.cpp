@@ -0,0 +1,122 @@
+#include "catch.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../SharedCache.h"
+
+using namespace SharedCache;
+
+TEST_CASE( "Content key ignores exactSerial", "[ContentKey]" ) {
+    Messages::ContentRequest request;
+    request.histogram.build();
+    request.histogram->source.stream = "stream";
+    request.histogram->source.serial = 4;
+
+    ContentKey loose = request.contentKey();
+    request.histogram->source.exactSerial = true;
+    ContentKey exact = request.contentKey();
+
+    request.priority = Messages::PriorityBackground;
+    REQUIRE(request.contentKey() == exact);
+    request.traceId = "1.2.3";
+    REQUIRE(request.contentKey() == exact);
+
+    REQUIRE(loose == exact);
+    REQUIRE(loose.hash() == exact.hash());
+    // contentKey must not alter the request
+    REQUIRE(request.histogram->source.exactSerial);
+
+    request.histogram->source.serial = 5;
+    ContentKey upgraded = request.contentKey();
+    REQUIRE(upgraded != exact);
+    REQUIRE(upgraded.str() != exact.str());
+}
+
+TEST_CASE( "Content key changes with the source identity", "[ContentKey]" ) {
+    char path[] = "/tmp/contentkey-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd != -1);
+    REQUIRE(write(fd, "plop", 4) == 4);
+
+    Messages::ContentRequest request;
+    request.histogram.build();
+    request.histogram->source.path = path;
+    ContentKey unstamped = request.contentKey();
+
+    request.histogram->source.stampIdentity();
+    REQUIRE(!request.histogram->source.identity.empty());
+    ContentKey first = request.contentKey();
+    REQUIRE(first != unstamped);
+
+    request.histogram->source.stampIdentity();
+    REQUIRE(request.contentKey() == first);
+
+    // Overwritten
+    REQUIRE(write(fd, "plop", 4) == 4);
+    request.histogram->source.stampIdentity();
+    REQUIRE(request.contentKey() != first);
+
+    close(fd);
+    unlink(path);
+    request.histogram->source.stampIdentity();
+    REQUIRE(request.histogram->source.identity.empty());
+
+    // Streams are not stamped
+    request.histogram->source.path = "";
+    request.histogram->source.stream = "stream";
+    request.histogram->source.stampIdentity();
+    REQUIRE(request.histogram->source.identity.empty());
+}
+
+TEST_CASE( "Products declare the contents they read", "[ContentKey]" ) {
+    Messages::RawContent source;
+    source.path = "/tmp/image.fits";
+
+    Messages::ContentRequest raw;
+    raw.fitsContent = new Messages::RawContent(source);
+    Messages::ContentRequest histogram;
+    histogram.histogram.build();
+    histogram.histogram->source = source;
+    Messages::ContentRequest starField;
+    starField.starField.build();
+    starField.starField->source = source;
+    Messages::ContentRequest astrometry;
+    astrometry.astrometry.build();
+    astrometry.astrometry->source.source = source;
+
+    std::list<Messages::ContentRequest> dependencies;
+    raw.collectDependencies(dependencies);
+    REQUIRE(dependencies.empty());
+
+    histogram.collectDependencies(dependencies);
+    REQUIRE(dependencies.size() == 1);
+    REQUIRE(dependencies.front().contentKey() == raw.contentKey());
+
+    dependencies.clear();
+    starField.collectDependencies(dependencies);
+    REQUIRE(dependencies.size() == 2);
+    REQUIRE(dependencies.front().contentKey() == raw.contentKey());
+    REQUIRE(dependencies.back().contentKey() == histogram.contentKey());
+
+    dependencies.clear();
+    astrometry.collectDependencies(dependencies);
+    REQUIRE(dependencies.size() == 1);
+    REQUIRE(dependencies.front().contentKey() == starField.contentKey());
+
+    // Headers of files are read without the pixels
+    Messages::ContentRequest header;
+    header.fitsHeader.build();
+    header.fitsHeader->source = source;
+    REQUIRE(header.productType() == Messages::ProductFitsHeader);
+    REQUIRE(header.contentKey() != raw.contentKey());
+    dependencies.clear();
+    header.collectDependencies(dependencies);
+    REQUIRE(dependencies.empty());
+
+    header.fitsHeader->source.path = "";
+    header.fitsHeader->source.stream = "stream";
+    header.collectDependencies(dependencies);
+    REQUIRE(dependencies.size() == 1);
+    REQUIRE(dependencies.front().fitsContent->stream == "stream");
+}
@@ -0,0 +1,64 @@
+#include "catch.hpp"
+
+#include <stdlib.h>
+#include <memory>
+#include <vector>
+
+#include "../DeadlineHeap.h"
+
+using namespace SharedCache;
+
+struct Timer {
+    int id;
+    Deadline<Timer> deadline;
+
+    Timer(int id) : id(id), deadline(this) {}
+};
+
+TEST_CASE( "Deadline heap returns the earliest deadline", "[DeadlineHeap]" ) {
+    auto origin = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<Timer>> timers;
+    for(int i = 0; i < 200; ++i) {
+        timers.emplace_back(new Timer(i));
+    }
+
+    DeadlineHeap<Timer> heap;
+    srand(42);
+    for(int round = 0; round < 5000; ++round) {
+        Timer * t = timers[rand() % timers.size()].get();
+        if (rand() % 3 == 0) {
+            heap.disarm(&t->deadline);
+            REQUIRE(!t->deadline.armed());
+        } else {
+            // Arm, or move when already armed
+            heap.arm(&t->deadline, origin + std::chrono::milliseconds(rand() % 1000));
+            REQUIRE(t->deadline.armed());
+        }
+
+        size_t armed = 0;
+        Timer * earliest = nullptr;
+        for(auto & timer : timers) {
+            if (!timer->deadline.armed()) {
+                continue;
+            }
+            armed++;
+            if (earliest == nullptr || timer->deadline.when < earliest->deadline.when) {
+                earliest = timer.get();
+            }
+        }
+        REQUIRE(heap.size() == armed);
+        if (armed) {
+            REQUIRE(heap.top()->when == earliest->deadline.when);
+        }
+    }
+
+    // Drain in order
+    auto previous = origin;
+    while(!heap.empty()) {
+        Deadline<Timer> * top = heap.top();
+        REQUIRE(!(top->when < previous));
+        previous = top->when;
+        heap.disarm(top);
+        REQUIRE(!top->owner->deadline.armed());
+    }
+}
@@ -15,11 +15,13 @@ static uint8_t smallStar[] = {
 
 using StarOccurence=SharedCache::Messages::StarOccurence;
 
-RawDataStorage * load(int w, int h, uint8_t * data)
+RawDataStorage * load(int w, int h, uint8_t * data, RawDataStorage::SampleType sampleType = RawDataStorage::SampleU16, SampleLevels levels = {0, 1})
 {
-    RawDataStorage * result = (RawDataStorage *)::operator new (RawDataStorage::requiredStorage(w,h));
+    RawDataStorage * result = (RawDataStorage *)::operator new (RawDataStorage::requiredStorage(w, h, sampleType));
     result->setBayer("");
     result->setSize(w, h);
+    result->setSampleType(sampleType);
+    result->levels = levels;
 
     unsigned pos = 0;
     for(int y = 0; y < h; ++y)
@@ -52,4 +54,21 @@ TEST_CASE( "StarFinder report FWHM", "[StarFinder]" ) {
         REQUIRE(round(findResult.flux / 1000) == 51);
     }
 
+    SECTION("finds the same star in 32 bits samples") {
+        std::shared_ptr<RawDataStorage> ints(load(57, 64, smallStar, RawDataStorage::SampleI32, {-5000, 1}));
+        std::shared_ptr<RawDataStorage> floats(load(57, 64, smallStar, RawDataStorage::SampleF32, {0, 65535}));
+        for(auto wide : { ints, floats }) {
+            StarOccurence wideResult;
+            StarFinder sf(wide.get(), ChannelMode(1), 32, 32, 16);
+            REQUIRE(sf.perform(wideResult) == true);
+            StarFinder sf16(source.get(), ChannelMode(1), 32, 32, 16);
+            REQUIRE(sf16.perform(findResult) == true);
+            REQUIRE(wideResult.x == findResult.x);
+            REQUIRE(wideResult.y == findResult.y);
+            REQUIRE(wideResult.fwhm == findResult.fwhm);
+            REQUIRE(wideResult.peak == findResult.peak);
+            REQUIRE(wideResult.flux == findResult.flux);
+        }
+    }
+
 };
\ No newline at end of file
@@ -0,0 +1,252 @@
+#include "catch.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "../SharedCache.h"
+#include "../RawDataStorage.h"
+#include "../FastFitsReader.h"
+
+using namespace SharedCache;
+
+static std::string card(const std::string & text) {
+    std::string result = text;
+    result.resize(80, ' ');
+    return result;
+}
+
+static std::string valueCard(const char * keyword, const std::string & value) {
+    char buffer[81];
+    snprintf(buffer, sizeof(buffer), "%-8s= %20s", keyword, value.c_str());
+    return card(buffer);
+}
+
+// Header and big endian pixels of a w x h image
+static std::string buildFits(int w, int h, const std::vector<std::string> & extraCards, const std::vector<int16_t> & pixels) {
+    std::string fits = valueCard("SIMPLE", "T") + valueCard("BITPIX", "16") + valueCard("NAXIS", "2")
+            + valueCard("NAXIS1", std::to_string(w)) + valueCard("NAXIS2", std::to_string(h));
+    for(auto & extra : extraCards) {
+        fits += extra;
+    }
+    fits += card("END");
+    fits.resize((fits.size() + 2879) / 2880 * 2880, ' ');
+    for(int16_t pixel : pixels) {
+        fits += (char)((uint16_t)pixel >> 8);
+        fits += (char)(pixel & 0xff);
+    }
+    fits.resize((fits.size() + 2879) / 2880 * 2880, 0);
+    return fits;
+}
+
+class MemoryEntry : public WriteableEntry {
+public:
+    std::vector<char> buffer;
+    virtual void allocate(unsigned long int size) { buffer.resize(size); }
+    virtual void * data() { return buffer.data(); }
+    virtual unsigned long int size() { return buffer.size(); }
+};
+
+TEST_CASE( "Fast reader converts signed 16 bits pixels", "[FastFitsReader]" ) {
+    std::vector<int16_t> pixels;
+    for(int i = 0; i < 5 * 3; ++i) {
+        pixels.push_back(i * 4000 - 32768);
+    }
+    std::string fits = buildFits(5, 3, { valueCard("BZERO", "32768"), valueCard("BSCALE", "1.0"), card("BAYERPAT= 'RGGB'           / Bayer pattern") }, pixels);
+
+    FastFitsReader::Header header;
+    REQUIRE(FastFitsReader::parseHeader(fits.data(), fits.size(), header));
+    REQUIRE(header.w == 5);
+    REQUIRE(header.h == 3);
+    REQUIRE(header.bayer == "RGGB");
+    REQUIRE(header.dataOffset == 2880);
+
+    MemoryEntry entry;
+    REQUIRE(FastFitsReader::read(fits.data(), fits.size(), &entry));
+    RawDataStorage * storage = (RawDataStorage*)entry.data();
+    REQUIRE(storage->w == 5);
+    REQUIRE(storage->h == 3);
+    REQUIRE(storage->getBayer() == "RGGB");
+    for(int i = 0; i < 5 * 3; ++i) {
+        REQUIRE(storage->data[i] == i * 4000);
+    }
+}
+
+TEST_CASE( "Fast reader applies BZERO and BSCALE", "[FastFitsReader]" ) {
+    std::vector<int16_t> pixels = { -100, 0, 100, 20000, 32767, -32768 };
+    std::string fits = buildFits(3, 2, { valueCard("BSCALE", "2"), valueCard("BZERO", "100") }, pixels);
+
+    FastFitsReader::Header header;
+    REQUIRE(FastFitsReader::parseHeader(fits.data(), fits.size(), header));
+    REQUIRE(header.bitpix == 16);
+    REQUIRE(header.bscale == 2);
+    REQUIRE(header.bzero == 100);
+
+    MemoryEntry entry;
+    REQUIRE(FastFitsReader::read(fits.data(), fits.size(), &entry));
+    RawDataStorage * storage = (RawDataStorage*)entry.data();
+    uint16_t expected[] = { 0, 100, 300, 40100, 65535, 0 };
+    for(int i = 0; i < 6; ++i) {
+        REQUIRE(storage->data[i] == expected[i]);
+    }
+}
+
+// Big endian 32 bits words, as pairs of int16 for buildFits
+static std::vector<int16_t> splitWords(const std::vector<uint32_t> & words) {
+    std::vector<int16_t> pixels;
+    for(uint32_t word : words) {
+        pixels.push_back(word >> 16);
+        pixels.push_back(word & 0xffff);
+    }
+    return pixels;
+}
+
+TEST_CASE( "Fast reader keeps float pixels", "[FastFitsReader]" ) {
+    float values[] = { 0.0f, 0.5f, 1.0f, -0.25f, 2.0f, 0.125f };
+    std::vector<uint32_t> words;
+    for(float value : values) {
+        uint32_t bits;
+        memcpy(&bits, &value, 4);
+        words.push_back(bits);
+    }
+    // Two int16 per float
+    std::string fits = buildFits(6, 2, {}, splitWords(words));
+    fits.replace(80, 80, valueCard("BITPIX", "-32"));
+    fits.replace(240, 80, valueCard("NAXIS1", "3"));
+
+    MemoryEntry entry;
+    REQUIRE(FastFitsReader::read(fits.data(), fits.size(), &entry));
+    RawDataStorage * storage = (RawDataStorage*)entry.data();
+    REQUIRE(storage->w == 3);
+    REQUIRE(storage->sampleType == RawDataStorage::SampleF32);
+    REQUIRE(entry.buffer.size() == (size_t)RawDataStorage::requiredStorage(3, 2, RawDataStorage::SampleF32));
+    for(int i = 0; i < 6; ++i) {
+        REQUIRE(storage->samples<float>()[i] == values[i]);
+    }
+    // Out of the 0 - 1 range: the levels span -0.25 - 2
+    REQUIRE(storage->levels.offset == -0.25);
+    REQUIRE(storage->getAdu(0, 1) == 0);
+    REQUIRE(storage->getAdu(1, 1) == 65535);
+    REQUIRE(storage->getAdu(1, 0) == 21845);
+}
+
+TEST_CASE( "Fast reader keeps 32 bits integers", "[FastFitsReader]" ) {
+    std::vector<uint32_t> words = { 0, 1, 70000, (uint32_t)-5, 1 << 24, 65535 };
+    std::string fits = buildFits(6, 2, {}, splitWords(words));
+    fits.replace(80, 80, valueCard("BITPIX", "32"));
+    fits.replace(240, 80, valueCard("NAXIS1", "3"));
+
+    MemoryEntry entry;
+    REQUIRE(FastFitsReader::read(fits.data(), fits.size(), &entry));
+    RawDataStorage * storage = (RawDataStorage*)entry.data();
+    REQUIRE(storage->sampleType == RawDataStorage::SampleI32);
+    REQUIRE(storage->bitpix == 32);
+    for(int i = 0; i < 6; ++i) {
+        REQUIRE(storage->samples<int32_t>()[i] == (int32_t)words[i]);
+    }
+    REQUIRE(storage->getAdu(0, 1) == 0);
+    REQUIRE(storage->getAdu(1, 1) == 65535);
+
+    // Within 0 - 65535, levels are the values
+    std::string small = buildFits(2, 1, {}, splitWords({ 12, 65535 }));
+    small.replace(80, 80, valueCard("BITPIX", "32"));
+    REQUIRE(FastFitsReader::read(small.data(), small.size(), &entry));
+    storage = (RawDataStorage*)entry.data();
+    REQUIRE(storage->getAdu(0, 0) == 12);
+    REQUIRE(storage->getAdu(1, 0) == 65535);
+
+    // Scaled integers are read as floats
+    std::string scaled = buildFits(2, 1, { valueCard("BZERO", "2147483648") }, splitWords({ 0x80000000, 0x7fffffff }));
+    scaled.replace(80, 80, valueCard("BITPIX", "32"));
+    FastFitsReader::Header header;
+    REQUIRE(FastFitsReader::parseHeader(scaled.data(), scaled.size(), header));
+    REQUIRE(header.sampleType() == RawDataStorage::SampleF32);
+    REQUIRE(FastFitsReader::read(scaled.data(), scaled.size(), &entry));
+    storage = (RawDataStorage*)entry.data();
+    REQUIRE(storage->sampleType == RawDataStorage::SampleF32);
+    REQUIRE(storage->samples<float>()[0] == 0.0f);
+    REQUIRE(storage->samples<float>()[1] == 4294967295.0f);
+}
+
+TEST_CASE( "Fast reader keeps bytes as 8 bits samples", "[FastFitsReader]" ) {
+    uint8_t values[] = { 0, 1, 127, 128, 200, 255, 42, 7 };
+    std::vector<int16_t> pixels;
+    for(int i = 0; i < 8; i += 2) {
+        pixels.push_back((values[i] << 8) | values[i + 1]);
+    }
+    // Two bytes per int16
+    std::string fits = buildFits(2, 2, {}, pixels);
+    fits.replace(80, 80, valueCard("BITPIX", "8"));
+    fits.replace(240, 80, valueCard("NAXIS1", "4"));
+
+    MemoryEntry entry;
+    REQUIRE(FastFitsReader::read(fits.data(), fits.size(), &entry));
+    RawDataStorage * storage = (RawDataStorage*)entry.data();
+    REQUIRE(storage->sampleType == RawDataStorage::SampleU8);
+    REQUIRE(storage->bitpix == 8);
+    REQUIRE(entry.buffer.size() == (size_t)RawDataStorage::requiredStorage(4, 2, RawDataStorage::SampleU8));
+    for(int i = 0; i < 8; ++i) {
+        REQUIRE(storage->samples<uint8_t>()[i] == values[i]);
+        REQUIRE(storage->getAdu(i % 4, i / 4) == values[i]);
+    }
+}
+
+TEST_CASE( "Fast reader leaves other layouts to cfitsio", "[FastFitsReader]" ) {
+    std::vector<int16_t> pixels(4 * 4, 0);
+    FastFitsReader::Header header;
+
+    std::string unsignedFits = buildFits(4, 4, { valueCard("BZERO", "32768") }, pixels);
+    REQUIRE(FastFitsReader::parseHeader(unsignedFits.data(), unsignedFits.size(), header));
+
+    // Scaled bytes
+    std::string bytes = unsignedFits;
+    bytes.replace(80, 80, valueCard("BITPIX", "8"));
+    REQUIRE(!FastFitsReader::parseHeader(bytes.data(), bytes.size(), header));
+
+    std::string doubles = unsignedFits;
+    doubles.replace(80, 80, valueCard("BITPIX", "-64"));
+    REQUIRE(!FastFitsReader::parseHeader(doubles.data(), doubles.size(), header));
+
+    std::string cube = unsignedFits;
+    cube.replace(160, 80, valueCard("NAXIS", "3"));
+    REQUIRE(!FastFitsReader::parseHeader(cube.data(), cube.size(), header));
+
+    // Truncated data
+    REQUIRE(!FastFitsReader::parseHeader(unsignedFits.data(), 2880 + 4 * 4, header));
+    // Not a FITS file (e.g. gzipped)
+    std::string gzipped = "\x1f\x8b" + unsignedFits;
+    REQUIRE(!FastFitsReader::parseHeader(gzipped.data(), gzipped.size(), header));
+
+    MemoryEntry entry;
+    REQUIRE(!FastFitsReader::read(bytes.data(), bytes.size(), &entry));
+    REQUIRE(entry.buffer.empty());
+}
+
+TEST_CASE( "Fast reader parses file headers without the pixels", "[FastFitsReader]" ) {
+    std::vector<int16_t> pixels(64 * 48, 0);
+    // Long header, spanning several blocks
+    std::vector<std::string> history(80, card("HISTORY padding"));
+    std::string fits = buildFits(64, 48, history, pixels);
+
+    char path[] = "/tmp/fastfitsreader-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd != -1);
+    REQUIRE(write(fd, fits.data(), fits.size()) == (ssize_t)fits.size());
+
+    FastFitsReader::Header header;
+    REQUIRE(FastFitsReader::readHeader(path, header));
+    REQUIRE(header.w == 64);
+    REQUIRE(header.h == 48);
+    REQUIRE(header.dataOffset == 3 * 2880);
+    REQUIRE(header.sampleType() == RawDataStorage::SampleU16);
+
+    // Truncated pixels
+    REQUIRE(ftruncate(fd, 3 * 2880 + 100) == 0);
+    REQUIRE(!FastFitsReader::readHeader(path, header));
+
+    close(fd);
+    unlink(path);
+    REQUIRE(!FastFitsReader::readHeader(path, header));
+}
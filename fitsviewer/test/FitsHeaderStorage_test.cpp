@@ -0,0 +1,69 @@
+#include "catch.hpp"
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "../FitsHeaderStorage.h"
+
+static FitsHeaderStorage * build(const std::vector<FitsHeaderStorage::Keyword> & keywords) {
+    return FitsHeaderStorage::build(640, 480, 16, keywords, [](long int size){ return malloc(size); });
+}
+
+TEST_CASE( "Header storage finds keywords", "[FitsHeaderStorage]" ) {
+    FitsHeaderStorage * storage = build({
+        { "SIMPLE", "T", "", false },
+        { "EXPTIME", "1.5", "Exposure, seconds", false },
+        { "BAYERPAT", "RGGB", "", true },
+        { "FILTER", "Red", "first", true },
+        { "FILTER", "Blue", "duplicate", true },
+    });
+    REQUIRE(storage->width == 640);
+    REQUIRE(storage->height == 480);
+    REQUIRE(storage->bitpix == 16);
+    REQUIRE(storage->cardCount == 5);
+
+    const FitsHeaderStorage::Card * exptime = storage->find("EXPTIME");
+    REQUIRE(exptime != nullptr);
+    REQUIRE(std::string(storage->value(*exptime)) == "1.5");
+    REQUIRE(std::string(storage->comment(*exptime)) == "Exposure, seconds");
+    REQUIRE(!exptime->isString);
+
+    const FitsHeaderStorage::Card * bayer = storage->find("BAYERPAT");
+    REQUIRE(bayer != nullptr);
+    REQUIRE(bayer->isString);
+    REQUIRE(std::string(storage->value(*bayer)) == "RGGB");
+
+    // Like cfitsio, the first one wins
+    const FitsHeaderStorage::Card * filter = storage->find("FILTER");
+    REQUIRE(filter != nullptr);
+    REQUIRE(std::string(storage->value(*filter)) == "Red");
+    // But all are kept in order
+    REQUIRE(std::string(storage->value(storage->cards()[4])) == "Blue");
+
+    REQUIRE(storage->find("EXPOSURE") == nullptr);
+    REQUIRE(storage->find("") == nullptr);
+    free(storage);
+}
+
+TEST_CASE( "Header storage handles many keywords", "[FitsHeaderStorage]" ) {
+    std::vector<FitsHeaderStorage::Keyword> keywords;
+    for(int i = 0; i < 500; ++i) {
+        keywords.push_back({ "KEY" + std::to_string(i), std::to_string(i * 3), "", false });
+    }
+    FitsHeaderStorage * storage = build(keywords);
+    REQUIRE(storage->bucketCount >= 2 * storage->cardCount);
+    for(int i = 0; i < 500; ++i) {
+        const FitsHeaderStorage::Card * card = storage->find(("KEY" + std::to_string(i)).c_str());
+        REQUIRE(card != nullptr);
+        REQUIRE(std::string(storage->value(*card)) == std::to_string(i * 3));
+    }
+    REQUIRE(storage->find("KEY500") == nullptr);
+    free(storage);
+
+    // Empty header
+    storage = build({});
+    REQUIRE(storage->cardCount == 0);
+    REQUIRE(storage->find("SIMPLE") == nullptr);
+    free(storage);
+}
@@ -325,3 +325,164 @@ TEST_CASE( "FITS rendering", "[FitsRenderer.cpp]" ) {
         }
     }
 }
+
+// Histogram such as 8 bit result will be the 8 bit input
+HistogramStorage * buildFlatHisto8(int channels)
+{
+    uint16_t min[channels];
+    uint16_t max[channels];
+    for(int i = 0; i < channels; ++i) {
+        min[i] = 0;
+        max[i] = 0xff;
+    }
+
+    HistogramStorage * result = (HistogramStorage*)malloc(HistogramStorage::requiredStorage(channels, min, max));
+    result->init(channels, min, max);
+    result->bitpix = 8;
+    for(int ch = 0; ch < channels; ++ch) {
+        result->channel(ch)->pixcount = 0x100;
+        for(int32_t v = 0; v < 0x100; ++v) {
+            result->channel(ch)->data[v] = v + 1;
+        }
+    }
+    return result;
+}
+
+TEST_CASE( "FITS rendering of 8 bits samples", "[FitsRenderer.cpp]" ) {
+    TestFrameGrey grey;
+    TestFrameColor color;
+    GreyscaleFrameInterpreter greyInterpreter;
+    ColorFrameInterpreter colorInterpreter;
+    std::pair<TestFrame*, FrameInterpreter*> tests[] = {
+        { &grey, &greyInterpreter },
+        { &color, &colorInterpreter },
+    };
+
+    for(auto test : tests) {
+        for(int binShift = test.second->minBinPow(); binShift < 4; binShift++) {
+            SECTION(test.first->title() + ", bin " + std::to_string(1 << binShift)) {
+                int w = 126, h = 126;
+                int channelCount = test.second->channelCount();
+                test.first->build(w, h);
+                // The test frames only use the upper byte
+                std::vector<uint8_t> bytes(w * h);
+                for(int i = 0; i < w * h; ++i) {
+                    bytes[i] = test.first->data[i] >> 8;
+                }
+                HistogramStorage * histo = buildFlatHisto8(channelCount);
+
+                FitsRendererParam r;
+                r.data = bytes.data();
+                r.sampleType = RawDataStorage::SampleU8;
+                r.w = w;
+                r.h = h;
+                r.bin = binShift;
+                r.low = 0;
+                r.med = 0.5;
+                r.high = 1;
+                r.bayer = test.second->bayer();
+                r.histogramStorage = histo;
+
+                FitsRenderer * renderer = FitsRenderer::build(r);
+                renderer->prepare();
+
+                int outSize = binDiv(w, binShift) * binDiv(h, binShift);
+                auto result = renderer->render(0, 0, w, h);
+                std::vector<uint16_t> resultVec(result, result + outSize * channelCount);
+
+                std::vector<uint16_t> expectedVec;
+                uint16_t expected[channelCount];
+                int bin = 1 << binShift;
+                for(int y = 0; y < h; y += bin)
+                    for(int x = 0; x < w; x += bin) {
+                        test.second->calc(test.first, x, y, bin, expected);
+                        for(int ch = 0; ch < channelCount; ++ch) {
+                            expectedVec.push_back(expected[ch] >> 8);
+                        }
+                    }
+
+                REQUIRE(resultVec == expectedVec);
+
+                delete renderer;
+                free(histo);
+                test.first->dispose();
+            }
+        }
+    }
+}
+
+TEST_CASE( "FITS rendering of 32 bits samples", "[FitsRenderer.cpp]" ) {
+    TestFrameGrey grey;
+    TestFrameColor color;
+    GreyscaleFrameInterpreter greyInterpreter;
+    ColorFrameInterpreter colorInterpreter;
+    std::pair<TestFrame*, FrameInterpreter*> tests[] = {
+        { &grey, &greyInterpreter },
+        { &color, &colorInterpreter },
+    };
+
+    for(auto test : tests) {
+        for(int binShift = test.second->minBinPow(); binShift < 4; binShift++) {
+            for(auto sampleType : { RawDataStorage::SampleI32, RawDataStorage::SampleF32 }) {
+                SECTION(test.first->title() + ", bin " + std::to_string(1 << binShift) + (sampleType == RawDataStorage::SampleI32 ? ", int" : ", float")) {
+                    int w = 126, h = 126;
+                    int channelCount = test.second->channelCount();
+                    test.first->build(w, h);
+                    // Samples whose levels are the 16 bits test frame
+                    SampleLevels levels;
+                    std::vector<int32_t> ints(w * h);
+                    std::vector<float> floats(w * h);
+                    if (sampleType == RawDataStorage::SampleI32) {
+                        levels = { -1000, 1 };
+                        for(int i = 0; i < w * h; ++i) {
+                            ints[i] = test.first->data[i] - 1000;
+                        }
+                    } else {
+                        levels = { 0, 0.5 };
+                        for(int i = 0; i < w * h; ++i) {
+                            floats[i] = test.first->data[i] * 2.0f;
+                        }
+                    }
+                    HistogramStorage * histo = buildFlatHisto(channelCount);
+
+                    FitsRendererParam r;
+                    r.data = sampleType == RawDataStorage::SampleI32 ? (const void*)ints.data() : (const void*)floats.data();
+                    r.sampleType = sampleType;
+                    r.levels = levels;
+                    r.w = w;
+                    r.h = h;
+                    r.bin = binShift;
+                    r.low = 0;
+                    r.med = 0.5;
+                    r.high = 1;
+                    r.bayer = test.second->bayer();
+                    r.histogramStorage = histo;
+
+                    FitsRenderer * renderer = FitsRenderer::build(r);
+                    renderer->prepare();
+
+                    int outSize = binDiv(w, binShift) * binDiv(h, binShift);
+                    auto result = renderer->render(0, 0, w, h);
+                    std::vector<uint16_t> resultVec(result, result + outSize * channelCount);
+
+                    std::vector<uint16_t> expectedVec;
+                    uint16_t expected[channelCount];
+                    int bin = 1 << binShift;
+                    for(int y = 0; y < h; y += bin)
+                        for(int x = 0; x < w; x += bin) {
+                            test.second->calc(test.first, x, y, bin, expected);
+                            for(int ch = 0; ch < channelCount; ++ch) {
+                                expectedVec.push_back(expected[ch] >> 8);
+                            }
+                        }
+
+                    REQUIRE(resultVec == expectedVec);
+
+                    delete renderer;
+                    free(histo);
+                    test.first->dispose();
+                }
+            }
+        }
+    }
+}
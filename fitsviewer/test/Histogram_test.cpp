@@ -1,5 +1,8 @@
 #include <stdlib.h>
 #include <string.h>
+#include <functional>
+#include <vector>
+#include <algorithm>
 
 #include "catch.hpp"
 #include "../RawDataStorage.h"
@@ -35,10 +38,25 @@ static RawDataStorage * buildRDS(int w, int h, uint16_t* data)
     content->w = w;
     content->h = h;
     content->bayer[0] = 0;
+    content->setSampleType(RawDataStorage::SampleU16);
     memcpy(content->data, data, w * h * sizeof(uint16_t));
     return content;
 }
 
+// Same, with 8 bits samples
+static RawDataStorage * buildRDS8(int w, int h, uint16_t* data, const char * bayer)
+{
+    RawDataStorage * content = (RawDataStorage*)(::operator new(RawDataStorage::requiredStorage(w, h, RawDataStorage::SampleU8)));
+    content->w = w;
+    content->h = h;
+    content->setBayer(bayer);
+    content->setSampleType(RawDataStorage::SampleU8);
+    for(int i = 0; i < w * h; ++i) {
+        content->samples<uint8_t>()[i] = data[i];
+    }
+    return content;
+}
+
 static RawDataStorage * buildBayerRDS(int w, int h, uint16_t* data)
 {
     RawDataStorage * content = (RawDataStorage*)(::operator new(RawDataStorage::requiredStorage(w, h)));
@@ -48,6 +66,7 @@ static RawDataStorage * buildBayerRDS(int w, int h, uint16_t* data)
     content->bayer[1] = 'G';
     content->bayer[2] = 'G';
     content->bayer[3] = 'B';
+    content->setSampleType(RawDataStorage::SampleU16);
     memcpy(content->data, data, w * h * sizeof(uint16_t));
     return content;
 }
@@ -132,3 +151,109 @@ TEST_CASE( "Histogram scanning", "[Histogram.cpp]" ) {
     }
 };
 
+TEST_CASE( "Histogram of 8 bits samples", "[Histogram.cpp]" ) {
+    REQUIRE(RawDataStorage::requiredStorage(8, 6, RawDataStorage::SampleU8) == (long)sizeof(RawDataStorage) + 48);
+
+    for(const char * bayer : { "", "RGGB" }) {
+        std::unique_ptr<RawDataStorage> rds16(bayer[0] ? buildBayerRDS(8, 6, bayer8x6) : buildRDS(8, 6, bayer8x6));
+        std::unique_ptr<RawDataStorage> rds8(buildRDS8(8, 6, bayer8x6, bayer));
+        for(int y = 0; y < 6; ++y) {
+            for(int x = 0; x < 8; ++x) {
+                REQUIRE(rds8->getAdu(x, y) == rds16->getAdu(x, y));
+            }
+        }
+
+        std::unique_ptr<HistogramStorage> hs16(HistogramStorage::build(rds16.get(), 0, 0, 7, 5, [](long int size){return ::operator new(size);}));
+        std::unique_ptr<HistogramStorage> hs8(HistogramStorage::build(rds8.get(), 0, 0, 7, 5, [](long int size){return ::operator new(size);}));
+        REQUIRE(hs8->bitpix == 8);
+        REQUIRE(hs16->bitpix == 16);
+        REQUIRE(hs8->channelCount == hs16->channelCount);
+        for(int ch = 0; ch < hs8->channelCount; ++ch) {
+            REQUIRE(hs8->channel(ch)->min == hs16->channel(ch)->min);
+            REQUIRE(hs8->channel(ch)->max == hs16->channel(ch)->max);
+            REQUIRE(hs8->channel(ch)->pixcount == hs16->channel(ch)->pixcount);
+            for(int adu = hs8->channel(ch)->min; adu <= hs8->channel(ch)->max; ++adu) {
+                REQUIRE(hs8->channel(ch)->atAdu(adu) == hs16->channel(ch)->atAdu(adu));
+            }
+        }
+    }
+}
+
+// 32 bits samples with value(pixel), and their levels
+template<class Sample>
+static RawDataStorage * buildWideRDS(int w, int h, uint16_t* data, const char * bayer, RawDataStorage::SampleType sampleType, std::function<Sample(uint16_t)> value)
+{
+    RawDataStorage * content = (RawDataStorage*)(::operator new(RawDataStorage::requiredStorage(w, h, sampleType)));
+    content->w = w;
+    content->h = h;
+    content->setBayer(bayer);
+    content->setSampleType(sampleType);
+    for(int i = 0; i < w * h; ++i) {
+        content->samples<Sample>()[i] = value(data[i]);
+    }
+    content->computeLevels();
+    return content;
+}
+
+TEST_CASE( "Histogram of 32 bits samples", "[Histogram.cpp]" ) {
+    REQUIRE(RawDataStorage::requiredStorage(8, 6, RawDataStorage::SampleF32) == (long)sizeof(RawDataStorage) + 192);
+
+    for(const char * bayer : { "", "RGGB" }) {
+        std::unique_ptr<RawDataStorage> wides[] = {
+            std::unique_ptr<RawDataStorage>(buildWideRDS<int32_t>(8, 6, bayer8x6, bayer, RawDataStorage::SampleI32,
+                    [](uint16_t v) { return v * 100000 - 7; })),
+            std::unique_ptr<RawDataStorage>(buildWideRDS<float>(8, 6, bayer8x6, bayer, RawDataStorage::SampleF32,
+                    [](uint16_t v) { return v == 2 ? NAN : v * 1.5f - 0.5f; })),
+        };
+        for(auto & wide : wides) {
+            // The levels span the values
+            REQUIRE(wide->getAdu(0, 0) == 0);
+            REQUIRE(wide->getAdu(1, 3) == 65535);
+            REQUIRE(wide->getAdu(1, 0) > 0);
+            REQUIRE(wide->getAdu(1, 0) < 65535);
+
+            // Same as 16 bits samples of the levels
+            std::vector<uint16_t> levels(8 * 6);
+            for(int i = 0; i < 8 * 6; ++i) {
+                levels[i] = wide->getAdu(i % 8, i / 8);
+            }
+            std::unique_ptr<RawDataStorage> rds16(bayer[0] ? buildBayerRDS(8, 6, levels.data()) : buildRDS(8, 6, levels.data()));
+
+            std::unique_ptr<HistogramStorage> hs16(HistogramStorage::build(rds16.get(), 0, 0, 7, 5, [](long int size){return ::operator new(size);}));
+            std::unique_ptr<HistogramStorage> hsWide(HistogramStorage::build(wide.get(), 0, 0, 7, 5, [](long int size){return ::operator new(size);}));
+            REQUIRE(hsWide->bitpix == 16);
+            REQUIRE(hsWide->channelCount == hs16->channelCount);
+            for(int ch = 0; ch < hsWide->channelCount; ++ch) {
+                REQUIRE(hsWide->channel(ch)->min == hs16->channel(ch)->min);
+                REQUIRE(hsWide->channel(ch)->max == hs16->channel(ch)->max);
+                REQUIRE(hsWide->channel(ch)->pixcount == hs16->channel(ch)->pixcount);
+                const uint32_t * counts = hsWide->channel(ch)->data;
+                REQUIRE(std::equal(counts, counts + hsWide->channel(ch)->sampleCount(), hs16->channel(ch)->data));
+            }
+        }
+    }
+}
+
+TEST_CASE( "Levels of 32 bits samples", "[Histogram.cpp]" ) {
+    // Floats in 0 - 1 use the scale of 16 bits ADU
+    std::unique_ptr<RawDataStorage> unit(buildWideRDS<float>(8, 6, bayer8x6, "", RawDataStorage::SampleF32,
+            [](uint16_t v) { return v / 4.0f; }));
+    REQUIRE(unit->levels.offset == 0);
+    REQUIRE(unit->levels.scale == 65535);
+    REQUIRE(unit->getAdu(1, 3) == 49151);
+
+    // Integers keep one level per value when they can
+    std::unique_ptr<RawDataStorage> ints(buildWideRDS<int32_t>(8, 6, bayer8x6, "", RawDataStorage::SampleI32,
+            [](uint16_t v) { return v * 10 - 100000; }));
+    REQUIRE(ints->levels.offset == -100000);
+    REQUIRE(ints->levels.scale == 1);
+    REQUIRE(ints->getAdu(1, 3) == 30);
+
+    // setAdu stores the sample of a level
+    for(auto & wide : { unit.get(), ints.get() }) {
+        for(uint16_t level : { 0, 1, 7, 30 }) {
+            wide->setAdu(2, 2, level);
+            REQUIRE(wide->getAdu(2, 2) == level);
+        }
+    }
+}
@@ -0,0 +1,209 @@
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+
+#include "../LocalEntryTable.h"
+#include "../SharedCacheServer.h"
+#include "../FitsFile.h"
+
+using namespace SharedCache;
+
+TEST_CASE( "Local entries are lent until the last release", "[LocalEntryTable]" ) {
+    LocalEntryTable table;
+    Messages::ContentRequest request;
+    request.fitsContent.build();
+    request.fitsContent->path = "/plop.fits";
+    ContentKey key = request.contentKey();
+
+    char data[16];
+    REQUIRE(table.acquire(key) == nullptr);
+
+    ChildPtr<Messages::ContentRequest> actual;
+    actual = new Messages::ContentRequest(request);
+    LocalMapping * mapping = table.publish(key, "data000000000001", data, sizeof(data), actual);
+    REQUIRE(mapping != nullptr);
+    // A second thread mapping the same content keeps its own mapping
+    REQUIRE(table.publish(key, "data000000000001", data, sizeof(data), actual) == nullptr);
+
+    LocalMapping * borrowed = table.acquire(key);
+    REQUIRE(borrowed == mapping);
+    REQUIRE(borrowed->filename == "data000000000001");
+    REQUIRE(borrowed->size == sizeof(data));
+    REQUIRE(borrowed->actualRequest->fitsContent->path == "/plop.fits");
+
+    REQUIRE(!table.release(borrowed));
+    REQUIRE(table.release(mapping));
+    REQUIRE(table.acquire(key) == nullptr);
+}
+
+TEST_CASE( "Stream contents are not shared", "[LocalEntryTable]" ) {
+    Messages::ContentRequest request;
+    request.histogram.build();
+    request.histogram->source.path = "/plop.fits";
+    REQUIRE(LocalEntryTable::shareable(request));
+
+    request.histogram->source.stream = "stream";
+    REQUIRE(!LocalEntryTable::shareable(request));
+}
+
+TEST_CASE( "Finished productions are kept for their dependents", "[LocalEntryTable]" ) {
+    LocalEntryTable table(1);
+    ChildPtr<Messages::ContentRequest> actual;
+    char data[16];
+    Messages::ContentRequest request;
+    request.fitsContent.build();
+
+    request.fitsContent->path = "/first.fits";
+    ContentKey first = request.contentKey();
+    LocalMapping * firstMapping = table.publish(first, "data000000000001", data, sizeof(data), actual);
+    REQUIRE(table.keep(firstMapping) == nullptr);
+    // Still lent after the producer is done
+    LocalMapping * borrowed = table.acquire(first);
+    REQUIRE(borrowed == firstMapping);
+
+    request.fitsContent->path = "/second.fits";
+    ContentKey second = request.contentKey();
+    LocalMapping * secondMapping = table.publish(second, "data000000000002", data, sizeof(data), actual);
+    // The oldest goes out, with the reference of the table
+    REQUIRE(table.keep(secondMapping) == firstMapping);
+    REQUIRE(!table.release(firstMapping));
+    REQUIRE(table.release(borrowed));
+    REQUIRE(table.acquire(first) == nullptr);
+    REQUIRE(table.acquire(second) == secondMapping);
+}
+
+// Read one request frame, as the server does
+static Messages::Request readRequest(int fd, uint32_t & requestId) {
+    Wire::FrameHeader header;
+    REQUIRE(read(fd, &header, sizeof(header)) == sizeof(header));
+    std::string payload(header.size, '\0');
+    REQUIRE(read(fd, &payload[0], header.size) == header.size);
+    requestId = header.requestId;
+
+    Messages::Request request;
+    Wire::decode(payload.data(), header.size, header.format, request);
+    return request;
+}
+
+static void reply(int fd, uint32_t requestId, const Messages::Result & result) {
+    std::string frame;
+    Wire::encode(result, Wire::Binary, frame, requestId);
+    REQUIRE(write(fd, frame.data(), frame.size()) == (ssize_t)frame.size());
+}
+
+// Next request of the worker, progress announces aside
+static Messages::Request nextRequest(int fd, uint32_t & requestId) {
+    while(true) {
+        Messages::Request request = readRequest(fd, requestId);
+        if (!request.progressAnnounce) {
+            return request;
+        }
+        reply(fd, requestId, Messages::Result());
+    }
+}
+
+static void replyWork(int fd, uint32_t requestId, const Messages::ContentRequest & content, const std::string & filename) {
+    Messages::Result work;
+    work.todoResult.build();
+    work.todoResult->content = new Messages::ContentRequest(content);
+    work.todoResult->filename = filename;
+    reply(fd, requestId, work);
+}
+
+// Server side of a worker thread. Closing the connection ends the thread
+struct WorkerConnection {
+    int fds[2];
+    Cache * cache;
+    std::thread thread;
+
+    WorkerConnection(const std::string & basePath) {
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        cache = new Cache(basePath, fds[0]);
+        Cache * threadCache = cache;
+        thread = std::thread([threadCache]() {
+            SharedCacheServer::threadedWorkerLogic({ threadCache });
+        });
+    }
+
+    ~WorkerConnection() {
+        close(fds[1]);
+        thread.join();
+        close(fds[0]);
+        delete(cache);
+    }
+};
+
+TEST_CASE( "Threaded workers lend their productions to the dependents", "[LocalEntryTable]" ) {
+    char dir[] = "/tmp/localentrytable-XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string basePath = std::string(dir) + "/";
+    std::string path = basePath + "image.fits";
+    {
+        FitsFile file;
+        file.create(path);
+        int status = 0;
+        long naxes[2] = { 16, 16 };
+        std::vector<uint16_t> pixels(16 * 16, 1000);
+        long first[2] = { 1, 1 };
+        fits_create_img(file.fptr, USHORT_IMG, 2, naxes, &status);
+        fits_write_pix(file.fptr, TUSHORT, first, pixels.size(), pixels.data(), &status);
+        REQUIRE(status == 0);
+        file.close();
+    }
+    for(auto filename : { "data000000000001", "data000000000002" }) {
+        int fd = open((basePath + filename).c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+        REQUIRE(fd != -1);
+        close(fd);
+    }
+
+    {
+        WorkerConnection worker(basePath);
+        uint32_t id;
+        Messages::Request request = nextRequest(worker.fds[1], id);
+        REQUIRE(request.workRequest);
+        Messages::ContentRequest content;
+        content.fitsContent.build();
+        content.fitsContent->path = path;
+        replyWork(worker.fds[1], id, content, "data000000000001");
+
+        request = nextRequest(worker.fds[1], id);
+        REQUIRE(request.finishedAnnounce);
+        REQUIRE(request.finishedAnnounce->filename == "data000000000001");
+        REQUIRE(!request.finishedAnnounce->error);
+        REQUIRE(request.finishedAnnounce->keep);
+        reply(worker.fds[1], id, Messages::Result());
+
+        request = nextRequest(worker.fds[1], id);
+        REQUIRE(request.workRequest);
+        Messages::ContentRequest histogram;
+        histogram.histogram.build();
+        histogram.histogram->source.path = path;
+        replyWork(worker.fds[1], id, histogram, "data000000000002");
+
+        // The source comes from the worker itself, not from the server
+        request = nextRequest(worker.fds[1], id);
+        REQUIRE(!request.contentRequest);
+        REQUIRE(request.finishedAnnounce);
+        REQUIRE(request.finishedAnnounce->filename == "data000000000002");
+        REQUIRE(!request.finishedAnnounce->error);
+        reply(worker.fds[1], id, Messages::Result());
+
+        // Only one production is kept per thread
+        request = nextRequest(worker.fds[1], id);
+        REQUIRE(request.releasedAnnounce);
+        REQUIRE(request.releasedAnnounce->filename == "data000000000001");
+        reply(worker.fds[1], id, Messages::Result());
+
+        request = nextRequest(worker.fds[1], id);
+        REQUIRE(request.workRequest);
+    }
+
+    unlink(path.c_str());
+    unlink((basePath + "data000000000001").c_str());
+    unlink((basePath + "data000000000002").c_str());
+    rmdir(dir);
+}
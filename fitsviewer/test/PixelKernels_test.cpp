@@ -0,0 +1,99 @@
+#include "catch.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits>
+#include <vector>
+
+#include "../PixelKernels.h"
+
+// Big endian pixels: random values, then the interesting ones
+static std::vector<uint8_t> sourcePixels(PixelKernels::SourceType type, size_t count) {
+    int size = PixelKernels::pixelSize(type);
+    std::vector<uint8_t> result(size * count);
+    srand(42);
+    for(size_t i = 0; i < result.size(); ++i) {
+        result[i] = rand() & 0xff;
+    }
+    if (type == PixelKernels::Float32) {
+        float edges[] = { 0.0f, 1.0f, 0.5f, -1.0f, 2.0f, 1e-7f, 0.99999f,
+                            std::numeric_limits<float>::quiet_NaN(),
+                            std::numeric_limits<float>::infinity(),
+                            -std::numeric_limits<float>::infinity() };
+        for(size_t i = 0; i < count; ++i) {
+            float value = i < sizeof(edges) / sizeof(edges[0]) ? edges[i] : (rand() % 140000) / 100000.0f - 0.2f;
+            uint32_t bits;
+            memcpy(&bits, &value, 4);
+            for(int b = 0; b < 4; ++b) {
+                result[4 * i + b] = bits >> (24 - 8 * b);
+            }
+        }
+    }
+    return result;
+}
+
+static void checkVariants(PixelKernels::SourceType type, double scale, double offset, int tolerance) {
+    for(size_t count : { 0, 1, 7, 8, 9, 15, 16, 17, 31, 33, 63, 64, 1000 }) {
+        std::vector<uint8_t> from = sourcePixels(type, count);
+        std::vector<uint16_t> expected(count);
+        PixelKernels::convert(PixelKernels::scalar(), type, from.data(), expected.data(), count, scale, offset);
+
+        for(auto variant : PixelKernels::available()) {
+            INFO("variant " << variant->name << ", count " << count);
+            std::vector<uint16_t> to(count + 1, 0xdead);
+            PixelKernels::convert(*variant, type, from.data(), to.data(), count, scale, offset);
+            for(size_t i = 0; i < count; ++i) {
+                INFO("pixel " << i);
+                REQUIRE(abs((int)to[i] - (int)expected[i]) <= tolerance);
+            }
+            // No overflow
+            REQUIRE(to[count] == 0xdead);
+        }
+    }
+}
+
+TEST_CASE( "Scalar kernels clamp to 16 bits ADU", "[PixelKernels]" ) {
+    uint8_t int16[] = { 0x80, 0x00, 0xff, 0xff, 0x00, 0x01, 0x7f, 0xff };
+    uint16_t to[4];
+    PixelKernels::convert(PixelKernels::scalar(), PixelKernels::Int16, int16, to, 4, 1, 32768);
+    REQUIRE(to[0] == 0);
+    REQUIRE(to[1] == 32767);
+    REQUIRE(to[2] == 32769);
+    REQUIRE(to[3] == 65535);
+
+    PixelKernels::convert(PixelKernels::scalar(), PixelKernels::Int16, int16, to, 4, 4, 0);
+    REQUIRE(to[0] == 0);
+    REQUIRE(to[1] == 0);
+    REQUIRE(to[2] == 4);
+    REQUIRE(to[3] == 65535);
+
+    uint8_t int32[] = { 0x00, 0x01, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x30, 0x39 };
+    PixelKernels::convert(PixelKernels::scalar(), PixelKernels::Int32, int32, to, 3, 1, 0);
+    REQUIRE(to[0] == 65535);
+    REQUIRE(to[1] == 0);
+    REQUIRE(to[2] == 12345);
+}
+
+TEST_CASE( "Unsigned 16 bits kernels are exact", "[PixelKernels]" ) {
+    checkVariants(PixelKernels::Int16, 1, 32768, 0);
+}
+
+TEST_CASE( "Scaled integer kernels match the scalar reference", "[PixelKernels]" ) {
+    checkVariants(PixelKernels::Int16, 1, 0, 0);
+    checkVariants(PixelKernels::Int16, 0.5, 16384, 1);
+    checkVariants(PixelKernels::Int32, 1, 32768, 0);
+    checkVariants(PixelKernels::Int32, 1.0 / 65536, 32768, 1);
+}
+
+TEST_CASE( "Float kernels match the scalar reference", "[PixelKernels]" ) {
+    std::vector<uint8_t> from = sourcePixels(PixelKernels::Float32, 10);
+    std::vector<uint16_t> to(10);
+    PixelKernels::convert(PixelKernels::scalar(), PixelKernels::Float32, from.data(), to.data(), 10, 65535, 0);
+    uint16_t expected[] = { 0, 65535, 32767, 0, 65535, 0, 65534, 0, 65535, 0 };
+    for(int i = 0; i < 10; ++i) {
+        REQUIRE(to[i] == expected[i]);
+    }
+
+    checkVariants(PixelKernels::Float32, 65535, 0, 1);
+}
@@ -0,0 +1,73 @@
+#include "catch.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "../SharedCache.h"
+#include "../RawDataStorage.h"
+#include "../FitsFile.h"
+
+using namespace SharedCache;
+
+class MemoryEntry : public WriteableEntry {
+public:
+    std::vector<char> buffer;
+    virtual void allocate(unsigned long int size) { buffer.resize(size); }
+    virtual void * data() { return buffer.data(); }
+    virtual unsigned long int size() { return buffer.size(); }
+};
+
+// Same layout as fpack: an empty primary HDU, then the tile compressed image
+static void writeCompressed(const std::string & path, int w, int h, int tileHeight) {
+    FitsFile file;
+    file.create(path);
+    int status = 0;
+    long naxes[2] = { w, h };
+    long tile[2] = { w, tileHeight };
+    fits_set_compression_type(file.fptr, RICE_1, &status);
+    fits_set_tile_dim(file.fptr, 2, tile, &status);
+    fits_create_img(file.fptr, USHORT_IMG, 2, naxes, &status);
+    std::vector<uint16_t> pixels((size_t)w * h);
+    for(size_t i = 0; i < pixels.size(); ++i) {
+        pixels[i] = (i * 7919) & 0xffff;
+    }
+    long first[2] = { 1, 1 };
+    fits_write_pix(file.fptr, TUSHORT, first, pixels.size(), pixels.data(), &status);
+    REQUIRE(status == 0);
+    file.close();
+}
+
+static void produceWithThreads(const std::string & path, const char * threads, MemoryEntry & entry) {
+    setenv("FITS_SERVER_DECODE_THREADS", threads, 1);
+    Messages::RawContent content;
+    content.path = path;
+    content.produce(&entry);
+    unsetenv("FITS_SERVER_DECODE_THREADS");
+}
+
+TEST_CASE( "Compressed images are decoded in parallel", "[RawContent]" ) {
+    char dir[] = "/tmp/rawcontent-XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string path = std::string(dir) + "/image.fits.fz";
+    // Several bands of rows, so that every thread gets some
+    int w = 1000, h = 3000;
+    writeCompressed(path, w, h, 16);
+
+    MemoryEntry sequential;
+    produceWithThreads(path, "1", sequential);
+    RawDataStorage * storage = (RawDataStorage*)sequential.data();
+    REQUIRE(storage->w == w);
+    REQUIRE(storage->h == h);
+    REQUIRE(storage->sampleType == RawDataStorage::SampleU16);
+    REQUIRE(storage->getAdu(0, 0) == 0);
+    REQUIRE(storage->getAdu(3, 1) == ((1003 * 7919) & 0xffff));
+
+    MemoryEntry parallel;
+    produceWithThreads(path, "4", parallel);
+    REQUIRE(parallel.buffer == sequential.buffer);
+
+    unlink(path.c_str());
+    rmdir(dir);
+}
@@ -0,0 +1,103 @@
+#include "catch.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "../SpillCache.h"
+#include "../RawDataStorage.h"
+
+using namespace SharedCache;
+
+// A RawDataStorage of w x h samples, with extra trailing bytes
+static std::vector<char> rawContent(int w, int h, RawDataStorage::SampleType sampleType, int extra = 0) {
+    std::vector<char> data(RawDataStorage::requiredStorage(w, h, sampleType) + extra);
+    RawDataStorage * storage = (RawDataStorage*)data.data();
+    storage->setSize(w, h);
+    storage->setBayer("");
+    storage->setSampleType(sampleType);
+    return data;
+}
+
+TEST_CASE( "Spill codecs round trip", "[SpillCache]" ) {
+    // A smooth 16 bits image, with an odd trailing byte
+    std::vector<char> data = rawContent(256, 256, RawDataStorage::SampleU16, 1);
+    RawDataStorage * storage = (RawDataStorage*)data.data();
+    for(int i = 0; i < 256 * 256; ++i) {
+        storage->data[i] = 1000 + i % 256 + (i % 7);
+    }
+    data.back() = 42;
+
+    for(SpillCache::Codec codec : { SpillCache::Raw, SpillCache::Deflate, SpillCache::ShuffleDeflate }) {
+        std::string encoded = "header";
+        SpillCache::encode(codec, data.data(), data.size(), encoded);
+        REQUIRE(encoded.substr(0, 6) == "header");
+        if (codec != SpillCache::Raw) {
+            REQUIRE(encoded.size() < data.size() / 2);
+        }
+
+        std::vector<char> decoded(data.size());
+        REQUIRE(SpillCache::decode(codec, encoded.data() + 6, encoded.size() - 6, decoded.data(), decoded.size()));
+        REQUIRE(decoded == data);
+
+        // Wrong size is rejected
+        REQUIRE(!SpillCache::decode(codec, encoded.data() + 6, encoded.size() - 6, decoded.data(), decoded.size() - 1));
+    }
+}
+
+TEST_CASE( "Byte planes compress better than interleaved pixels", "[SpillCache]" ) {
+    std::vector<char> data = rawContent(512, 512, RawDataStorage::SampleU16);
+    RawDataStorage * storage = (RawDataStorage*)data.data();
+    uint32_t seed = 12345;
+    for(int i = 0; i < 512 * 512; ++i) {
+        // Noisy low bits over a constant background
+        seed = seed * 1103515245 + 12345;
+        storage->data[i] = 2000 + ((seed >> 16) & 0xff);
+    }
+    std::string deflated, shuffled;
+    SpillCache::encode(SpillCache::Deflate, data.data(), data.size(), deflated);
+    SpillCache::encode(SpillCache::ShuffleDeflate, data.data(), data.size(), shuffled);
+    REQUIRE(shuffled.size() < deflated.size());
+}
+
+TEST_CASE( "Byte planes follow the sample size", "[SpillCache]" ) {
+    for(RawDataStorage::SampleType sampleType : { RawDataStorage::SampleU8, RawDataStorage::SampleI32, RawDataStorage::SampleF32 }) {
+        std::vector<char> data = rawContent(256, 256, sampleType, 3);
+        RawDataStorage * storage = (RawDataStorage*)data.data();
+        uint32_t seed = 12345;
+        for(int i = 0; i < 256 * 256; ++i) {
+            seed = seed * 1103515245 + 12345;
+            int noise = (seed >> 16) & 0xff;
+            switch(sampleType) {
+                case RawDataStorage::SampleU8:
+                    storage->samples<uint8_t>()[i] = noise;
+                    break;
+                case RawDataStorage::SampleI32:
+                    storage->samples<int32_t>()[i] = 100000 + noise;
+                    break;
+                default:
+                    storage->samples<float>()[i] = 1000.0 + noise / 16.0;
+            }
+        }
+        storage->computeLevels();
+
+        std::string deflated, shuffled;
+        SpillCache::encode(SpillCache::Deflate, data.data(), data.size(), deflated);
+        SpillCache::encode(SpillCache::ShuffleDeflate, data.data(), data.size(), shuffled);
+        if (sampleType != RawDataStorage::SampleU8) {
+            REQUIRE(shuffled.size() < deflated.size());
+        }
+
+        std::vector<char> decoded(data.size());
+        REQUIRE(SpillCache::decode(SpillCache::ShuffleDeflate, shuffled.data(), shuffled.size(), decoded.data(), decoded.size()));
+        REQUIRE(decoded == data);
+    }
+
+    // Shorter than a header: nothing to shuffle
+    std::string data = "short";
+    std::string encoded;
+    SpillCache::encode(SpillCache::ShuffleDeflate, data.data(), data.size(), encoded);
+    std::vector<char> decoded(data.size());
+    REQUIRE(SpillCache::decode(SpillCache::ShuffleDeflate, encoded.data(), encoded.size(), decoded.data(), decoded.size()));
+    REQUIRE(std::string(decoded.begin(), decoded.end()) == data);
+}
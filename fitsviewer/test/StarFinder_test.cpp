@@ -10,6 +10,7 @@ RawDataStorage * noise(int w, int h, int black, int blackLarg)
     RawDataStorage * result = (RawDataStorage *)::operator new (RawDataStorage::requiredStorage(w,h));
     result->setBayer("");
     result->setSize(w, h);
+    result->setSampleType(RawDataStorage::SampleU16);
 
     srand(0);
     for(int y = 0; y < h; ++y)
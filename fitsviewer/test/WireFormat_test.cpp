@@ -0,0 +1,232 @@
+#include "catch.hpp"
+
+#include "../SharedCache.h"
+
+using namespace SharedCache;
+
+static Messages::Request buildRequest() {
+    Messages::Request request;
+    request.contentRequest.build();
+    request.contentRequest->astrometry.build();
+    request.contentRequest->astrometry->source.source.path = "/plop";
+    request.contentRequest->astrometry->source.source.serial = 12;
+    request.contentRequest->astrometry->source.source.exactSerial = true;
+    request.contentRequest->astrometry->source.source.identity = "2049:1234:5760:1700000000000000000";
+    request.contentRequest->astrometry->fieldMin = 0.5;
+    request.contentRequest->astrometry->numberOfBinInUniformize = 10;
+    request.contentRequest->priority = Messages::PriorityBackground;
+    request.contentRequest->traceId = "1234.5678.9";
+    return request;
+}
+
+static Messages::Request roundTrip(const Messages::Request & request, Wire::Format format) {
+    std::string frame;
+    Wire::encode(request, format, frame);
+
+    Wire::FrameHeader header;
+    REQUIRE(frame.size() >= sizeof(header));
+    memcpy(&header, frame.data(), sizeof(header));
+    REQUIRE(header.format == format);
+    REQUIRE(header.size == frame.size() - sizeof(header));
+    REQUIRE(header.requestId == 0);
+
+    Messages::Request result;
+    Wire::decode(frame.data() + sizeof(header), header.size, header.format, result);
+    return result;
+}
+
+TEST_CASE( "Wire format round trip", "[WireFormat]" ) {
+    Messages::Request request = buildRequest();
+
+    for(Wire::Format format : { Wire::Binary, Wire::Json }) {
+        Messages::Request decoded = roundTrip(request, format);
+        REQUIRE(decoded.contentRequest);
+        REQUIRE(!decoded.streamWatchRequest);
+        REQUIRE(!decoded.contentRequest->fitsContent);
+        REQUIRE(decoded.contentRequest->astrometry);
+        REQUIRE(decoded.contentRequest->astrometry->source.source.path == "/plop");
+        REQUIRE(decoded.contentRequest->astrometry->source.source.serial == 12);
+        REQUIRE(decoded.contentRequest->astrometry->source.source.exactSerial);
+        REQUIRE(decoded.contentRequest->astrometry->source.source.identity == "2049:1234:5760:1700000000000000000");
+        REQUIRE(decoded.contentRequest->astrometry->fieldMin == 0.5);
+        REQUIRE(decoded.contentRequest->astrometry->numberOfBinInUniformize == 10);
+        REQUIRE(decoded.contentRequest->priority == Messages::PriorityBackground);
+        REQUIRE(decoded.contentRequest->traceId == "1234.5678.9");
+    }
+}
+
+TEST_CASE( "Wire format rejects truncated binary", "[WireFormat]" ) {
+    std::string frame;
+    Wire::encode(buildRequest(), Wire::Binary, frame);
+
+    const char * payload = frame.data() + sizeof(Wire::FrameHeader);
+    uint32_t size = frame.size() - sizeof(Wire::FrameHeader);
+
+    Messages::Request result;
+    REQUIRE_THROWS(Wire::decode(payload, size - 3, Wire::Binary, result));
+}
+
+TEST_CASE( "Wire format stats round trip", "[WireFormat]" ) {
+    Messages::Result stats;
+    stats.statsResult.build();
+    stats.statsResult->maxSize = 1 << 30;
+    stats.statsResult->currentSize = 12345;
+    stats.statsResult->reservedSize = 0;
+    stats.statsResult->contentCount = 3;
+    stats.statsResult->waitingConsumers = 1;
+    stats.statsResult->waitingWorkers = 2;
+    stats.statsResult->streamWatchers = 0;
+    stats.statsResult->startedWorkers = 3;
+    stats.statsResult->activeWorkers = 1;
+    stats.statsResult->blockedWorkers = 0;
+    stats.statsResult->workerSpawns = 3;
+    stats.statsResult->workerSpawnTime = 4500;
+    stats.statsResult->firstProductions = 2;
+    stats.statsResult->firstProductionTime = 12;
+    stats.statsResult->spillMaxSize = 1L << 32;
+    stats.statsResult->spillSize = 5000;
+    stats.statsResult->spillHits = 7;
+    stats.statsResult->spillMisses = 9;
+    stats.statsResult->spillWrites = 11;
+    stats.statsResult->products.resize(2);
+    stats.statsResult->products[1].product = "histogram";
+    stats.statsResult->products[1].misses = 4;
+    stats.statsResult->products[1].evictedBytes = 1L << 40;
+
+    for(Wire::Format format : { Wire::Binary, Wire::Json }) {
+        std::string frame;
+        Wire::encode(stats, format, frame);
+
+        Messages::Result decoded;
+        Wire::decode(frame.data() + sizeof(Wire::FrameHeader), frame.size() - sizeof(Wire::FrameHeader), format, decoded);
+        REQUIRE(decoded.statsResult);
+        REQUIRE(!decoded.contentResult);
+        REQUIRE(decoded.statsResult->currentSize == 12345);
+        REQUIRE(decoded.statsResult->startedWorkers == 3);
+        REQUIRE(decoded.statsResult->workerSpawnTime == 4500);
+        REQUIRE(decoded.statsResult->firstProductionTime == 12);
+        REQUIRE(decoded.statsResult->spillMaxSize == 1L << 32);
+        REQUIRE(decoded.statsResult->spillHits == 7);
+        REQUIRE(decoded.statsResult->spillMisses == 9);
+        REQUIRE(decoded.statsResult->spillWrites == 11);
+        REQUIRE(decoded.statsResult->products.size() == 2);
+        REQUIRE(decoded.statsResult->products[1].product == "histogram");
+        REQUIRE(decoded.statsResult->products[1].misses == 4);
+        REQUIRE(decoded.statsResult->products[1].evictedBytes == 1L << 40);
+    }
+}
+
+TEST_CASE( "Wire format progress round trip", "[WireFormat]" ) {
+    Messages::Request request;
+    request.progressAnnounce.build();
+    request.progressAnnounce->filename = "data000000000012";
+    request.progressAnnounce->progress = 0.25;
+
+    for(Wire::Format format : { Wire::Binary, Wire::Json }) {
+        Messages::Request decoded = roundTrip(request, format);
+        REQUIRE(!decoded.contentRequest);
+        REQUIRE(decoded.progressAnnounce);
+        REQUIRE(decoded.progressAnnounce->filename == "data000000000012");
+        REQUIRE(decoded.progressAnnounce->progress == 0.25);
+    }
+}
+
+TEST_CASE( "Wire format batch round trip", "[WireFormat]" ) {
+    Messages::Request request;
+    request.batchRequest.build();
+    request.batchRequest->contents.push_back(*buildRequest().contentRequest);
+    request.batchRequest->contents.push_back(Messages::ContentRequest());
+    request.batchRequest->contents.back().starField.build();
+    request.batchRequest->contents.back().starField->source.path = "/plop";
+
+    for(Wire::Format format : { Wire::Binary, Wire::Json }) {
+        Messages::Request decoded = roundTrip(request, format);
+        REQUIRE(!decoded.contentRequest);
+        REQUIRE(decoded.batchRequest);
+        REQUIRE(decoded.batchRequest->contents.size() == 2);
+        REQUIRE(decoded.batchRequest->contents[0].astrometry);
+        REQUIRE(decoded.batchRequest->contents[0].astrometry->source.source.path == "/plop");
+        REQUIRE(decoded.batchRequest->contents[1].starField);
+        REQUIRE(decoded.batchRequest->contents[1].starField->source.path == "/plop");
+        REQUIRE(decoded.batchRequest->contents[0].contentKey() == request.batchRequest->contents[0].contentKey());
+    }
+}
+
+TEST_CASE( "Wire format carries request id", "[WireFormat]" ) {
+    std::string frame;
+    Wire::encode(buildRequest(), Wire::Binary, frame, 42);
+    size_t firstSize = frame.size();
+    // Frames are appended
+    Wire::encode(buildRequest(), Wire::Json, frame, 43);
+
+    Wire::FrameHeader header;
+    memcpy(&header, frame.data(), sizeof(header));
+    REQUIRE(header.requestId == 42);
+    REQUIRE(header.size == firstSize - sizeof(header));
+    memcpy(&header, frame.data() + firstSize, sizeof(header));
+    REQUIRE(header.requestId == 43);
+    REQUIRE(header.format == Wire::Json);
+
+    Messages::Request decoded;
+    Wire::decode(frame.data() + firstSize + sizeof(header), header.size, header.format, decoded);
+    REQUIRE(decoded.contentRequest);
+}
+
+TEST_CASE( "Wire format binary layout", "[WireFormat]" ) {
+    // Every message, with default values
+    Messages::Request request;
+    request.contentRequest.build();
+    request.contentRequest->fitsContent.build();
+    request.contentRequest->histogram.build();
+    request.contentRequest->starField.build();
+    request.contentRequest->astrometry.build();
+    request.contentRequest->fitsHeader.build();
+    request.streamWatchRequest.build();
+    request.workRequest.build();
+    request.finishedAnnounce.build();
+    request.releasedAnnounce.build();
+    request.streamStartImageRequest.build();
+    request.streamPublishRequest.build();
+    request.statsRequest.build();
+    request.progressAnnounce.build();
+    request.batchRequest.build();
+    request.batchRequest->contents.push_back(*request.contentRequest);
+
+    Messages::Result result;
+    result.contentResult.build();
+    result.contentResult->actualRequest = new Messages::ContentRequest(*request.contentRequest);
+    result.streamWatchResult.build();
+    result.todoResult.build();
+    result.todoResult->content = new Messages::ContentRequest(*request.contentRequest);
+    result.streamStartImageResult.build();
+    result.streamPublishResult.build();
+    result.statsResult.build();
+    result.statsResult->products.resize(1);
+    result.batchResult.build();
+    result.batchResult->contents.push_back(*result.contentResult);
+    result.progressResult.build();
+
+    std::string requestFrame, resultFrame;
+    Wire::encode(request, Wire::Binary, requestFrame);
+    Wire::encode(result, Wire::Binary, resultFrame);
+    // A failure here means that the binary layout changed: bump Wire::Binary, then update the sizes
+    REQUIRE(Wire::Binary == 4);
+    REQUIRE(requestFrame.size() - sizeof(Wire::FrameHeader) == 416);
+    REQUIRE(resultFrame.size() - sizeof(Wire::FrameHeader) == 786);
+}
+
+TEST_CASE( "Wire format rejects other binary versions", "[WireFormat]" ) {
+    REQUIRE(Wire::isValidFormat(Wire::Binary));
+    REQUIRE(Wire::isValidFormat(Wire::Json));
+    REQUIRE(Wire::formatError(Wire::Binary).empty());
+    REQUIRE(!Wire::isValidFormat(1));
+    REQUIRE(Wire::formatError(1).find("Binary protocol version 1") != std::string::npos);
+    REQUIRE(!Wire::isValidFormat(Wire::Binary + 1));
+    REQUIRE(Wire::formatError(0).find("Invalid message format") != std::string::npos);
+
+    std::string frame;
+    Wire::encode(buildRequest(), Wire::Binary, frame);
+    Messages::Request result;
+    REQUIRE_THROWS_WITH(Wire::decode(frame.data() + sizeof(Wire::FrameHeader), frame.size() - sizeof(Wire::FrameHeader), 1, result),
+                        Catch::Contains("same build"));
+}
@@ -20,6 +20,9 @@ export type SucceededAstrometryResult = {
 
 export type AstrometryResult = FailedAstrometryResult|SucceededAstrometryResult;
 
+// Scheduling class in fits-server. Defaults to normal
+export type ProcessorPriority = "interactive"|"normal"|"background";
+
 export type ProcessorContentRequest = {
     path: string;
     streamId: string;
@@ -66,6 +69,21 @@ export type ProcessorHistogramResult = Array<ProcessorHistogramChannel>;
 
 export type ProcessorAstrometryResult = AstrometryResult;
 
+export type ProcessorFitsHeaderRequest = {
+    source: ProcessorContentRequest;
+}
+
+// Only return these keywords (default to all)
+export type ProcessorFitsHeaderOptions = {keys?: Array<string>};
+export type ProcessorFitsHeaderResult = {
+    width: number;
+    height: number;
+    bitpix: number;
+    // Valid BAYERPAT
+    color: boolean;
+    cards: {[keyword: string]: string|number|boolean};
+};
+
 export type Order<Req, Res, Options> = {
     req: Req,
     res: Res,
@@ -82,10 +100,13 @@ export type StarField = Order<ProcessorStarFieldRequest, ProcessorStarFieldResul
 
 export type Histogram = Order<ProcessorHistogramRequest, ProcessorHistogramResult, ProcessorHistogramOptions>;
 
+export type FitsHeader = Order<ProcessorFitsHeaderRequest, ProcessorFitsHeaderResult, ProcessorFitsHeaderOptions>;
+
 type Registry = {
     astrometry: Astrometry,
     starField: StarField,
     histogram: Histogram,
+    fitsHeader: FitsHeader,
 }
 
 export type Request = {